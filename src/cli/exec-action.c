@@ -93,9 +93,10 @@ gboolean exec_action (CmdlineOpts  *cmdline_opts,
     if (db_data->db_path == NULL) {
         return FALSE;
     }
+    db_data->backup_generations = gsettings_common_get_backup_generations ();
 
     if (g_file_test (db_data->db_path, G_FILE_TEST_EXISTS)) {
-        if (get_file_size (db_data->db_path) > (goffset)(db_data->max_file_size_from_memlock * SECMEM_SIZE_THRESHOLD_RATIO)) {
+        if (db_too_big_for_secure_memory (db_data->db_path, db_data->max_file_size_from_memlock)) {
             gchar *msg = g_strdup_printf (_(
                 "Your system's secure memory limit (memlock: %d bytes) is not enough to securely load the database into memory.\n"
                 "You need to increase your system's memlock limit by following the instructions on our "
@@ -1,10 +1,9 @@
 #include <glib.h>
 #include <jansson.h>
-#include <cotp.h>
 #include <glib/gi18n.h>
 #include <stdlib.h>
-#include <limits.h>
 #include "../common/db-common.h"
+#include "../common/otp-context.h"
 #include "../common/otp-validation.h"
 #include "get-data.h"
 
@@ -276,12 +275,11 @@ emit_token (json_t       *obj,
         return FALSE;
     }
 
-    cotp_error_t cotp_err;
     const gchar *issuer = json_string_value (json_object_get (obj, "issuer"));
     const gchar *label = json_string_value (json_object_get (obj, "label"));
     const gchar *secret = json_string_value (json_object_get (obj, "secret"));
     gint digits = (gint)json_integer_value (json_object_get (obj, "digits"));
-    gint algo = get_algo_int_from_str (json_string_value (json_object_get (obj, "algo")));
+    const gchar *algo = json_string_value (json_object_get (obj, "algo"));
     const gchar *type = json_string_value (json_object_get (obj, "type"));
     if (type == NULL) {
         if (format == OUTPUT_FORMAT_TABLE)
@@ -294,6 +292,18 @@ emit_token (json_t       *obj,
         return FALSE;
     }
 
+    // Steam Guard codes are HMAC-SHA1 whatever the token says.
+    gboolean is_totp = g_ascii_strcasecmp (type, "TOTP") == 0;
+    gboolean is_steam = is_totp && issuer != NULL && g_ascii_strcasecmp (issuer, "steam") == 0;
+    GError *ctx_err = NULL;
+    OtpContext *ctx = otp_context_new (secret, is_steam ? "SHA1" : algo, &ctx_err);
+    if (ctx == NULL) {
+        if (format == OUTPUT_FORMAT_TABLE)
+            g_printerr ("[ERROR] Failed to generate OTP: %s\n", ctx_err->message);
+        g_clear_error (&ctx_err);
+        return FALSE;
+    }
+
     json_t *row = NULL;
     if (format == OUTPUT_FORMAT_JSON) {
         row = json_is_array (dest) ? json_object () : dest;
@@ -302,66 +312,44 @@ emit_token (json_t       *obj,
         json_object_set_new (row, "issuer", json_string (issuer ? issuer : ""));
     }
 
-    if (g_ascii_strcasecmp (type, "TOTP") == 0) {
+    if (is_totp) {
         gint period = (gint)json_integer_value (json_object_get (obj, "period"));
         if (period <= 0 || period > 300) {
             if (format == OUTPUT_FORMAT_TABLE)
                 g_printerr ("[ERROR] TOTP token has an invalid period, skipping.\n");
+            otp_context_free (ctx);
             if (row != NULL && json_is_array (dest)) json_decref (row);
             return FALSE;
         }
-        time_t now = time (NULL);
-        if (now < 0 || (guint64) now > (guint64) LONG_MAX ||
-            (guint64) now + period > (guint64) LONG_MAX) {
+        gint64 current_ts = (gint64) time (NULL);
+        if (current_ts < 0) {
             if (format == OUTPUT_FORMAT_TABLE)
-                g_printerr ("[ERROR] Current timestamp is outside libcotp's supported range.\n");
+                g_printerr ("[ERROR] Current timestamp is out of range.\n");
+            otp_context_free (ctx);
             if (row != NULL && json_is_array (dest)) json_decref (row);
             return FALSE;
         }
-        long current_ts = (long) now;
         gint token_validity = period - (gint) (current_ts % period);
         gchar *current_totp = NULL;
         gchar *next_totp = NULL;
-        if ((issuer != NULL && g_ascii_strcasecmp (issuer, "steam") == 0) ? TRUE : FALSE) {
-            current_totp = get_steam_totp_at (secret, current_ts, period, &cotp_err);
-            if (cotp_err != NO_ERROR) {
-                if (format == OUTPUT_FORMAT_TABLE)
-                    g_printerr ("[ERROR] Failed to generate Steam TOTP (error %d).\n", cotp_err);
-                sensitive_free (current_totp);
-                if (row != NULL && json_is_array (dest)) json_decref (row);
-                return FALSE;
-            }
-            if (show_next_token) {
-                next_totp = get_steam_totp_at (secret, current_ts + period, period, &cotp_err);
-                if (cotp_err != NO_ERROR) {
-                    if (format == OUTPUT_FORMAT_TABLE)
-                        g_printerr ("[ERROR] Failed to generate next Steam TOTP (error %d).\n", cotp_err);
-                    sensitive_free (current_totp);
-                    sensitive_free (next_totp);
-                    if (row != NULL && json_is_array (dest)) json_decref (row);
-                    return FALSE;
-                }
-            }
+        // One context for both codes: the secret is decoded once.
+        if (is_steam) {
+            current_totp = otp_context_steam_at (ctx, current_ts, period);
+            if (show_next_token)
+                next_totp = otp_context_steam_at (ctx, current_ts + period, period);
         } else {
-            current_totp = get_totp_at (secret, current_ts, digits, period, algo, &cotp_err);
-            if (cotp_err != NO_ERROR) {
-                if (format == OUTPUT_FORMAT_TABLE)
-                    g_printerr ("[ERROR] Failed to generate TOTP (error %d).\n", cotp_err);
-                sensitive_free (current_totp);
-                if (row != NULL && json_is_array (dest)) json_decref (row);
-                return FALSE;
-            }
-            if (show_next_token) {
-                next_totp = get_totp_at (secret, current_ts + period, digits, period, algo, &cotp_err);
-                if (cotp_err != NO_ERROR) {
-                    if (format == OUTPUT_FORMAT_TABLE)
-                        g_printerr ("[ERROR] Failed to generate next TOTP (error %d).\n", cotp_err);
-                    sensitive_free (current_totp);
-                    sensitive_free (next_totp);
-                    if (row != NULL && json_is_array (dest)) json_decref (row);
-                    return FALSE;
-                }
-            }
+            current_totp = otp_context_totp_at (ctx, current_ts, period, digits);
+            if (show_next_token)
+                next_totp = otp_context_totp_at (ctx, current_ts + period, period, digits);
+        }
+        otp_context_free (ctx);
+        if (current_totp == NULL || (show_next_token && next_totp == NULL)) {
+            if (format == OUTPUT_FORMAT_TABLE)
+                g_printerr ("[ERROR] Failed to generate %s.\n", is_steam ? "Steam TOTP" : "TOTP");
+            sensitive_secure_free (current_totp);
+            sensitive_secure_free (next_totp);
+            if (row != NULL && json_is_array (dest)) json_decref (row);
+            return FALSE;
         }
         if (format == OUTPUT_FORMAT_TABLE) {
             g_string_append_printf (
@@ -379,13 +367,14 @@ emit_token (json_t       *obj,
             if (show_next_token && next_totp != NULL)
                 json_object_set_new (row, "next", json_string (next_totp));
         }
-        sensitive_free (current_totp);
-        sensitive_free (next_totp);
+        sensitive_secure_free (current_totp);
+        sensitive_secure_free (next_totp);
     } else {
         json_t *counter_obj = json_object_get (obj, "counter");
         if (!json_is_integer (counter_obj)) {
             if (format == OUTPUT_FORMAT_TABLE)
                 g_printerr ("[ERROR] HOTP token has no valid counter field, skipping.\n");
+            otp_context_free (ctx);
             if (row != NULL && json_is_array (dest)) json_decref (row);
             return FALSE;
         }
@@ -393,14 +382,15 @@ emit_token (json_t       *obj,
         if (counter < 0 || (guint64) counter >= OTP_HOTP_COUNTER_MAX) {
             if (format == OUTPUT_FORMAT_TABLE)
                 g_printerr ("[ERROR] HOTP counter is out of range, skipping.\n");
+            otp_context_free (ctx);
             if (row != NULL && json_is_array (dest)) json_decref (row);
             return FALSE;
         }
-        gchar *hotp = get_hotp (secret, counter, digits, algo, &cotp_err);
-        if (cotp_err != NO_ERROR) {
+        gchar *hotp = otp_context_hotp (ctx, (guint64) counter, digits);
+        otp_context_free (ctx);
+        if (hotp == NULL) {
             if (format == OUTPUT_FORMAT_TABLE)
-                g_printerr ("[ERROR] Failed to generate HOTP (error %d).\n", cotp_err);
-            sensitive_free (hotp);
+                g_printerr ("[ERROR] Failed to generate HOTP.\n");
             if (row != NULL && json_is_array (dest)) json_decref (row);
             return FALSE;
         }
@@ -410,7 +400,7 @@ emit_token (json_t       *obj,
             json_object_set_new (row, "current", json_string (hotp));
             json_object_set_new (row, "counter", json_integer (counter + 1));
         }
-        sensitive_free (hotp);
+        sensitive_secure_free (hotp);
         json_object_set_new (obj, "counter", json_integer (counter + 1));
         if (hotp_changed != NULL)
             *hotp_changed = TRUE;
@@ -261,6 +261,241 @@ open_cipher_and_set_data (guchar *derived_key,
 }
 
 
+gboolean
+thread_pool_push_queued (GThreadPool *pool,
+                         gpointer     data,
+                         const gchar *what)
+{
+    // FALSE only means no new worker could be started; GLib queues data
+    // regardless and a running or later worker picks it up. Only when the
+    // pool has no thread at all is nobody going to, until the next push.
+    GError *push_err = NULL;
+    if (g_thread_pool_push (pool, data, &push_err))
+        return TRUE;
+
+    g_warning ("Couldn't start a worker thread for %s: %s", what, push_err->message);
+    g_clear_error (&push_err);
+
+    return g_thread_pool_get_num_threads (pool) > 0;
+}
+
+
+/* Argon2id lane scheduling.
+ *
+ * gcry_kdf_compute (hd, NULL) runs every lane of every segment on the calling
+ * thread, so the parallelism value stored in the DB header bought nothing but
+ * a longer serial computation. libgcrypt lets the caller supply a job
+ * dispatcher instead: for each segment it hands over one job per lane and then
+ * waits for all of them before moving to the next one. The lanes are fed to a
+ * single process-wide GThreadPool capped at the number of online CPUs, so the
+ * GUI unlock thread, the cross-DB loader, the CLI and the search provider all
+ * share it. Each compute call queues its lanes on a private queue and pushes
+ * one ticket per lane to the pool; a worker holding a ticket runs whichever of
+ * that call's lanes is still queued. The waiting thread pops from the same
+ * queue, so lanes no worker has reached yet run there instead of stalling,
+ * even when the pool could not start a single worker. Concurrent derivations
+ * never wait on each other's lanes. */
+typedef struct kdf_jobs_t {
+    gint ref_count;
+    GAsyncQueue *lanes;
+    GMutex lock;
+    GCond cond;
+    guint pending;
+} KdfJobs;
+
+typedef struct kdf_job_t {
+    gcry_kdf_job_fn_t fn;
+    void *priv;
+} KdfJob;
+
+static GThreadPool *kdf_pool = NULL;
+static gint kdf_pool_max_threads = 0;
+G_LOCK_DEFINE_STATIC (kdf_pool);
+
+
+static KdfJobs *
+kdf_jobs_new (void)
+{
+    KdfJobs *jobs = g_new0 (KdfJobs, 1);
+    jobs->ref_count = 1;
+    jobs->lanes = g_async_queue_new ();
+    g_mutex_init (&jobs->lock);
+    g_cond_init (&jobs->cond);
+
+    return jobs;
+}
+
+
+static KdfJobs *
+kdf_jobs_ref (KdfJobs *jobs)
+{
+    g_atomic_int_inc (&jobs->ref_count);
+    return jobs;
+}
+
+
+static void
+kdf_jobs_unref (KdfJobs *jobs)
+{
+    if (!g_atomic_int_dec_and_test (&jobs->ref_count))
+        return;
+    g_async_queue_unref (jobs->lanes);
+    g_cond_clear (&jobs->cond);
+    g_mutex_clear (&jobs->lock);
+    g_free (jobs);
+}
+
+
+static gboolean
+kdf_jobs_run_one (KdfJobs *jobs)
+{
+    // Whoever pops a lane runs it, so each lane runs exactly once.
+    KdfJob *job = g_async_queue_try_pop (jobs->lanes);
+    if (job == NULL)
+        return FALSE;
+
+    job->fn (job->priv);
+    g_free (job);
+
+    g_mutex_lock (&jobs->lock);
+    if (--jobs->pending == 0)
+        g_cond_signal (&jobs->cond);
+    g_mutex_unlock (&jobs->lock);
+
+    return TRUE;
+}
+
+
+static void
+kdf_pool_run_job (gpointer data,
+                  gpointer user_data)
+{
+    (void) user_data;
+    KdfJobs *jobs = data;
+
+    // The lane this ticket was pushed for may already have run on the
+    // waiting thread, or the derivation may be over: then there's nothing left.
+    kdf_jobs_run_one (jobs);
+    kdf_jobs_unref (jobs);
+}
+
+
+static GThreadPool *
+kdf_pool_get (void)
+{
+    G_LOCK (kdf_pool);
+    if (kdf_pool == NULL) {
+        if (kdf_pool_max_threads <= 0)
+            kdf_pool_max_threads = (gint) g_get_num_processors ();
+        if (kdf_pool_max_threads > 1) {
+            // Non-exclusive: idle threads go back to GLib's shared set, so a
+            // process that unlocked once doesn't keep N threads parked forever.
+            kdf_pool = g_thread_pool_new (kdf_pool_run_job, NULL,
+                                          kdf_pool_max_threads, FALSE, NULL);
+        }
+    }
+    GThreadPool *pool = kdf_pool;
+    G_UNLOCK (kdf_pool);
+
+    return pool;
+}
+
+
+static int
+kdf_dispatch_job (void              *jobs_context,
+                  gcry_kdf_job_fn_t  job_fn,
+                  void              *job_priv)
+{
+    KdfJobs *jobs = jobs_context;
+    GThreadPool *pool = kdf_pool_get ();
+
+    if (pool != NULL) {
+        KdfJob *job = g_new0 (KdfJob, 1);
+        job->fn = job_fn;
+        job->priv = job_priv;
+
+        g_mutex_lock (&jobs->lock);
+        jobs->pending++;
+        g_mutex_unlock (&jobs->lock);
+        g_async_queue_push (jobs->lanes, job);
+
+        // The ticket stays queued even if no worker could be started for it,
+        // and kdf_wait_all_jobs runs the lane in the meantime.
+        thread_pool_push_queued (pool, kdf_jobs_ref (jobs), "an Argon2 lane");
+        return 0;
+    }
+
+    job_fn (job_priv);
+
+    return 0;
+}
+
+
+static int
+kdf_wait_all_jobs (void *jobs_context)
+{
+    KdfJobs *jobs = jobs_context;
+
+    // Run the lanes no worker has taken yet, then wait for those that have.
+    while (kdf_jobs_run_one (jobs))
+        ;
+
+    g_mutex_lock (&jobs->lock);
+    while (jobs->pending > 0)
+        g_cond_wait (&jobs->cond, &jobs->lock);
+    g_mutex_unlock (&jobs->lock);
+
+    return 0;
+}
+
+
+void
+kdf_set_max_threads (gint max_threads)
+{
+    G_LOCK (kdf_pool);
+    kdf_pool_max_threads = max_threads > 0 ? max_threads : (gint) g_get_num_processors ();
+    if (kdf_pool != NULL) {
+        if (kdf_pool_max_threads > 1) {
+            g_thread_pool_set_max_threads (kdf_pool, kdf_pool_max_threads, NULL);
+        } else {
+            // No derivation is running, so whatever is still queued is a
+            // ticket whose lane already ran on the waiting thread: drop it,
+            // and the finished KdfJobs it pins, rather than wait for a worker
+            // that may never start.
+            g_thread_pool_free (kdf_pool, TRUE, TRUE);
+            kdf_pool = NULL;
+        }
+    }
+    G_UNLOCK (kdf_pool);
+}
+
+
+gcry_error_t
+kdf_compute_threaded (gcry_kdf_hd_t hd)
+{
+    if (kdf_pool_get () == NULL)
+        return gcry_kdf_compute (hd, NULL);
+
+    // Heap-allocated and refcounted: tickets for lanes the waiting thread
+    // ran itself may reach a worker after this call has returned.
+    KdfJobs *jobs = kdf_jobs_new ();
+
+    const gcry_kdf_thread_ops_t ops = {
+        .jobs_context = jobs,
+        .dispatch_job = kdf_dispatch_job,
+        .wait_all_jobs = kdf_wait_all_jobs,
+    };
+    gcry_error_t gc_err = gcry_kdf_compute (hd, &ops);
+
+    // libgcrypt always waits before returning, but never leave a lane
+    // running on hd if a future version bails out early.
+    kdf_wait_all_jobs (jobs);
+    kdf_jobs_unref (jobs);
+
+    return gc_err;
+}
+
+
 guchar *
 get_authpro_derived_key (const gchar *password,
                          const guchar *salt)
@@ -282,7 +517,7 @@ get_authpro_derived_key (const gchar *password,
         gcry_free (derived_key);
         return NULL;
     }
-    if (gcry_kdf_compute (hd, NULL) != GPG_ERR_NO_ERROR) {
+    if (kdf_compute_threaded (hd) != GPG_ERR_NO_ERROR) {
         g_printerr ("Error while computing the KDF\n");
         gcry_free (derived_key);
         gcry_kdf_close (hd);
@@ -473,60 +708,6 @@ get_data_from_encrypted_backup (const gchar       *path,
 }
 
 
-static guint32
-jenkins_one_at_a_time_hash (const gchar *key, gsize len)
-{
-    guint32 hash, i;
-    for (hash = i = 0; i < len; ++i) {
-        hash += key[i];
-        hash += (hash << 10);
-        hash ^= (hash >> 6);
-    }
-    hash += (hash << 3);
-    hash ^= (hash >> 11);
-    hash += (hash << 15);
-
-    return hash;
-}
-
-
-guint32
-json_object_get_hash (json_t *obj)
-{
-    // GString grows as needed, so a long label/issuer no longer gets truncated
-    // and inflates the collision rate of the 32-bit jenkins hash. The hash is
-    // still only used as a fast first-pass filter - add_otps_to_db_ex breaks
-    // ties with json_equal so a colliding-but-distinct entry isn't silently
-    // dropped as a "duplicate".
-    GString *tmp_string = g_string_new (NULL);
-    const gchar *key;
-    json_t *value;
-    json_object_foreach (obj, key, value) {
-        if (g_strcmp0 (key, "group") == 0)
-            continue;
-        if (g_strcmp0 (key, "period") == 0 || g_strcmp0 (key, "counter") == 0 || g_strcmp0 (key, "digits") == 0) {
-            json_int_t v = json_integer_value (value);
-            g_string_append_printf (tmp_string, "%" G_GINT64_FORMAT, (gint64) v);
-        } else {
-            const gchar *str_val = json_string_value (value);
-            if (str_val != NULL)
-                g_string_append (tmp_string, str_val);
-        }
-    }
-
-    guint32 hash = jenkins_one_at_a_time_hash (tmp_string->str, tmp_string->len + 1);
-
-    // Wipe before free: tmp_string holds the OTP secret as part of the hashed
-    // material. GString uses regular g_malloc, so explicit_bzero is needed to
-    // avoid leaving secret bytes on the freed heap page.
-    if (tmp_string->str != NULL && tmp_string->allocated_len > 0)
-        explicit_bzero (tmp_string->str, tmp_string->allocated_len);
-    g_string_free (tmp_string, TRUE);
-
-    return hash;
-}
-
-
 void
 free_otps_gslist (GSList *otps,
                   guint   list_len G_GNUC_UNUSED)
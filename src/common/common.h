@@ -77,11 +77,27 @@ gchar            *get_data_from_encrypted_backup (const gchar        *path,
                                                   GFileInputStream   *in_stream,
                                                   GError            **err);
 
+/* g_thread_pool_push() that logs a failure: data is queued either way, so it
+ * is the pool's and must not be freed by the caller. Returns FALSE when the
+ * pool has no thread left to pick data up; the caller then has to get the job
+ * done some other way, and make sure it runs once if a worker reaches it
+ * later. what names the job in the warning. */
+gboolean          thread_pool_push_queued        (GThreadPool        *pool,
+                                                  gpointer            data,
+                                                  const gchar        *what);
+
+/* Drop-in replacement for gcry_kdf_compute (hd, NULL) that spreads Argon2
+ * lanes over a shared, CPU-bounded thread pool. Falls back to the serial path
+ * on single-core machines. */
+gcry_error_t      kdf_compute_threaded           (gcry_kdf_hd_t       hd);
+
+/* Caps the lane pool (<= 0 restores the CPU count; 1 forces serial lanes).
+ * Must not be called while a derivation is running. */
+void              kdf_set_max_threads            (gint                max_threads);
+
 guchar           *get_authpro_derived_key        (const gchar        *password,
                                                   const guchar       *salt);
 
-guint32           json_object_get_hash           (json_t             *obj);
-
 void              free_otps_gslist               (GSList             *otps,
                                                   guint               list_len);
 
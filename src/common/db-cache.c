@@ -0,0 +1,179 @@
+#include <glib.h>
+#include "db-cache.h"
+#include "db-journal.h"
+#include "file-size.h"
+
+
+typedef struct {
+    DatabaseData *db_data;
+    gsize cost;
+} CachedDb;
+
+struct db_cache_t {
+    GQueue entries;             // CachedDb *, most recently used first
+    guint max_entries;
+    gsize budget;
+    gsize used;
+};
+
+
+static void
+cached_db_evict (DbCache  *cache,
+                 CachedDb *entry)
+{
+    cache->used -= entry->cost;
+    // Wipe now even if a background save still holds a reference.
+    database_data_purge_secrets (entry->db_data);
+    database_data_unref (entry->db_data);
+    g_free (entry);
+}
+
+
+static void
+evict_until (DbCache *cache,
+             guint    max_entries,
+             gsize    needed)
+{
+    while (!g_queue_is_empty (&cache->entries) &&
+           (cache->entries.length > max_entries || cache->used + needed > cache->budget))
+        cached_db_evict (cache, g_queue_pop_tail (&cache->entries));
+}
+
+
+static GList *
+find_link (DbCache     *cache,
+           const gchar *db_path)
+{
+    for (GList *l = cache->entries.head; l != NULL; l = l->next) {
+        CachedDb *entry = l->data;
+        if (g_strcmp0 (entry->db_data->db_path, db_path) == 0)
+            return l;
+    }
+    return NULL;
+}
+
+
+DbCache *
+db_cache_new (guint max_entries,
+              gsize secmem_budget)
+{
+    DbCache *cache = g_new0 (DbCache, 1);
+    g_queue_init (&cache->entries);
+    cache->max_entries = max_entries;
+    cache->budget = secmem_budget;
+    return cache;
+}
+
+
+void
+db_cache_free (DbCache *cache)
+{
+    if (cache == NULL)
+        return;
+    db_cache_clear (cache);
+    g_free (cache);
+}
+
+
+gsize
+db_cache_estimate_cost (const gchar *db_path)
+{
+    goffset size = get_file_size (db_path);
+    g_autofree gchar *journal = db_journal_path (db_path);
+    if (g_file_test (journal, G_FILE_TEST_IS_REGULAR))
+        size += MAX (get_file_size (journal), 0);
+    return (size > 0) ? (gsize) size * 2 : 0;
+}
+
+
+void
+db_cache_put (DbCache      *cache,
+              DatabaseData *db_data)
+{
+    g_return_if_fail (cache != NULL);
+    if (db_data == NULL)
+        return;
+
+    db_cache_remove (cache, db_data->db_path);
+
+    gsize cost = db_cache_estimate_cost (db_data->db_path);
+    if (cache->max_entries == 0 || db_data->key == NULL ||
+        db_data->in_memory_json_data == NULL || cost > cache->budget) {
+        database_data_purge_secrets (db_data);
+        database_data_unref (db_data);
+        return;
+    }
+
+    evict_until (cache, cache->max_entries - 1, cost);
+
+    CachedDb *entry = g_new0 (CachedDb, 1);
+    entry->db_data = db_data;
+    entry->cost = cost;
+    cache->used += cost;
+    g_queue_push_head (&cache->entries, entry);
+}
+
+
+DatabaseData *
+db_cache_take (DbCache     *cache,
+               const gchar *db_path)
+{
+    g_return_val_if_fail (cache != NULL, NULL);
+
+    GList *link = find_link (cache, db_path);
+    if (link == NULL)
+        return NULL;
+
+    CachedDb *entry = link->data;
+    g_queue_delete_link (&cache->entries, link);
+    if (!db_loaded_file_unchanged (entry->db_data)) {
+        // Rewritten by someone else: only a full load shows the new tokens.
+        cached_db_evict (cache, entry);
+        return NULL;
+    }
+
+    DatabaseData *db_data = entry->db_data;
+    cache->used -= entry->cost;
+    g_free (entry);
+    return db_data;
+}
+
+
+void
+db_cache_make_room (DbCache *cache,
+                    gsize    needed)
+{
+    g_return_if_fail (cache != NULL);
+    evict_until (cache, cache->max_entries, needed);
+}
+
+
+void
+db_cache_remove (DbCache     *cache,
+                 const gchar *db_path)
+{
+    g_return_if_fail (cache != NULL);
+
+    GList *link = find_link (cache, db_path);
+    if (link == NULL)
+        return;
+    CachedDb *entry = link->data;
+    g_queue_delete_link (&cache->entries, link);
+    cached_db_evict (cache, entry);
+}
+
+
+void
+db_cache_clear (DbCache *cache)
+{
+    g_return_if_fail (cache != NULL);
+    evict_until (cache, 0, 0);
+}
+
+
+guint
+db_cache_get_n_entries (DbCache *cache)
+{
+    g_return_val_if_fail (cache != NULL, 0);
+    return cache->entries.length;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "db-common.h"
+
+G_BEGIN_DECLS
+
+/* Recently used databases kept unlocked, so switching back to one skips the
+ * Secret Service lookup, Argon2id, decrypt and parse.
+ *
+ * The cache owns the DatabaseData it holds, key and derived key included.
+ * It is bounded both by a number of entries and by the secure memory those
+ * databases are estimated to occupy; the least recently used one goes first.
+ * Every eviction wipes the secrets with database_data_purge_secrets. */
+
+typedef struct db_cache_t DbCache;
+
+DbCache      *db_cache_new           (guint         max_entries,
+                                      gsize         secmem_budget);
+
+/* Purges and frees every cached database. */
+void          db_cache_free          (DbCache      *cache);
+
+/* Secure memory a database is expected to take once loaded: its decrypted
+ * tokens and their parsed JSON, both in gcry secure memory. */
+gsize         db_cache_estimate_cost (const gchar  *db_path);
+
+/* Takes ownership of an unlocked db_data as the most recent entry, evicting
+ * older ones as needed. A database that is locked, or does not fit on its
+ * own, is purged and freed right away. */
+void          db_cache_put           (DbCache      *cache,
+                                      DatabaseData *db_data);
+
+/* Removes the database for db_path and hands it back, or returns NULL. An
+ * entry whose file changed on disk since it was loaded is purged instead. */
+DatabaseData *db_cache_take          (DbCache      *cache,
+                                      const gchar  *db_path);
+
+/* Evicts until `needed` more bytes fit in the budget, e.g. for the database
+ * about to be opened outside the cache. */
+void          db_cache_make_room     (DbCache      *cache,
+                                      gsize         needed);
+
+void          db_cache_remove        (DbCache      *cache,
+                                      const gchar  *db_path);
+
+/* Purges every entry (lock, memory pressure). */
+void          db_cache_clear         (DbCache      *cache);
+
+guint         db_cache_get_n_entries (DbCache      *cache);
+
+G_END_DECLS
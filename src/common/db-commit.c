@@ -0,0 +1,434 @@
+#define _DEFAULT_SOURCE
+#include <glib.h>
+#include <glib/gi18n.h>
+#include <gcrypt.h>
+#include <jansson.h>
+#include <string.h>
+#include "gquarks.h"
+#include "db-common.h"
+#include "db-commit.h"
+#include "db-journal.h"
+#include "otp-validation.h"
+
+
+typedef struct {
+    DbCommitCallback callback;
+    gpointer user_data;
+} CommitWaiter;
+
+typedef struct {
+    gchar *plaintext;           // gcry secure memory, wiped as soon as it's written
+    gsize plaintext_len;
+    DbJournalDelta *delta;      // same change as a journal record, if it qualifies
+    GArray *waiters;            // CommitWaiter, one per merged submission
+    json_t *committed;          // the live array as submitted, tokens shared; adopted on success
+    gint commit_seq;            // db_data->commit_seq after this write (or at failure)
+    GError *error;
+} CommitBatch;
+
+struct db_commit_queue_t {
+    DatabaseData *db_data;      // not owned: the queue lives and dies with it
+    GMainContext *context;
+    GThreadPool *worker;        // one thread, so writes stay ordered
+
+    GMutex lock;
+    GCond idle_cond;
+    CommitBatch *pending;       // snapshot waiting for the worker; new submissions merge into it
+    gboolean busy;              // a batch is being written right now
+    GQueue completed;           // finished batches waiting for the main context
+    GSource *dispatch_source;
+    guint undispatched_failures;
+};
+
+static void      commit_worker_func   (gpointer      data,
+                                       gpointer      user_data);
+
+static gboolean  dispatch_completed   (DbCommitQueue *queue,
+                                       GError       **first_error);
+
+
+static void
+wipe_plaintext (CommitBatch *batch)
+{
+    if (batch->plaintext != NULL) {
+        explicit_bzero (batch->plaintext, batch->plaintext_len);
+        gcry_free (batch->plaintext);
+        batch->plaintext = NULL;
+        batch->plaintext_len = 0;
+    }
+    g_clear_pointer (&batch->delta, db_journal_delta_free);
+}
+
+
+static CommitBatch *
+commit_batch_new (DbCommitCallback callback,
+                  gpointer         user_data)
+{
+    CommitBatch *batch = g_new0 (CommitBatch, 1);
+    batch->waiters = g_array_new (FALSE, FALSE, sizeof (CommitWaiter));
+    if (callback != NULL) {
+        CommitWaiter waiter = { callback, user_data };
+        g_array_append_val (batch->waiters, waiter);
+    }
+    return batch;
+}
+
+
+static void
+commit_batch_free (CommitBatch *batch)
+{
+    wipe_plaintext (batch);
+    g_array_free (batch->waiters, TRUE);
+    if (batch->committed != NULL)
+        json_decref (batch->committed);
+    g_clear_error (&batch->error);
+    g_free (batch);
+}
+
+
+static DbCommitQueue *
+get_queue (DatabaseData *db_data)
+{
+    if (db_data->commit_queue != NULL)
+        return db_data->commit_queue;
+
+    DbCommitQueue *queue = g_new0 (DbCommitQueue, 1);
+    queue->db_data = db_data;
+    queue->context = g_main_context_ref_thread_default ();
+    g_mutex_init (&queue->lock);
+    g_cond_init (&queue->idle_cond);
+    g_queue_init (&queue->completed);
+    queue->worker = g_thread_pool_new (commit_worker_func, queue, 1, FALSE, NULL);
+    db_data->commit_queue = queue;
+    return queue;
+}
+
+
+static gboolean
+dispatch_source_cb (gpointer user_data)
+{
+    dispatch_completed (user_data, NULL);
+    return G_SOURCE_REMOVE;
+}
+
+
+/* Called with queue->lock held. */
+static void
+schedule_dispatch_locked (DbCommitQueue *queue)
+{
+    if (queue->dispatch_source != NULL)
+        return;
+    queue->dispatch_source = g_idle_source_new ();
+    g_source_set_priority (queue->dispatch_source, G_PRIORITY_DEFAULT);
+    g_source_set_callback (queue->dispatch_source, dispatch_source_cb, queue, NULL);
+    g_source_attach (queue->dispatch_source, queue->context);
+}
+
+
+/* Called with queue->lock held. */
+static void
+fail_batch_locked (DbCommitQueue *queue,
+                   CommitBatch   *batch,
+                   GError        *error)
+{
+    wipe_plaintext (batch);
+    batch->error = error;
+    batch->commit_seq = g_atomic_int_get (&queue->db_data->commit_seq);
+    queue->undispatched_failures++;
+    g_queue_push_tail (&queue->completed, batch);
+    schedule_dispatch_locked (queue);
+}
+
+
+/* Writes the pending batch, if any. Runs on the worker, or on the submitting
+ * or waiting thread when the pool has no worker to run it. */
+static void
+commit_pending (DbCommitQueue *queue)
+{
+    g_mutex_lock (&queue->lock);
+    // One write at a time, whichever thread it is on.
+    while (queue->busy)
+        g_cond_wait (&queue->idle_cond, &queue->lock);
+    CommitBatch *batch = queue->pending;
+    queue->pending = NULL;
+    if (batch == NULL) {
+        // Already written by an earlier call, here or on another thread, or failed.
+        g_mutex_unlock (&queue->lock);
+        return;
+    }
+    queue->busy = TRUE;
+    g_mutex_unlock (&queue->lock);
+
+    GError *err = NULL;
+    gboolean written = db_write_serialized (queue->db_data, batch->plaintext,
+                                            batch->plaintext_len, batch->delta, &err);
+    if (written)
+        batch->commit_seq = g_atomic_int_get (&queue->db_data->commit_seq);
+    wipe_plaintext (batch);
+
+    g_mutex_lock (&queue->lock);
+    if (written) {
+        g_queue_push_tail (&queue->completed, batch);
+        schedule_dispatch_locked (queue);
+    } else {
+        fail_batch_locked (queue, batch, err);
+        // Whatever is queued behind the failed write was serialized from the
+        // same live array, so it carries the change that was just refused.
+        if (queue->pending != NULL) {
+            CommitBatch *next = queue->pending;
+            queue->pending = NULL;
+            fail_batch_locked (queue, next,
+                               g_error_new (generic_error_gquark (), GENERIC_ERRCODE,
+                                            "%s", _("An earlier save failed; this change was rolled back.")));
+        }
+    }
+    queue->busy = FALSE;
+    g_cond_broadcast (&queue->idle_cond);
+    g_mutex_unlock (&queue->lock);
+}
+
+
+static void
+commit_worker_func (gpointer data,
+                    gpointer user_data)
+{
+    (void) data;
+    commit_pending (user_data);
+}
+
+
+/* Called with queue->lock held. Only a push can start the worker, and pushes
+ * happen under the lock, so this can't change behind our back. */
+static gboolean
+pending_stranded_locked (DbCommitQueue *queue)
+{
+    return queue->pending != NULL && !queue->busy &&
+           g_thread_pool_get_num_threads (queue->worker) == 0;
+}
+
+
+static gboolean
+dispatch_completed (DbCommitQueue  *queue,
+                    GError        **first_error)
+{
+    DatabaseData *db_data = queue->db_data;
+
+    g_mutex_lock (&queue->lock);
+    if (queue->dispatch_source != NULL) {
+        g_source_destroy (queue->dispatch_source);
+        g_source_unref (queue->dispatch_source);
+        queue->dispatch_source = NULL;
+    }
+    GQueue batches = G_QUEUE_INIT;
+    while (!g_queue_is_empty (&queue->completed))
+        g_queue_push_tail (&batches, g_queue_pop_head (&queue->completed));
+    g_mutex_unlock (&queue->lock);
+
+    if (g_queue_is_empty (&batches))
+        return TRUE;
+
+    // A callback may drop the last reference (e.g. a one-shot handle for a
+    // cross-database move); keep the queue alive until the loop is done. When
+    // we're already inside that last unref (purge -> quiesce) there is
+    // nothing left to hold.
+    gboolean hold_ref = g_atomic_int_get (&db_data->ref_count) > 0;
+    if (hold_ref)
+        database_data_ref (db_data);
+
+    gboolean all_ok = TRUE;
+    CommitBatch *batch;
+    while ((batch = g_queue_pop_head (&batches)) != NULL) {
+        if (batch->error == NULL) {
+            db_adopt_committed (db_data, batch->committed, batch->commit_seq);
+            batch->committed = NULL;
+        } else {
+            g_mutex_lock (&queue->lock);
+            queue->undispatched_failures--;
+            g_mutex_unlock (&queue->lock);
+
+            if (g_atomic_int_get (&db_data->commit_seq) != batch->commit_seq) {
+                // A synchronous save went through after this one failed and
+                // wrote the live array, this change included.
+                g_clear_error (&batch->error);
+            } else {
+                db_rollback_to_committed (db_data);
+                all_ok = FALSE;
+                if (first_error != NULL && *first_error == NULL)
+                    *first_error = g_error_copy (batch->error);
+            }
+        }
+
+        for (guint i = 0; i < batch->waiters->len; i++) {
+            CommitWaiter *waiter = &g_array_index (batch->waiters, CommitWaiter, i);
+            waiter->callback (db_data, batch->error, waiter->user_data);
+        }
+        commit_batch_free (batch);
+    }
+
+    if (hold_ref)
+        database_data_unref (db_data);
+    return all_ok;
+}
+
+
+gboolean
+db_commit_async (DatabaseData      *db_data,
+                 DbMutationFunc     mutation,
+                 gpointer           mutation_data,
+                 DbCommitCallback   callback,
+                 gpointer           user_data,
+                 GError           **err)
+{
+    g_return_val_if_fail (db_data != NULL, FALSE);
+    g_return_val_if_fail (err == NULL || *err == NULL, FALSE);
+
+    if (db_data->in_memory_json_data == NULL) {
+        g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                     "%s", _("The database is not loaded."));
+        return FALSE;
+    }
+
+    DbCommitQueue *queue = get_queue (db_data);
+
+    g_mutex_lock (&queue->lock);
+    gboolean poisoned = (queue->undispatched_failures > 0);
+    if (poisoned) {
+        // The failure is about to roll the live array back, which discards
+        // this change too. Report it in order, behind the original failure.
+        fail_batch_locked (queue, commit_batch_new (callback, user_data),
+                           g_error_new (generic_error_gquark (), GENERIC_ERRCODE,
+                                        "%s", _("An earlier save failed; this change was rolled back.")));
+    }
+    g_mutex_unlock (&queue->lock);
+    if (poisoned)
+        return TRUE;
+
+    json_t *live = db_data->in_memory_json_data;
+    gsize plaintext_len = 0;
+    gchar *plaintext = NULL;
+    if ((mutation == NULL || mutation (live, mutation_data, err)) &&
+        otp_validate_database_root (live, err))
+        plaintext = db_serialize_tokens (db_data, live, &plaintext_len, err);
+
+    // Diffed against the committed snapshot; the worker falls back to a full
+    // write if an earlier batch lands first and moves the base.
+    DbJournalDelta *delta = plaintext != NULL ? db_journal_delta_new (db_data, live) : NULL;
+
+    if (plaintext == NULL) {
+        // The mutation may have half-applied. Let everything already queued
+        // land first so the committed snapshot covers it, then roll back.
+        db_commit_flush (db_data, NULL);
+        db_rollback_to_committed (db_data);
+        return FALSE;
+    }
+
+    // Becomes the committed snapshot once the write lands. Copying the array
+    // is enough: the tokens are shared (see db_token_for_write).
+    json_t *snapshot = json_copy (live);
+    gboolean write_here = FALSE;
+
+    g_mutex_lock (&queue->lock);
+    if (queue->pending != NULL) {
+        // Merge: this snapshot already contains every change of the pending one.
+        CommitBatch *pending = queue->pending;
+        wipe_plaintext (pending);
+        pending->plaintext = plaintext;
+        pending->plaintext_len = plaintext_len;
+        pending->delta = delta;
+        if (pending->committed != NULL)
+            json_decref (pending->committed);
+        pending->committed = snapshot;
+        if (callback != NULL) {
+            CommitWaiter waiter = { callback, user_data };
+            g_array_append_val (pending->waiters, waiter);
+        }
+    } else {
+        CommitBatch *batch = commit_batch_new (callback, user_data);
+        batch->plaintext = plaintext;
+        batch->plaintext_len = plaintext_len;
+        batch->delta = delta;
+        batch->committed = snapshot;
+        queue->pending = batch;
+        write_here = !thread_pool_push_queued (queue->worker, queue, "the database commit queue");
+    }
+    g_mutex_unlock (&queue->lock);
+
+    // No worker could be started: write it now, like a synchronous save,
+    // rather than leave it for a thread that may never come.
+    if (write_here)
+        commit_pending (queue);
+
+    return TRUE;
+}
+
+
+void
+db_commit_wait_idle (DatabaseData *db_data)
+{
+    if (db_data == NULL || db_data->commit_queue == NULL)
+        return;
+
+    DbCommitQueue *queue = db_data->commit_queue;
+    g_mutex_lock (&queue->lock);
+    while (queue->pending != NULL || queue->busy) {
+        if (pending_stranded_locked (queue)) {
+            g_mutex_unlock (&queue->lock);
+            commit_pending (queue);
+            g_mutex_lock (&queue->lock);
+            continue;
+        }
+        g_cond_wait (&queue->idle_cond, &queue->lock);
+    }
+    g_mutex_unlock (&queue->lock);
+}
+
+
+gboolean
+db_commit_flush (DatabaseData  *db_data,
+                 GError       **err)
+{
+    g_return_val_if_fail (err == NULL || *err == NULL, FALSE);
+
+    if (db_data == NULL || db_data->commit_queue == NULL)
+        return TRUE;
+
+    db_commit_wait_idle (db_data);
+    return dispatch_completed (db_data->commit_queue, err);
+}
+
+
+void
+db_commit_quiesce (DatabaseData *db_data)
+{
+    db_commit_flush (db_data, NULL);
+}
+
+
+void
+db_commit_queue_free (DatabaseData *db_data)
+{
+    if (db_data == NULL || db_data->commit_queue == NULL)
+        return;
+
+    DbCommitQueue *queue = db_data->commit_queue;
+    db_commit_wait_idle (db_data);
+    // Nothing is pending any more, so whatever is still queued is a push for
+    // a batch that was written elsewhere; don't wait for a worker to drop it.
+    g_thread_pool_free (queue->worker, TRUE, TRUE);
+
+    // The last unref normally comes after a purge has dispatched everything;
+    // anything left over has no database to report to any more.
+    CommitBatch *batch;
+    while ((batch = g_queue_pop_head (&queue->completed)) != NULL)
+        commit_batch_free (batch);
+    if (queue->dispatch_source != NULL) {
+        g_source_destroy (queue->dispatch_source);
+        g_source_unref (queue->dispatch_source);
+    }
+
+    g_main_context_unref (queue->context);
+    g_cond_clear (&queue->idle_cond);
+    g_mutex_clear (&queue->lock);
+    g_free (queue);
+    db_data->commit_queue = NULL;
+}
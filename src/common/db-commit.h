@@ -0,0 +1,51 @@
+#pragma once
+
+#include "db-common.h"
+
+G_BEGIN_DECLS
+
+/* Background commit pipeline.
+ *
+ * db_commit_async () applies a mutation to the live token array on the calling
+ * (main) thread, validates and serializes it, and hands the plaintext to a
+ * per-database worker thread that does the lock / stale-check / backup /
+ * AES-GCM / fsync sequence of update_db. Submissions that arrive while an
+ * earlier one is still waiting for the worker are merged: the newest snapshot
+ * already contains every older change, so a burst of edits costs one encrypt
+ * and one fsync. If the worker thread can't be started, the write happens on
+ * the submitting thread instead, like a synchronous save.
+ *
+ * The callback runs on the thread-default main context of the first
+ * submission, with error == NULL once the change is on disk. On failure the
+ * live array has already been rolled back to the last committed snapshot.
+ * Callbacks can also run synchronously from db_commit_flush () or
+ * database_data_purge_secrets () if those are reached first. */
+typedef void (*DbCommitCallback) (DatabaseData *db_data,
+                                  const GError *error,
+                                  gpointer      user_data);
+
+/* Returns FALSE (and sets err, with the live array restored) if the mutation
+ * or validation rejected the change up front; the callback is not invoked in
+ * that case. mutation may be NULL to persist changes already made to
+ * db_data->in_memory_json_data. */
+gboolean db_commit_async       (DatabaseData      *db_data,
+                                DbMutationFunc     mutation,
+                                gpointer           mutation_data,
+                                DbCommitCallback   callback,
+                                gpointer           user_data,
+                                GError           **err);
+
+/* Blocks until every submitted change is on disk (or failed) and dispatches
+ * the pending callbacks. Returns FALSE if any of them failed. */
+gboolean db_commit_flush       (DatabaseData      *db_data,
+                                GError           **err);
+
+/* Blocks until the worker is idle without dispatching callbacks. The
+ * synchronous write paths call this so they never race the worker. */
+void     db_commit_wait_idle   (DatabaseData      *db_data);
+
+/* Called by database_data_purge_secrets () / the last unref. */
+void     db_commit_quiesce     (DatabaseData      *db_data);
+void     db_commit_queue_free  (DatabaseData      *db_data);
+
+G_END_DECLS
@@ -12,11 +12,21 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/file.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
 #include "gquarks.h"
 #include "db-common.h"
+#include "db-commit.h"
+#include "db-journal.h"
+#include "db-record.h"
+#include "db-token-index.h"
 #include "file-size.h"
 #include "otp-validation.h"
 
+// Saves are hashed in slices of this size as they are written out.
+#define DB_WRITE_CHUNK_SIZE (64 * 1024)
 
 typedef struct {
     int fd;
@@ -27,6 +37,8 @@ typedef struct {
 static gboolean test_fail_encrypt = FALSE;
 static gboolean test_fail_atomic_write = FALSE;
 static gboolean test_unsupported_lock = FALSE;
+static guint test_file_hash_count = 0;
+static gint32 test_save_version = 0;
 
 void
 db_test_set_fail_encrypt (gboolean fail)
@@ -45,7 +57,36 @@ db_test_set_unsupported_lock (gboolean unsupported)
 {
     test_unsupported_lock = unsupported;
 }
+
+void
+db_test_set_save_version (gint32 version)
+{
+    test_save_version = version;
+}
+
+guint
+db_test_get_file_hash_count (void)
+{
+    return test_file_hash_count;
+}
+#endif
+
+/* Tests force "encryption failed" on every write path, journal appends
+ * included, so the failure paths are exercised whichever one a save takes. */
+static gboolean
+injected_encrypt_failure (GError **err)
+{
+#ifdef OTPCLIENT_TESTING
+    if (test_fail_encrypt) {
+        g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                     "Injected encrypt failure.");
+        return TRUE;
+    }
+#else
+    (void) err;
 #endif
+    return FALSE;
+}
 
 static gint32    get_db_version     (const gchar      *db_path,
                                      GError          **err);
@@ -81,44 +122,59 @@ static gchar    *try_decrypt_v3     (DatabaseData     *db_data,
                                      gboolean          use_legacy_length,
                                      GError          **err);
 
+static json_t   *load_v4_tokens     (DatabaseData     *db_data,
+                                     GError          **err);
+
 static gchar    *decrypt_db         (DatabaseData     *db_data,
                                      gsize            *dec_len,
                                      GError          **err);
 
 static gboolean  encrypt_db         (DatabaseData     *db_data,
-                                     json_t           *json_data,
+                                     const gchar      *plaintext,
+                                     gsize             plaintext_len,
+                                     GError          **err);
+
+static gboolean  commit_candidate   (DatabaseData     *db_data,
+                                     json_t           *candidate,
+                                     gboolean          allow_journal,
                                      GError          **err);
 
 static void      add_to_json        (gpointer          list_elem,
                                      gpointer          json_array);
 
 static gboolean  backup_db          (const gchar      *path,
+                                     gboolean          with_journal,
+                                     guint             generations,
                                      GError          **err);
 
 static void      cleanup_db_gfile   (GFile            *file,
                                      gpointer          stream,
                                      GError           *err);
 
-static void      free_db_resources  (gcry_cipher_hd_t  hd,
-                                     guchar           *derived_key,
-                                     guchar           *enc_buf,
-                                     gchar            *dec_buf,
-                                     DbHeaderData_v1  *header_data_v1,
-                                     DbHeaderData_v2  *header_data_v2);
-
 static gboolean  compute_file_digest (const gchar      *path,
                                       guint8            digest[32],
+                                      DbFileStamp      *stamp,
                                       GError          **err);
 
 static gboolean  loaded_file_digest_matches (DatabaseData *db_data,
                                              GError      **err);
 
-static void      rebuild_objects_hash (DatabaseData *db_data);
-
 static void      refresh_committed_snapshot (DatabaseData *db_data);
 
 static void      restore_live_from_committed (DatabaseData *db_data);
 
+static void      update_token_index (DatabaseData     *db_data,
+                                     json_t           *previous);
+
+static DbTokenIndex *live_token_index_acquire (DatabaseData *db_data,
+                                               json_t       *live,
+                                               gboolean     *owned);
+
+static void      live_token_index_release (DatabaseData *db_data,
+                                           json_t       *live,
+                                           DbTokenIndex *index,
+                                           gboolean      owned);
+
 static gboolean  partition_valid_tokens (DatabaseData     *db_data,
                                          GError          **err);
 
@@ -143,6 +199,10 @@ database_data_purge_secrets (DatabaseData *db_data)
     if (db_data == NULL)
         return;
 
+    // Let an in-flight background save finish (and its callbacks run) before
+    // the key and token arrays it works from are wiped.
+    db_commit_quiesce (db_data);
+
     db_invalidate_kdf_cache (db_data);
 
     if (db_data->key != NULL) {
@@ -166,8 +226,7 @@ database_data_purge_secrets (DatabaseData *db_data)
 
     g_slist_free_full (db_data->data_to_add, (GDestroyNotify) json_decref);
     db_data->data_to_add = NULL;
-    g_slist_free_full (db_data->objects_hash, g_free);
-    db_data->objects_hash = NULL;
+    g_clear_pointer (&db_data->token_index, db_token_index_free);
 
     if (db_data->last_hotp != NULL) {
         explicit_bzero (db_data->last_hotp, strlen (db_data->last_hotp));
@@ -179,7 +238,9 @@ database_data_purge_secrets (DatabaseData *db_data)
     explicit_bzero (db_data->loaded_file_digest,
                     sizeof (db_data->loaded_file_digest));
     db_data->has_loaded_file_digest = FALSE;
+    db_data->loaded_file_stamp.valid = FALSE;
     db_data->needs_legacy_kdf_migration = FALSE;
+    db_journal_reset (db_data);
 }
 
 
@@ -204,6 +265,41 @@ write_be32 (guint8 *p,
 }
 
 
+static void
+file_stamp_from_stat (const struct stat *st,
+                      DbFileStamp       *stamp)
+{
+    stamp->valid = TRUE;
+    stamp->dev = (guint64) st->st_dev;
+    stamp->ino = (guint64) st->st_ino;
+    stamp->size = (gint64) st->st_size;
+    stamp->mtime_ns = (gint64) st->st_mtim.tv_sec * G_GINT64_CONSTANT (1000000000) + st->st_mtim.tv_nsec;
+    stamp->ctime_ns = (gint64) st->st_ctim.tv_sec * G_GINT64_CONSTANT (1000000000) + st->st_ctim.tv_nsec;
+}
+
+
+static gboolean
+file_stamp_of_path (const gchar *path,
+                    DbFileStamp *stamp)
+{
+    struct stat st;
+    if (lstat (path, &st) != 0 || !S_ISREG (st.st_mode))
+        return FALSE;
+    file_stamp_from_stat (&st, stamp);
+    return TRUE;
+}
+
+
+static gboolean
+file_stamp_equal (const DbFileStamp *a,
+                  const DbFileStamp *b)
+{
+    return a->valid && b->valid &&
+           a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+           a->mtime_ns == b->mtime_ns && a->ctime_ns == b->ctime_ns;
+}
+
+
 static gboolean
 write_all_fd (int           fd,
               const void   *buf,
@@ -245,13 +341,14 @@ fsync_parent_dir (const gchar *path)
 }
 
 
+/* Hashes the bytes as they are written out, so the caller learns the digest
+ * and stat identity of the new file without reading it back. */
 static gboolean
 atomic_write_database (const gchar  *path,
-                       const guint8 *header,
-                       gsize         header_len,
-                       const guint8 *enc_buf,
-                       gsize         enc_len,
-                       const guint8  tag[TAG_SIZE],
+                       const guint8 *data,
+                       gsize         len,
+                       guint8        digest[32],
+                       DbFileStamp  *stamp,
                        GError      **err)
 {
 #ifdef OTPCLIENT_TESTING
@@ -273,14 +370,34 @@ atomic_write_database (const gchar  *path,
         return FALSE;
     }
 
-    gboolean ok = write_all_fd (fd, header, header_len, err) &&
-                  write_all_fd (fd, enc_buf, enc_len, err) &&
-                  write_all_fd (fd, tag, TAG_SIZE, err);
+    gcry_md_hd_t md = NULL;
+    if (gcry_md_open (&md, GCRY_MD_SHA256, 0) != GPG_ERR_NO_ERROR) {
+        g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                     "Error while opening the hash handle.");
+        close (fd);
+        g_unlink (tmpl);
+        return FALSE;
+    }
+    gboolean ok = TRUE;
+    for (gsize off = 0; ok && off < len; off += DB_WRITE_CHUNK_SIZE) {
+        gsize n = MIN (DB_WRITE_CHUNK_SIZE, len - off);
+        ok = write_all_fd (fd, data + off, n, err);
+        gcry_md_write (md, data + off, n);
+    }
+    memcpy (digest, gcry_md_read (md, GCRY_MD_SHA256), 32);
+    gcry_md_close (md);
+
+    struct stat written;
     if (ok && fsync (fd) != 0) {
         g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
                      "Failed to fsync temporary database file: %s", g_strerror (errno));
         ok = FALSE;
     }
+    if (ok && fstat (fd, &written) != 0) {
+        g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                     "Cannot stat temporary database file: %s", g_strerror (errno));
+        ok = FALSE;
+    }
     if (close (fd) != 0 && ok) {
         g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
                      "Failed to close temporary database file: %s", g_strerror (errno));
@@ -302,6 +419,11 @@ atomic_write_database (const gchar  *path,
     if (!fsync_parent_dir (path)) {
         g_warning ("Failed to fsync parent directory for %s: %s", path, g_strerror (errno));
     }
+    // rename() bumps ctime, so take the stamp from the path, but only if it is
+    // still the inode we wrote; otherwise the next save falls back to hashing.
+    if (!file_stamp_of_path (path, stamp) ||
+        stamp->dev != (guint64) written.st_dev || stamp->ino != (guint64) written.st_ino)
+        stamp->valid = FALSE;
     return TRUE;
 }
 
@@ -426,6 +548,7 @@ database_data_unref (DatabaseData *db_data)
         return;
 
     database_data_purge_secrets (db_data);
+    db_commit_queue_free (db_data);
     g_free (db_data->db_path);
     g_free (db_data);
 }
@@ -475,6 +598,31 @@ partition_valid_tokens (DatabaseData  *db_data,
 }
 
 
+static json_t *
+load_tokens (DatabaseData  *db_data,
+             GError       **err)
+{
+    if (db_data->current_db_version >= 4)
+        return load_v4_tokens (db_data, err);
+
+    // v1-v3 are a single AES-GCM blob and can only be opened whole.
+    gsize json_len = 0;
+    gchar *json = decrypt_db (db_data, &json_len, err);
+    if (json == NULL)
+        return NULL;
+
+    json_error_t jerr;
+    if (json_len > 0 && json[json_len - 1] == '\0')
+        json_len--;
+    json_t *root = json_loadb (json, json_len, 0, &jerr);
+    gcry_free (json);
+    if (root == NULL)
+        g_set_error (err, memlock_error_gquark(), MEMLOCK_ERRCODE,
+                     "Error while loading json data: %s", jerr.text);
+    return root;
+}
+
+
 void
 load_db (DatabaseData    *db_data,
          GError         **err)
@@ -494,27 +642,15 @@ load_db (DatabaseData    *db_data,
         return;
     }
 
-    /* Bail-on-error pattern: decrypt_db / update_db return NULL or set *err on
+    /* Bail-on-error pattern: load_tokens / update_db return NULL or set *err on
      * failure. Previously we used g_return_if_fail (err == NULL || *err == NULL)
      * here, but that logs a CRITICAL every time the condition is false - i.e.
      * on every legitimate failure (wrong password, truncated file, etc.) - and
      * that noise made real bugs harder to spot in the journal. A plain early
      * return preserves the original control flow without the misuse. */
-    gsize in_memory_json_len = 0;
-    gchar *in_memory_json = decrypt_db (db_data, &in_memory_json_len, err);
-    if (in_memory_json == NULL)
-        return;
-
-    json_error_t jerr;
-    if (in_memory_json_len > 0 && in_memory_json[in_memory_json_len - 1] == '\0')
-        in_memory_json_len--;
-    db_data->in_memory_json_data = json_loadb (in_memory_json, in_memory_json_len, 0, &jerr);
-    gcry_free (in_memory_json);
-    if (db_data->in_memory_json_data == NULL) {
-        g_set_error (err, memlock_error_gquark(), MEMLOCK_ERRCODE,
-                     "Error while loading json data: %s", jerr.text);
+    db_data->in_memory_json_data = load_tokens (db_data, err);
+    if (db_data->in_memory_json_data == NULL)
         return;
-    }
     /* Give any anonymous token (neither label nor issuer) a placeholder so a
      * single such entry does not make the whole database refuse to open
      * (issue #462). The names live in memory and persist on the next save. */
@@ -524,6 +660,14 @@ load_db (DatabaseData    *db_data,
     if (!partition_valid_tokens (db_data, err))
         return;
 
+    /* Edits saved since the last full write are in the journal next to the
+     * file. Journal indices refer to the live (partitioned) token set. */
+    if (!db_journal_replay (db_data, err)) {
+        json_decref (db_data->in_memory_json_data);
+        db_data->in_memory_json_data = NULL;
+        return;
+    }
+
     if (db_data->current_db_version < DB_VERSION || db_data->needs_legacy_kdf_migration) {
         update_db (db_data, err);
         if (err != NULL && *err != NULL)
@@ -532,31 +676,18 @@ load_db (DatabaseData    *db_data,
         if (db_data->in_memory_json_data != NULL) {
             json_decref (db_data->in_memory_json_data);
         }
-        g_slist_free_full (db_data->objects_hash, g_free);
-        db_data->objects_hash = NULL;
-
-        in_memory_json = decrypt_db (db_data, &in_memory_json_len, err);
-        if (in_memory_json == NULL)
-            return;
 
-        if (in_memory_json_len > 0 && in_memory_json[in_memory_json_len - 1] == '\0')
-            in_memory_json_len--;
-        db_data->in_memory_json_data = json_loadb (in_memory_json, in_memory_json_len, 0, &jerr);
-        gcry_free (in_memory_json);
-        if (db_data->in_memory_json_data == NULL) {
-            g_set_error (err, memlock_error_gquark(), MEMLOCK_ERRCODE,
-                         "Error while loading json data: %s", jerr.text);
+        db_data->in_memory_json_data = load_tokens (db_data, err);
+        if (db_data->in_memory_json_data == NULL)
             return;
-        }
         otp_repair_database_root (db_data->in_memory_json_data);
         if (!partition_valid_tokens (db_data, err))
             return;
     }
 
-    rebuild_objects_hash (db_data);
     refresh_committed_snapshot (db_data);
 
-    /* decrypt_db records the digest of the exact authenticated bytes. Do not
+    /* load_tokens records the digest of the exact authenticated bytes. Do not
      * reopen by path here: that could bind stale-write protection to a
      * different file than the one whose GCM tag was verified. */
 }
@@ -568,8 +699,10 @@ update_db (DatabaseData  *db_data,
 {
     g_return_if_fail (err == NULL || *err == NULL);
 
+    db_commit_wait_idle (db_data);
+
     gboolean first_run = (db_data->in_memory_json_data == NULL);
-    json_t *candidate = first_run ? json_array () : json_deep_copy (db_data->in_memory_json_data);
+    json_t *candidate = first_run ? json_array () : json_copy (db_data->in_memory_json_data);
     if (candidate == NULL) {
         g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
                      "Failed to allocate a database update candidate.");
@@ -587,39 +720,8 @@ update_db (DatabaseData  *db_data,
         g_slist_foreach (db_data->data_to_add, add_to_json, candidate);
     }
 
-    if (!otp_validate_database_root (candidate, err)) {
-        json_decref (candidate);
-        restore_live_from_committed (db_data);
-        return;
-    }
-
-    DbLock lock = { .fd = -1, .path = NULL };
-    if (!lock_db (db_data->db_path, &lock, err)) {
-        json_decref (candidate);
-        restore_live_from_committed (db_data);
-        return;
-    }
-
-    gboolean exists = g_file_test (db_data->db_path, G_FILE_TEST_EXISTS);
-    if (exists && db_data->has_loaded_file_digest &&
-        !loaded_file_digest_matches (db_data, err)) {
-        unlock_db (&lock);
-        json_decref (candidate);
-        restore_live_from_committed (db_data);
-        return;
-    }
-
-    if (exists && !backup_db (db_data->db_path, err)) {
-        unlock_db (&lock);
-        json_decref (candidate);
-        restore_live_from_committed (db_data);
-        return;
-    }
-
-    gboolean committed = encrypt_db (db_data, candidate, err);
-    unlock_db (&lock);
-
-    if (!committed) {
+    if (!otp_validate_database_root (candidate, err) ||
+        !commit_candidate (db_data, candidate, TRUE, err)) {
         json_decref (candidate);
         restore_live_from_committed (db_data);
         return;
@@ -634,12 +736,6 @@ update_db (DatabaseData  *db_data,
 
     g_slist_free_full (db_data->data_to_add, (GDestroyNotify) json_decref);
     db_data->data_to_add = NULL;
-    rebuild_objects_hash (db_data);
-
-    compute_file_digest (db_data->db_path, db_data->loaded_file_digest, NULL);
-    db_data->has_loaded_file_digest = TRUE;
-
-    backup_db (db_data->db_path, NULL);
 }
 
 
@@ -653,8 +749,11 @@ db_transaction (DatabaseData   *db_data,
     g_return_val_if_fail (mutation != NULL, FALSE);
     g_return_val_if_fail (err == NULL || *err == NULL, FALSE);
 
+    db_commit_wait_idle (db_data);
+
+    // Shares the token objects; mutations swap in copies via db_token_for_write.
     json_t *candidate = (db_data->in_memory_json_data != NULL)
-        ? json_deep_copy (db_data->in_memory_json_data)
+        ? json_copy (db_data->in_memory_json_data)
         : json_array ();
     if (candidate == NULL) {
         g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
@@ -663,47 +762,172 @@ db_transaction (DatabaseData   *db_data,
     }
 
     if (!mutation (candidate, user_data, err) ||
-        !otp_validate_database_root (candidate, err)) {
+        !otp_validate_database_root (candidate, err) ||
+        !commit_candidate (db_data, candidate, TRUE, err)) {
         json_decref (candidate);
         return FALSE;
     }
 
+    if (db_data->in_memory_json_data != NULL)
+        json_decref (db_data->in_memory_json_data);
+    db_data->in_memory_json_data = candidate;
+    db_data->current_db_version = DB_VERSION;
+    db_data->needs_legacy_kdf_migration = FALSE;
+    refresh_committed_snapshot (db_data);
+    return TRUE;
+}
+
+
+/* Serialize, then lock / stale-check / back up / encrypt / swap the file, or
+ * append the difference to the journal when that is enough. Shared by
+ * update_db and db_transaction; the background queue calls the two halves
+ * separately so serialization stays on the thread that owns the JSON. */
+static gboolean
+commit_candidate (DatabaseData  *db_data,
+                  json_t        *candidate,
+                  gboolean       allow_journal,
+                  GError       **err)
+{
+    gsize plaintext_len = 0;
+    gchar *plaintext = db_serialize_tokens (db_data, candidate, &plaintext_len, err);
+    if (plaintext == NULL)
+        return FALSE;
+
+    DbJournalDelta *delta = allow_journal ? db_journal_delta_new (db_data, candidate) : NULL;
+    gboolean written = db_write_serialized (db_data, plaintext, plaintext_len, delta, err);
+    db_journal_delta_free (delta);
+    explicit_bzero (plaintext, plaintext_len);
+    gcry_free (plaintext);
+    return written;
+}
+
+
+/* The journal is sealed with the cached key of the main file, so it can only
+ * extend a current-version file this handle loaded or wrote itself. */
+static gboolean
+can_append_to_journal (DatabaseData          *db_data,
+                       const DbJournalDelta  *delta)
+{
+    return delta != NULL &&
+           delta->base_seq == g_atomic_int_get (&db_data->commit_seq) &&
+           db_data->has_loaded_file_digest &&
+           db_data->has_cached_key &&
+           db_data->current_db_version == DB_VERSION &&
+           !db_data->needs_legacy_kdf_migration &&
+           db_journal_has_room (db_data, delta);
+}
+
+
+gboolean
+db_write_serialized (DatabaseData         *db_data,
+                     const gchar          *plaintext,
+                     gsize                 plaintext_len,
+                     const DbJournalDelta *delta,
+                     GError              **err)
+{
+    g_return_val_if_fail (db_data != NULL && plaintext != NULL, FALSE);
+
     DbLock lock = { .fd = -1, .path = NULL };
-    if (!lock_db (db_data->db_path, &lock, err)) {
-        json_decref (candidate);
+    if (!lock_db (db_data->db_path, &lock, err))
         return FALSE;
-    }
 
     gboolean exists = g_file_test (db_data->db_path, G_FILE_TEST_EXISTS);
     if (exists && db_data->has_loaded_file_digest &&
         !loaded_file_digest_matches (db_data, err)) {
         unlock_db (&lock);
-        json_decref (candidate);
         return FALSE;
     }
-    if (exists && !backup_db (db_data->db_path, err)) {
+    // Another process may have journaled edits on top of the same main file.
+    // Without a main file any journal is an orphan the write below removes.
+    if (exists && !db_journal_matches_loaded (db_data, err)) {
         unlock_db (&lock);
-        json_decref (candidate);
         return FALSE;
     }
 
-    gboolean committed = encrypt_db (db_data, candidate, err);
-    unlock_db (&lock);
-    if (!committed) {
-        json_decref (candidate);
+    if (exists && can_append_to_journal (db_data, delta)) {
+        // The main file (and so its digest and backup) stays as it is.
+        gboolean appended = !injected_encrypt_failure (err) &&
+                            db_journal_append (db_data, delta, err);
+        unlock_db (&lock);
+        if (!appended)
+            return FALSE;
+        g_atomic_int_inc (&db_data->commit_seq);
+        return TRUE;
+    }
+
+    // Journaled edits are part of the state being replaced: keep them with it.
+    if (exists && !backup_db (db_data->db_path, db_data->journal_len > 0,
+                              db_data->backup_generations, err)) {
+        unlock_db (&lock);
         return FALSE;
     }
 
-    if (db_data->in_memory_json_data != NULL)
-        json_decref (db_data->in_memory_json_data);
-    db_data->in_memory_json_data = candidate;
+    gboolean committed = encrypt_db (db_data, plaintext, plaintext_len, err);
+    // The new file carries every journaled edit, so this is the checkpoint.
+    if (committed)
+        db_journal_discard (db_data);
+    unlock_db (&lock);
+    if (!committed)
+        return FALSE;
+
+    g_atomic_int_inc (&db_data->commit_seq);
+    return TRUE;
+}
+
+
+void
+db_adopt_committed (DatabaseData *db_data,
+                    json_t       *committed,
+                    gint          commit_seq)
+{
+    if (committed == NULL)
+        return;
+    // A later save (sync or queued) already refreshed the snapshot, or the
+    // secrets were purged while the worker was writing: drop this one.
+    if (db_data->in_memory_json_data == NULL ||
+        g_atomic_int_get (&db_data->commit_seq) != commit_seq) {
+        json_decref (committed);
+        return;
+    }
+    json_t *previous = db_data->committed_json_data;
+    db_data->committed_json_data = committed;
+    update_token_index (db_data, previous);
+    if (previous != NULL)
+        json_decref (previous);
+    db_data->committed_seq = commit_seq;
     db_data->current_db_version = DB_VERSION;
     db_data->needs_legacy_kdf_migration = FALSE;
-    rebuild_objects_hash (db_data);
-    refresh_committed_snapshot (db_data);
-    compute_file_digest (db_data->db_path, db_data->loaded_file_digest, NULL);
-    db_data->has_loaded_file_digest = TRUE;
-    backup_db (db_data->db_path, NULL);
+}
+
+
+void
+db_rollback_to_committed (DatabaseData *db_data)
+{
+    restore_live_from_committed (db_data);
+}
+
+
+gboolean
+db_checkpoint (DatabaseData  *db_data,
+               GError       **err)
+{
+    g_return_val_if_fail (db_data != NULL, FALSE);
+    g_return_val_if_fail (err == NULL || *err == NULL, FALSE);
+
+    // Let queued saves land and be adopted so the snapshot matches the disk.
+    if (!db_commit_flush (db_data, err))
+        return FALSE;
+    if (db_data->journal_file_size == 0)
+        return TRUE;
+    if (db_data->committed_json_data == NULL) {
+        g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                     "The database is not loaded.");
+        return FALSE;
+    }
+
+    if (!commit_candidate (db_data, db_data->committed_json_data, FALSE, err))
+        return FALSE;
+    db_data->committed_seq = g_atomic_int_get (&db_data->commit_seq);
     return TRUE;
 }
 
@@ -717,6 +941,8 @@ db_change_password (DatabaseData  *db_data,
     g_return_val_if_fail (new_password != NULL, FALSE);
     g_return_val_if_fail (err == NULL || *err == NULL, FALSE);
 
+    db_commit_wait_idle (db_data);
+
     gchar *old_key = db_data->key;
     gchar *new_key = gcry_calloc_secure (strlen (new_password) + 1, 1);
     if (new_key == NULL) {
@@ -762,6 +988,8 @@ db_update_kdf_params (DatabaseData *db_data,
         return FALSE;
     }
 
+    db_commit_wait_idle (db_data);
+
     gint32 old_iter = db_data->argon2id_iter;
     gint32 old_memcost = db_data->argon2id_memcost;
     gint32 old_parallelism = db_data->argon2id_parallelism;
@@ -785,71 +1013,122 @@ db_update_kdf_params (DatabaseData *db_data,
 
 
 typedef struct {
-    GSList *otps;
-    OtpImportReport *report;
-} ImportOtpsContext;
+    json_t *obj;
+    DbTokenDigest digest;
+} PreparedToken;
 
+struct _DbImportBatch {
+    GArray *tokens;             // PreparedToken
+    guint n_seen;
+    guint n_invalid;
+};
 
-static gboolean
-candidate_contains_object (json_t *candidate,
-                           json_t *obj)
+
+DbImportBatch *
+db_import_batch_new (void)
 {
-    gsize index;
-    json_t *existing;
+    DbImportBatch *batch = g_new0 (DbImportBatch, 1);
+    batch->tokens = g_array_new (FALSE, FALSE, sizeof (PreparedToken));
+    return batch;
+}
 
-    json_array_foreach (candidate, index, existing) {
-        if (json_equal (existing, obj))
-            return TRUE;
+
+void
+db_import_batch_free (DbImportBatch *batch)
+{
+    if (batch == NULL)
+        return;
+    for (guint i = 0; i < batch->tokens->len; i++)
+        json_decref (g_array_index (batch->tokens, PreparedToken, i).obj);
+    g_array_unref (batch->tokens);
+    g_free (batch);
+}
+
+
+void
+db_import_batch_add (DbImportBatch *batch,
+                     otp_t         *otp)
+{
+    GError *validation_err = NULL;
+    /* Keep an anonymous imported token instead of dropping it (issue #462);
+     * a no-op if a parse-time repair already named it. */
+    otp_repair_anonymous_import_token (otp, batch->n_seen++);
+    if (!otp_validate_import_token (otp, &validation_err)) {
+        if (validation_err != NULL) {
+            g_printerr ("Skipping invalid imported token: %s\n", validation_err->message);
+            g_clear_error (&validation_err);
+        }
+        batch->n_invalid++;
+        return;
     }
-    return FALSE;
+
+    PreparedToken prepared;
+    prepared.obj = build_json_obj (otp->type, otp->account_name, otp->issuer,
+                                   otp->secret, otp->digits, otp->algo,
+                                   otp->period, otp->counter, otp->group);
+    if (prepared.obj == NULL) {
+        batch->n_invalid++;
+        return;
+    }
+    if (!db_token_digest (prepared.obj, &prepared.digest)) {
+        json_decref (prepared.obj);
+        batch->n_invalid++;
+        return;
+    }
+    g_array_append_val (batch->tokens, prepared);
 }
 
 
-static gboolean
-import_otps_mutation (json_t   *candidate,
-                      gpointer  user_data,
-                      GError  **err)
+guint
+db_import_batch_get_n_tokens (DbImportBatch *batch)
+{
+    return batch->tokens->len;
+}
+
+
+guint
+db_import_batch_get_n_invalid (DbImportBatch *batch)
+{
+    return batch->n_invalid;
+}
+
+
+gboolean
+db_import_batch_mutation (json_t   *candidate,
+                          gpointer  user_data,
+                          GError  **err)
 {
     (void) err;
-    ImportOtpsContext *ctx = user_data;
+    DbImportContext *ctx = user_data;
     OtpImportReport local = {0, 0, 0};
     OtpImportReport *report = ctx->report != NULL ? ctx->report : &local;
-    *report = (OtpImportReport) {0, 0, 0};
-
-    gsize import_index = 0;
-    for (GSList *l = ctx->otps; l != NULL; l = l->next, import_index++) {
-        otp_t *otp = l->data;
-        GError *validation_err = NULL;
-        /* Keep an anonymous imported token instead of dropping it (issue #462);
-         * a no-op if a parse-time repair already named it. */
-        otp_repair_anonymous_import_token (otp, import_index);
-        if (!otp_validate_import_token (otp, &validation_err)) {
-            if (validation_err != NULL) {
-                g_printerr ("Skipping invalid imported token: %s\n", validation_err->message);
-                g_clear_error (&validation_err);
-            }
-            report->skipped_invalid++;
-            continue;
-        }
+    *report = (OtpImportReport) {0, 0, ctx->batch->n_invalid};
 
-        json_t *obj = build_json_obj (otp->type, otp->account_name, otp->issuer,
-                                      otp->secret, otp->digits, otp->algo,
-                                      otp->period, otp->counter, otp->group);
-        if (obj == NULL) {
-            report->skipped_invalid++;
-            continue;
-        }
+    gboolean owned = FALSE;
+    DbTokenIndex *existing = live_token_index_acquire (ctx->db_data, candidate, &owned);
+    DbTokenIndex *added = db_token_index_new ();
+    GPtrArray *fresh = g_ptr_array_new ();
 
-        if (candidate_contains_object (candidate, obj)) {
-            json_decref (obj);
+    for (guint i = 0; i < ctx->batch->tokens->len; i++) {
+        PreparedToken *prepared = &g_array_index (ctx->batch->tokens, PreparedToken, i);
+        if (db_token_index_contains (existing, &prepared->digest) ||
+            db_token_index_contains (added, &prepared->digest)) {
             report->skipped_duplicates++;
             continue;
         }
 
-        json_array_append_new (candidate, obj);
+        db_token_index_add (added, &prepared->digest);
+        g_ptr_array_add (fresh, prepared->obj);
         report->added++;
     }
 
+    db_token_index_free (added);
+    // Before appending: the index is handed back by diffing candidate.
+    live_token_index_release (ctx->db_data, candidate, existing, owned);
+    // The batch keeps its reference: the mutation may run again.
+    for (guint i = 0; i < fresh->len; i++)
+        json_array_append (candidate, g_ptr_array_index (fresh, i));
+    g_ptr_array_unref (fresh);
     return TRUE;
 }
 
@@ -860,67 +1139,81 @@ db_import_otps (DatabaseData     *db_data,
                 OtpImportReport  *report,
                 GError         **err)
 {
-    ImportOtpsContext ctx = {
-        .otps = otps,
+    DbImportBatch *batch = db_import_batch_new ();
+    for (GSList *l = otps; l != NULL; l = l->next)
+        db_import_batch_add (batch, l->data);
+
+    DbImportContext ctx = {
+        .db_data = db_data,
+        .batch = batch,
         .report = report,
     };
-    return db_transaction (db_data, import_otps_mutation, &ctx, err);
+    gboolean ok = db_transaction (db_data, db_import_batch_mutation, &ctx, err);
+    db_import_batch_free (batch);
+    return ok;
 }
 
 
-/* True when `obj` is byte-equal (per Jansson's json_equal) to any token already
- * present either on disk or staged for the next save. Used to break ties when
- * two distinct OTP tokens share a 32-bit jenkins hash - without this fallback
- * the second token would be silently skipped as a "duplicate". */
-static gboolean
-otp_object_already_present (DatabaseData *db_data,
-                            json_t       *obj)
+static void
+update_token_index (DatabaseData *db_data,
+                    json_t       *previous)
 {
-    if (db_data->in_memory_json_data != NULL) {
-        gsize idx;
-        json_t *existing;
-        json_array_foreach (db_data->in_memory_json_data, idx, existing) {
-            if (json_equal (existing, obj))
-                return TRUE;
-        }
-    }
-    for (GSList *l = db_data->data_to_add; l != NULL; l = l->next) {
-        if (json_equal ((json_t *) l->data, obj))
-            return TRUE;
-    }
-    return FALSE;
+    if (db_data->token_index == NULL)
+        db_data->token_index = db_token_index_new ();
+    db_token_index_update (db_data->token_index, previous, db_data->committed_json_data);
 }
 
 
-static void
-rebuild_objects_hash (DatabaseData *db_data)
+/* The index describes the committed snapshot, but the live tokens run ahead
+ * of it while edits wait in the commit queue or have not been submitted yet.
+ * So the index is moved to describe live for as long as it is borrowed and
+ * moved back on release; both only re-hash the window where the two arrays
+ * differ, and tokens shared with the snapshot compare by pointer. live must
+ * not change in between. A handle that was never loaded or saved has no
+ * snapshot, so its live tokens are indexed on the spot. */
+static DbTokenIndex *
+live_token_index_acquire (DatabaseData *db_data,
+                          json_t       *live,
+                          gboolean     *owned)
 {
-    g_slist_free_full (db_data->objects_hash, g_free);
-    db_data->objects_hash = NULL;
+    if (db_data->committed_json_data != NULL && db_data->token_index != NULL) {
+        db_token_index_update (db_data->token_index, db_data->committed_json_data, live);
+        *owned = FALSE;
+        return db_data->token_index;
+    }
+    DbTokenIndex *index = db_token_index_new ();
+    db_token_index_update (index, NULL, live);
+    *owned = TRUE;
+    return index;
+}
 
-    if (db_data->in_memory_json_data == NULL)
-        return;
 
-    gsize index;
-    json_t *obj;
-    json_array_foreach (db_data->in_memory_json_data, index, obj) {
-        guint32 hash = json_object_get_hash (obj);
-        db_data->objects_hash = g_slist_prepend (db_data->objects_hash,
-                                                 g_memdup2 (&hash, sizeof (guint32)));
+static void
+live_token_index_release (DatabaseData *db_data,
+                          json_t       *live,
+                          DbTokenIndex *index,
+                          gboolean      owned)
+{
+    if (owned) {
+        db_token_index_free (index);
+        return;
     }
-    db_data->objects_hash = g_slist_reverse (db_data->objects_hash);
+    db_token_index_update (index, live, db_data->committed_json_data);
 }
 
 
 static void
 refresh_committed_snapshot (DatabaseData *db_data)
 {
-    if (db_data->committed_json_data != NULL) {
-        json_decref (db_data->committed_json_data);
-        db_data->committed_json_data = NULL;
-    }
+    json_t *previous = db_data->committed_json_data;
+    db_data->committed_json_data = NULL;
+    // Only the array is copied; the tokens themselves are shared.
     if (db_data->in_memory_json_data != NULL)
-        db_data->committed_json_data = json_deep_copy (db_data->in_memory_json_data);
+        db_data->committed_json_data = json_copy (db_data->in_memory_json_data);
+    update_token_index (db_data, previous);
+    if (previous != NULL)
+        json_decref (previous);
+    db_data->committed_seq = g_atomic_int_get (&db_data->commit_seq);
 }
 
 
@@ -931,8 +1224,22 @@ restore_live_from_committed (DatabaseData *db_data)
         return;
     if (db_data->in_memory_json_data != NULL)
         json_decref (db_data->in_memory_json_data);
-    db_data->in_memory_json_data = json_deep_copy (db_data->committed_json_data);
-    rebuild_objects_hash (db_data);
+    db_data->in_memory_json_data = json_copy (db_data->committed_json_data);
+}
+
+
+json_t *
+db_token_for_write (json_t *tokens,
+                    gsize   index)
+{
+    json_t *token = json_array_get (tokens, index);
+    if (!json_is_object (token))
+        return NULL;
+    // Shallow is enough: values are replaced, never modified, as well.
+    json_t *copy = json_copy (token);
+    if (copy == NULL || json_array_set_new (tokens, index, copy) != 0)
+        return NULL;
+    return copy;
 }
 
 
@@ -943,8 +1250,16 @@ add_otps_to_db_ex (GSList       *otps,
                    guint        *skipped_out)
 {
     guint added = 0, skipped = 0;
-    GSList *new_hashes = NULL;
     GSList *new_data = NULL;
+    gboolean owned = FALSE;
+    DbTokenIndex *existing = live_token_index_acquire (db_data, db_data->in_memory_json_data, &owned);
+    // Tokens staged by earlier calls are not committed, so not in `existing`.
+    DbTokenIndex *staged = db_token_index_new ();
+    for (GSList *l = db_data->data_to_add; l != NULL; l = l->next) {
+        DbTokenDigest digest;
+        if (db_token_digest (l->data, &digest))
+            db_token_index_add (staged, &digest);
+    }
     gsize import_index = 0;
     for (GSList *l = otps; l != NULL; l = l->next, import_index++) {
         otp_t *otp = l->data;
@@ -961,34 +1276,21 @@ add_otps_to_db_ex (GSList       *otps,
             continue;
         }
         json_t *obj = build_json_obj (otp->type, otp->account_name, otp->issuer, otp->secret, otp->digits, otp->algo, otp->period, otp->counter, otp->group);
-        guint32 hash = json_object_get_hash (obj);
-        gboolean is_duplicate = FALSE;
-        if (g_slist_find_custom (db_data->objects_hash, GUINT_TO_POINTER((guint)hash), check_duplicate) != NULL) {
-            // Hash hit: confirm with a real content comparison before skipping.
-            // jenkins is 32-bit and the hashed string is bounded; collisions
-            // between distinct tokens are realistic and silent skipping causes
-            // user-visible data loss on import.
-            is_duplicate = otp_object_already_present (db_data, obj);
-        }
-        if (!is_duplicate &&
-            g_slist_find_custom (new_hashes, GUINT_TO_POINTER((guint)hash), check_duplicate) != NULL) {
-            for (GSList *staged = new_data; staged != NULL; staged = staged->next) {
-                if (json_equal ((json_t *) staged->data, obj)) {
-                    is_duplicate = TRUE;
-                    break;
-                }
-            }
-        }
-        if (!is_duplicate) {
-            new_hashes = g_slist_prepend (new_hashes, g_memdup2 (&hash, sizeof (guint32)));
-            new_data = g_slist_prepend (new_data, obj);
-            added++;
-        } else {
-            json_decref (obj);
+        DbTokenDigest digest;
+        if (obj == NULL || !db_token_digest (obj, &digest) ||
+            db_token_index_contains (existing, &digest) ||
+            db_token_index_contains (staged, &digest)) {
+            if (obj != NULL)
+                json_decref (obj);
             skipped++;
+            continue;
         }
+        db_token_index_add (staged, &digest);
+        new_data = g_slist_prepend (new_data, obj);
+        added++;
     }
-    db_data->objects_hash = g_slist_concat (db_data->objects_hash, g_slist_reverse (new_hashes));
+    db_token_index_free (staged);
+    live_token_index_release (db_data, db_data->in_memory_json_data, existing, owned);
     db_data->data_to_add = g_slist_concat (db_data->data_to_add, g_slist_reverse (new_data));
     if (added_out != NULL) *added_out = added;
     if (skipped_out != NULL) *skipped_out = skipped;
@@ -1003,18 +1305,6 @@ add_otps_to_db (GSList       *otps,
 }
 
 
-gint
-check_duplicate (gconstpointer data,
-                 gconstpointer user_data)
-{
-    guint32 list_elem = *(guint32 *)data;
-    if (list_elem == (guint32)GPOINTER_TO_UINT(user_data)) {
-        return 0;
-    }
-    return -1;
-}
-
-
 static gint32
 get_db_version (const gchar  *db_path,
                 GError      **err)
@@ -1149,7 +1439,7 @@ get_db_derived_key (DatabaseData  *db_data,
             g_set_error (err, key_deriv_gquark (), KEY_DERIVATION_ERRCODE, "Error while deriving the key (kdf_open).");
             return NULL;
         }
-        if (gcry_kdf_compute (hd, NULL) != GPG_ERR_NO_ERROR) {
+        if (kdf_compute_threaded (hd) != GPG_ERR_NO_ERROR) {
             gcry_free (derived_key);
             gcry_kdf_close (hd);
             g_set_error (err, key_deriv_gquark (), KEY_DERIVATION_ERRCODE, "Error while deriving the key (kdf_compute).");
@@ -1261,6 +1551,183 @@ try_decrypt_v2 (DatabaseData    *db_data,
 }
 
 
+/* Where each record sits in the stream db_serialize_tokens produced. */
+typedef struct {
+    gsize offset;
+    gsize len;
+} RecordSpan;
+
+
+/* The stream is BE32 length | record, once per token. */
+static gboolean
+split_record_stream (const gchar *stream,
+                     gsize        len,
+                     GArray      *spans)
+{
+    gsize pos = 0;
+    while (pos < len) {
+        if (len - pos < 4)
+            return FALSE;
+        RecordSpan span = { pos + 4, read_be32 ((const guint8 *) stream + pos) };
+        if (span.len > len - span.offset)
+            return FALSE;
+        g_array_append_val (spans, span);
+        pos = span.offset + span.len;
+    }
+    return TRUE;
+}
+
+
+/* Version written by saves; tests can ask for an older one to produce files
+ * the way a previous release did. */
+static gint32
+save_version (void)
+{
+#ifdef OTPCLIENT_TESTING
+    if (test_save_version != 0)
+        return test_save_version;
+#endif
+    return DB_VERSION;
+}
+
+
+enum {
+    DB_V4_PART_HEADER,
+    DB_V4_PART_INDEX,
+    DB_V4_PART_RECORD
+};
+
+
+/* Seals or opens one part of a v4 file. Every part uses the cached key, so
+ * the nonce is the per-save nonce from the header with (part, index) mixed
+ * into its last 8 bytes: unique within the file, and fresh for each save.
+ * The header plus (part, index) is the associated data, which pins a part to
+ * its position and to this exact save. */
+static gboolean
+v4_crypt_part (const guchar  *derived_key,
+               const guint8  *header,
+               guint32        part,
+               guint32        index,
+               const guint8  *in,
+               guint8        *out,
+               gsize          len,
+               guint8        *tag,
+               gboolean       encrypt,
+               GError       **err)
+{
+    guint8 aad[DB_V4_HEADER_SIZE + 8];
+    memcpy (aad, header, DB_V4_HEADER_SIZE);
+    write_be32 (aad + DB_V4_HEADER_SIZE, part);
+    write_be32 (aad + DB_V4_HEADER_SIZE + 4, index);
+
+    guint8 iv[IV_SIZE];
+    memcpy (iv, header + DB_HEADER_NAME_LEN + 4, IV_SIZE);
+    for (guint i = 0; i < 8; i++)
+        iv[IV_SIZE - 8 + i] ^= aad[DB_V4_HEADER_SIZE + i];
+
+    gcry_cipher_hd_t hd = open_cipher_and_set_data ((guchar *) derived_key, iv, IV_SIZE);
+    if (hd == NULL) {
+        g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                     "Error while opening and setting the cipher data.");
+        return FALSE;
+    }
+    if (gcry_cipher_authenticate (hd, aad, sizeof (aad)) != GPG_ERR_NO_ERROR) {
+        g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                     "Error while processing the authenticated data.");
+        gcry_cipher_close (hd);
+        return FALSE;
+    }
+    if (len > 0) {
+        gpg_error_t crypt_err = encrypt
+            ? gcry_cipher_encrypt (hd, out, len, in, len)
+            : gcry_cipher_decrypt (hd, out, len, in, len);
+        if (crypt_err != GPG_ERR_NO_ERROR) {
+            g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                         "Error while %s the data.", encrypt ? "encrypting" : "decrypting");
+            gcry_cipher_close (hd);
+            return FALSE;
+        }
+    }
+
+    if (encrypt) {
+        gpg_error_t tag_err = gcry_cipher_gettag (hd, tag, TAG_SIZE);
+        gcry_cipher_close (hd);
+        if (tag_err != GPG_ERR_NO_ERROR) {
+            g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE, "Error while getting the tag.");
+            return FALSE;
+        }
+        return TRUE;
+    }
+
+    gpg_error_t tag_err = gcry_cipher_checktag (hd, tag, TAG_SIZE);
+    gcry_cipher_close (hd);
+    if (tag_err == GPG_ERR_NO_ERROR)
+        return TRUE;
+    if (part == DB_V4_PART_HEADER && gcry_err_code (tag_err) == GPG_ERR_CHECKSUM)
+        g_set_error (err, bad_tag_gquark (), BAD_TAG_ERRCODE,
+                     "The tag doesn't match. Either the password is wrong or the file is corrupted.");
+    else
+        g_set_error (err, bad_tag_gquark (), BAD_TAG_ERRCODE,
+                     "Tag verification failed for database %s %u: %s/%s",
+                     part == DB_V4_PART_RECORD ? "record" : part == DB_V4_PART_INDEX ? "index entry" : "header",
+                     index, gcry_strsource (tag_err), gcry_strerror (tag_err));
+    if (len > 0)
+        explicit_bzero (out, len);
+    return FALSE;
+}
+
+
+static void
+cache_derived_key (DatabaseData  *db_data,
+                   const guchar  *derived_key,
+                   const guint8  *salt)
+{
+    if (db_data->cached_derived_key == NULL)
+        db_data->cached_derived_key = gcry_malloc_secure (ARGON2ID_KEYLEN);
+    if (db_data->cached_derived_key == NULL)
+        return;
+    memcpy (db_data->cached_derived_key, derived_key, ARGON2ID_KEYLEN);
+    memcpy (db_data->cached_salt, salt, KDF_SALT_SIZE);
+    gcry_md_hash_buffer (GCRY_MD_SHA256, db_data->cached_pwd_hash,
+                         db_data->key, strlen (db_data->key));
+    db_data->has_cached_key = TRUE;
+}
+
+
+/* Checks the magic and version of a v3-style header (v4 extends it) and loads
+ * its Argon2id parameters into db_data, rejecting out-of-range values. */
+static gboolean
+read_v3_header (DatabaseData  *db_data,
+                const guint8  *header,
+                gint32         db_version,
+                GError       **err)
+{
+    if (memcmp (header, DB_HEADER_NAME, DB_HEADER_NAME_LEN) != 0 ||
+        read_be32 (header + DB_HEADER_NAME_LEN) != (guint32) db_version) {
+        g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                     "Malformed database v%d header.", db_version);
+        return FALSE;
+    }
+
+    const guint8 *salt = header + DB_HEADER_NAME_LEN + 4 + IV_SIZE;
+    db_data->argon2id_iter = (gint32) read_be32 (salt + KDF_SALT_SIZE);
+    db_data->argon2id_memcost = (gint32) read_be32 (salt + KDF_SALT_SIZE + 4);
+    db_data->argon2id_parallelism = (gint32) read_be32 (salt + KDF_SALT_SIZE + 8);
+
+    if (db_data->argon2id_iter < ARGON2ID_MIN_ITER || db_data->argon2id_iter > ARGON2ID_MAX_ITER ||
+        db_data->argon2id_memcost < ARGON2ID_MIN_MC || db_data->argon2id_memcost > ARGON2ID_MAX_MC ||
+        db_data->argon2id_parallelism < ARGON2ID_MIN_PARAL || db_data->argon2id_parallelism > ARGON2ID_MAX_PARAL) {
+        g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                     "Database header contains out-of-range Argon2id parameters "
+                     "(iter=%d, memcost=%d KiB, parallelism=%d).",
+                     db_data->argon2id_iter, db_data->argon2id_memcost,
+                     db_data->argon2id_parallelism);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+
 static gchar *
 try_decrypt_v3 (DatabaseData  *db_data,
                 const guint8  *header_data,
@@ -1348,6 +1815,141 @@ try_decrypt_v3 (DatabaseData  *db_data,
 }
 
 
+/* Records are the unit of decryption: each one is opened straight out of a
+ * read-only mapping of the file into a scratch buffer the size of the largest
+ * record, parsed, and wiped before the next one. Secure memory holds the
+ * parsed tokens plus one record, never the whole plaintext, so the file size
+ * is not bounded by the secure memory pool the way v1-v3 files are. */
+static json_t *
+load_v4_tokens (DatabaseData  *db_data,
+                GError       **err)
+{
+    int fd = path_open_safe_regular_file (db_data->db_path, err);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    GMappedFile *mapped = NULL;
+    if (fstat (fd, &st) != 0)
+        g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                     "Cannot stat database file: %s", g_strerror (errno));
+    else
+        mapped = g_mapped_file_new_from_fd (fd, FALSE, err);
+    close (fd);
+    if (mapped == NULL)
+        return NULL;
+
+    gsize file_size = g_mapped_file_get_length (mapped);
+    const guint8 *file_buf = (const guint8 *) g_mapped_file_get_contents (mapped);
+    json_t *tokens = NULL;
+    guchar *derived_key = NULL;
+    guint32 *lengths = NULL;
+    gchar *scratch = NULL;
+    gsize max_len = 0;
+
+    if (file_size < DB_V4_PREFIX_SIZE) {
+        g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                     "Database file is too small (got %" G_GSIZE_FORMAT " bytes, need at least %d).",
+                     file_size, DB_V4_PREFIX_SIZE);
+        goto out;
+    }
+    gint32 version = (gint32) read_be32 (file_buf + DB_HEADER_NAME_LEN);
+    if (!read_v3_header (db_data, file_buf, version, err))
+        goto out;
+
+    const guint8 *header = file_buf;
+    const guint8 *salt = header + DB_HEADER_NAME_LEN + 4 + IV_SIZE;
+    guint32 n_records = read_be32 (salt + KDF_SALT_SIZE + 12);
+    if ((file_size - DB_V4_PREFIX_SIZE) / DB_V4_INDEX_ENTRY_SIZE < n_records) {
+        g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                     "Malformed database v4 index.");
+        goto out;
+    }
+
+    derived_key = get_db_derived_key (db_data, DB_VERSION, salt, FALSE, err);
+    if (derived_key == NULL ||
+        !v4_crypt_part (derived_key, header, DB_V4_PART_HEADER, 0, NULL, NULL, 0,
+                        (guint8 *) file_buf + DB_V4_HEADER_SIZE, FALSE, err))
+        goto out;
+
+    // The index first: the records must tile the rest of the file exactly.
+    lengths = g_new (guint32, n_records > 0 ? n_records : 1);
+    gsize expected = DB_V4_PREFIX_SIZE + (gsize) n_records * DB_V4_INDEX_ENTRY_SIZE;
+    for (guint32 i = 0; i < n_records; i++) {
+        const guint8 *entry = file_buf + DB_V4_PREFIX_SIZE + (gsize) i * DB_V4_INDEX_ENTRY_SIZE;
+        guint8 plain[8];
+        if (!v4_crypt_part (derived_key, header, DB_V4_PART_INDEX, i, entry, plain,
+                            sizeof (plain), (guint8 *) entry + sizeof (plain), FALSE, err))
+            goto out;
+        lengths[i] = read_be32 (plain + 4);
+        if (read_be32 (plain) != expected || lengths[i] > file_size - expected ||
+            file_size - expected - lengths[i] < TAG_SIZE) {
+            g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                         "Malformed database v4 index.");
+            goto out;
+        }
+        expected += (gsize) lengths[i] + TAG_SIZE;
+        max_len = MAX (max_len, lengths[i]);
+    }
+    if (expected != file_size) {
+        g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                     "Database file has trailing data after the last record.");
+        goto out;
+    }
+    if (db_data->max_file_size_from_memlock > 0 &&
+        max_len > (gsize) (db_data->max_file_size_from_memlock * SECMEM_SIZE_THRESHOLD_RATIO)) {
+        g_set_error (err, file_too_big_gquark (), FILE_TOO_BIG_ERRCODE, FILE_SIZE_SECMEM_MSG);
+        goto out;
+    }
+
+    scratch = gcry_malloc_secure (max_len + 1);
+    tokens = json_array ();
+    if (scratch == NULL || tokens == NULL) {
+        g_set_error (err, secmem_alloc_error_gquark (), SECMEM_ALLOC_ERRCODE,
+                     "Error while allocating secure memory.");
+        goto fail;
+    }
+    gsize offset = DB_V4_PREFIX_SIZE + (gsize) n_records * DB_V4_INDEX_ENTRY_SIZE;
+    for (guint32 i = 0; i < n_records; i++) {
+        if (!v4_crypt_part (derived_key, header, DB_V4_PART_RECORD, i, file_buf + offset,
+                            (guint8 *) scratch, lengths[i],
+                            (guint8 *) file_buf + offset + lengths[i], FALSE, err))
+            goto fail;
+        json_t *token = db_record_read ((const guint8 *) scratch, lengths[i], version, err);
+        explicit_bzero (scratch, lengths[i]);
+        if (token == NULL)
+            goto fail;
+        if (json_array_append_new (tokens, token) != 0) {
+            // Jansson allocates from the secure pool (see init_libs).
+            g_set_error (err, file_too_big_gquark (), FILE_TOO_BIG_ERRCODE, FILE_SIZE_SECMEM_MSG);
+            goto fail;
+        }
+        offset += (gsize) lengths[i] + TAG_SIZE;
+    }
+
+    gcry_md_hash_buffer (GCRY_MD_SHA256, db_data->loaded_file_digest, file_buf, file_size);
+    db_data->has_loaded_file_digest = TRUE;
+    file_stamp_from_stat (&st, &db_data->loaded_file_stamp);
+    cache_derived_key (db_data, derived_key, salt);
+    goto out;
+
+fail:
+    if (tokens != NULL) {
+        json_decref (tokens);
+        tokens = NULL;
+    }
+out:
+    if (derived_key != NULL) {
+        explicit_bzero (derived_key, ARGON2ID_KEYLEN);
+        gcry_free (derived_key);
+    }
+    if (scratch != NULL)
+        gcry_free (scratch);
+    g_free (lengths);
+    g_mapped_file_unref (mapped);
+    return tokens;
+}
+
+
 static gchar *
 decrypt_db (DatabaseData *db_data,
             gsize        *dec_len,
@@ -1435,34 +2037,15 @@ decrypt_db (DatabaseData *db_data,
         *dec_len = enc_buf_size;
 
     gchar *dec_buf = NULL;
-    if (db_data->current_db_version == 3) {
+    if (db_data->current_db_version >= 3) {
         const guint8 *header = file_buf;
-        if (memcmp (header, DB_HEADER_NAME, DB_HEADER_NAME_LEN) != 0 ||
-            read_be32 (header + DB_HEADER_NAME_LEN) != 3) {
-            g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
-                         "Malformed database v3 header.");
+        if (!read_v3_header (db_data, header, db_data->current_db_version, err)) {
             g_free (file_buf);
             return NULL;
         }
 
         const guint8 *iv = header + DB_HEADER_NAME_LEN + 4;
         const guint8 *salt = iv + IV_SIZE;
-        db_data->argon2id_iter = (gint32) read_be32 (salt + KDF_SALT_SIZE);
-        db_data->argon2id_memcost = (gint32) read_be32 (salt + KDF_SALT_SIZE + 4);
-        db_data->argon2id_parallelism = (gint32) read_be32 (salt + KDF_SALT_SIZE + 8);
-
-        if (db_data->argon2id_iter < ARGON2ID_MIN_ITER || db_data->argon2id_iter > ARGON2ID_MAX_ITER ||
-            db_data->argon2id_memcost < ARGON2ID_MIN_MC || db_data->argon2id_memcost > ARGON2ID_MAX_MC ||
-            db_data->argon2id_parallelism < ARGON2ID_MIN_PARAL || db_data->argon2id_parallelism > ARGON2ID_MAX_PARAL) {
-            g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
-                         "Database header contains out-of-range Argon2id parameters "
-                         "(iter=%d, memcost=%d KiB, parallelism=%d).",
-                         db_data->argon2id_iter, db_data->argon2id_memcost,
-                         db_data->argon2id_parallelism);
-            g_free (file_buf);
-            return NULL;
-        }
-
         dec_buf = try_decrypt_v3 (db_data, header, header_data_size, salt, iv,
                                   enc_buf, enc_buf_size, tag, FALSE, err);
     } else if (db_data->current_db_version == 2) {
@@ -1547,6 +2130,7 @@ decrypt_db (DatabaseData *db_data,
         gcry_md_hash_buffer (GCRY_MD_SHA256, db_data->loaded_file_digest,
                              file_buf, file_size);
         db_data->has_loaded_file_digest = TRUE;
+        file_stamp_from_stat (&st, &db_data->loaded_file_stamp);
     }
     g_free (file_buf);
     return dec_buf;
@@ -1554,46 +2138,154 @@ decrypt_db (DatabaseData *db_data,
 
 
 static gboolean
-encrypt_db (DatabaseData *db_data,
-            json_t       *json_data,
-            GError      **err)
+pread_all (int       fd,
+           guint8   *buf,
+           gsize     len,
+           gsize     offset,
+           GError  **err)
 {
-    g_return_val_if_fail (err == NULL || *err == NULL, FALSE);
+    gsize done = 0;
+    while (done < len) {
+        ssize_t n = pread (fd, buf + done, len - done, (off_t) (offset + done));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                         "Failed to read database file: %s", n < 0 ? g_strerror (errno) : "short read");
+            return FALSE;
+        }
+        done += (gsize) n;
+    }
+    return TRUE;
+}
 
-#ifdef OTPCLIENT_TESTING
-    if (test_fail_encrypt) {
+
+json_t *
+db_fetch_token (DatabaseData  *db_data,
+                gsize          index,
+                GError       **err)
+{
+    g_return_val_if_fail (db_data != NULL && db_data->key != NULL, NULL);
+    g_return_val_if_fail (err == NULL || *err == NULL, NULL);
+
+    // Journaled edits can move or change any token; only load_db replays them.
+    g_autofree gchar *journal_path = db_journal_path (db_data->db_path);
+    if (g_file_test (journal_path, G_FILE_TEST_EXISTS)) {
         g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
-                     "Injected encrypt failure.");
-        return FALSE;
+                     "The database has journaled changes and must be loaded in full.");
+        return NULL;
     }
-#endif
 
-    guint8 header_data[DB_V3_HEADER_SIZE] = {0};
-    memcpy (header_data, DB_HEADER_NAME, DB_HEADER_NAME_LEN);
-    write_be32 (header_data + DB_HEADER_NAME_LEN, DB_VERSION);
-    guint8 *iv = header_data + DB_HEADER_NAME_LEN + 4;
-    guint8 *salt = iv + IV_SIZE;
-    gcry_create_nonce (iv, IV_SIZE);
-    // Reuse the previously-derived salt when we have a cached key so the KDF
-    // step is a memcpy instead of a 150 ms Argon2id derivation. The per-save
-    // random IV above guarantees AES-GCM nonce uniqueness independently of
-    // salt reuse. db_invalidate_kdf_cache() is called on password change to
-    // force a fresh salt + key on the next save.
-    if (db_data->has_cached_key)
-        memcpy (salt, db_data->cached_salt, KDF_SALT_SIZE);
-    else
-        gcry_create_nonce (salt, KDF_SALT_SIZE);
-    write_be32 (salt + KDF_SALT_SIZE, (guint32) db_data->argon2id_iter);
-    write_be32 (salt + KDF_SALT_SIZE + 4, (guint32) db_data->argon2id_memcost);
-    write_be32 (salt + KDF_SALT_SIZE + 8, (guint32) db_data->argon2id_parallelism);
+    int fd = path_open_safe_regular_file (db_data->db_path, err);
+    if (fd < 0)
+        return NULL;
 
-    // encrypt_db unconditionally uses the corrected (strlen) password byte length.
-    // The legacy g_utf8_strlen length is only used on the decrypt retry path
-    // when reading older databases (see decrypt_db / try_decrypt_v2).
-    guchar *derived_key = get_db_derived_key (db_data, DB_VERSION, salt, FALSE, err);
-    if (derived_key == NULL) {
-        return FALSE;
+    json_t *token = NULL;
+    guchar *derived_key = NULL;
+    guint8 *record = NULL;
+    gchar *plaintext = NULL;
+    guint32 record_len = 0;
+
+    struct stat st;
+    guint8 prefix[DB_V4_PREFIX_SIZE];
+    if (fstat (fd, &st) != 0 || st.st_size < (off_t) sizeof (prefix)) {
+        g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                     "Database file is too small.");
+        goto out;
+    }
+    gsize file_size = (gsize) st.st_size;
+    if (!pread_all (fd, prefix, sizeof (prefix), 0, err))
+        goto out;
+    gint32 version = (gint32) read_be32 (prefix + DB_HEADER_NAME_LEN);
+    if (version < 4 || version > DB_VERSION) {
+        g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                     "Only v4 and later databases can be read one token at a time.");
+        goto out;
+    }
+    if (!read_v3_header (db_data, prefix, version, err))
+        goto out;
+
+    const guint8 *salt = prefix + DB_HEADER_NAME_LEN + 4 + IV_SIZE;
+    guint32 n_records = read_be32 (salt + KDF_SALT_SIZE + 12);
+    gsize records_start = DB_V4_PREFIX_SIZE + (gsize) n_records * DB_V4_INDEX_ENTRY_SIZE;
+    if ((file_size - DB_V4_PREFIX_SIZE) / DB_V4_INDEX_ENTRY_SIZE < n_records) {
+        g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                     "Malformed database v4 index.");
+        goto out;
+    }
+    if (index >= n_records) {
+        g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                     "Token %" G_GSIZE_FORMAT " is out of range.", index);
+        goto out;
+    }
+
+    derived_key = get_db_derived_key (db_data, DB_VERSION, salt, FALSE, err);
+    if (derived_key == NULL ||
+        !v4_crypt_part (derived_key, prefix, DB_V4_PART_HEADER, 0, NULL, NULL, 0,
+                        prefix + DB_V4_HEADER_SIZE, FALSE, err))
+        goto out;
+
+    guint8 entry[DB_V4_INDEX_ENTRY_SIZE];
+    guint8 plain[8];
+    if (!pread_all (fd, entry, sizeof (entry), DB_V4_PREFIX_SIZE + index * DB_V4_INDEX_ENTRY_SIZE, err) ||
+        !v4_crypt_part (derived_key, prefix, DB_V4_PART_INDEX, (guint32) index, entry, plain,
+                        sizeof (plain), entry + sizeof (plain), FALSE, err))
+        goto out;
+    gsize offset = read_be32 (plain);
+    record_len = read_be32 (plain + 4);
+    if (offset < records_start || offset > file_size ||
+        record_len > file_size - offset || file_size - offset - record_len < TAG_SIZE) {
+        g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                     "Malformed database v4 index.");
+        goto out;
+    }
+
+    record = g_malloc ((gsize) record_len + TAG_SIZE);
+    plaintext = gcry_calloc_secure ((gsize) record_len + 1, 1);
+    if (plaintext == NULL) {
+        g_set_error (err, secmem_alloc_error_gquark (), SECMEM_ALLOC_ERRCODE,
+                     "Error while allocating secure memory.");
+        goto out;
+    }
+    if (!pread_all (fd, record, (gsize) record_len + TAG_SIZE, offset, err) ||
+        !v4_crypt_part (derived_key, prefix, DB_V4_PART_RECORD, (guint32) index, record,
+                        (guint8 *) plaintext, record_len, record + record_len, FALSE, err))
+        goto out;
+
+    token = db_record_read ((const guint8 *) plaintext, record_len, version, err);
+    if (token != NULL && !json_is_object (token)) {
+        g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                     "Malformed database record: not an object");
+        json_decref (token);
+        token = NULL;
+    }
+    if (token == NULL)
+        goto out;
+    cache_derived_key (db_data, derived_key, salt);
+
+out:
+    close (fd);
+    if (derived_key != NULL) {
+        explicit_bzero (derived_key, ARGON2ID_KEYLEN);
+        gcry_free (derived_key);
+    }
+    if (plaintext != NULL) {
+        explicit_bzero (plaintext, record_len);
+        gcry_free (plaintext);
     }
+    g_free (record);
+    return token;
+}
+
+
+gchar *
+db_serialize_tokens (DatabaseData  *db_data,
+                     json_t        *json_data,
+                     gsize         *out_len,
+                     GError       **err)
+{
+    g_return_val_if_fail (out_len != NULL, NULL);
+    g_return_val_if_fail (err == NULL || *err == NULL, NULL);
 
     // Preserve tokens set aside on load because they failed validation (issue
     // #464): they are kept out of the live in-memory set, so merge them back in
@@ -1608,9 +2300,7 @@ encrypt_db (DatabaseData *db_data,
         if (merged == NULL) {
             g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
                          "Failed to merge preserved tokens for serialization.");
-            explicit_bzero (derived_key, ARGON2ID_KEYLEN);
-            gcry_free (derived_key);
-            return FALSE;
+            return NULL;
         }
         gsize q_idx;
         json_t *q_obj;
@@ -1619,92 +2309,148 @@ encrypt_db (DatabaseData *db_data,
         to_dump = merged;
     }
 
-    gsize input_data_len = json_dumpb (to_dump, NULL, 0, JSON_COMPACT);
-    if (input_data_len == 0) {
-        g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE, "Failed to serialize the in-memory database.");
-        if (merged != NULL) json_decref (merged);
-        explicit_bzero (derived_key, ARGON2ID_KEYLEN);
-        gcry_free (derived_key);
-        return FALSE;
+    // Size every record first so the stream is written once, in place.
+    gint32 version = save_version ();
+    gsize stream_len = 0;
+    gsize t_idx;
+    json_t *token;
+    json_array_foreach (to_dump, t_idx, token) {
+        gsize record_len = db_record_size (token, version);
+        if (record_len == 0 || record_len > G_MAXUINT32) {
+            g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE, "Failed to serialize the in-memory database.");
+            if (merged != NULL) json_decref (merged);
+            return NULL;
+        }
+        stream_len += 4 + record_len;
     }
-    gchar *in_memory_dumped_data = gcry_calloc_secure (input_data_len, 1);
-    if (in_memory_dumped_data == NULL) {
+    // One spare byte keeps the allocation non-empty for an empty database.
+    gchar *stream = gcry_calloc_secure (stream_len + 1, 1);
+    if (stream == NULL) {
         g_set_error (err, secmem_alloc_error_gquark (), SECMEM_ALLOC_ERRCODE,
                      "Failed to allocate secure memory for serialized database.");
         if (merged != NULL) json_decref (merged);
-        explicit_bzero (derived_key, ARGON2ID_KEYLEN);
-        gcry_free (derived_key);
-        return FALSE;
+        return NULL;
     }
-    if (json_dumpb (to_dump, in_memory_dumped_data, input_data_len, JSON_COMPACT) == (size_t) -1) {
-        g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE, "Failed to serialize the in-memory database.");
-        if (merged != NULL) json_decref (merged);
-        gcry_free (in_memory_dumped_data);
-        explicit_bzero (derived_key, ARGON2ID_KEYLEN);
-        gcry_free (derived_key);
-        return FALSE;
+    gsize pos = 0;
+    json_array_foreach (to_dump, t_idx, token) {
+        guint8 *record = (guint8 *) stream + pos + 4;
+        gsize written = db_record_write (token, version, record, stream_len - pos - 4);
+        if (written == 0) {
+            g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE, "Failed to serialize the in-memory database.");
+            if (merged != NULL) json_decref (merged);
+            explicit_bzero (stream, stream_len);
+            gcry_free (stream);
+            return NULL;
+        }
+        write_be32 ((guint8 *) stream + pos, (guint32) written);
+        pos += 4 + written;
     }
     if (merged != NULL) json_decref (merged);
-    guchar *enc_buffer = g_malloc0 (input_data_len);
 
-    // C3 fix: in_memory_dumped_data holds the plaintext database (every secret).
-    // Every error path below MUST free it; previously only the success path did,
-    // leaving plaintext in secure memory until process exit on encrypt failures.
-    gcry_cipher_hd_t hd = open_cipher_and_set_data (derived_key, iv, IV_SIZE);
-    if (hd == NULL) {
-        g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE, "Failed to open the cipher and set the data.");
-        gcry_free (in_memory_dumped_data);
-        free_db_resources (NULL, derived_key, enc_buffer, NULL, NULL, NULL);
-        return FALSE;
-    }
+    *out_len = pos;
+    return stream;
+}
+
+
+static gboolean
+encrypt_db (DatabaseData *db_data,
+            const gchar  *plaintext,
+            gsize         plaintext_len,
+            GError      **err)
+{
+    g_return_val_if_fail (err == NULL || *err == NULL, FALSE);
 
-    if (gcry_cipher_authenticate (hd, header_data, sizeof (header_data)) != GPG_ERR_NO_ERROR) {
-        g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE, "Error while processing the authenticated data");
-        gcry_free (in_memory_dumped_data);
-        free_db_resources (hd, derived_key, enc_buffer, NULL, NULL, NULL);
+    if (injected_encrypt_failure (err))
         return FALSE;
-    }
 
-    if (gcry_cipher_encrypt (hd, enc_buffer, input_data_len, in_memory_dumped_data, input_data_len) != GPG_ERR_NO_ERROR) {
-        g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE, "Error while encrypting the data.");
-        gcry_free (in_memory_dumped_data);
-        free_db_resources (hd, derived_key, enc_buffer, NULL, NULL, NULL);
+    g_autoptr (GArray) spans = g_array_new (FALSE, FALSE, sizeof (RecordSpan));
+    if (!split_record_stream (plaintext, plaintext_len, spans)) {
+        g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                     "Failed to split the serialized database into records.");
         return FALSE;
     }
-    gcry_free (in_memory_dumped_data);
 
-    guchar tag[TAG_SIZE];
-    if (gcry_cipher_gettag (hd, tag, TAG_SIZE) != GPG_ERR_NO_ERROR) {
-        g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE, "Error while getting the tag.");
-        free_db_resources (hd, derived_key, enc_buffer, NULL, NULL, NULL);
+    // Offsets and lengths in the index are 32-bit.
+    gsize index_end = DB_V4_PREFIX_SIZE + (gsize) spans->len * DB_V4_INDEX_ENTRY_SIZE;
+    gsize file_size = index_end;
+    for (guint i = 0; i < spans->len; i++)
+        file_size += g_array_index (spans, RecordSpan, i).len + TAG_SIZE;
+    if (file_size > G_MAXUINT32) {
+        g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                     "The database is too large to be saved.");
         return FALSE;
     }
 
-    gboolean wrote = atomic_write_database (db_data->db_path, header_data, sizeof (header_data),
-                                            enc_buffer, input_data_len, tag, err);
-    explicit_bzero (tag, TAG_SIZE);
-    if (!wrote) {
-        free_db_resources (hd, derived_key, enc_buffer, NULL, NULL, NULL);
+    guint8 *file_buf = g_malloc0 (file_size);
+    guint8 *header = file_buf;
+    memcpy (header, DB_HEADER_NAME, DB_HEADER_NAME_LEN);
+    write_be32 (header + DB_HEADER_NAME_LEN, (guint32) save_version ());
+    guint8 *nonce = header + DB_HEADER_NAME_LEN + 4;
+    guint8 *salt = nonce + IV_SIZE;
+    gcry_create_nonce (nonce, IV_SIZE);
+    // Reuse the previously-derived salt when we have a cached key so the KDF
+    // step is a memcpy instead of a 150 ms Argon2id derivation. The per-save
+    // random nonce above guarantees AES-GCM nonce uniqueness independently of
+    // salt reuse. db_invalidate_kdf_cache() is called on password change to
+    // force a fresh salt + key on the next save.
+    if (db_data->has_cached_key)
+        memcpy (salt, db_data->cached_salt, KDF_SALT_SIZE);
+    else
+        gcry_create_nonce (salt, KDF_SALT_SIZE);
+    write_be32 (salt + KDF_SALT_SIZE, (guint32) db_data->argon2id_iter);
+    write_be32 (salt + KDF_SALT_SIZE + 4, (guint32) db_data->argon2id_memcost);
+    write_be32 (salt + KDF_SALT_SIZE + 8, (guint32) db_data->argon2id_parallelism);
+    write_be32 (salt + KDF_SALT_SIZE + 12, spans->len);
+
+    // encrypt_db unconditionally uses the corrected (strlen) password byte length.
+    // The legacy g_utf8_strlen length is only used on the decrypt retry path
+    // when reading older databases (see decrypt_db / try_decrypt_v2).
+    guchar *derived_key = get_db_derived_key (db_data, DB_VERSION, salt, FALSE, err);
+    if (derived_key == NULL) {
+        g_free (file_buf);
         return FALSE;
     }
 
+    // The plaintext belongs to the caller (see commit_candidate / db-commit.c),
+    // which wipes it on every path; nothing below keeps a copy.
+    gboolean ok = v4_crypt_part (derived_key, header, DB_V4_PART_HEADER, 0, NULL, NULL, 0,
+                                 file_buf + DB_V4_HEADER_SIZE, TRUE, err);
+    gsize offset = index_end;
+    for (guint i = 0; ok && i < spans->len; i++) {
+        const RecordSpan *span = &g_array_index (spans, RecordSpan, i);
+        guint8 entry[8];
+        write_be32 (entry, (guint32) offset);
+        write_be32 (entry + 4, (guint32) span->len);
+        guint8 *entry_out = file_buf + DB_V4_PREFIX_SIZE + (gsize) i * DB_V4_INDEX_ENTRY_SIZE;
+        ok = v4_crypt_part (derived_key, header, DB_V4_PART_INDEX, i, entry, entry_out,
+                            sizeof (entry), entry_out + sizeof (entry), TRUE, err) &&
+             v4_crypt_part (derived_key, header, DB_V4_PART_RECORD, i,
+                            (const guint8 *) plaintext + span->offset, file_buf + offset,
+                            span->len, file_buf + offset + span->len, TRUE, err);
+        offset += span->len + TAG_SIZE;
+    }
+
+    guint8 digest[32];
+    DbFileStamp stamp = { 0 };
+    if (ok)
+        ok = atomic_write_database (db_data->db_path, file_buf, file_size, digest, &stamp, err);
     // Mirror try_decrypt_v2's cache populate so subsequent operations under
     // the same (password, salt) skip the 150 ms Argon2id derivation. Without
     // this, the first save after a fresh unlock paid the derive cost but
     // discarded the result, forcing the next save to redo the work.
-    if (db_data->cached_derived_key == NULL)
-        db_data->cached_derived_key = gcry_malloc_secure (ARGON2ID_KEYLEN);
-    if (db_data->cached_derived_key != NULL) {
-        memcpy (db_data->cached_derived_key, derived_key, ARGON2ID_KEYLEN);
-        memcpy (db_data->cached_salt, salt, KDF_SALT_SIZE);
-        gcry_md_hash_buffer (GCRY_MD_SHA256, db_data->cached_pwd_hash,
-                             db_data->key, strlen (db_data->key));
-        db_data->has_cached_key = TRUE;
-    }
+    if (ok)
+        cache_derived_key (db_data, derived_key, salt);
 
-    free_db_resources (hd, derived_key, enc_buffer, NULL, NULL, NULL);
+    explicit_bzero (derived_key, ARGON2ID_KEYLEN);
+    gcry_free (derived_key);
+    g_free (file_buf);
+    if (!ok)
+        return FALSE;
 
-    db_data->current_db_version = DB_VERSION;
+    memcpy (db_data->loaded_file_digest, digest, sizeof (digest));
+    db_data->has_loaded_file_digest = TRUE;
+    db_data->loaded_file_stamp = stamp;
+    db_data->current_db_version = save_version ();
     db_data->needs_legacy_kdf_migration = FALSE;
     return TRUE;
 }
@@ -1714,62 +2460,177 @@ static void
 add_to_json (gpointer list_elem,
              gpointer json_array)
 {
-    // append_new (not append) for the freshly-created deep copy: append would
-    // bump the deep-copy's refcount to 2 with no local handle to decref, so
-    // the copy would persist indefinitely after the parent array is freed.
-    json_array_append_new (json_array, json_deep_copy (list_elem));
+    // Staged tokens are immutable like the stored ones: share, don't copy.
+    // data_to_add keeps its own reference and drops it after the save.
+    json_array_append (json_array, list_elem);
 }
 
 
+/* Last resort when the filesystem has no hard links: a reflink if it can
+ * share extents, a plain copy otherwise. */
 static gboolean
-perform_backup_restore (const gchar *path,
-                        gboolean     is_backup,
-                        GError     **out_err)
+clone_or_copy_file (const gchar *src_path,
+                    const gchar *dst_path,
+                    GError     **err)
 {
-    GError *err = NULL;
-    gchar *src_path = is_backup ? g_strdup (path) : g_strconcat (path, ".bak", NULL);
-    gchar *dst_path = is_backup ? g_strconcat (path, ".bak", NULL) : g_strdup (path);
-
-    GFile *src = g_file_new_for_path (src_path);
-    GFile *dst = g_file_new_for_path (dst_path);
-
-    /* Tighten umask so a freshly-created destination is born 0600 instead of
-     * exposing the encrypted blob (and Argon2id salt+params) for the duration
-     * of the copy. Restore immediately after. */
-    mode_t old_umask = umask (0077);
-    gboolean copied = g_file_copy (src, dst, G_FILE_COPY_OVERWRITE | G_FILE_COPY_NOFOLLOW_SYMLINKS, NULL, NULL, NULL, &err);
-    umask (old_umask);
+    int src_fd = g_open (src_path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW, 0);
+    if (src_fd < 0) {
+        g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                     "Couldn't create the backup: %s", g_strerror (errno));
+        return FALSE;
+    }
+    int dst_fd = g_open (dst_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC | O_NOFOLLOW, 0600);
+    if (dst_fd < 0) {
+        g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                     "Couldn't create the backup: %s", g_strerror (errno));
+        close (src_fd);
+        return FALSE;
+    }
 
-    if (!copied) {
-        g_propagate_prefixed_error (out_err, err, "Couldn't %s: ",
-                                    is_backup ? "create the backup" : "restore the backup");
-        err = NULL;
-    } else {
-        /* Belt-and-braces: if the destination already existed with broader
-         * perms, g_file_copy preserves them. Force 0600 unconditionally. */
-        if (g_chmod (dst_path, 0600) != 0) {
-            g_set_error (out_err, generic_error_gquark (), GENERIC_ERRCODE,
-                         "Failed to chmod 0600 on %s: %s", dst_path, g_strerror (errno));
-            copied = FALSE;
-        } else {
-            g_print("%s\n", is_backup ? _("Backup copy successfully created.") : _("Backup copy successfully restored."));
+    gboolean ok = FALSE;
+#ifdef FICLONE
+    ok = (ioctl (dst_fd, FICLONE, src_fd) == 0);
+#endif
+    if (!ok) {
+        guint8 buf[DB_WRITE_CHUNK_SIZE];
+        ssize_t n;
+        ok = TRUE;
+        while (ok && (n = read (src_fd, buf, sizeof (buf))) != 0) {
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                             "Couldn't create the backup: %s", g_strerror (errno));
+                ok = FALSE;
+            } else {
+                ok = write_all_fd (dst_fd, buf, (gsize) n, err);
+            }
         }
+        // Unlike a link or a reflink, copied data is not covered by the
+        // directory fsync that makes the save durable.
+        if (ok && fsync (dst_fd) != 0) {
+            g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                         "Couldn't create the backup: %s", g_strerror (errno));
+            ok = FALSE;
+        }
+    }
+    close (src_fd);
+    if (close (dst_fd) != 0 && ok) {
+        g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                     "Couldn't create the backup: %s", g_strerror (errno));
+        ok = FALSE;
     }
+    if (!ok)
+        g_unlink (dst_path);
+    return ok;
+}
 
-    g_free (src_path);
-    g_free (dst_path);
 
-    g_object_unref (src);
-    g_object_unref (dst);
-    return copied;
+/* Shifts .bak → .bak.1 → … → .bak.N, dropping the oldest, each with the
+ * journal kept next to it (see backup_db). Only names change, so this is best
+ * effort: a failed rename costs a generation, not the save. */
+static void
+rotate_backups (const gchar *bak_path,
+                guint        generations)
+{
+    generations = MIN (generations, DB_BACKUP_GENERATIONS_MAX);
+    for (guint i = generations; i > 0; i--) {
+        g_autofree gchar *from = (i == 1) ? g_strdup (bak_path)
+                                          : g_strdup_printf ("%s.%u", bak_path, i - 1);
+        g_autofree gchar *to = g_strdup_printf ("%s.%u", bak_path, i);
+        if (g_rename (from, to) != 0 && errno != ENOENT)
+            g_warning ("Failed to rotate backup %s: %s", from, g_strerror (errno));
+
+        g_autofree gchar *from_journal = db_journal_path (from);
+        g_autofree gchar *to_journal = db_journal_path (to);
+        if (g_rename (from_journal, to_journal) != 0) {
+            // Without a journal of its own, the generation must not keep the
+            // one of the generation it replaced.
+            if (errno == ENOENT)
+                g_unlink (to_journal);
+            else
+                g_warning ("Failed to rotate backup %s: %s", from_journal, g_strerror (errno));
+        }
+    }
 }
 
 
+/* Keeps the file that is about to be replaced as <path>.bak. The save writes
+ * a new inode and renames it over the database, so the current inode only
+ * needs a second name: a hard link, no data read or written. The new names
+ * live in the database's directory, whose fsync in atomic_write_database
+ * makes them durable together with the new file.
+ *
+ * When the write is a checkpoint, the state being replaced is the main file
+ * plus its journal, so the journal is kept too, as <path>.bak.journal: that
+ * is where load_db looks when the backup is opened, and its header still
+ * names the main file now linked as .bak. It is copied rather than linked
+ * because a failed write leaves the live journal in place to be appended to. */
 static gboolean
 backup_db (const gchar *path,
+           gboolean     with_journal,
+           guint        generations,
            GError     **err)
 {
-    return perform_backup_restore (path, TRUE, err);
+    g_autofree gchar *bak_path = g_strconcat (path, ".bak", NULL);
+    g_autofree gchar *tmp_path = g_strconcat (path, ".bak.tmp", NULL);
+    g_autofree gchar *bak_journal_path = db_journal_path (bak_path);
+    g_autofree gchar *tmp_journal_path = g_strconcat (path, ".bak.journal.tmp", NULL);
+
+    // Left behind by an interrupted save; we hold the database lock.
+    g_unlink (tmp_path);
+    g_unlink (tmp_journal_path);
+    if (link (path, tmp_path) != 0 && !clone_or_copy_file (path, tmp_path, err))
+        return FALSE;
+    /* Files written by older versions may carry broader permissions; the link
+     * shares them with the database, which is replaced by a 0600 file anyway. */
+    if (g_chmod (tmp_path, 0600) != 0) {
+        g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                     "Failed to chmod 0600 on %s: %s", tmp_path, g_strerror (errno));
+        g_unlink (tmp_path);
+        return FALSE;
+    }
+    if (with_journal) {
+        g_autofree gchar *journal_path = db_journal_path (path);
+        if (!clone_or_copy_file (journal_path, tmp_journal_path, err)) {
+            g_unlink (tmp_path);
+            return FALSE;
+        }
+    }
+
+    if (generations > 0)
+        rotate_backups (bak_path, generations);
+    if (g_rename (tmp_path, bak_path) != 0) {
+        g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                     "Couldn't create the backup: %s", g_strerror (errno));
+        g_unlink (tmp_path);
+        g_unlink (tmp_journal_path);
+        return FALSE;
+    }
+    // A journal left from the previous backup would not match its digest, but
+    // it has no business next to this one either.
+    if (!with_journal) {
+        g_unlink (bak_journal_path);
+    } else if (g_rename (tmp_journal_path, bak_journal_path) != 0) {
+        g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                     "Couldn't create the backup: %s", g_strerror (errno));
+        g_unlink (tmp_journal_path);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+
+gboolean
+db_too_big_for_secure_memory (const gchar *db_path,
+                              gint32       max_file_size_from_memlock)
+{
+    // v4 is opened one record at a time (see load_v4_tokens), so the file
+    // size alone says nothing about how much secure memory the load needs.
+    g_autoptr(GError) err = NULL;
+    if (get_db_version (db_path, &err) >= 4)
+        return FALSE;
+    return get_file_size (db_path) > (goffset) (max_file_size_from_memlock * SECMEM_SIZE_THRESHOLD_RATIO);
 }
 
 
@@ -1809,8 +2670,12 @@ db_copy_to (const gchar *src_path,
 static gboolean
 compute_file_digest (const gchar *path,
                      guint8       digest[32],
+                     DbFileStamp *stamp,
                      GError     **err)
 {
+#ifdef OTPCLIENT_TESTING
+    test_file_hash_count++;
+#endif
     int fd = path_open_safe_regular_file (path, err);
     if (fd < 0)
         return FALSE;
@@ -1853,22 +2718,66 @@ compute_file_digest (const gchar *path,
     close (fd);
 
     gcry_md_hash_buffer (GCRY_MD_SHA256, digest, buf, size);
+    file_stamp_from_stat (&st, stamp);
     return TRUE;
 }
 
 
+gboolean
+db_loaded_file_unchanged (DatabaseData *db_data)
+{
+    DbFileStamp current;
+    if (db_data == NULL || !file_stamp_of_path (db_data->db_path, &current) ||
+        !file_stamp_equal (&current, &db_data->loaded_file_stamp))
+        return FALSE;
+
+    // Journaled edits from another process grow the journal, not the file.
+    g_autofree gchar *journal = db_journal_path (db_data->db_path);
+    struct stat st;
+    if (lstat (journal, &st) != 0)
+        return errno == ENOENT && db_data->journal_file_size == 0;
+    return S_ISREG (st.st_mode) && (gsize) st.st_size == db_data->journal_file_size;
+}
+
+
+gboolean
+db_file_stamp_read (const gchar *path,
+                    DbFileStamp *stamp)
+{
+    memset (stamp, 0, sizeof (*stamp));
+    return path != NULL && file_stamp_of_path (path, stamp);
+}
+
+
+gboolean
+db_file_stamp_equal (const DbFileStamp *a,
+                     const DbFileStamp *b)
+{
+    return file_stamp_equal (a, b);
+}
+
+
 static gboolean
 loaded_file_digest_matches (DatabaseData *db_data,
                             GError      **err)
 {
+    // Every write goes through a rename, so a changed file has a new inode or
+    // new times; only then is it worth reading the whole thing back.
+    DbFileStamp current;
+    if (file_stamp_of_path (db_data->db_path, &current) &&
+        file_stamp_equal (&current, &db_data->loaded_file_stamp))
+        return TRUE;
+
     guint8 current_digest[32];
-    if (!compute_file_digest (db_data->db_path, current_digest, err))
+    if (!compute_file_digest (db_data->db_path, current_digest, &current, err))
         return FALSE;
     if (memcmp (current_digest, db_data->loaded_file_digest, sizeof (current_digest)) != 0) {
         g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
                      "Database changed on disk after it was loaded; refusing to overwrite newer data.");
         return FALSE;
     }
+    // Same bytes under a new identity (touched, copied back): remember it.
+    db_data->loaded_file_stamp = current;
     return TRUE;
 }
 
@@ -1884,29 +2793,3 @@ cleanup_db_gfile (GFile    *file,
     if (stream != NULL)
         g_object_unref (stream);
 }
-
-
-static void
-free_db_resources (gcry_cipher_hd_t  hd,
-                   guchar           *derived_key,
-                   guchar           *enc_buf,
-                   gchar            *dec_buf,
-                   DbHeaderData_v1  *header_data_v1,
-                   DbHeaderData_v2  *header_data_v2)
-{
-    g_free (enc_buf);
-    g_free (header_data_v1);
-    g_free (header_data_v2);
-
-    if (hd != NULL)
-        gcry_cipher_close (hd);
-    // explicit_bzero before gcry_free as belt-and-braces: gcry_free is
-    // documented to wipe, but failing closed against any future regression
-    // in libgcrypt is cheap insurance for the master key.
-    if (derived_key != NULL) {
-        explicit_bzero (derived_key, ARGON2ID_KEYLEN);
-        gcry_free (derived_key);
-    }
-    if (dec_buf != NULL)
-        gcry_free (dec_buf);
-}
@@ -11,7 +11,8 @@ G_BEGIN_DECLS
 // Header data
 #define DB_HEADER_NAME         "OTPClient"
 #define DB_HEADER_NAME_LEN      9
-#define DB_VERSION              3
+
+#define DB_VERSION              5
 #define IV_SIZE                 16
 #define KDF_SALT_SIZE           32
 #define DB_V3_HEADER_SIZE       (DB_HEADER_NAME_LEN + 4 + IV_SIZE + KDF_SALT_SIZE + 4 + 4 + 4)
@@ -19,6 +20,24 @@ G_BEGIN_DECLS
 // Parameter used by the encryption routine (+IV from header data)
 #define TAG_SIZE                16
 
+/* v4 seals every token as its own record so one of them can be read without
+ * decrypting the rest:
+ *
+ *   header   v3 header (the IV slot holds a per-save nonce) | BE32 record count
+ *   tag      authenticates the header, i.e. checks the password
+ *   index    one sealed (BE32 offset, BE32 length) entry per record
+ *   records  ciphertext | tag, back to back
+ *
+ * Entry i sits at a fixed position, so a lookup costs three small reads and
+ * three AES-GCM operations whatever the number of tokens. v4 records hold the
+ * token's JSON; v5 keeps the layout and encodes records as in db-record.h. */
+#define DB_V4_HEADER_SIZE       (DB_V3_HEADER_SIZE + 4)
+#define DB_V4_PREFIX_SIZE       (DB_V4_HEADER_SIZE + TAG_SIZE)
+#define DB_V4_INDEX_ENTRY_SIZE  (4 + 4 + TAG_SIZE)
+
+// Upper bound for DatabaseData.backup_generations
+#define DB_BACKUP_GENERATIONS_MAX  10
+
 // Parameters used to derive the db's password (v2)
 #define ARGON2ID_TAGLEN            32
 #define ARGON2ID_KEYLEN            32
@@ -36,6 +55,17 @@ G_BEGIN_DECLS
 #define ARGON2ID_MIN_PARAL          1
 #define ARGON2ID_MAX_PARAL         16
 
+// Presets offered by the KDF dialog (iterations, memory cost in KiB, lanes)
+#define ARGON2ID_STANDARD_ITER      3
+#define ARGON2ID_STANDARD_MC   131072   // 128 MiB
+#define ARGON2ID_STANDARD_PARAL     2
+#define ARGON2ID_STRONG_ITER        5
+#define ARGON2ID_STRONG_MC     262144   // 256 MiB
+#define ARGON2ID_STRONG_PARAL       4
+#define ARGON2ID_PARANOID_ITER      8
+#define ARGON2ID_PARANOID_MC   524288   // 512 MiB
+#define ARGON2ID_PARANOID_PARAL     4
+
 
 typedef struct db_header_data_v1_t {
     guint8 iv[IV_SIZE];
@@ -54,6 +84,21 @@ typedef struct db_header_data_v2_t {
 } DbHeaderData_v2;
 
 
+/* stat() identity of a database file. While the file still reports the same
+ * one, nobody replaced or rewrote it since we last hashed it. */
+typedef struct db_file_stamp_t {
+    gboolean valid;
+    guint64 dev;
+    guint64 ino;
+    gint64 size;
+    gint64 mtime_ns;
+    gint64 ctime_ns;
+} DbFileStamp;
+
+typedef struct db_commit_queue_t DbCommitQueue;
+typedef struct db_token_index_t DbTokenIndex;
+typedef struct db_journal_delta_t DbJournalDelta;
+
 typedef struct db_data_t {
     gint ref_count;
 
@@ -72,7 +117,9 @@ typedef struct db_data_t {
      * for the user to repair or delete. NULL until load runs. */
     json_t *quarantined_tokens;
 
-    GSList *objects_hash;
+    // Digests of committed_json_data's tokens (db-token-index.c), moved along
+    // with it on every commit; imports look duplicates up here.
+    DbTokenIndex *token_index;
 
     GSList *data_to_add;
 
@@ -108,8 +155,35 @@ typedef struct db_data_t {
     guint8 cached_pwd_hash[32];     // SHA-256(db_data->key) when cache populated
     gboolean has_cached_key;
 
+    // Older generations kept as <db>.bak.1 … .bak.N next to <db>.bak
+    // (0 = only .bak). Rotated by rename, so they cost no data I/O. A
+    // generation is a full write (a checkpoint), not every save: each keeps
+    // the journal it replaced as <backup>.journal.
+    guint backup_generations;
+
     guint8 loaded_file_digest[32];
     gboolean has_loaded_file_digest;
+    // Identity of the file loaded_file_digest was taken from. The stale-write
+    // check only re-hashes the file when this no longer matches.
+    DbFileStamp loaded_file_stamp;
+
+    // Background writer (db-commit.c), created on the first db_commit_async.
+    // commit_seq is bumped atomically on every successful write, sync or not,
+    // so a worker result that was overtaken by a later save can be detected.
+    DbCommitQueue *commit_queue;
+    gint commit_seq;
+    // commit_seq at which committed_json_data was last known to match the
+    // disk; journal deltas are only appended on top of that exact state.
+    gint committed_seq;
+
+    // Delta journal next to the file (db-journal.c). journal_len covers the
+    // authenticated frames we wrote or replayed (0 = none), journal_file_size
+    // what was on disk at the time; together with the last frame's tag they
+    // extend the stale-write check to the journal.
+    gsize journal_len;
+    gsize journal_file_size;
+    guint32 journal_frames;
+    guint8 journal_last_tag[TAG_SIZE];
 } DatabaseData;
 
 typedef gboolean (*DbMutationFunc) (json_t  *candidate,
@@ -162,6 +236,36 @@ gboolean db_import_otps    (DatabaseData      *db_data,
                             OtpImportReport   *report,
                             GError          **err);
 
+/* An import split in two: the batch does the per-token work that needs no
+ * database (repair, validation, building the JSON object and its digest) and
+ * can be filled on any thread; db_import_batch_mutation then appends the
+ * tokens that are not duplicates, under db_transaction or db_commit_async on
+ * the thread that owns db_data. db_import_otps is both steps at once. */
+typedef struct _DbImportBatch DbImportBatch;
+
+typedef struct {
+    DatabaseData    *db_data;
+    DbImportBatch   *batch;
+    OtpImportReport *report;    // may be NULL
+} DbImportContext;
+
+DbImportBatch *db_import_batch_new           (void);
+
+void           db_import_batch_free          (DbImportBatch *batch);
+
+void           db_import_batch_add           (DbImportBatch *batch,
+                                              otp_t         *otp);
+
+/* Tokens that passed validation so far. */
+guint          db_import_batch_get_n_tokens  (DbImportBatch *batch);
+
+guint          db_import_batch_get_n_invalid (DbImportBatch *batch);
+
+/* DbMutationFunc; user_data is a DbImportContext. */
+gboolean       db_import_batch_mutation      (json_t        *candidate,
+                                              gpointer       user_data,
+                                              GError       **err);
+
 void    add_otps_to_db     (GSList       *otps,
                             DatabaseData *db_data);
 
@@ -172,12 +276,76 @@ void    add_otps_to_db_ex  (GSList       *otps,
                             guint        *added_out,
                             guint        *skipped_out);
 
-gint    check_duplicate    (gconstpointer   data,
-                            gconstpointer   user_data);
-
 void    db_invalidate_kdf_cache (DatabaseData *db_data);
 void    database_data_purge_secrets (DatabaseData *db_data);
 
+/* Plumbing for the background commit queue (db-commit.c). The plaintext
+ * returned by db_serialize_tokens is one BE32 length | record (db-record.h)
+ * per token, lives in secure memory and already carries the quarantined
+ * tokens; wipe and gcry_free it. db_write_serialized does the
+ * locked, stale-checked, backed-up atomic write and may run off the main
+ * thread as long as nothing else writes db_data concurrently. When delta is
+ * given and still applies, it appends that to the journal instead. */
+gchar   *db_serialize_tokens     (DatabaseData  *db_data,
+                                  json_t        *json_data,
+                                  gsize         *out_len,
+                                  GError       **err);
+
+gboolean db_write_serialized     (DatabaseData         *db_data,
+                                  const gchar          *plaintext,
+                                  gsize                 plaintext_len,
+                                  const DbJournalDelta *delta,
+                                  GError              **err);
+
+/* Installs `committed` (ownership transferred) as the committed snapshot if
+ * no later write happened since commit_seq, otherwise drops it. */
+void     db_adopt_committed      (DatabaseData  *db_data,
+                                  json_t        *committed,
+                                  gint           commit_seq);
+
+void     db_rollback_to_committed (DatabaseData *db_data);
+
+/* Folds the delta journal into the main file. Anything that copies the file
+ * elsewhere (backups, exports) must call this first. */
+gboolean db_checkpoint           (DatabaseData  *db_data,
+                                  GError       **err);
+
+/* Token objects are shared, never copied, between the live array, the
+ * committed snapshot and pending commits (json_copy of the array), so they
+ * must not be changed in place. This swaps token `index` of `tokens` for a
+ * private shallow copy and returns it for the caller to modify; NULL if there
+ * is no object at that index. */
+json_t *db_token_for_write       (json_t        *tokens,
+                                  gsize          index);
+
+/* Decrypts only the token at `index` of the file's token array (the same
+ * position load_db gives it unless tokens were quarantined or repaired). Needs
+ * db_data->key and uses the cached derived key when it matches; nothing else
+ * in db_data is loaded. Fails for pre-v4 files and while journaled edits are
+ * pending, in which case the caller falls back to load_db. */
+json_t *db_fetch_token           (DatabaseData  *db_data,
+                                  gsize          index,
+                                  GError       **err);
+
+/* TRUE while the file (and its journal) on disk are still the ones db_data
+ * was loaded from or last wrote, judged by stat() alone. */
+gboolean db_loaded_file_unchanged (DatabaseData *db_data);
+
+/* The same stat() identity for callers that keep something derived from a
+ * file without holding its DatabaseData. db_file_stamp_read leaves stamp
+ * invalid and returns FALSE when path is missing or not a regular file. */
+gboolean db_file_stamp_read       (const gchar       *path,
+                                   DbFileStamp       *stamp);
+
+gboolean db_file_stamp_equal      (const DbFileStamp *a,
+                                   const DbFileStamp *b);
+
+/* TRUE when the file cannot be opened within the secure memory limit before
+ * even trying: v1-v3 files are decrypted whole, v4 files one record at a time
+ * and are only refused by load_db if a single record or the tokens don't fit. */
+gboolean db_too_big_for_secure_memory (const gchar *db_path,
+                                       gint32       max_file_size_from_memlock);
+
 /* Copies an encrypted database file to dst_path with 0600 perms. The source
  * is not followed if it is a symlink, and the destination is forced 0600
  * regardless of any pre-existing perms - same hardening used for the .bak
@@ -190,6 +358,9 @@ gchar  *db_copy_to              (const gchar  *src_path,
 void    db_test_set_fail_encrypt      (gboolean fail);
 void    db_test_set_fail_atomic_write (gboolean fail);
 void    db_test_set_unsupported_lock  (gboolean unsupported);
+guint   db_test_get_file_hash_count   (void);
+/* Saves write this version (4 or DB_VERSION) instead; 0 restores the default. */
+void    db_test_set_save_version      (gint32   version);
 #endif
 
 G_END_DECLS
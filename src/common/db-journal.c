@@ -0,0 +1,654 @@
+#define _DEFAULT_SOURCE
+#include <glib.h>
+#include <glib/gi18n.h>
+#include <glib/gstdio.h>
+#include <gcrypt.h>
+#include <jansson.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "gquarks.h"
+#include "db-common.h"
+#include "db-journal.h"
+#include "otp-validation.h"
+
+#ifdef OTPCLIENT_TESTING
+static gsize test_checkpoint_size = 0;
+
+void
+db_test_set_journal_checkpoint_size (gsize size)
+{
+    test_checkpoint_size = size;
+}
+#endif
+
+
+gchar *
+db_journal_path (const gchar *db_path)
+{
+    return g_strconcat (db_path, ".journal", NULL);
+}
+
+
+static void
+put_be32 (guint8  *p,
+          guint32  v)
+{
+    v = GUINT32_TO_BE (v);
+    memcpy (p, &v, sizeof (v));
+}
+
+
+static guint32
+get_be32 (const guint8 *p)
+{
+    guint32 v;
+    memcpy (&v, p, sizeof (v));
+    return GUINT32_FROM_BE (v);
+}
+
+
+static void
+build_header (const guint8 base_digest[32],
+              guint8       header[DB_JOURNAL_HEADER_SIZE])
+{
+    memcpy (header, DB_JOURNAL_MAGIC, DB_JOURNAL_MAGIC_LEN);
+    put_be32 (header + DB_JOURNAL_MAGIC_LEN, DB_JOURNAL_VERSION);
+    memcpy (header + DB_JOURNAL_MAGIC_LEN + 4, base_digest, 32);
+}
+
+
+static void
+set_stale_error (GError **err)
+{
+    g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                 "Database changed on disk after it was loaded; refusing to overwrite newer data.");
+}
+
+
+/* Opens AES-GCM under the cached derived key (the key of the main file the
+ * journal extends) and feeds it the frame's associated data. */
+static gcry_cipher_hd_t
+open_frame_cipher (DatabaseData  *db_data,
+                   const guint8  *header,
+                   guint32        frame_index,
+                   guint32        payload_len,
+                   const guint8  *iv,
+                   GError       **err)
+{
+    if (!db_data->has_cached_key || db_data->cached_derived_key == NULL) {
+        g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                     "The database key is not available to process the journal.");
+        return NULL;
+    }
+
+    gcry_cipher_hd_t hd = open_cipher_and_set_data (db_data->cached_derived_key, (guchar *) iv, IV_SIZE);
+    if (hd == NULL) {
+        g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                     "Error while opening and setting the cipher data.");
+        return NULL;
+    }
+
+    guint8 aad[DB_JOURNAL_HEADER_SIZE + 8];
+    memcpy (aad, header, DB_JOURNAL_HEADER_SIZE);
+    put_be32 (aad + DB_JOURNAL_HEADER_SIZE, frame_index);
+    put_be32 (aad + DB_JOURNAL_HEADER_SIZE + 4, payload_len);
+    if (gcry_cipher_authenticate (hd, aad, sizeof (aad)) != GPG_ERR_NO_ERROR) {
+        g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                     "Error while processing the authenticated data.");
+        gcry_cipher_close (hd);
+        return NULL;
+    }
+    return hd;
+}
+
+
+static json_t *
+make_op (const gchar *name,
+         gsize        index)
+{
+    json_t *op = json_object ();
+    json_object_set_new (op, "op", json_string (name));
+    json_object_set_new (op, "index", json_integer ((json_int_t) index));
+    return op;
+}
+
+
+/* Field-level difference between two versions of one token, or NULL when
+ * they are equal. */
+static json_t *
+make_patch_op (json_t *old_obj,
+               json_t *new_obj,
+               gsize   index)
+{
+    json_t *set = json_object ();
+    json_t *unset = json_array ();
+    const char *key;
+    json_t *value;
+
+    json_object_foreach (new_obj, key, value) {
+        json_t *old_value = json_object_get (old_obj, key);
+        if (old_value == NULL || !json_equal (old_value, value))
+            json_object_set (set, key, value);
+    }
+    json_object_foreach (old_obj, key, value) {
+        if (json_object_get (new_obj, key) == NULL)
+            json_array_append_new (unset, json_string (key));
+    }
+
+    if (json_object_size (set) == 0 && json_array_size (unset) == 0) {
+        json_decref (set);
+        json_decref (unset);
+        return NULL;
+    }
+
+    json_t *op = make_op ("patch", index);
+    json_object_set_new (op, "set", set);
+    if (json_array_size (unset) > 0)
+        json_object_set_new (op, "unset", unset);
+    else
+        json_decref (unset);
+    return op;
+}
+
+
+DbJournalDelta *
+db_journal_delta_new (DatabaseData *db_data,
+                      json_t       *candidate)
+{
+    json_t *base = db_data->committed_json_data;
+    if (base == NULL || !json_is_array (base) || !json_is_array (candidate))
+        return NULL;
+
+    // Everything outside the first and last differing token is untouched; the
+    // window in between becomes patches, then inserts or deletes for the
+    // length difference. Moving a token around shifts everything between its
+    // old and new position, which usually trips DB_JOURNAL_MAX_OPS and goes
+    // through a full write instead.
+    gsize base_len = json_array_size (base);
+    gsize cand_len = json_array_size (candidate);
+    gsize prefix = 0;
+    while (prefix < base_len && prefix < cand_len &&
+           json_equal (json_array_get (base, prefix), json_array_get (candidate, prefix)))
+        prefix++;
+    gsize suffix = 0;
+    while (suffix < base_len - prefix && suffix < cand_len - prefix &&
+           json_equal (json_array_get (base, base_len - 1 - suffix),
+                       json_array_get (candidate, cand_len - 1 - suffix)))
+        suffix++;
+
+    gsize changed_base = base_len - prefix - suffix;
+    gsize changed_cand = cand_len - prefix - suffix;
+    if (MAX (changed_base, changed_cand) > DB_JOURNAL_MAX_OPS)
+        return NULL;
+
+    json_t *ops = json_array ();
+    gsize common = MIN (changed_base, changed_cand);
+    for (gsize i = 0; i < common; i++) {
+        json_t *old_obj = json_array_get (base, prefix + i);
+        json_t *new_obj = json_array_get (candidate, prefix + i);
+        if (!json_is_object (old_obj) || !json_is_object (new_obj)) {
+            json_decref (ops);
+            return NULL;
+        }
+        json_t *op = make_patch_op (old_obj, new_obj, prefix + i);
+        if (op != NULL)
+            json_array_append_new (ops, op);
+    }
+    for (gsize i = common; i < changed_cand; i++) {
+        json_t *op = make_op ("insert", prefix + i);
+        json_object_set (op, "token", json_array_get (candidate, prefix + i));
+        json_array_append_new (ops, op);
+    }
+    for (gsize i = common; i < changed_base; i++)
+        json_array_append_new (ops, make_op ("delete", prefix + common));
+
+    DbJournalDelta *delta = g_new0 (DbJournalDelta, 1);
+    delta->n_ops = (guint) json_array_size (ops);
+    delta->base_seq = db_data->committed_seq;
+    delta->ops_len = json_dumpb (ops, NULL, 0, JSON_COMPACT);
+    delta->ops = delta->ops_len > 0 ? gcry_calloc_secure (delta->ops_len, 1) : NULL;
+    if (delta->ops == NULL ||
+        json_dumpb (ops, delta->ops, delta->ops_len, JSON_COMPACT) != delta->ops_len) {
+        json_decref (ops);
+        db_journal_delta_free (delta);
+        return NULL;
+    }
+    json_decref (ops);
+    return delta;
+}
+
+
+void
+db_journal_delta_free (DbJournalDelta *delta)
+{
+    if (delta == NULL)
+        return;
+    if (delta->ops != NULL) {
+        explicit_bzero (delta->ops, delta->ops_len);
+        gcry_free (delta->ops);
+    }
+    g_free (delta);
+}
+
+
+static gboolean
+apply_op (json_t  *tokens,
+          json_t  *op,
+          GError **err)
+{
+    const gchar *name = json_string_value (json_object_get (op, "op"));
+    json_t *index_json = json_object_get (op, "index");
+    if (name == NULL || !json_is_integer (index_json) || json_integer_value (index_json) < 0)
+        goto malformed;
+
+    gsize index = (gsize) json_integer_value (index_json);
+    gsize len = json_array_size (tokens);
+
+    if (g_strcmp0 (name, "insert") == 0) {
+        json_t *token = json_object_get (op, "token");
+        if (index > len || !json_is_object (token))
+            goto malformed;
+        if (json_array_insert (tokens, index, token) != 0)
+            goto malformed;
+        return TRUE;
+    }
+    if (g_strcmp0 (name, "delete") == 0) {
+        if (index >= len)
+            goto malformed;
+        if (json_array_remove (tokens, index) != 0)
+            goto malformed;
+        return TRUE;
+    }
+    if (g_strcmp0 (name, "patch") == 0) {
+        json_t *set = json_object_get (op, "set");
+        json_t *unset = json_object_get (op, "unset");
+        if (index >= len || !json_is_object (set) || (unset != NULL && !json_is_array (unset)))
+            goto malformed;
+        json_t *token = db_token_for_write (tokens, index);
+        if (token == NULL)
+            goto malformed;
+        json_object_update (token, set);
+        gsize i;
+        json_t *key;
+        json_array_foreach (unset, i, key) {
+            if (!json_is_string (key))
+                goto malformed;
+            json_object_del (token, json_string_value (key));
+        }
+        return TRUE;
+    }
+
+malformed:
+    g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                 "Malformed operation in the database journal.");
+    return FALSE;
+}
+
+
+gboolean
+db_journal_apply (json_t       *tokens,
+                  const gchar  *ops,
+                  gsize         ops_len,
+                  GError      **err)
+{
+    json_error_t jerr;
+    json_t *root = json_loadb (ops, ops_len, 0, &jerr);
+    if (!json_is_array (root)) {
+        g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                     "Malformed database journal record: %s", root == NULL ? jerr.text : "not an array");
+        if (root != NULL)
+            json_decref (root);
+        return FALSE;
+    }
+
+    gboolean ok = TRUE;
+    gsize i;
+    json_t *op;
+    json_array_foreach (root, i, op) {
+        if (!apply_op (tokens, op, err)) {
+            ok = FALSE;
+            break;
+        }
+    }
+    json_decref (root);
+    return ok;
+}
+
+
+static gchar *
+open_frame (DatabaseData  *db_data,
+            const guint8  *header,
+            guint32        frame_index,
+            const guint8  *frame,
+            guint32        payload_len,
+            GError       **err)
+{
+    const guint8 *iv = frame + 4;
+    const guint8 *ciphertext = iv + IV_SIZE;
+    const guint8 *tag = ciphertext + payload_len;
+
+    gcry_cipher_hd_t hd = open_frame_cipher (db_data, header, frame_index, payload_len, iv, err);
+    if (hd == NULL)
+        return NULL;
+
+    gchar *plaintext = gcry_calloc_secure ((gsize) payload_len + 1, 1);
+    if (plaintext == NULL) {
+        g_set_error (err, secmem_alloc_error_gquark (), SECMEM_ALLOC_ERRCODE,
+                     "Error while allocating secure memory.");
+        gcry_cipher_close (hd);
+        return NULL;
+    }
+    if (gcry_cipher_decrypt (hd, plaintext, payload_len, ciphertext, payload_len) != GPG_ERR_NO_ERROR) {
+        g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                     "Error while decrypting the data.");
+        gcry_cipher_close (hd);
+        gcry_free (plaintext);
+        return NULL;
+    }
+    gpg_error_t tag_err = gcry_cipher_checktag (hd, tag, TAG_SIZE);
+    gcry_cipher_close (hd);
+    if (tag_err != GPG_ERR_NO_ERROR) {
+        g_set_error (err, bad_tag_gquark (), BAD_TAG_ERRCODE,
+                     "Tag verification failed for database journal record %u: %s/%s",
+                     frame_index, gcry_strsource (tag_err), gcry_strerror (tag_err));
+        explicit_bzero (plaintext, payload_len);
+        gcry_free (plaintext);
+        return NULL;
+    }
+    return plaintext;
+}
+
+
+void
+db_journal_reset (DatabaseData *db_data)
+{
+    db_data->journal_len = 0;
+    db_data->journal_file_size = 0;
+    db_data->journal_frames = 0;
+    explicit_bzero (db_data->journal_last_tag, sizeof (db_data->journal_last_tag));
+}
+
+
+gboolean
+db_journal_replay (DatabaseData  *db_data,
+                   GError       **err)
+{
+    db_journal_reset (db_data);
+
+    g_autofree gchar *path = db_journal_path (db_data->db_path);
+    int fd = g_open (path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC, 0);
+    if (fd < 0) {
+        if (errno == ENOENT)
+            return TRUE;
+        g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                     "Refusing to open '%s': %s", path,
+                     errno == ELOOP ? "is a symlink" : g_strerror (errno));
+        return FALSE;
+    }
+
+    struct stat st;
+    if (fstat (fd, &st) != 0 || !S_ISREG (st.st_mode) || st.st_size < 0 || st.st_size > G_MAXSIZE) {
+        g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                     "'%s' is not a regular file.", path);
+        close (fd);
+        return FALSE;
+    }
+    gsize size = (gsize) st.st_size;
+    db_data->journal_file_size = size;
+
+    // The journal only ever extends a file sealed with the cached Argon2id
+    // key (v3 and later); it describes an older generation otherwise and is
+    // dropped by the write that migrates the file.
+    if (db_data->current_db_version < 3 || db_data->needs_legacy_kdf_migration ||
+        !db_data->has_loaded_file_digest || size < DB_JOURNAL_HEADER_SIZE) {
+        close (fd);
+        return TRUE;
+    }
+    if (db_data->max_file_size_from_memlock > 0 &&
+        size > (gsize) (db_data->max_file_size_from_memlock * SECMEM_SIZE_THRESHOLD_RATIO)) {
+        g_set_error (err, file_too_big_gquark (), FILE_TOO_BIG_ERRCODE, FILE_SIZE_SECMEM_MSG);
+        close (fd);
+        return FALSE;
+    }
+
+    g_autofree guint8 *buf = g_malloc (size);
+    gsize total = 0;
+    while (total < size) {
+        ssize_t n = read (fd, buf + total, size - total);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                         "Failed to read '%s': %s", path, n < 0 ? g_strerror (errno) : "short read");
+            close (fd);
+            return FALSE;
+        }
+        total += (gsize) n;
+    }
+    close (fd);
+
+    if (memcmp (buf, DB_JOURNAL_MAGIC, DB_JOURNAL_MAGIC_LEN) != 0)
+        return TRUE;
+    guint32 version = get_be32 (buf + DB_JOURNAL_MAGIC_LEN);
+    if (version > DB_JOURNAL_VERSION) {
+        g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                     "Unsupported future database journal version %u.", version);
+        return FALSE;
+    }
+    // Written on top of a main file that a checkpoint has since replaced.
+    if (memcmp (buf + DB_JOURNAL_MAGIC_LEN + 4, db_data->loaded_file_digest, 32) != 0)
+        return TRUE;
+
+    gsize offset = DB_JOURNAL_HEADER_SIZE;
+    guint32 index = 0;
+    while (size - offset >= DB_JOURNAL_FRAME_OVERHEAD) {
+        guint32 payload_len = get_be32 (buf + offset);
+        if (payload_len > size - offset - DB_JOURNAL_FRAME_OVERHEAD)
+            break;
+        gsize frame_end = offset + DB_JOURNAL_FRAME_OVERHEAD + payload_len;
+
+        GError *frame_err = NULL;
+        gchar *ops = open_frame (db_data, buf, index, buf + offset, payload_len, &frame_err);
+        if (ops == NULL) {
+            if (frame_end == size && frame_err->domain == bad_tag_gquark ()) {
+                // A crash between extending the file and finishing the write.
+                g_clear_error (&frame_err);
+                break;
+            }
+            g_propagate_prefixed_error (err, frame_err, "Database journal '%s' is corrupted: ", path);
+            return FALSE;
+        }
+        gboolean applied = db_journal_apply (db_data->in_memory_json_data, ops, payload_len, err);
+        explicit_bzero (ops, payload_len);
+        gcry_free (ops);
+        if (!applied)
+            return FALSE;
+
+        memcpy (db_data->journal_last_tag, buf + frame_end - TAG_SIZE, TAG_SIZE);
+        index++;
+        offset = frame_end;
+    }
+
+    if (offset < size)
+        g_info ("Ignoring %" G_GSIZE_FORMAT " bytes of an interrupted journal append.", size - offset);
+    if (index == 0)
+        return TRUE;
+
+    db_data->journal_len = offset;
+    db_data->journal_frames = index;
+    return otp_validate_database_root (db_data->in_memory_json_data, err);
+}
+
+
+gboolean
+db_journal_matches_loaded (DatabaseData  *db_data,
+                           GError       **err)
+{
+    g_autofree gchar *path = db_journal_path (db_data->db_path);
+    struct stat st;
+    if (g_lstat (path, &st) != 0) {
+        if (errno == ENOENT && db_data->journal_file_size == 0)
+            return TRUE;
+        set_stale_error (err);
+        return FALSE;
+    }
+    if (!S_ISREG (st.st_mode) || (gsize) st.st_size != db_data->journal_file_size) {
+        set_stale_error (err);
+        return FALSE;
+    }
+    if (db_data->journal_len == 0)
+        return TRUE;
+
+    // Same size; make sure it still ends in the frame we wrote or replayed.
+    guint8 tag[TAG_SIZE];
+    int fd = g_open (path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC, 0);
+    gboolean same = fd >= 0 &&
+                    pread (fd, tag, TAG_SIZE, (off_t) (db_data->journal_len - TAG_SIZE)) == TAG_SIZE &&
+                    memcmp (tag, db_data->journal_last_tag, TAG_SIZE) == 0;
+    if (fd >= 0)
+        close (fd);
+    if (!same)
+        set_stale_error (err);
+    return same;
+}
+
+
+gboolean
+db_journal_has_room (DatabaseData          *db_data,
+                     const DbJournalDelta  *delta)
+{
+    gsize limit = DB_JOURNAL_CHECKPOINT_SIZE;
+    struct stat st;
+    if (g_stat (db_data->db_path, &st) == 0 && (gsize) st.st_size > limit)
+        limit = (gsize) st.st_size;
+#ifdef OTPCLIENT_TESTING
+    if (test_checkpoint_size > 0)
+        limit = test_checkpoint_size;
+#endif
+
+    gsize start = db_data->journal_len > 0 ? db_data->journal_len : DB_JOURNAL_HEADER_SIZE;
+    return delta->ops_len <= G_MAXUINT32 &&
+           start + DB_JOURNAL_FRAME_OVERHEAD + delta->ops_len <= limit;
+}
+
+
+static gboolean
+pwrite_all (int           fd,
+            const guint8 *buf,
+            gsize         len,
+            gsize         offset)
+{
+    gsize written = 0;
+    while (written < len) {
+        ssize_t n = pwrite (fd, buf + written, len - written, (off_t) (offset + written));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return FALSE;
+        written += (gsize) n;
+    }
+    return TRUE;
+}
+
+
+gboolean
+db_journal_append (DatabaseData          *db_data,
+                   const DbJournalDelta  *delta,
+                   GError               **err)
+{
+    // Nothing changed: the main file plus the journal already hold this state.
+    if (delta->n_ops == 0)
+        return TRUE;
+
+    guint8 header[DB_JOURNAL_HEADER_SIZE];
+    build_header (db_data->loaded_file_digest, header);
+
+    // With no valid frames on disk, start over: whatever is there is stale or
+    // an interrupted first append.
+    gboolean fresh = (db_data->journal_len == 0);
+    gsize offset = fresh ? 0 : db_data->journal_len;
+    guint32 frame_index = fresh ? 0 : db_data->journal_frames;
+    gsize out_len = (fresh ? DB_JOURNAL_HEADER_SIZE : 0) + DB_JOURNAL_FRAME_OVERHEAD + delta->ops_len;
+
+    g_autofree guint8 *out = g_malloc (out_len);
+    guint8 *frame = out;
+    if (fresh) {
+        memcpy (out, header, DB_JOURNAL_HEADER_SIZE);
+        frame = out + DB_JOURNAL_HEADER_SIZE;
+    }
+    put_be32 (frame, (guint32) delta->ops_len);
+    guint8 *iv = frame + 4;
+    guint8 *ciphertext = iv + IV_SIZE;
+    guint8 *tag = ciphertext + delta->ops_len;
+    gcry_create_nonce (iv, IV_SIZE);
+
+    gcry_cipher_hd_t hd = open_frame_cipher (db_data, header, frame_index, (guint32) delta->ops_len, iv, err);
+    if (hd == NULL)
+        return FALSE;
+    if (gcry_cipher_encrypt (hd, ciphertext, delta->ops_len, delta->ops, delta->ops_len) != GPG_ERR_NO_ERROR ||
+        gcry_cipher_gettag (hd, tag, TAG_SIZE) != GPG_ERR_NO_ERROR) {
+        g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                     "Error while encrypting the journal record.");
+        gcry_cipher_close (hd);
+        return FALSE;
+    }
+    gcry_cipher_close (hd);
+
+    g_autofree gchar *path = db_journal_path (db_data->db_path);
+    int fd = g_open (path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                     "Failed to open database journal '%s': %s", path, g_strerror (errno));
+        return FALSE;
+    }
+    // Truncating first drops a torn tail left by an interrupted append.
+    gboolean ok = ftruncate (fd, (off_t) offset) == 0 &&
+                  pwrite_all (fd, out, out_len, offset) &&
+                  fsync (fd) == 0;
+    if (!ok) {
+        g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                     "Failed to write database journal '%s': %s", path, g_strerror (errno));
+        // Keep the stale check in line with whatever reached the disk.
+        struct stat st;
+        if (fstat (fd, &st) == 0)
+            db_data->journal_file_size = (gsize) st.st_size;
+        close (fd);
+        return FALSE;
+    }
+    close (fd);
+
+    if (fresh) {
+        g_autofree gchar *dir = g_path_get_dirname (path);
+        int dir_fd = g_open (dir, O_RDONLY | O_CLOEXEC, 0);
+        if (dir_fd >= 0) {
+            fsync (dir_fd);
+            close (dir_fd);
+        }
+    }
+
+    db_data->journal_len = offset + out_len;
+    db_data->journal_file_size = db_data->journal_len;
+    db_data->journal_frames = frame_index + 1;
+    memcpy (db_data->journal_last_tag, tag, TAG_SIZE);
+    return TRUE;
+}
+
+
+void
+db_journal_discard (DatabaseData *db_data)
+{
+    g_autofree gchar *path = db_journal_path (db_data->db_path);
+    db_journal_reset (db_data);
+
+    // A leftover journal is harmless (its base digest no longer matches the
+    // main file) but the stale check has to know it is there.
+    if (g_unlink (path) != 0 && errno != ENOENT) {
+        struct stat st;
+        if (g_lstat (path, &st) == 0)
+            db_data->journal_file_size = (gsize) st.st_size;
+    }
+}
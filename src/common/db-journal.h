@@ -0,0 +1,80 @@
+#pragma once
+
+#include "db-common.h"
+
+G_BEGIN_DECLS
+
+/* Append-only delta journal next to the database ("<db>.journal").
+ *
+ * A small edit does not re-encrypt and rewrite the whole file. Its difference
+ * against the committed snapshot (a few insert / delete / patch operations)
+ * is sealed into one AES-GCM frame under the cached derived key and appended
+ * to the journal. load_db replays the frames on top of the main file. The
+ * next full write folds them in (a checkpoint) and removes the journal.
+ *
+ *   header  "OTPCJRNL" | BE32 version | SHA-256 of the main file it extends
+ *   frame   BE32 payload length | IV | ciphertext | tag
+ *
+ * Every frame authenticates the header plus its own index and length.
+ * Frames therefore cannot be reordered, moved to another journal or replayed
+ * on top of a different main file. If the last frame is short or fails to
+ * authenticate, it is treated as a torn append and dropped. */
+
+#define DB_JOURNAL_MAGIC            "OTPCJRNL"
+#define DB_JOURNAL_MAGIC_LEN        8
+#define DB_JOURNAL_VERSION          1
+#define DB_JOURNAL_HEADER_SIZE      (DB_JOURNAL_MAGIC_LEN + 4 + 32)
+#define DB_JOURNAL_FRAME_OVERHEAD   (4 + IV_SIZE + TAG_SIZE)
+
+// Checkpoint once the journal would outgrow this, or the main file if that is
+// bigger, so replaying it never costs more than a second load.
+#define DB_JOURNAL_CHECKPOINT_SIZE  (64 * 1024)
+
+// A change that touches more tokens than this is cheaper as a full write.
+#define DB_JOURNAL_MAX_OPS          32
+
+struct db_journal_delta_t {
+    gchar *ops;                 // compact JSON array, gcry secure memory
+    gsize ops_len;
+    guint n_ops;
+    gint base_seq;              // commit_seq of the snapshot the ops apply to
+};
+
+/* Diffs candidate against db_data->committed_json_data. Returns NULL when
+ * there is no snapshot or the change is too large to be worth journaling. */
+DbJournalDelta *db_journal_delta_new       (DatabaseData          *db_data,
+                                            json_t                *candidate);
+
+void            db_journal_delta_free      (DbJournalDelta        *delta);
+
+gboolean        db_journal_apply           (json_t                *tokens,
+                                            const gchar           *ops,
+                                            gsize                  ops_len,
+                                            GError               **err);
+
+/* Called by load_db once the main file is decrypted and partitioned. */
+gboolean        db_journal_replay          (DatabaseData          *db_data,
+                                            GError               **err);
+
+/* The helpers below run with the database lock held. */
+gboolean        db_journal_matches_loaded  (DatabaseData          *db_data,
+                                            GError               **err);
+
+gboolean        db_journal_has_room        (DatabaseData          *db_data,
+                                            const DbJournalDelta  *delta);
+
+gboolean        db_journal_append          (DatabaseData          *db_data,
+                                            const DbJournalDelta  *delta,
+                                            GError               **err);
+
+void            db_journal_discard         (DatabaseData          *db_data);
+
+void            db_journal_reset           (DatabaseData          *db_data);
+
+gchar          *db_journal_path            (const gchar           *db_path);
+
+#ifdef OTPCLIENT_TESTING
+void            db_test_set_journal_checkpoint_size (gsize size);
+#endif
+
+G_END_DECLS
@@ -0,0 +1,293 @@
+#include <glib.h>
+#include <jansson.h>
+#include <string.h>
+#include "db-record.h"
+#include "gquarks.h"
+
+
+static const gchar *const record_types[] = { "TOTP", "HOTP" };
+static const gchar *const record_algos[] = { "SHA1", "SHA256", "SHA512" };
+
+#define RECORD_FLAG_GROUP       0x01
+#define RECORD_FIXED_SIZE       5       // kind, type, algo, digits, flags
+#define RECORD_MAX_STRINGS      4       // label, issuer, secret, group
+
+typedef struct {
+    guint8 type;
+    guint8 algo;
+    guint8 digits;
+    guint8 flags;
+    guint64 param;              // period for TOTP, counter for HOTP
+    json_t *strings[RECORD_MAX_STRINGS];
+    guint n_strings;
+} BinaryToken;
+
+
+static gint
+lookup_name (const gchar *const *names,
+             guint               n_names,
+             json_t             *value)
+{
+    const gchar *s = json_string_value (value);
+    if (s == NULL || strlen (s) != json_string_length (value))
+        return -1;
+    for (guint i = 0; i < n_names; i++) {
+        if (g_strcmp0 (s, names[i]) == 0)
+            return (gint) i;
+    }
+    return -1;
+}
+
+
+/* TRUE when the token has exactly the keys and types build_json_obj gives it,
+ * so the binary form loses nothing. */
+static gboolean
+binary_token_from_json (json_t      *token,
+                        BinaryToken *bt)
+{
+    if (!json_is_object (token))
+        return FALSE;
+    gint type = lookup_name (record_types, G_N_ELEMENTS (record_types), json_object_get (token, "type"));
+    gint algo = lookup_name (record_algos, G_N_ELEMENTS (record_algos), json_object_get (token, "algo"));
+    if (type < 0 || algo < 0)
+        return FALSE;
+
+    json_t *digits = json_object_get (token, "digits");
+    json_t *param = json_object_get (token, type == 0 ? "period" : "counter");
+    if (!json_is_integer (digits) || json_integer_value (digits) < 0 || json_integer_value (digits) > G_MAXUINT8 ||
+        !json_is_integer (param) || json_integer_value (param) < 0)
+        return FALSE;
+
+    const gchar *keys[] = { "label", "issuer", "secret", "group" };
+    bt->n_strings = 0;
+    for (guint i = 0; i < G_N_ELEMENTS (keys); i++) {
+        json_t *value = json_object_get (token, keys[i]);
+        if (value == NULL && g_strcmp0 (keys[i], "group") == 0)
+            break;
+        // g_utf8_validate_len on the way back rejects embedded NULs.
+        if (!json_is_string (value) || strlen (json_string_value (value)) != json_string_length (value))
+            return FALSE;
+        bt->strings[bt->n_strings++] = value;
+    }
+    // type, algo, digits, period/counter plus the strings: nothing else.
+    if (json_object_size (token) != 4 + bt->n_strings)
+        return FALSE;
+
+    bt->type = (guint8) type;
+    bt->algo = (guint8) algo;
+    bt->digits = (guint8) json_integer_value (digits);
+    bt->flags = (bt->n_strings == RECORD_MAX_STRINGS) ? RECORD_FLAG_GROUP : 0;
+    bt->param = (guint64) json_integer_value (param);
+    return TRUE;
+}
+
+
+static gsize
+varint_size (guint64 value)
+{
+    gsize n = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        n++;
+    }
+    return n;
+}
+
+
+static gsize
+write_varint (guint8  *out,
+              guint64  value)
+{
+    gsize n = 0;
+    while (value >= 0x80) {
+        out[n++] = (guint8) (value | 0x80);
+        value >>= 7;
+    }
+    out[n++] = (guint8) value;
+    return n;
+}
+
+
+static gboolean
+read_varint (const guint8 *buf,
+             gsize         len,
+             gsize        *pos,
+             guint64      *value)
+{
+    guint64 v = 0;
+    for (guint shift = 0; shift < 64 && *pos < len; shift += 7) {
+        guint8 byte = buf[(*pos)++];
+        // The tenth byte may only carry the top bit.
+        if (shift == 63 && byte > 1)
+            return FALSE;
+        v |= (guint64) (byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            *value = v;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+
+static gsize
+binary_token_size (const BinaryToken *bt)
+{
+    gsize size = RECORD_FIXED_SIZE + varint_size (bt->param);
+    for (guint i = 0; i < bt->n_strings; i++) {
+        gsize len = json_string_length (bt->strings[i]);
+        size += varint_size (len) + len;
+    }
+    return size;
+}
+
+
+gsize
+db_record_size (json_t *token,
+                gint32  db_version)
+{
+    BinaryToken bt;
+    if (db_version >= 5 && binary_token_from_json (token, &bt))
+        return binary_token_size (&bt);
+    gsize json_len = json_dumpb (token, NULL, 0, JSON_COMPACT);
+    if (json_len == 0)
+        return 0;
+    return (db_version >= 5) ? json_len + 1 : json_len;
+}
+
+
+gsize
+db_record_write (json_t *token,
+                 gint32  db_version,
+                 guint8 *out,
+                 gsize   out_len)
+{
+    BinaryToken bt;
+    if (db_version >= 5 && binary_token_from_json (token, &bt)) {
+        if (binary_token_size (&bt) > out_len)
+            return 0;
+        gsize pos = 0;
+        out[pos++] = DB_RECORD_KIND_BINARY;
+        out[pos++] = bt.type;
+        out[pos++] = bt.algo;
+        out[pos++] = bt.digits;
+        out[pos++] = bt.flags;
+        pos += write_varint (out + pos, bt.param);
+        for (guint i = 0; i < bt.n_strings; i++) {
+            gsize len = json_string_length (bt.strings[i]);
+            pos += write_varint (out + pos, len);
+            memcpy (out + pos, json_string_value (bt.strings[i]), len);
+            pos += len;
+        }
+        return pos;
+    }
+
+    gsize prefix = 0;
+    if (db_version >= 5) {
+        if (out_len == 0)
+            return 0;
+        out[prefix++] = DB_RECORD_KIND_JSON;
+    }
+    gsize json_len = json_dumpb (token, (gchar *) out + prefix, out_len - prefix, JSON_COMPACT);
+    if (json_len == 0 || json_len > out_len - prefix)
+        return 0;
+    return prefix + json_len;
+}
+
+
+static json_t *
+parse_json_record (const guint8  *buf,
+                   gsize          len,
+                   GError       **err)
+{
+    json_error_t jerr;
+    json_t *token = json_loadb ((const gchar *) buf, len, 0, &jerr);
+    if (token == NULL) {
+        // Jansson allocates from the secure pool (see init_libs).
+        if (json_error_code (&jerr) == json_error_out_of_memory)
+            g_set_error (err, file_too_big_gquark (), FILE_TOO_BIG_ERRCODE, FILE_SIZE_SECMEM_MSG);
+        else
+            g_set_error (err, memlock_error_gquark (), MEMLOCK_ERRCODE,
+                         "Error while loading json data: %s", jerr.text);
+    }
+    return token;
+}
+
+
+static json_t *
+malformed_record (GError **err)
+{
+    g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                 "Malformed database record.");
+    return NULL;
+}
+
+
+static json_t *
+parse_binary_record (const guint8  *buf,
+                     gsize          len,
+                     GError       **err)
+{
+    if (len < RECORD_FIXED_SIZE ||
+        buf[1] >= G_N_ELEMENTS (record_types) || buf[2] >= G_N_ELEMENTS (record_algos) ||
+        (buf[4] & ~RECORD_FLAG_GROUP) != 0)
+        return malformed_record (err);
+    guint8 type = buf[1];
+    guint8 algo = buf[2];
+    guint8 digits = buf[3];
+    guint n_strings = (buf[4] & RECORD_FLAG_GROUP) ? RECORD_MAX_STRINGS : RECORD_MAX_STRINGS - 1;
+
+    gsize pos = RECORD_FIXED_SIZE;
+    guint64 param = 0;
+    if (!read_varint (buf, len, &pos, &param) || param > G_MAXINT64)
+        return malformed_record (err);
+    const gchar *strings[RECORD_MAX_STRINGS];
+    gsize lengths[RECORD_MAX_STRINGS];
+    for (guint i = 0; i < n_strings; i++) {
+        guint64 slen = 0;
+        if (!read_varint (buf, len, &pos, &slen) || slen > len - pos ||
+            !g_utf8_validate_len ((const gchar *) buf + pos, (gsize) slen, NULL))
+            return malformed_record (err);
+        strings[i] = (const gchar *) buf + pos;
+        lengths[i] = (gsize) slen;
+        pos += (gsize) slen;
+    }
+    if (pos != len)
+        return malformed_record (err);
+
+    json_t *token = json_object ();
+    gboolean ok = token != NULL &&
+        json_object_set_new (token, "type", json_string (record_types[type])) == 0 &&
+        json_object_set_new (token, "label", json_stringn (strings[0], lengths[0])) == 0 &&
+        json_object_set_new (token, "issuer", json_stringn (strings[1], lengths[1])) == 0 &&
+        json_object_set_new (token, "digits", json_integer (digits)) == 0 &&
+        json_object_set_new (token, "algo", json_string (record_algos[algo])) == 0 &&
+        json_object_set_new (token, "secret", json_stringn (strings[2], lengths[2])) == 0 &&
+        json_object_set_new (token, type == 0 ? "period" : "counter", json_integer ((json_int_t) param)) == 0 &&
+        (n_strings < RECORD_MAX_STRINGS ||
+         json_object_set_new (token, "group", json_stringn (strings[3], lengths[3])) == 0);
+    if (!ok) {
+        // The strings are valid UTF-8, so only the secure pool can run out.
+        if (token != NULL)
+            json_decref (token);
+        g_set_error (err, file_too_big_gquark (), FILE_TOO_BIG_ERRCODE, FILE_SIZE_SECMEM_MSG);
+        return NULL;
+    }
+    return token;
+}
+
+
+json_t *
+db_record_read (const guint8  *record,
+                gsize          len,
+                gint32         db_version,
+                GError       **err)
+{
+    if (db_version < 5)
+        return parse_json_record (record, len, err);
+    if (len > 0 && record[0] == DB_RECORD_KIND_BINARY)
+        return parse_binary_record (record, len, err);
+    if (len > 0 && record[0] == DB_RECORD_KIND_JSON)
+        return parse_json_record (record + 1, len - 1, err);
+    return malformed_record (err);
+}
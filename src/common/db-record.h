@@ -0,0 +1,44 @@
+#pragma once
+
+#include <glib.h>
+#include <jansson.h>
+
+G_BEGIN_DECLS
+
+/* Plaintext of one token record in a v4+ database.
+ *
+ * v4 stores the token's compact JSON. From v5 on, a record starts with a kind
+ * byte. A token shaped the way build_json_obj makes it is stored as a compact
+ * binary encoding:
+ *
+ *   0x01 | type | algo | digits | flags | varint period-or-counter
+ *        | varint len + label | varint len + issuer | varint len + secret
+ *        | [varint len + group]
+ *
+ * type and algo are small enums and varints are unsigned LEB128. flags bit 0
+ * says whether a group follows. Any other token (unknown keys, other spellings
+ * or out-of-range values, as kept for quarantined tokens) is stored as 0x00
+ * followed by its compact JSON. Decoding a binary record gives a token that
+ * json_equal()s the one that was encoded. */
+
+#define DB_RECORD_KIND_JSON     0x00
+#define DB_RECORD_KIND_BINARY   0x01
+
+/* Bytes db_record_write will produce for a file of db_version, or 0 when the
+ * token cannot be serialized. */
+gsize    db_record_size  (json_t        *token,
+                          gint32         db_version);
+
+/* Writes the record into out, which must hold db_record_size bytes. Returns
+ * the number of bytes written, 0 on failure. */
+gsize    db_record_write (json_t        *token,
+                          gint32         db_version,
+                          guint8        *out,
+                          gsize          out_len);
+
+json_t  *db_record_read  (const guint8  *record,
+                          gsize          len,
+                          gint32         db_version,
+                          GError       **err);
+
+G_END_DECLS
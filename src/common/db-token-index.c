@@ -0,0 +1,182 @@
+#define _DEFAULT_SOURCE
+#include <glib.h>
+#include <gcrypt.h>
+#include <jansson.h>
+#include <string.h>
+#include "db-token-index.h"
+
+
+typedef struct {
+    DbTokenDigest digest;       // first, so a bare DbTokenDigest can be looked up
+    guint count;
+} IndexEntry;
+
+struct db_token_index_t {
+    GHashTable *entries;        // set of IndexEntry, keyed by digest
+};
+
+static guint8 digest_key[32];
+
+
+static void
+ensure_digest_key (void)
+{
+    static gsize initialized = 0;
+    if (g_once_init_enter (&initialized)) {
+        gcry_create_nonce (digest_key, sizeof (digest_key));
+        g_once_init_leave (&initialized, 1);
+    }
+}
+
+
+static guint
+digest_hash (gconstpointer key)
+{
+    // The digest is already uniformly distributed.
+    guint hash;
+    memcpy (&hash, ((const DbTokenDigest *) key)->bytes, sizeof (hash));
+    return hash;
+}
+
+
+static gboolean
+digest_equal (gconstpointer a,
+              gconstpointer b)
+{
+    return memcmp (a, b, sizeof (DbTokenDigest)) == 0;
+}
+
+
+DbTokenIndex *
+db_token_index_new (void)
+{
+    DbTokenIndex *index = g_new0 (DbTokenIndex, 1);
+    index->entries = g_hash_table_new_full (digest_hash, digest_equal, g_free, NULL);
+    return index;
+}
+
+
+void
+db_token_index_free (DbTokenIndex *index)
+{
+    if (index == NULL)
+        return;
+    g_hash_table_destroy (index->entries);
+    g_free (index);
+}
+
+
+gboolean
+db_token_digest (json_t        *token,
+                 DbTokenDigest *digest)
+{
+    const gsize flags = JSON_COMPACT | JSON_SORT_KEYS;
+    gsize len = json_dumpb (token, NULL, 0, flags);
+    if (len == 0)
+        return FALSE;
+    // The encoding carries the secret: keep it in secure memory.
+    gchar *buf = gcry_malloc_secure (len);
+    if (buf == NULL)
+        return FALSE;
+
+    ensure_digest_key ();
+    gboolean ok = FALSE;
+    gcry_md_hd_t hd = NULL;
+    if (json_dumpb (token, buf, len, flags) == len &&
+        gcry_md_open (&hd, GCRY_MD_BLAKE2S_128, 0) == GPG_ERR_NO_ERROR) {
+        if (gcry_md_setkey (hd, digest_key, sizeof (digest_key)) == GPG_ERR_NO_ERROR) {
+            gcry_md_write (hd, buf, len);
+            memcpy (digest->bytes, gcry_md_read (hd, GCRY_MD_BLAKE2S_128), DB_TOKEN_DIGEST_SIZE);
+            ok = TRUE;
+        }
+        gcry_md_close (hd);
+    }
+    explicit_bzero (buf, len);
+    gcry_free (buf);
+    return ok;
+}
+
+
+void
+db_token_index_add (DbTokenIndex        *index,
+                    const DbTokenDigest *digest)
+{
+    IndexEntry *entry = g_hash_table_lookup (index->entries, digest);
+    if (entry != NULL) {
+        entry->count++;
+        return;
+    }
+    entry = g_new (IndexEntry, 1);
+    entry->digest = *digest;
+    entry->count = 1;
+    g_hash_table_add (index->entries, entry);
+}
+
+
+void
+db_token_index_remove (DbTokenIndex        *index,
+                       const DbTokenDigest *digest)
+{
+    IndexEntry *entry = g_hash_table_lookup (index->entries, digest);
+    if (entry == NULL)
+        return;
+    if (--entry->count == 0)
+        g_hash_table_remove (index->entries, digest);
+}
+
+
+gboolean
+db_token_index_contains (DbTokenIndex        *index,
+                         const DbTokenDigest *digest)
+{
+    return g_hash_table_contains (index->entries, digest);
+}
+
+
+guint
+db_token_index_size (DbTokenIndex *index)
+{
+    return g_hash_table_size (index->entries);
+}
+
+
+static void
+index_window (DbTokenIndex *index,
+              json_t       *tokens,
+              gsize         from,
+              gsize         to,
+              gboolean      add)
+{
+    for (gsize i = from; i < to; i++) {
+        DbTokenDigest digest;
+        if (!db_token_digest (json_array_get (tokens, i), &digest))
+            continue;
+        if (add)
+            db_token_index_add (index, &digest);
+        else
+            db_token_index_remove (index, &digest);
+    }
+}
+
+
+void
+db_token_index_update (DbTokenIndex *index,
+                       json_t       *before,
+                       json_t       *after)
+{
+    // json_array_size () and json_array_get () treat NULL as an empty array.
+    gsize before_len = json_array_size (before);
+    gsize after_len = json_array_size (after);
+    gsize prefix = 0;
+    while (prefix < before_len && prefix < after_len &&
+           json_equal (json_array_get (before, prefix), json_array_get (after, prefix)))
+        prefix++;
+    gsize suffix = 0;
+    while (suffix < before_len - prefix && suffix < after_len - prefix &&
+           json_equal (json_array_get (before, before_len - 1 - suffix),
+                       json_array_get (after, after_len - 1 - suffix)))
+        suffix++;
+
+    index_window (index, before, prefix, before_len - suffix, FALSE);
+    index_window (index, after, prefix, after_len - suffix, TRUE);
+}
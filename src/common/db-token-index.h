@@ -0,0 +1,53 @@
+#pragma once
+
+#include <glib.h>
+#include <jansson.h>
+
+G_BEGIN_DECLS
+
+/* Set of token digests used to spot duplicates in O(1).
+ *
+ * A digest is a keyed BLAKE2s-128 of the token's canonical JSON (compact,
+ * sorted keys), so two tokens share one exactly when json_equal says they are
+ * equal. The key is random per process: the digests (which cover the secret)
+ * live in ordinary heap memory and must not be usable to test guesses
+ * offline. The index is a multiset, since a database may legitimately hold
+ * the same token twice, and is kept in step with an array by diffing the
+ * array's old and new contents instead of being rebuilt. */
+
+#define DB_TOKEN_DIGEST_SIZE    16
+
+typedef struct {
+    guint8 bytes[DB_TOKEN_DIGEST_SIZE];
+} DbTokenDigest;
+
+typedef struct db_token_index_t DbTokenIndex;
+
+DbTokenIndex *db_token_index_new      (void);
+
+void          db_token_index_free     (DbTokenIndex        *index);
+
+gboolean      db_token_digest         (json_t              *token,
+                                       DbTokenDigest       *digest);
+
+void          db_token_index_add      (DbTokenIndex        *index,
+                                       const DbTokenDigest *digest);
+
+void          db_token_index_remove   (DbTokenIndex        *index,
+                                       const DbTokenDigest *digest);
+
+gboolean      db_token_index_contains (DbTokenIndex        *index,
+                                       const DbTokenDigest *digest);
+
+/* Number of distinct digests. */
+guint         db_token_index_size     (DbTokenIndex        *index);
+
+/* Moves the index from describing `before` to describing `after` (either may
+ * be NULL for an empty array). Only the window between the longest common
+ * prefix and suffix is re-hashed, so an append or a single edit costs a few
+ * digests regardless of the array size. */
+void          db_token_index_update   (DbTokenIndex        *index,
+                                       json_t              *before,
+                                       json_t              *after);
+
+G_END_DECLS
@@ -1,5 +1,6 @@
 #include "gsettings-common.h"
 #include "common.h"
+#include "db-common.h"
 
 #define OTPCLIENT_SCHEMA_ID "com.github.paolostivanin.OTPClient"
 
@@ -81,6 +82,25 @@ gsettings_common_get_use_secret_service (void)
 }
 
 
+guint
+gsettings_common_get_backup_generations (void)
+{
+    g_autoptr (GSettings) settings = gsettings_common_get_settings ();
+    if (settings != NULL)
+        return g_settings_get_uint (settings, "backup-generations");
+
+    /* Fallback to GKeyFile */
+    GKeyFile *kf = get_kf_ptr ();
+    if (kf == NULL)
+        return 0;
+
+    gint generations = g_key_file_get_integer (kf, "config", "backup_generations", NULL);
+    g_key_file_free (kf);
+
+    return (guint) CLAMP (generations, 0, DB_BACKUP_GENERATIONS_MAX);
+}
+
+
 gboolean
 gsettings_common_get_search_provider_enabled (void)
 {
@@ -117,6 +137,17 @@ gsettings_common_get_search_provider_keyword (void)
 }
 
 
+gboolean
+gsettings_common_get_search_provider_keep_unlocked (void)
+{
+    g_autoptr (GSettings) settings = gsettings_common_get_settings ();
+    if (settings != NULL)
+        return g_settings_get_boolean (settings, "search-provider-keep-unlocked");
+
+    return FALSE;
+}
+
+
 GPtrArray *
 gsettings_common_get_db_list (void)
 {
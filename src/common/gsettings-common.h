@@ -23,10 +23,14 @@ gchar      *gsettings_common_get_db_path                 (void);
 
 gboolean    gsettings_common_get_use_secret_service      (void);
 
+guint       gsettings_common_get_backup_generations      (void);
+
 gboolean    gsettings_common_get_search_provider_enabled (void);
 
 gchar      *gsettings_common_get_search_provider_keyword (void);
 
+gboolean    gsettings_common_get_search_provider_keep_unlocked (void);
+
 GPtrArray  *gsettings_common_get_db_list                 (void);
 
 void        db_list_entry_free                           (DbListEntry *entry);
@@ -0,0 +1,243 @@
+#define _DEFAULT_SOURCE
+#include <glib.h>
+#include <gcrypt.h>
+#include <string.h>
+#include "otp-context.h"
+#include "gquarks.h"
+
+#define STEAM_DIGITS 5
+
+static const gchar steam_alphabet[] = "23456789BCDFGHJKMNPQRTVWXY";
+
+struct otp_context_t {
+    gcry_md_hd_t hmac;          // keyed once, see otp-context.h
+    gint algo;
+};
+
+
+static gint
+md_algo_from_name (const gchar *algo)
+{
+    if (algo == NULL || g_ascii_strcasecmp (algo, "SHA1") == 0)
+        return GCRY_MD_SHA1;
+    if (g_ascii_strcasecmp (algo, "SHA256") == 0)
+        return GCRY_MD_SHA256;
+    if (g_ascii_strcasecmp (algo, "SHA512") == 0)
+        return GCRY_MD_SHA512;
+    return GCRY_MD_NONE;
+}
+
+
+static gint
+base32_value (gchar c)
+{
+    c = g_ascii_toupper (c);
+    if (c >= 'A' && c <= 'Z')
+        return c - 'A';
+    if (c >= '2' && c <= '7')
+        return c - '2' + 26;
+    return -1;
+}
+
+
+// Decodes into secure memory; NULL if the secret is not base32 or is empty.
+static guint8 *
+base32_decode_secure (const gchar *secret,
+                      gsize       *len_out)
+{
+    gsize max_len = strlen (secret) * 5 / 8 + 1;
+    guint8 *key = gcry_calloc_secure (max_len, 1);
+    if (key == NULL)
+        return NULL;
+
+    guint32 buffer = 0;
+    guint bits = 0;
+    gsize len = 0;
+    gboolean seen_padding = FALSE;
+    for (const gchar *p = secret; *p != '\0'; p++) {
+        if (g_ascii_isspace (*p))
+            continue;
+        if (*p == '=') {
+            seen_padding = TRUE;
+            continue;
+        }
+        gint value = base32_value (*p);
+        if (seen_padding || value < 0) {
+            len = 0;
+            break;
+        }
+        buffer = (buffer << 5) | (guint32) value;
+        bits += 5;
+        if (bits >= 8) {
+            bits -= 8;
+            key[len++] = (guint8) (buffer >> bits);
+        }
+    }
+    buffer = 0;                 // leftover key bits
+
+    if (len == 0) {
+        explicit_bzero (key, max_len);
+        gcry_free (key);
+        return NULL;
+    }
+    *len_out = len;
+    return key;
+}
+
+
+OtpContext *
+otp_context_new (const gchar *secret,
+                 const gchar *algo,
+                 GError     **err)
+{
+    gint md_algo = md_algo_from_name (algo);
+    if (md_algo == GCRY_MD_NONE) {
+        g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                     "Unsupported algorithm: %s", algo);
+        return NULL;
+    }
+
+    gsize key_len = 0;
+    guint8 *key = (secret != NULL) ? base32_decode_secure (secret, &key_len) : NULL;
+    if (key == NULL) {
+        g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                     "The secret is not valid Base32.");
+        return NULL;
+    }
+
+    OtpContext *ctx = g_new0 (OtpContext, 1);
+    ctx->algo = md_algo;
+    gcry_error_t gerr = gcry_md_open (&ctx->hmac, md_algo, GCRY_MD_FLAG_HMAC | GCRY_MD_FLAG_SECURE);
+    if (!gerr)
+        gerr = gcry_md_setkey (ctx->hmac, key, key_len);
+    explicit_bzero (key, key_len);
+    gcry_free (key);
+
+    if (gerr) {
+        g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                     "Cannot set up the HMAC: %s", gcry_strerror (gerr));
+        otp_context_free (ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+
+void
+otp_context_free (OtpContext *ctx)
+{
+    if (ctx == NULL)
+        return;
+    // gcry_md_close wipes the secure buffers holding the pad states.
+    if (ctx->hmac != NULL)
+        gcry_md_close (ctx->hmac);
+    g_free (ctx);
+}
+
+
+// RFC 4226 dynamic truncation of HMAC(key, counter).
+static guint32
+truncated_hmac (OtpContext *ctx,
+                guint64     counter)
+{
+    guint8 message[8];
+    for (gint i = 7; i >= 0; i--) {
+        message[i] = (guint8) (counter & 0xff);
+        counter >>= 8;
+    }
+
+    gcry_md_reset (ctx->hmac);
+    gcry_md_write (ctx->hmac, message, sizeof (message));
+    const guint8 *mac = gcry_md_read (ctx->hmac, ctx->algo);
+    guint offset = mac[gcry_md_get_algo_dlen (ctx->algo) - 1] & 0x0f;
+    guint32 binary = ((guint32) (mac[offset] & 0x7f) << 24) |
+                     ((guint32) mac[offset + 1] << 16) |
+                     ((guint32) mac[offset + 2] << 8) |
+                     (guint32) mac[offset + 3];
+    // The finished digest stays in the handle until the next reset.
+    gcry_md_reset (ctx->hmac);
+    return binary;
+}
+
+
+static gchar *
+format_decimal (guint32 value,
+                guint   digits)
+{
+    guint64 modulus = 1;
+    for (guint i = 0; i < digits; i++)
+        modulus *= 10;
+    guint64 rest = value % modulus;
+
+    gchar *code = gcry_calloc_secure (digits + 1, 1);
+    if (code == NULL)
+        return NULL;
+    for (gint i = (gint) digits - 1; i >= 0; i--) {
+        code[i] = (gchar) ('0' + rest % 10);
+        rest /= 10;
+    }
+    return code;
+}
+
+
+static gchar *
+format_steam (guint32 value)
+{
+    gchar *code = gcry_calloc_secure (STEAM_DIGITS + 1, 1);
+    if (code == NULL)
+        return NULL;
+    for (guint i = 0; i < STEAM_DIGITS; i++) {
+        code[i] = steam_alphabet[value % (sizeof (steam_alphabet) - 1)];
+        value /= sizeof (steam_alphabet) - 1;
+    }
+    return code;
+}
+
+
+gchar *
+otp_context_hotp (OtpContext *ctx,
+                  guint64     counter,
+                  guint       digits)
+{
+    g_return_val_if_fail (ctx != NULL, NULL);
+    g_return_val_if_fail (digits > 0 && digits <= 19, NULL);
+    return format_decimal (truncated_hmac (ctx, counter), digits);
+}
+
+
+gchar *
+otp_context_totp_at (OtpContext *ctx,
+                     gint64      timestamp,
+                     guint       period,
+                     guint       digits)
+{
+    g_return_val_if_fail (period > 0 && timestamp >= 0, NULL);
+    return otp_context_hotp (ctx, (guint64) timestamp / period, digits);
+}
+
+
+gchar *
+otp_context_steam_at (OtpContext *ctx,
+                      gint64      timestamp,
+                      guint       period)
+{
+    g_return_val_if_fail (ctx != NULL, NULL);
+    g_return_val_if_fail (period > 0 && timestamp >= 0, NULL);
+    return format_steam (truncated_hmac (ctx, (guint64) timestamp / period));
+}
+
+
+void
+otp_context_generate_batch (OtpBatchItem *items,
+                            guint         n_items)
+{
+    for (guint i = 0; i < n_items; i++) {
+        OtpBatchItem *item = &items[i];
+        item->code = NULL;
+        if (item->ctx == NULL || item->digits > 19)
+            continue;
+        guint32 value = truncated_hmac (item->ctx, item->counter);
+        item->code = (item->digits == OTP_CONTEXT_STEAM) ? format_steam (value)
+                                                         : format_decimal (value, item->digits);
+    }
+}
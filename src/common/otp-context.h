@@ -0,0 +1,62 @@
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Per-token state for generating codes without starting from the base32
+ * string each time.
+ *
+ * The secret is decoded once into gcrypt secure memory and used to key an
+ * HMAC handle opened with GCRY_MD_FLAG_SECURE; libgcrypt keeps the hashed
+ * ipad and opad blocks in the handle, and the decoded key is wiped as soon
+ * as the handle is keyed. A code then costs a reset (which restores the
+ * inner state), one 8-byte write and the outer finish: two compression
+ * function calls for every supported algorithm. Results match libcotp's
+ * get_totp_at / get_hotp / get_steam_totp_at.
+ *
+ * A context is not thread-safe; use one per thread. Codes are returned in
+ * secure memory, release them with sensitive_secure_free. */
+
+typedef struct otp_context_t OtpContext;
+
+/* algo is "SHA1", "SHA256" or "SHA512" (NULL means SHA1). The secret follows
+ * the rules of otp_secret_is_valid_base32: case and whitespace are ignored,
+ * padding is optional. */
+OtpContext *otp_context_new          (const gchar *secret,
+                                      const gchar *algo,
+                                      GError     **err);
+
+void        otp_context_free         (OtpContext  *ctx);
+
+gchar      *otp_context_hotp         (OtpContext  *ctx,
+                                      guint64      counter,
+                                      guint        digits);
+
+gchar      *otp_context_totp_at      (OtpContext  *ctx,
+                                      gint64       timestamp,
+                                      guint        period,
+                                      guint        digits);
+
+/* Steam Guard codes are always HMAC-SHA1: create the context with "SHA1". */
+gchar      *otp_context_steam_at     (OtpContext  *ctx,
+                                      gint64       timestamp,
+                                      guint        period);
+
+#define OTP_CONTEXT_STEAM 0
+
+typedef struct {
+    OtpContext *ctx;
+    guint64     counter;        // HOTP counter or TOTP time step
+    guint       digits;         // OTP_CONTEXT_STEAM for a Steam Guard code
+    gchar      *code;           // set by otp_context_generate_batch
+} OtpBatchItem;
+
+/* Fills in code for every item, NULL where ctx is NULL or digits is out of
+ * range. Same results as calling the functions above one by one; meant for
+ * callers that roll many tokens over at once, so they work out the time
+ * step once and the codes come out together. */
+void        otp_context_generate_batch (OtpBatchItem *items,
+                                        guint         n_items);
+
+G_END_DECLS
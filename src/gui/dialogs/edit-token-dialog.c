@@ -2,9 +2,11 @@
 #include "edit-token-dialog.h"
 #include "common.h"
 #include "db-common.h"
+#include "db-commit.h"
 #include "gquarks.h"
 #include "otp-validation.h"
 #include "../otpclient-application.h"
+#include "../otpclient-window.h"
 
 struct _EditTokenDialog
 {
@@ -46,6 +48,12 @@ edit_token_mutation (json_t   *candidate,
                      "%s", _("Token changed while the edit dialog was open."));
         return FALSE;
     }
+    token_obj = db_token_for_write (candidate, mutation->token_index);
+    if (token_obj == NULL) {
+        g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                     "%s", _("Failed to update the token."));
+        return FALSE;
+    }
 
     json_object_set_new (token_obj, "label", json_string (mutation->label));
     json_object_set_new (token_obj, "issuer", json_string (mutation->issuer));
@@ -58,6 +66,36 @@ edit_token_mutation (json_t   *candidate,
     return otp_validate_token_object (token_obj, mutation->token_index, err);
 }
 
+typedef struct {
+    EditTokenCallback callback;
+    gpointer callback_data;
+} EditTokenCommit;
+
+static void
+on_edit_committed (DatabaseData *db_data,
+                   const GError *error,
+                   gpointer      user_data)
+{
+    (void) db_data;
+    EditTokenCommit *commit = user_data;
+
+    if (error != NULL) {
+        // The dialog is long gone; report on the main window, which is also
+        // the only thing the rebuild callback is ever registered for.
+        GApplication *default_app = g_application_get_default ();
+        GtkWindow *win = GTK_IS_APPLICATION (default_app)
+            ? gtk_application_get_active_window (GTK_APPLICATION (default_app))
+            : NULL;
+        if (win != NULL && OTPCLIENT_IS_WINDOW (win)) {
+            g_autofree gchar *msg = g_strdup_printf (_("Failed to save token: %s"), error->message);
+            otpclient_window_show_error_toast (OTPCLIENT_WINDOW (win), msg);
+            if (commit->callback != NULL && commit->callback_data == (gpointer) win)
+                commit->callback (commit->callback_data);
+        }
+    }
+    g_free (commit);
+}
+
 static void
 on_save_clicked (GtkButton       *button,
                  EditTokenDialog *self)
@@ -89,9 +127,13 @@ on_save_clicked (GtkButton       *button,
         .issuer = (gchar *) issuer,
         .group = (gchar *) group_text,
     };
-    db_transaction (self->db_data, edit_token_mutation, &mutation, &err);
-    if (err != NULL)
+    EditTokenCommit *commit = g_new0 (EditTokenCommit, 1);
+    commit->callback = self->callback;
+    commit->callback_data = self->callback_data;
+    if (!db_commit_async (self->db_data, edit_token_mutation, &mutation,
+                          on_edit_committed, commit, &err))
     {
+        g_free (commit);
         gtk_label_set_text (GTK_LABEL (self->error_label), err->message);
         gtk_widget_set_visible (self->error_label, TRUE);
         g_clear_error (&err);
@@ -141,7 +183,8 @@ edit_token_dialog_new (json_t            *token_obj,
                                           NULL);
 
     self->token_obj = token_obj;
-    self->original_token = json_deep_copy (token_obj);
+    // Tokens are never modified in place, so a reference is a stable copy.
+    self->original_token = json_incref (token_obj);
     self->token_index = token_index;
     self->db_data = database_data_ref (db_data);
     self->callback = callback;
@@ -4,6 +4,7 @@
 #include "import-dialog.h"
 #include "import-export.h"
 #include "db-common.h"
+#include "db-commit.h"
 #include "common.h"
 #include "file-size.h"
 #include "gquarks.h"
@@ -26,8 +27,19 @@ struct _ImportDialog
     GtkWidget *import_button;
     GtkWidget *error_label;
 
+    GtkWidget *progress_box;
+    GtkWidget *progress_label;
+    GtkWidget *progress_bar;
+    GtkWidget *cancel_button;
+
     gchar *selected_file;
-    gchar *import_password;
+
+    GWeakRef parent_ref;
+    GTask *import_task;         /* the running import, not owned */
+    GCancellable *cancellable;
+    const gchar *running_action;
+    gboolean running_encrypted;
+    ImportSummary summary;
 };
 
 G_DEFINE_FINAL_TYPE (ImportDialog, import_dialog, ADW_TYPE_DIALOG)
@@ -76,124 +88,395 @@ on_format_changed (AdwComboRow  *combo_row,
     gtk_widget_set_visible (self->password_row, needs_password);
 }
 
+/* The import runs as a GTask in a worker thread: the provider reads,
+ * decrypts (scrypt or PBKDF2 for encrypted backups) and parses the file,
+ * then every token is validated and turned into its JSON object and digest.
+ * Only the duplicate check and the append are left for the main thread, as
+ * one transaction through the background commit queue. Cancelling drops the
+ * result; a KDF already running is not interrupted, but nothing reaches the
+ * database. */
+typedef enum {
+    IMPORT_STAGE_DECODE,
+    IMPORT_STAGE_VALIDATE,
+    IMPORT_STAGE_SAVE,
+} ImportStage;
+
+#define IMPORT_PROGRESS_STEP 64
+
+typedef struct {
+    const gchar *action_name;
+    gchar *path;
+    gchar *password;            /* secure memory, may be NULL */
+    gint32 max_file_size_from_memlock;
+    gsize file_size;
+} ImportJob;
+
+typedef struct {
+    DbImportBatch *batch;
+    guint qr_invalid;
+    guint qr_batch_size;
+    guint qr_batch_index;
+} ImportResult;
+
+typedef struct {
+    GTask *task;
+    ImportStage stage;
+    guint done;
+    guint total;
+} ImportProgress;
+
 static void
-do_import (ImportDialog *self)
+import_job_free (gpointer data)
 {
-    guint fmt_idx = adw_combo_row_get_selected (ADW_COMBO_ROW (self->format_combo));
-    if (fmt_idx >= N_IMPORT_FORMATS)
-        return;
+    ImportJob *job = data;
+    g_free (job->path);
+    if (job->password != NULL) {
+        explicit_bzero (job->password, strlen (job->password));
+        gcry_free (job->password);
+    }
+    g_free (job);
+}
+
+static void
+import_result_free (gpointer data)
+{
+    ImportResult *result = data;
+    db_import_batch_free (result->batch);
+    g_free (result);
+}
+
+static void
+set_busy (ImportDialog *self,
+          gboolean      busy)
+{
+    gtk_widget_set_sensitive (self->format_combo, !busy);
+    gtk_widget_set_sensitive (self->password_row, !busy);
+    gtk_widget_set_visible (self->import_button, !busy);
+    gtk_widget_set_visible (self->progress_box, busy);
+    gtk_widget_set_sensitive (self->cancel_button, busy);
+    if (busy)
+        gtk_widget_set_visible (self->error_label, FALSE);
+}
 
-    if (self->import_password != NULL) {
-        explicit_bzero (self->import_password, strlen (self->import_password));
-        gcry_free (self->import_password);
-        self->import_password = NULL;
+static void
+show_stage (ImportDialog *self,
+            ImportStage   stage,
+            guint         done,
+            guint         total)
+{
+    const gchar *text = NULL;
+    switch (stage) {
+    case IMPORT_STAGE_DECODE:
+        if (g_strcmp0 (self->running_action, GOOGLE_FILE_ACTION_NAME) == 0)
+            text = _("Reading QR code…");
+        else if (self->running_encrypted)
+            text = _("Decrypting backup…");
+        else
+            text = _("Reading backup…");
+        break;
+    case IMPORT_STAGE_VALIDATE:
+        text = _("Checking tokens…");
+        break;
+    case IMPORT_STAGE_SAVE:
+        text = _("Saving…");
+        /* The commit is already queued and cannot be taken back. */
+        gtk_widget_set_sensitive (self->cancel_button, FALSE);
+        break;
     }
-    if (gtk_widget_get_visible (self->password_row)) {
-        const gchar *text = gtk_editable_get_text (GTK_EDITABLE (self->password_row));
-        gsize len = strlen (text);
-        self->import_password = gcry_calloc_secure (len + 1, 1);
-        if (self->import_password == NULL) {
-            wipe_password_row (self->password_row);
-            gtk_label_set_text (GTK_LABEL (self->error_label),
-                                _("Secure memory is exhausted"));
-            gtk_widget_set_visible (self->error_label, TRUE);
-            return;
-        }
-        memcpy (self->import_password, text, len);
-        wipe_password_row (self->password_row);
+    gtk_label_set_text (GTK_LABEL (self->progress_label), text);
+
+    if (stage == IMPORT_STAGE_VALIDATE && total > 0)
+        gtk_progress_bar_set_fraction (GTK_PROGRESS_BAR (self->progress_bar),
+                                       (gdouble) done / (gdouble) total);
+    else
+        gtk_progress_bar_pulse (GTK_PROGRESS_BAR (self->progress_bar));
+}
+
+static gboolean
+import_progress_idle (gpointer user_data)
+{
+    ImportProgress *progress = user_data;
+    ImportDialog *self = g_task_get_source_object (progress->task);
+    // A cancelled run may still report until its thread notices.
+    if (self->import_task == progress->task)
+        show_stage (self, progress->stage, progress->done, progress->total);
+    return G_SOURCE_REMOVE;
+}
+
+static void
+import_progress_free (gpointer data)
+{
+    ImportProgress *progress = data;
+    g_object_unref (progress->task);
+    g_free (progress);
+}
+
+static void
+post_progress (GTask       *task,
+               ImportStage  stage,
+               guint        done,
+               guint        total)
+{
+    ImportProgress *progress = g_new0 (ImportProgress, 1);
+    progress->task = g_object_ref (task);
+    progress->stage = stage;
+    progress->done = done;
+    progress->total = total;
+    g_main_context_invoke_full (g_task_get_context (task), G_PRIORITY_DEFAULT,
+                                import_progress_idle, progress, import_progress_free);
+}
+
+static GSList *
+decode_file (ImportJob    *job,
+             ImportResult *result,
+             GError      **err)
+{
+    if (g_strcmp0 (job->action_name, GOOGLE_FILE_ACTION_NAME) != 0)
+        return get_data_from_provider (job->action_name, job->path, job->password,
+                                       job->max_file_size_from_memlock,
+                                       job->file_size, err);
+
+    GSList *otps = NULL;
+    gchar *uri = qrcode_parse_image_file (job->path, err);
+    if (uri != NULL) {
+        if (g_str_has_prefix (uri, "otpauth-migration://"))
+            otps = google_migration_decode (uri, &result->qr_invalid,
+                                            &result->qr_batch_size, &result->qr_batch_index,
+                                            err);
+        else
+            set_otps_from_uris (uri, &otps);
+        sensitive_g_free (uri);
+        if (otps == NULL && (err == NULL || *err == NULL))
+            g_set_error (err, generic_error_gquark (), GENERIC_ERRCODE,
+                         "QR code contains no valid OTP token.");
     }
+    return otps;
+}
 
-    goffset file_size = get_file_size (self->selected_file);
-    if (file_size <= 0) {
-        gtk_label_set_text (GTK_LABEL (self->error_label),
-                            _("Selected file is empty or no longer exists."));
-        gtk_widget_set_visible (self->error_label, TRUE);
+static void
+import_thread (GTask        *task,
+               gpointer      source_object,
+               gpointer      task_data,
+               GCancellable *cancellable)
+{
+    (void) source_object;
+    ImportJob *job = task_data;
+    ImportResult *result = g_new0 (ImportResult, 1);
+    result->batch = db_import_batch_new ();
+
+    post_progress (task, IMPORT_STAGE_DECODE, 0, 0);
+    GError *err = NULL;
+    GSList *otps = decode_file (job, result, &err);
+    if (err != NULL) {
+        free_otps_gslist (otps, g_slist_length (otps));
+        import_result_free (result);
+        g_task_return_error (task, err);
         return;
     }
 
-    GError *err = NULL;
-    GSList *otps = NULL;
-    guint qr_invalid = 0;
-    guint qr_batch_size = 0;
-    guint qr_batch_index = 0;
-    if (g_strcmp0 (import_formats[fmt_idx].action_name,
-                   GOOGLE_FILE_ACTION_NAME) == 0) {
-        gchar *uri = qrcode_parse_image_file (self->selected_file, &err);
-        if (uri != NULL) {
-            if (g_str_has_prefix (uri, "otpauth-migration://"))
-                otps = google_migration_decode (uri, &qr_invalid,
-                                                &qr_batch_size, &qr_batch_index,
-                                                &err);
-            else
-                set_otps_from_uris (uri, &otps);
-            sensitive_g_free (uri);
-            if (otps == NULL && err == NULL)
-                g_set_error (&err, generic_error_gquark (), GENERIC_ERRCODE,
-                             "QR code contains no valid OTP token.");
-        }
+    guint total = g_slist_length (otps);
+    guint done = 0;
+    for (GSList *l = otps; l != NULL && !g_cancellable_is_cancelled (cancellable); l = l->next) {
+        if (done % IMPORT_PROGRESS_STEP == 0)
+            post_progress (task, IMPORT_STAGE_VALIDATE, done, total);
+        db_import_batch_add (result->batch, l->data);
+        done++;
+    }
+    free_otps_gslist (otps, total);
+
+    if (g_task_return_error_if_cancelled (task)) {
+        import_result_free (result);
+        return;
+    }
+    g_task_return_pointer (task, result, import_result_free);
+}
+
+static void
+show_error (ImportDialog *self,
+            const gchar  *message)
+{
+    set_busy (self, FALSE);
+    gtk_label_set_text (GTK_LABEL (self->error_label), message);
+    gtk_widget_set_visible (self->error_label, TRUE);
+}
+
+static void
+finish_import (ImportDialog *self,
+               gboolean      saved)
+{
+    g_autoptr (GtkWidget) parent = g_weak_ref_get (&self->parent_ref);
+    if (saved)
+        adw_dialog_close (ADW_DIALOG (self));
+    /* The window shares the dialog's lifetime only while it is open. */
+    if (parent != NULL && self->callback != NULL)
+        self->callback (saved ? &self->summary : NULL, self->callback_data);
+}
+
+static void
+on_import_committed (DatabaseData *db_data,
+                     const GError *error,
+                     gpointer      user_data)
+{
+    (void) db_data;
+    ImportDialog *self = IMPORT_DIALOG (user_data);
+
+    if (error != NULL) {
+        show_error (self, error->message);
+        /* The queue rolled the tokens back; the window must drop them too. */
+        finish_import (self, FALSE);
     } else {
-        otps = get_data_from_provider (import_formats[fmt_idx].action_name,
-                                       self->selected_file,
-                                       self->import_password,
-                                       self->db_data->max_file_size_from_memlock,
-                                       (gsize) file_size,
-                                       &err);
+        finish_import (self, TRUE);
     }
+    g_object_unref (self);
+}
 
-    if (err != NULL)
-    {
-        gtk_label_set_text (GTK_LABEL (self->error_label), err->message);
-        gtk_widget_set_visible (self->error_label, TRUE);
+static void
+on_import_ready (GObject      *source,
+                 GAsyncResult *res,
+                 gpointer      user_data)
+{
+    (void) user_data;
+    ImportDialog *self = IMPORT_DIALOG (source);
+    GError *err = NULL;
+    ImportResult *result = g_task_propagate_pointer (G_TASK (res), &err);
+
+    if (self->import_task != G_TASK (res)) {
+        // Cancelled: the dialog has already moved on.
+        g_clear_error (&err);
+        if (result != NULL)
+            import_result_free (result);
+        return;
+    }
+    self->import_task = NULL;
+    g_clear_object (&self->cancellable);
+
+    if (err != NULL) {
+        show_error (self, err->message);
         g_clear_error (&err);
         return;
     }
 
-    ImportSummary summary = {0};
-    summary.batch_size = qr_batch_size;
-    summary.batch_index = qr_batch_index;
-    if (otps != NULL)
+    self->summary = (ImportSummary) {0};
+    self->summary.batch_size = result->qr_batch_size;
+    self->summary.batch_index = result->qr_batch_index;
+
+    guint qr_invalid = result->qr_invalid;
+    if (db_import_batch_get_n_tokens (result->batch) == 0) {
+        // Nothing valid: no transaction, just the report.
+        self->summary.skipped_invalid = db_import_batch_get_n_invalid (result->batch) + qr_invalid;
+        self->summary.skipped = self->summary.skipped_invalid;
+        import_result_free (result);
+        finish_import (self, TRUE);
+        return;
+    }
+
+    GApplication *default_app = g_application_get_default ();
+    OTPClientApplication *app = OTPCLIENT_IS_APPLICATION (default_app)
+        ? OTPCLIENT_APPLICATION (default_app)
+        : NULL;
+    if (app == NULL || otpclient_application_get_app_locked (app) ||
+        otpclient_application_get_db_data (app) != self->db_data)
     {
-        GApplication *default_app = g_application_get_default ();
-        OTPClientApplication *app = OTPCLIENT_IS_APPLICATION (default_app)
-            ? OTPCLIENT_APPLICATION (default_app)
-            : NULL;
-        if (app == NULL || otpclient_application_get_app_locked (app) ||
-            otpclient_application_get_db_data (app) != self->db_data)
-        {
-            gtk_label_set_text (GTK_LABEL (self->error_label),
-                                _("The active database changed. Reopen this dialog before importing."));
-            gtk_widget_set_visible (self->error_label, TRUE);
-            free_otps_gslist (otps, g_slist_length (otps));
-            return;
-        }
+        show_error (self, _("The active database changed. Reopen this dialog before importing."));
+        import_result_free (result);
+        return;
+    }
 
-        OtpImportReport report = {0, 0, qr_invalid};
-        db_import_otps (self->db_data, otps, &report, &err);
-        if (err != NULL)
-        {
-            gtk_label_set_text (GTK_LABEL (self->error_label), err->message);
-            gtk_widget_set_visible (self->error_label, TRUE);
-            g_clear_error (&err);
-            /* update_db has already consumed data_to_add AND rolled
-             * in_memory_json_data back to disk state, so no extra cleanup
-             * is needed here beyond the otps list (parsed but not committed). */
-            free_otps_gslist (otps, g_slist_length (otps));
-            return;
-        }
+    show_stage (self, IMPORT_STAGE_SAVE, 0, 0);
+    OtpImportReport report = {0, 0, 0};
+    DbImportContext ctx = { self->db_data, result->batch, &report };
+    if (!db_commit_async (self->db_data, db_import_batch_mutation, &ctx,
+                          on_import_committed, g_object_ref (self), &err))
+    {
+        show_error (self, err->message);
+        g_clear_error (&err);
+        import_result_free (result);
+        g_object_unref (self);
+        return;
+    }
+    import_result_free (result);
+
+    // The mutation ran synchronously; the callback fires once it is on disk.
+    self->summary.added = report.added;
+    self->summary.skipped_duplicates = report.skipped_duplicates;
+    self->summary.skipped_invalid = report.skipped_invalid + qr_invalid;
+    self->summary.skipped = self->summary.skipped_duplicates + self->summary.skipped_invalid;
+}
+
+static void
+cancel_import (ImportDialog *self)
+{
+    if (self->import_task == NULL)
+        return;
+    g_cancellable_cancel (self->cancellable);
+    g_clear_object (&self->cancellable);
+    self->import_task = NULL;
+    set_busy (self, FALSE);
+}
+
+static void
+on_cancel_clicked (GtkButton    *button,
+                   ImportDialog *self)
+{
+    (void) button;
+    cancel_import (self);
+}
+
+static void
+on_dialog_closed (AdwDialog *dialog,
+                  gpointer   user_data)
+{
+    (void) user_data;
+    cancel_import (IMPORT_DIALOG (dialog));
+}
 
-        summary.added = report.added;
-        summary.skipped_duplicates = report.skipped_duplicates;
-        summary.skipped_invalid = report.skipped_invalid;
-        summary.skipped = report.skipped_duplicates + report.skipped_invalid;
+static void
+do_import (ImportDialog *self)
+{
+    guint fmt_idx = adw_combo_row_get_selected (ADW_COMBO_ROW (self->format_combo));
+    if (fmt_idx >= N_IMPORT_FORMATS || self->import_task != NULL)
+        return;
 
-        guint list_len = g_slist_length (otps);
-        free_otps_gslist (otps, list_len);
+    ImportJob *job = g_new0 (ImportJob, 1);
+    if (gtk_widget_get_visible (self->password_row)) {
+        const gchar *text = gtk_editable_get_text (GTK_EDITABLE (self->password_row));
+        gsize len = strlen (text);
+        job->password = gcry_calloc_secure (len + 1, 1);
+        if (job->password == NULL) {
+            wipe_password_row (self->password_row);
+            import_job_free (job);
+            show_error (self, _("Secure memory is exhausted"));
+            return;
+        }
+        memcpy (job->password, text, len);
+        wipe_password_row (self->password_row);
     }
 
-    adw_dialog_close (ADW_DIALOG (self));
+    goffset file_size = get_file_size (self->selected_file);
+    if (file_size <= 0) {
+        import_job_free (job);
+        show_error (self, _("Selected file is empty or no longer exists."));
+        return;
+    }
 
-    if (self->callback != NULL)
-        self->callback (&summary, self->callback_data);
+    job->action_name = import_formats[fmt_idx].action_name;
+    job->path = g_strdup (self->selected_file);
+    job->max_file_size_from_memlock = self->db_data->max_file_size_from_memlock;
+    job->file_size = (gsize) file_size;
+
+    self->running_action = import_formats[fmt_idx].action_name;
+    self->running_encrypted = import_formats[fmt_idx].needs_password;
+    self->cancellable = g_cancellable_new ();
+    GTask *task = g_task_new (self, self->cancellable, on_import_ready, NULL);
+    g_task_set_source_tag (task, do_import);
+    g_task_set_task_data (task, job, import_job_free);
+    self->import_task = task;
+
+    set_busy (self, TRUE);
+    gtk_progress_bar_set_fraction (GTK_PROGRESS_BAR (self->progress_bar), 0.0);
+    show_stage (self, IMPORT_STAGE_DECODE, 0, 0);
+    g_task_run_in_thread (task, import_thread);
+    g_object_unref (task);
 }
 
 static void
@@ -262,10 +545,8 @@ import_dialog_finalize (GObject *object)
     wipe_password_row (self->password_row);
     g_free (self->selected_file);
     g_clear_pointer (&self->db_data, database_data_free);
-    if (self->import_password != NULL) {
-        explicit_bzero (self->import_password, strlen (self->import_password));
-        gcry_free (self->import_password);
-    }
+    g_clear_object (&self->cancellable);
+    g_weak_ref_clear (&self->parent_ref);
     G_OBJECT_CLASS (import_dialog_parent_class)->finalize (object);
 }
 
@@ -296,6 +577,7 @@ import_dialog_new (DatabaseData   *db_data,
 
     self->db_data = database_data_ref (db_data);
     self->parent_widget = parent;
+    g_weak_ref_init (&self->parent_ref, parent);
     self->callback = callback;
     self->callback_data = user_data;
 
@@ -350,6 +632,24 @@ import_dialog_new (DatabaseData   *db_data,
     g_signal_connect (self->import_button, "clicked", G_CALLBACK (on_import_clicked), self);
     gtk_box_append (GTK_BOX (box), self->import_button);
 
+    /* Progress, shown while an import runs */
+    self->progress_box = gtk_box_new (GTK_ORIENTATION_VERTICAL, 6);
+    self->progress_label = gtk_label_new (NULL);
+    gtk_widget_add_css_class (self->progress_label, "dim-label");
+    gtk_box_append (GTK_BOX (self->progress_box), self->progress_label);
+    self->progress_bar = gtk_progress_bar_new ();
+    gtk_progress_bar_set_pulse_step (GTK_PROGRESS_BAR (self->progress_bar), 0.2);
+    gtk_box_append (GTK_BOX (self->progress_box), self->progress_bar);
+    self->cancel_button = gtk_button_new_with_label (_("Cancel"));
+    gtk_widget_add_css_class (self->cancel_button, "pill");
+    gtk_widget_set_halign (self->cancel_button, GTK_ALIGN_CENTER);
+    g_signal_connect (self->cancel_button, "clicked", G_CALLBACK (on_cancel_clicked), self);
+    gtk_box_append (GTK_BOX (self->progress_box), self->cancel_button);
+    gtk_widget_set_visible (self->progress_box, FALSE);
+    gtk_box_append (GTK_BOX (box), self->progress_box);
+
+    g_signal_connect (self, "closed", G_CALLBACK (on_dialog_closed), NULL);
+
     GtkWidget *scrolled = gtk_scrolled_window_new ();
     gtk_scrolled_window_set_policy (GTK_SCROLLED_WINDOW (scrolled),
                                     GTK_POLICY_NEVER, GTK_POLICY_AUTOMATIC);
@@ -18,6 +18,8 @@ typedef struct {
     guint batch_index; /* zero-based index of the imported batch */
 } ImportSummary;
 
+/* summary is NULL when saving the imported tokens failed and the database
+ * was rolled back. */
 typedef void (*ImportCallback) (const ImportSummary *summary, gpointer user_data);
 
 ImportDialog *import_dialog_new (DatabaseData   *db_data,
@@ -27,9 +27,9 @@ static const struct {
     gint32 memcost;   /* KiB */
     gint32 parallelism;
 } kdf_presets[] = {
-    { 3, 131072, 2 },   /* Standard  - 128 MiB */
-    { 5, 262144, 4 },   /* Strong    - 256 MiB */
-    { 8, 524288, 4 },   /* Paranoid  - 512 MiB */
+    { ARGON2ID_STANDARD_ITER, ARGON2ID_STANDARD_MC, ARGON2ID_STANDARD_PARAL },   /* Standard  - 128 MiB */
+    { ARGON2ID_STRONG_ITER,   ARGON2ID_STRONG_MC,   ARGON2ID_STRONG_PARAL },     /* Strong    - 256 MiB */
+    { ARGON2ID_PARANOID_ITER, ARGON2ID_PARANOID_MC, ARGON2ID_PARANOID_PARAL },   /* Paranoid  - 512 MiB */
 };
 #define KDF_PRESET_CUSTOM 3
 
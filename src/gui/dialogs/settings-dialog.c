@@ -25,6 +25,7 @@ struct _SettingsDialog
     GtkWidget *secret_service_switch;
     GtkWidget *search_provider_switch;
     GtkWidget *search_provider_keyword_entry;
+    GtkWidget *search_provider_keep_switch;
     GtkWidget *clipboard_clear_combo;
     GtkWidget *hide_otps_switch;
 #ifdef ENABLE_MINIMIZE_TO_TRAY
@@ -209,6 +210,18 @@ on_search_provider_toggled (GObject        *obj,
     otpclient_application_set_search_provider_enabled (self->app, active);
     if (self->search_provider_keyword_entry != NULL)
         gtk_widget_set_sensitive (self->search_provider_keyword_entry, active);
+    if (self->search_provider_keep_switch != NULL)
+        gtk_widget_set_sensitive (self->search_provider_keep_switch, active);
+}
+
+static void
+on_search_provider_keep_toggled (GObject        *obj,
+                                 GParamSpec     *pspec,
+                                 SettingsDialog *self)
+{
+    (void) pspec;
+    otpclient_application_set_search_provider_keep_unlocked (self->app,
+                                                             adw_switch_row_get_active (ADW_SWITCH_ROW (obj)));
 }
 
 static void
@@ -653,6 +666,18 @@ settings_dialog_new (OTPClientApplication *app)
                       G_CALLBACK (on_search_provider_keyword_changed), self);
     adw_preferences_group_add (integration_group, self->search_provider_keyword_entry);
 
+    self->search_provider_keep_switch = adw_switch_row_new ();
+    adw_preferences_row_set_title (ADW_PREFERENCES_ROW (self->search_provider_keep_switch),
+                                    _("Keep Search Results Ready"));
+    adw_action_row_set_subtitle (ADW_ACTION_ROW (self->search_provider_keep_switch),
+                                 _("Codes for recently used accounts appear instantly, at the cost of keeping them unlocked in memory for up to 10 minutes"));
+    adw_switch_row_set_active (ADW_SWITCH_ROW (self->search_provider_keep_switch),
+                               otpclient_application_get_search_provider_keep_unlocked (app));
+    gtk_widget_set_sensitive (self->search_provider_keep_switch, sp_enabled);
+    g_signal_connect (self->search_provider_keep_switch, "notify::active",
+                      G_CALLBACK (on_search_provider_keep_toggled), self);
+    adw_preferences_group_add (integration_group, self->search_provider_keep_switch);
+
 #ifdef ENABLE_MINIMIZE_TO_TRAY
     self->minimize_to_tray_switch = adw_switch_row_new ();
     adw_preferences_row_set_title (ADW_PREFERENCES_ROW (self->minimize_to_tray_switch),
@@ -228,6 +228,11 @@ on_prepare_for_sleep (GDBusConnection *connection,
     /* Respect Auto-Lock here too (see on_screensaver_signal / #460). */
     if (preparing && otpclient_application_get_auto_lock (app))
         lock_app_lock (app);
+
+    /* Codes rotated while asleep but the refresh timeout did not run. */
+    GtkWindow *win = gtk_application_get_active_window (GTK_APPLICATION (app));
+    if (!preparing && win != NULL && OTPCLIENT_IS_WINDOW (win))
+        otpclient_window_resync_otp_timer (OTPCLIENT_WINDOW (win));
 }
 
 static gboolean
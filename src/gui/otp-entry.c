@@ -1,8 +1,7 @@
 #include <glib/gi18n.h>
 #include <gcrypt.h>
-#include <cotp.h>
-#include <limits.h>
 #include "common.h"
+#include "otp-context.h"
 #include "otp-entry.h"
 #include "otp-validation.h"
 
@@ -40,6 +39,19 @@ struct _OTPEntry
      * session, then the next rotation hides. Reset on the FALSE->TRUE
      * transition of `revealed` and on explicit re-click. */
     gboolean roll_consumed;
+
+    /* Demand-driven code cache: otp_value is only computed when a row shows
+     * it or a copy needs it. otp_step is the TOTP time step or HOTP counter
+     * the cached value belongs to; otp_valid is FALSE until the first
+     * computation. view_count counts the list rows bound to this entry. */
+    gboolean otp_valid;
+    guint64  otp_step;
+    guint    view_count;
+
+    /* Decoded key and HMAC pad states, built with the first code and wiped
+     * with the entry (entries are dropped when the app locks). NULL after a
+     * change to the secret or the issuer (Steam). */
+    OtpContext *otp_ctx;
 };
 
 static gchar *
@@ -70,14 +82,20 @@ static GParamSpec *properties[N_PROPS];
 
 G_DEFINE_FINAL_TYPE (OTPEntry, otp_entry, G_TYPE_OBJECT)
 
-static gint
-get_algo_int (const gchar *algo)
+static gboolean
+is_steam (OTPEntry *self)
+{
+    return self->issuer != NULL && g_ascii_strcasecmp (self->issuer, "steam") == 0;
+}
+
+static OtpContext *
+ensure_context (OTPEntry *self)
 {
-    if (g_strcmp0 (algo, "SHA256") == 0)
-        return COTP_SHA256;
-    if (g_strcmp0 (algo, "SHA512") == 0)
-        return COTP_SHA512;
-    return COTP_SHA1;
+    if (self->otp_ctx == NULL && self->secret != NULL && self->secret[0] != '\0')
+        self->otp_ctx = otp_context_new (self->secret,
+                                         is_steam (self) ? "SHA1" : self->algorithm,
+                                         NULL);
+    return self->otp_ctx;
 }
 
 static void
@@ -106,6 +124,7 @@ otp_entry_finalize (GObject *object)
         gcry_free (self->secret);
         self->secret = NULL;
     }
+    g_clear_pointer (&self->otp_ctx, otp_context_free);
 
     g_clear_pointer (&self->db_name, g_free);
     g_clear_pointer (&self->group, g_free);
@@ -189,6 +208,7 @@ otp_entry_set_property (GObject      *object,
             self->issuer = g_value_dup_string (value);
             g_free (self->issuer_lower);
             self->issuer_lower = strdown_or_empty (self->issuer);
+            g_clear_pointer (&self->otp_ctx, otp_context_free);
             break;
         case PROP_OTP_VALUE:
             if (self->otp_value != NULL)
@@ -216,6 +236,7 @@ otp_entry_set_property (GObject      *object,
             if (self->secret != NULL)
                 gcry_free (self->secret);
             self->secret = secure_strdup (g_value_get_string (value));
+            g_clear_pointer (&self->otp_ctx, otp_context_free);
             break;
         case PROP_DB_NAME:
             g_free (self->db_name);
@@ -411,15 +432,22 @@ otp_entry_set_issuer (OTPEntry    *self,
     self->issuer = g_strdup (issuer);
     g_free (self->issuer_lower);
     self->issuer_lower = strdown_or_empty (self->issuer);
+    g_clear_pointer (&self->otp_ctx, otp_context_free);
     g_object_notify_by_pspec (G_OBJECT (self), properties[PROP_ISSUER]);
 }
 
-void
-otp_entry_set_otp_value (OTPEntry    *self,
-                         const gchar *otp_value)
+static guint64
+current_step (OTPEntry *self)
 {
-    g_return_if_fail (OTP_IS_ENTRY (self));
+    if (g_ascii_strcasecmp (self->otp_type, "TOTP") == 0)
+        return (guint64) (g_get_real_time () / G_USEC_PER_SEC / self->period);
+    return self->counter;
+}
 
+static void
+store_otp_value (OTPEntry    *self,
+                 const gchar *otp_value)
+{
     if (g_strcmp0 (self->otp_value, otp_value) == 0)
         return;
 
@@ -429,6 +457,20 @@ otp_entry_set_otp_value (OTPEntry    *self,
     g_object_notify_by_pspec (G_OBJECT (self), properties[PROP_OTP_VALUE]);
 }
 
+void
+otp_entry_set_otp_value (OTPEntry    *self,
+                         const gchar *otp_value)
+{
+    g_return_if_fail (OTP_IS_ENTRY (self));
+
+    /* A value set from outside (e.g. blanked by hide-and-unselect) stands
+     * for the current step, as it did when every code was recomputed on
+     * rotation: the next rotation or HOTP advance replaces it. */
+    self->otp_valid = TRUE;
+    self->otp_step = current_step (self);
+    store_otp_value (self, otp_value);
+}
+
 void
 otp_entry_set_counter (OTPEntry *self,
                        guint64   counter)
@@ -450,35 +492,123 @@ otp_entry_update_otp (OTPEntry *self)
     if (self->secret == NULL || self->secret[0] == '\0')
         return;
 
-    cotp_error_t err;
-    gint algo = get_algo_int (self->algorithm);
+    OtpContext *ctx = ensure_context (self);
     gchar *otp = NULL;
+    guint64 step = self->counter;
 
     if (g_ascii_strcasecmp (self->otp_type, "TOTP") == 0)
     {
-        if (self->issuer != NULL &&
-            g_ascii_strcasecmp (self->issuer, "steam") == 0)
-            otp = get_steam_totp (self->secret, self->period, &err);
-        else
-            otp = get_totp (self->secret, self->digits, self->period, algo, &err);
+        /* Generate at the same instant the cache step is taken from, so a
+         * code computed across a boundary is not filed under the old step. */
+        gint64 now = g_get_real_time () / G_USEC_PER_SEC;
+        step = (guint64) (now / self->period);
+        if (ctx != NULL)
+        {
+            if (is_steam (self))
+                otp = otp_context_steam_at (ctx, now, self->period);
+            else
+                otp = otp_context_totp_at (ctx, now, self->period, self->digits);
+        }
     }
-    else
+    else if (ctx != NULL)
     {
-        otp = get_hotp (self->secret, self->counter, self->digits, algo, &err);
+        otp = otp_context_hotp (ctx, self->counter, self->digits);
     }
 
-    if (otp != NULL && err == NO_ERROR)
+    /* Mark the cache first: notify::otp-value re-renders bound rows, which
+     * ask for the code again. */
+    self->otp_valid = TRUE;
+    self->otp_step = step;
+    if (otp != NULL)
+        store_otp_value (self, otp);
+    else
+        store_otp_value (self, _("Error"));
+    sensitive_secure_free (otp);
+}
+
+void
+otp_entry_update_batch (OTPEntry **entries,
+                        guint      n_entries)
+{
+    if (n_entries == 0)
+        return;
+
+    /* One timestamp for the whole batch: entries sharing a period get the
+     * same step even if the clock ticks over while the codes are made. */
+    gint64 now = g_get_real_time () / G_USEC_PER_SEC;
+    g_autofree OtpBatchItem *items = g_new0 (OtpBatchItem, n_entries);
+    g_autofree guint64 *steps = g_new0 (guint64, n_entries);
+    for (guint i = 0; i < n_entries; i++)
     {
-        otp_entry_set_otp_value (self, otp);
-        sensitive_free (otp);
+        OTPEntry *self = entries[i];
+        if (self->secret == NULL || self->secret[0] == '\0')
+            continue;
+
+        if (g_ascii_strcasecmp (self->otp_type, "TOTP") == 0)
+            steps[i] = (guint64) (now / self->period);
+        else
+            steps[i] = self->counter;
+        items[i].counter = steps[i];
+        items[i].digits = is_steam (self) ? OTP_CONTEXT_STEAM : self->digits;
+        if (is_steam (self) || self->digits > 0)
+            items[i].ctx = ensure_context (self);
     }
-    else
+
+    otp_context_generate_batch (items, n_entries);
+
+    // Store only once every code is ready, as otp_entry_update_otp would.
+    for (guint i = 0; i < n_entries; i++)
     {
-        otp_entry_set_otp_value (self, _("Error"));
-        sensitive_free (otp);
+        OTPEntry *self = entries[i];
+        if (self->secret == NULL || self->secret[0] == '\0')
+            continue;
+
+        self->otp_valid = TRUE;
+        self->otp_step = steps[i];
+        store_otp_value (self, items[i].code != NULL ? items[i].code : _("Error"));
+        sensitive_secure_free (items[i].code);
     }
 }
 
+const gchar *
+otp_entry_ensure_otp (OTPEntry *self)
+{
+    g_return_val_if_fail (OTP_IS_ENTRY (self), NULL);
+
+    if (!otp_entry_is_current (self))
+        otp_entry_update_otp (self);
+    return self->otp_value;
+}
+
+gboolean
+otp_entry_is_current (OTPEntry *self)
+{
+    g_return_val_if_fail (OTP_IS_ENTRY (self), FALSE);
+    return self->otp_valid && self->otp_step == current_step (self);
+}
+
+void
+otp_entry_add_view (OTPEntry *self)
+{
+    g_return_if_fail (OTP_IS_ENTRY (self));
+    self->view_count++;
+}
+
+void
+otp_entry_remove_view (OTPEntry *self)
+{
+    g_return_if_fail (OTP_IS_ENTRY (self));
+    g_return_if_fail (self->view_count > 0);
+    self->view_count--;
+}
+
+gboolean
+otp_entry_has_view (OTPEntry *self)
+{
+    g_return_val_if_fail (OTP_IS_ENTRY (self), FALSE);
+    return self->view_count > 0;
+}
+
 gchar *
 otp_entry_get_next_otp (OTPEntry *self)
 {
@@ -490,28 +620,16 @@ otp_entry_get_next_otp (OTPEntry *self)
     if (g_ascii_strcasecmp (self->otp_type, "TOTP") != 0)
         return NULL;
 
-    cotp_error_t err;
-    gint algo = get_algo_int (self->algorithm);
+    OtpContext *ctx = ensure_context (self);
+    if (ctx == NULL)
+        return NULL;
 
     gint64 now = g_get_real_time () / G_USEC_PER_SEC;
     gint64 next_step_time = now + self->period - (now % self->period);
 
-    if (next_step_time > LONG_MAX)
-        return NULL;
-
-    gchar *otp = NULL;
-    if (self->issuer != NULL &&
-        g_ascii_strcasecmp (self->issuer, "steam") == 0)
-        otp = get_steam_totp_at (self->secret, (long) next_step_time,
-                                 self->period, &err);
-    else
-        otp = get_totp_at (self->secret, (long) next_step_time,
-                           self->digits, self->period, algo, &err);
-    if (otp != NULL && err == NO_ERROR)
-        return otp;
-
-    sensitive_free (otp);
-    return NULL;
+    if (is_steam (self))
+        return otp_context_steam_at (ctx, next_step_time, self->period);
+    return otp_context_totp_at (ctx, next_step_time, self->period, self->digits);
 }
 
 gboolean
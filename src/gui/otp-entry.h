@@ -51,6 +51,28 @@ const gchar *otp_entry_get_group_lower   (OTPEntry *self);
 
 void         otp_entry_update_otp   (OTPEntry *self);
 
+/* Same as calling otp_entry_update_otp on each entry, with all the codes
+ * generated in one pass before any otp-value notification goes out. Used
+ * when a period boundary rolls many visible entries over at once. */
+void         otp_entry_update_batch (OTPEntry   **entries,
+                                     guint        n_entries);
+
+/* Returns the current code, computing it only when the cached one is missing
+ * or belongs to an earlier TOTP step / HOTP counter. Rows call this when they
+ * show the value, so codes are never generated for rows nobody looks at. */
+const gchar *otp_entry_ensure_otp   (OTPEntry *self);
+
+/* TRUE while the cached code still belongs to the current step. */
+gboolean     otp_entry_is_current   (OTPEntry *self);
+
+/* Bound-row bookkeeping: the value column adds a view on bind and removes it
+ * on unbind, so a TOTP rotation only recomputes entries that are on screen. */
+void         otp_entry_add_view     (OTPEntry *self);
+void         otp_entry_remove_view  (OTPEntry *self);
+gboolean     otp_entry_has_view     (OTPEntry *self);
+
+/* The code of the next TOTP step, in secure memory: release it with
+ * sensitive_secure_free. NULL for HOTP. */
 gchar       *otp_entry_get_next_otp (OTPEntry *self);
 
 /* Reveal/hide state controls whether the OTP value column shows the live
@@ -0,0 +1,164 @@
+#include <glib.h>
+#include "otp-entry.h"
+#include "otp-rotation.h"
+
+typedef struct {
+    guint32 period;
+    gint64 next_boundary;       // unix second the current codes expire
+    GPtrArray *entries;         // OTPEntry, owned
+} RotationBucket;
+
+struct _OTPRotationWheel {
+    GPtrArray *buckets;         // RotationBucket, a handful at most
+};
+
+
+static gint64
+boundary_after (gint64  now,
+                guint32 period)
+{
+    return now - (now % period) + period;
+}
+
+
+static void
+rotation_bucket_free (gpointer data)
+{
+    RotationBucket *bucket = data;
+    g_ptr_array_unref (bucket->entries);
+    g_free (bucket);
+}
+
+
+OTPRotationWheel *
+otp_rotation_wheel_new (void)
+{
+    OTPRotationWheel *wheel = g_new0 (OTPRotationWheel, 1);
+    wheel->buckets = g_ptr_array_new_with_free_func (rotation_bucket_free);
+    return wheel;
+}
+
+
+void
+otp_rotation_wheel_free (OTPRotationWheel *wheel)
+{
+    if (wheel == NULL)
+        return;
+    g_ptr_array_unref (wheel->buckets);
+    g_free (wheel);
+}
+
+
+void
+otp_rotation_wheel_clear (OTPRotationWheel *wheel)
+{
+    g_return_if_fail (wheel != NULL);
+    g_ptr_array_set_size (wheel->buckets, 0);
+}
+
+
+static RotationBucket *
+bucket_for_period (OTPRotationWheel *wheel,
+                   guint32           period,
+                   gint64            now)
+{
+    for (guint i = 0; i < wheel->buckets->len; i++) {
+        RotationBucket *bucket = g_ptr_array_index (wheel->buckets, i);
+        if (bucket->period == period)
+            return bucket;
+    }
+    RotationBucket *bucket = g_new0 (RotationBucket, 1);
+    bucket->period = period;
+    bucket->next_boundary = boundary_after (now, period);
+    bucket->entries = g_ptr_array_new_with_free_func (g_object_unref);
+    g_ptr_array_add (wheel->buckets, bucket);
+    return bucket;
+}
+
+
+void
+otp_rotation_wheel_rebuild (OTPRotationWheel *wheel,
+                            GListModel       *model,
+                            gint64            now)
+{
+    g_return_if_fail (wheel != NULL);
+
+    otp_rotation_wheel_clear (wheel);
+    if (model == NULL)
+        return;
+
+    guint n = g_list_model_get_n_items (model);
+    for (guint i = 0; i < n; i++) {
+        g_autoptr (OTPEntry) entry = g_list_model_get_item (model, i);
+        if (entry != NULL)
+            otp_rotation_wheel_add (wheel, entry, now);
+    }
+}
+
+
+gboolean
+otp_rotation_wheel_add (OTPRotationWheel *wheel,
+                        OTPEntry         *entry,
+                        gint64            now)
+{
+    g_return_val_if_fail (wheel != NULL, FALSE);
+    g_return_val_if_fail (OTP_IS_ENTRY (entry), FALSE);
+
+    const gchar *type = otp_entry_get_otp_type (entry);
+    guint32 period = otp_entry_get_period (entry);
+    if (type == NULL || g_ascii_strcasecmp (type, "TOTP") != 0 || period == 0)
+        return FALSE;
+
+    g_ptr_array_add (bucket_for_period (wheel, period, now)->entries, g_object_ref (entry));
+    return TRUE;
+}
+
+
+guint
+otp_rotation_wheel_get_n_entries (OTPRotationWheel *wheel)
+{
+    g_return_val_if_fail (wheel != NULL, 0);
+
+    guint n = 0;
+    for (guint i = 0; i < wheel->buckets->len; i++)
+        n += ((RotationBucket *) g_ptr_array_index (wheel->buckets, i))->entries->len;
+    return n;
+}
+
+
+gint64
+otp_rotation_wheel_next_boundary (OTPRotationWheel *wheel)
+{
+    g_return_val_if_fail (wheel != NULL, G_MAXINT64);
+
+    gint64 next = G_MAXINT64;
+    for (guint i = 0; i < wheel->buckets->len; i++) {
+        RotationBucket *bucket = g_ptr_array_index (wheel->buckets, i);
+        next = MIN (next, bucket->next_boundary);
+    }
+    return next;
+}
+
+
+GPtrArray *
+otp_rotation_wheel_advance (OTPRotationWheel *wheel,
+                            gint64            now)
+{
+    g_return_val_if_fail (wheel != NULL, NULL);
+
+    GPtrArray *due = NULL;
+    for (guint i = 0; i < wheel->buckets->len; i++) {
+        RotationBucket *bucket = g_ptr_array_index (wheel->buckets, i);
+        gboolean rolled = now >= bucket->next_boundary;
+        gboolean went_back = now < bucket->next_boundary - bucket->period;
+        if (!rolled && !went_back)
+            continue;
+
+        bucket->next_boundary = boundary_after (now, bucket->period);
+        if (due == NULL)
+            due = g_ptr_array_new_with_free_func (g_object_unref);
+        for (guint j = 0; j < bucket->entries->len; j++)
+            g_ptr_array_add (due, g_object_ref (g_ptr_array_index (bucket->entries, j)));
+    }
+    return due;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <gio/gio.h>
+#include "otp-entry.h"
+
+G_BEGIN_DECLS
+
+/* TOTP entries bucketed by period. Each bucket remembers the wall-clock
+ * second its codes next rotate, so the window can sleep until the earliest
+ * boundary and then refresh only the entries whose period rolled, instead of
+ * walking the whole store every second. The wheel holds a reference on every
+ * entry it tracks; rebuild it when the store changes. */
+
+typedef struct _OTPRotationWheel OTPRotationWheel;
+
+OTPRotationWheel *otp_rotation_wheel_new           (void);
+
+void              otp_rotation_wheel_free          (OTPRotationWheel *wheel);
+
+void              otp_rotation_wheel_clear         (OTPRotationWheel *wheel);
+
+/* Tracks every TOTP OTPEntry in model, replacing what was tracked before.
+ * The codes are assumed current as of now (unix seconds). */
+void              otp_rotation_wheel_rebuild       (OTPRotationWheel *wheel,
+                                                    GListModel       *model,
+                                                    gint64            now);
+
+/* Tracks one more entry; HOTP entries are ignored (returns FALSE). */
+gboolean          otp_rotation_wheel_add           (OTPRotationWheel *wheel,
+                                                    OTPEntry         *entry,
+                                                    gint64            now);
+
+guint             otp_rotation_wheel_get_n_entries (OTPRotationWheel *wheel);
+
+/* Unix second of the earliest pending rotation, G_MAXINT64 when empty. */
+gint64            otp_rotation_wheel_next_boundary (OTPRotationWheel *wheel);
+
+/* Returns the entries whose code changed since the last call (a new array
+ * holding a reference on each, NULL when none) and moves their buckets to the
+ * next boundary after now. A bucket is due once its boundary has passed,
+ * however long ago (a resume or a clock jump forward), and also when the
+ * clock went back before the window its codes were computed for. */
+GPtrArray        *otp_rotation_wheel_advance       (OTPRotationWheel *wheel,
+                                                    gint64            now);
+
+G_END_DECLS
@@ -0,0 +1,378 @@
+#include <glib.h>
+#include <string.h>
+#include "otp-token-model.h"
+
+typedef struct {
+    json_t *token;              // reference
+    GRefString *db_name;        // NULL for the open database
+    OTPEntry *entry;            // NULL until someone asks for the item
+} TokenRecord;
+
+struct _OTPTokenModel
+{
+    GObject parent_instance;
+
+    GArray *records;            // TokenRecord
+    guint n_live;
+    SearchIndex *index;         // shared with the window, may be NULL
+};
+
+static void otp_token_model_list_model_init (GListModelInterface *iface);
+
+G_DEFINE_FINAL_TYPE_WITH_CODE (OTPTokenModel, otp_token_model, G_TYPE_OBJECT,
+                               G_IMPLEMENT_INTERFACE (G_TYPE_LIST_MODEL, otp_token_model_list_model_init))
+
+G_DEFINE_QUARK (otp-token-model-token, otp_token_model_token)
+
+
+static OTPEntry *
+entry_from_token (json_t      *token,
+                  const gchar *db_name)
+{
+    const gchar *type = json_string_value (json_object_get (token, "type"));
+    const gchar *label = json_string_value (json_object_get (token, "label"));
+    const gchar *issuer = json_string_value (json_object_get (token, "issuer"));
+    const gchar *secret = json_string_value (json_object_get (token, "secret"));
+    const gchar *algo = json_string_value (json_object_get (token, "algo"));
+    guint32 digits = (guint32) json_integer_value (json_object_get (token, "digits"));
+    guint32 period = 30;
+    guint64 counter = 0;
+
+    if (digits < 4) digits = 6;
+
+    if (type != NULL && g_ascii_strcasecmp (type, "HOTP") == 0)
+        counter = (guint64) json_integer_value (json_object_get (token, "counter"));
+    else
+        period = (guint32) json_integer_value (json_object_get (token, "period"));
+
+    if (period < 1) period = 30;
+
+    OTPEntry *entry = otp_entry_new (label, issuer, NULL,
+                                     type ? type : "TOTP",
+                                     period, counter,
+                                     algo ? algo : "SHA1",
+                                     digits, secret);
+    const gchar *group = json_string_value (json_object_get (token, "group"));
+    if (group != NULL)
+        otp_entry_set_group (entry, group);
+    if (db_name != NULL)
+        otp_entry_set_db_name (entry, db_name);
+    g_object_set_qdata_full (G_OBJECT (entry), otp_token_model_token_quark (),
+                             json_incref (token), (GDestroyNotify) json_decref);
+    /* No code yet: rows compute it when they are bound. */
+    return entry;
+}
+
+
+static void
+record_clear (OTPTokenModel *self,
+              TokenRecord   *record)
+{
+    if (record->entry != NULL) {
+        g_object_unref (record->entry);
+        record->entry = NULL;
+        self->n_live--;
+    }
+    g_clear_pointer (&record->db_name, g_ref_string_release);
+    if (self->index != NULL)
+        search_index_remove (self->index, record->token);
+    g_clear_pointer (&record->token, json_decref);
+}
+
+
+static void
+otp_token_model_finalize (GObject *object)
+{
+    OTPTokenModel *self = OTP_TOKEN_MODEL (object);
+
+    for (guint i = 0; i < self->records->len; i++)
+        record_clear (self, &g_array_index (self->records, TokenRecord, i));
+    g_array_unref (self->records);
+    g_clear_pointer (&self->index, search_index_unref);
+
+    G_OBJECT_CLASS (otp_token_model_parent_class)->finalize (object);
+}
+
+
+static void
+otp_token_model_class_init (OTPTokenModelClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+    object_class->finalize = otp_token_model_finalize;
+}
+
+
+static void
+otp_token_model_init (OTPTokenModel *self)
+{
+    self->records = g_array_new (FALSE, TRUE, sizeof (TokenRecord));
+}
+
+
+static GType
+otp_token_model_get_item_type (GListModel *model)
+{
+    (void) model;
+    return OTP_TYPE_ENTRY;
+}
+
+
+static guint
+otp_token_model_get_n_items (GListModel *model)
+{
+    return OTP_TOKEN_MODEL (model)->records->len;
+}
+
+
+static gpointer
+otp_token_model_get_item (GListModel *model,
+                          guint       position)
+{
+    OTPTokenModel *self = OTP_TOKEN_MODEL (model);
+
+    if (position >= self->records->len)
+        return NULL;
+
+    TokenRecord *record = &g_array_index (self->records, TokenRecord, position);
+    if (record->entry == NULL) {
+        record->entry = entry_from_token (record->token, record->db_name);
+        self->n_live++;
+    }
+    return g_object_ref (record->entry);
+}
+
+
+static void
+otp_token_model_list_model_init (GListModelInterface *iface)
+{
+    iface->get_item_type = otp_token_model_get_item_type;
+    iface->get_n_items = otp_token_model_get_n_items;
+    iface->get_item = otp_token_model_get_item;
+}
+
+
+OTPTokenModel *
+otp_token_model_new (void)
+{
+    return g_object_new (OTP_TYPE_TOKEN_MODEL, NULL);
+}
+
+
+void
+otp_token_model_sync (OTPTokenModel *self,
+                      json_t        *tokens)
+{
+    g_return_if_fail (OTP_IS_TOKEN_MODEL (self));
+
+    GArray *records = self->records;
+    guint old_n = records->len;
+    gsize new_n = json_array_size (tokens);
+
+    gsize prefix = 0;
+    while (prefix < old_n && prefix < new_n &&
+           g_array_index (records, TokenRecord, prefix).token == json_array_get (tokens, prefix))
+        prefix++;
+    gsize suffix = 0;
+    while (suffix < old_n - prefix && suffix < new_n - prefix &&
+           g_array_index (records, TokenRecord, old_n - 1 - suffix).token == json_array_get (tokens, new_n - 1 - suffix))
+        suffix++;
+
+    guint n_removed = (guint) (old_n - prefix - suffix);
+    gsize n_added = new_n - prefix - suffix;
+    if (n_removed == 0 && n_added == 0)
+        return;
+
+    /* Take the window out, then hand its records to the tokens that are
+     * still there; what is left over belonged to removed or edited tokens. */
+    TokenRecord *old = g_new (TokenRecord, MAX (n_removed, 1));
+    memcpy (old, &g_array_index (records, TokenRecord, prefix), n_removed * sizeof (TokenRecord));
+    g_array_remove_range (records, (guint) prefix, n_removed);
+
+    GHashTable *spare = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+                                               (GDestroyNotify) g_queue_free);
+    for (guint i = 0; i < n_removed; i++) {
+        GQueue *queue = g_hash_table_lookup (spare, old[i].token);
+        if (queue == NULL) {
+            queue = g_queue_new ();
+            g_hash_table_insert (spare, old[i].token, queue);
+        }
+        g_queue_push_tail (queue, GUINT_TO_POINTER (i + 1));
+    }
+
+    TokenRecord *fresh = g_new0 (TokenRecord, MAX (n_added, 1));
+    for (gsize j = 0; j < n_added; j++) {
+        json_t *token = json_array_get (tokens, prefix + j);
+        GQueue *queue = g_hash_table_lookup (spare, token);
+        guint slot = (queue != NULL) ? GPOINTER_TO_UINT (g_queue_pop_head (queue)) : 0;
+        if (slot != 0) {
+            fresh[j] = old[slot - 1];
+            old[slot - 1].token = NULL;
+        } else {
+            fresh[j].token = json_incref (token);
+            if (self->index != NULL)
+                search_index_add (self->index, token);
+        }
+    }
+    g_array_insert_vals (records, (guint) prefix, fresh, (guint) n_added);
+
+    for (guint i = 0; i < n_removed; i++) {
+        if (old[i].token != NULL)
+            record_clear (self, &old[i]);
+    }
+    g_hash_table_unref (spare);
+    g_free (fresh);
+    g_free (old);
+
+    g_list_model_items_changed (G_LIST_MODEL (self), (guint) prefix, n_removed, (guint) n_added);
+}
+
+
+void
+otp_token_model_append (OTPTokenModel *self,
+                        json_t        *tokens,
+                        const gchar   *db_name)
+{
+    g_return_if_fail (OTP_IS_TOKEN_MODEL (self));
+
+    guint position = self->records->len;
+    gsize n = json_array_size (tokens);
+    if (n == 0)
+        return;
+
+    GRefString *name = (db_name != NULL) ? g_ref_string_new_intern (db_name) : NULL;
+    for (gsize i = 0; i < n; i++) {
+        TokenRecord record = { 0 };
+        record.token = json_incref (json_array_get (tokens, i));
+        record.db_name = (name != NULL) ? g_ref_string_acquire (name) : NULL;
+        g_array_append_val (self->records, record);
+        if (self->index != NULL)
+            search_index_add (self->index, record.token);
+    }
+    if (name != NULL)
+        g_ref_string_release (name);
+
+    g_list_model_items_changed (G_LIST_MODEL (self), position, 0, (guint) n);
+}
+
+
+void
+otp_token_model_remove_all (OTPTokenModel *self)
+{
+    g_return_if_fail (OTP_IS_TOKEN_MODEL (self));
+
+    guint n = self->records->len;
+    if (n == 0)
+        return;
+
+    for (guint i = 0; i < n; i++)
+        record_clear (self, &g_array_index (self->records, TokenRecord, i));
+    g_array_set_size (self->records, 0);
+
+    g_list_model_items_changed (G_LIST_MODEL (self), 0, n, 0);
+}
+
+
+void
+otp_token_model_move (OTPTokenModel *self,
+                      guint          from,
+                      guint          to)
+{
+    g_return_if_fail (OTP_IS_TOKEN_MODEL (self));
+    g_return_if_fail (from < self->records->len && to < self->records->len);
+
+    if (from == to)
+        return;
+
+    TokenRecord record = g_array_index (self->records, TokenRecord, from);
+    g_array_remove_index (self->records, from);
+    g_list_model_items_changed (G_LIST_MODEL (self), from, 1, 0);
+    g_array_insert_val (self->records, to, record);
+    g_list_model_items_changed (G_LIST_MODEL (self), to, 0, 1);
+}
+
+
+guint
+otp_token_model_find (OTPTokenModel *self,
+                      OTPEntry      *entry)
+{
+    g_return_val_if_fail (OTP_IS_TOKEN_MODEL (self), G_MAXUINT);
+
+    if (entry == NULL)
+        return G_MAXUINT;
+    for (guint i = 0; i < self->records->len; i++) {
+        if (g_array_index (self->records, TokenRecord, i).entry == entry)
+            return i;
+    }
+    return G_MAXUINT;
+}
+
+
+GPtrArray *
+otp_token_model_get_live (OTPTokenModel *self)
+{
+    g_return_val_if_fail (OTP_IS_TOKEN_MODEL (self), NULL);
+
+    GPtrArray *live = g_ptr_array_new_full (self->n_live, g_object_unref);
+    for (guint i = 0; i < self->records->len && live->len < self->n_live; i++) {
+        OTPEntry *entry = g_array_index (self->records, TokenRecord, i).entry;
+        if (entry != NULL)
+            g_ptr_array_add (live, g_object_ref (entry));
+    }
+    return live;
+}
+
+
+void
+otp_token_model_set_search_index (OTPTokenModel *self,
+                                  SearchIndex   *index)
+{
+    g_return_if_fail (OTP_IS_TOKEN_MODEL (self));
+
+    if (self->index == index)
+        return;
+    for (guint i = 0; i < self->records->len; i++) {
+        json_t *token = g_array_index (self->records, TokenRecord, i).token;
+        if (self->index != NULL)
+            search_index_remove (self->index, token);
+        if (index != NULL)
+            search_index_add (index, token);
+    }
+    g_clear_pointer (&self->index, search_index_unref);
+    self->index = (index != NULL) ? search_index_ref (index) : NULL;
+}
+
+
+json_t *
+otp_token_model_get_entry_token (OTPEntry *entry)
+{
+    g_return_val_if_fail (OTP_IS_ENTRY (entry), NULL);
+    return g_object_get_qdata (G_OBJECT (entry), otp_token_model_token_quark ());
+}
+
+
+guint
+otp_token_model_get_n_live (OTPTokenModel *self)
+{
+    g_return_val_if_fail (OTP_IS_TOKEN_MODEL (self), 0);
+    return self->n_live;
+}
+
+
+void
+otp_token_model_trim (OTPTokenModel *self)
+{
+    g_return_if_fail (OTP_IS_TOKEN_MODEL (self));
+
+    for (guint i = 0; i < self->records->len && self->n_live > 0; i++) {
+        TokenRecord *record = &g_array_index (self->records, TokenRecord, i);
+        if (record->entry == NULL)
+            continue;
+        /* Our reference is the last one: no row, filter or timer holds the
+         * entry, so it can be rebuilt from the token when asked again. */
+        if (g_atomic_int_get (&G_OBJECT (record->entry)->ref_count) == 1 &&
+            !otp_entry_get_revealed (record->entry)) {
+            g_clear_object (&record->entry);
+            self->n_live--;
+        }
+    }
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <gio/gio.h>
+#include <jansson.h>
+#include "otp-entry.h"
+#include "search-index.h"
+
+G_BEGIN_DECLS
+
+/* GListModel of OTPEntry over an array of database tokens.
+ *
+ * Each position is a small record holding a reference on its token object;
+ * the OTPEntry for it is only built when a consumer asks for the item (a
+ * bound row, the filter, a copy) and is dropped again by
+ * otp_token_model_trim once nothing but the model holds it. Token objects
+ * are never modified in place (edits swap in a copy, see
+ * db_token_for_write), so the token pointer identifies an unchanged token
+ * and otp_token_model_sync only touches the positions that changed. */
+
+#define OTP_TYPE_TOKEN_MODEL (otp_token_model_get_type ())
+
+G_DECLARE_FINAL_TYPE (OTPTokenModel, otp_token_model, OTP, TOKEN_MODEL, GObject)
+
+OTPTokenModel *otp_token_model_new        (void);
+
+/* Brings the model in line with tokens with a single items-changed over the
+ * window between the longest common prefix and suffix. Records of tokens
+ * that only moved inside that window keep their entry. */
+void           otp_token_model_sync       (OTPTokenModel *self,
+                                           json_t        *tokens);
+
+/* Appends every token of another database; entries show db_name. */
+void           otp_token_model_append     (OTPTokenModel *self,
+                                           json_t        *tokens,
+                                           const gchar   *db_name);
+
+void           otp_token_model_remove_all (OTPTokenModel *self);
+
+/* Moves one record, keeping its entry. Emits a removal then an insertion,
+ * like g_list_store_remove + g_list_store_insert. */
+void           otp_token_model_move       (OTPTokenModel *self,
+                                           guint          from,
+                                           guint          to);
+
+/* Position of entry, or GTK_INVALID_LIST_POSITION (G_MAXUINT). Compares
+ * pointers only, so no entry is built. */
+guint          otp_token_model_find       (OTPTokenModel *self,
+                                           OTPEntry      *entry);
+
+/* The entries built so far (a new array holding a reference on each). */
+GPtrArray     *otp_token_model_get_live   (OTPTokenModel *self);
+
+guint          otp_token_model_get_n_live (OTPTokenModel *self);
+
+/* Keeps index (may be NULL) in step with the model's tokens: the current
+ * ones are added now, later ones as they come and go. Several models can
+ * share one index. */
+void           otp_token_model_set_search_index (OTPTokenModel *self,
+                                                 SearchIndex   *index);
+
+/* The token an entry built by a token model shows, or NULL. */
+json_t        *otp_token_model_get_entry_token  (OTPEntry      *entry);
+
+/* Drops the entries only the model still references, unless they are
+ * revealed (the reveal state must survive scrolling). */
+void           otp_token_model_trim       (OTPTokenModel *self);
+
+G_END_DECLS
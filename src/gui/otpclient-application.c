@@ -5,7 +5,7 @@
 #include <string.h>
 #include "otpclient-application.h"
 #include "otpclient-window.h"
-#include "otp-entry.h"
+#include "otp-token-model.h"
 #include "database-sidebar.h"
 #include "gui-misc.h"
 #include "dialogs/password-dialog.h"
@@ -15,6 +15,9 @@
 #include "dialogs/whats-new-dialog.h"
 #include "common.h"
 #include "db-common.h"
+#include "db-cache.h"
+#include "db-commit.h"
+#include "gsettings-common.h"
 #include "gquarks.h"
 #include "secret-schema.h"
 #include "version.h"
@@ -29,6 +32,11 @@ struct _OTPClientApplication
 
     DatabaseData *db_data;
 
+    /* Databases switched away from, still unlocked, so switching back is
+     * instant. Emptied on lock and on low-memory warnings. */
+    DbCache *db_cache;
+    GMemoryMonitor *memory_monitor;
+
     GCancellable *cancellable;
     GSettings *settings;
 
@@ -42,6 +50,7 @@ struct _OTPClientApplication
 gboolean use_secret_service;
     gboolean search_provider_enabled;
     gchar *search_provider_keyword;
+    gboolean search_provider_keep_unlocked;
     gboolean show_validity_seconds;
     gchar *validity_color;
     gchar *validity_warning_color;
@@ -68,6 +77,9 @@ gboolean use_secret_service;
 
 G_DEFINE_TYPE (OTPClientApplication, otpclient_application, ADW_TYPE_APPLICATION)
 
+/* Unlocked databases kept besides the open one */
+#define DB_CACHE_MAX_ENTRIES 4
+
 enum
 {
     PROP_0,
@@ -452,53 +464,44 @@ populate_window_from_db (OTPClientApplication *self)
     if (self->window == NULL)
         return;
 
-    GListStore *store = otpclient_window_get_otp_store (self->window);
+    OTPTokenModel *store = otpclient_window_get_otp_store (self->window);
     if (store == NULL)
         return;
 
-    g_list_store_remove_all (store);
-
-    json_t *json_db = self->db_data->in_memory_json_data;
-    gsize index;
-    json_t *obj;
-
-    json_array_foreach (json_db, index, obj)
-    {
-        const gchar *type = json_string_value (json_object_get (obj, "type"));
-        const gchar *label = json_string_value (json_object_get (obj, "label"));
-        const gchar *issuer = json_string_value (json_object_get (obj, "issuer"));
-        const gchar *secret = json_string_value (json_object_get (obj, "secret"));
-        const gchar *algo = json_string_value (json_object_get (obj, "algo"));
-        guint32 digits = (guint32) json_integer_value (json_object_get (obj, "digits"));
-        guint32 period = 30;
-        guint64 counter = 0;
-
-        if (digits < 4) digits = 6;
-
-        if (type != NULL && g_ascii_strcasecmp (type, "HOTP") == 0)
-            counter = (guint64) json_integer_value (json_object_get (obj, "counter"));
-        else
-            period = (guint32) json_integer_value (json_object_get (obj, "period"));
+    otp_token_model_sync (store, self->db_data->in_memory_json_data);
 
-        if (period < 1) period = 30;
+    otpclient_window_rebuild_groups (self->window);
+    otpclient_window_set_db_actions_enabled (self->window, TRUE);
+}
 
-        OTPEntry *entry = otp_entry_new (label, issuer, NULL,
-                                          type ? type : "TOTP",
-                                          period, counter,
-                                          algo ? algo : "SHA1",
-                                          digits, secret);
-        const gchar *group = json_string_value (json_object_get (obj, "group"));
-        if (group != NULL)
-            otp_entry_set_group (entry, group);
+/* Shows the tokens of the freshly opened db_data, by unlock or from the
+ * cache of recently used databases. */
+static void
+show_loaded_db (OTPClientApplication *self)
+{
+    /* Populate first, *then* swap out the loading page, otherwise
+     * non-empty databases briefly flash the empty-state placeholder. */
+    populate_window_from_db (self);
+    if (self->window == NULL)
+        return;
 
-        otp_entry_update_otp (entry);
+    otpclient_window_hide_loading (self->window);
+    otpclient_window_start_otp_timer (self->window);
+    otpclient_window_sync_active_flag (self->window);
 
-        g_list_store_append (store, entry);
-        g_object_unref (entry);
+    /* Issue #464: tokens that failed validation were set aside so the rest
+     * of the database could open. Tell the user they are preserved; the
+     * dedicated repair dialog arrives in 5.2.0. */
+    guint quarantined = db_get_quarantined_count (self->db_data);
+    if (quarantined > 0)
+    {
+        g_autofree gchar *msg = g_strdup_printf (
+            ngettext ("%u token could not be loaded and was kept for repair",
+                      "%u tokens could not be loaded and were kept for repair",
+                      quarantined),
+            quarantined);
+        otpclient_window_show_error_toast (self->window, msg);
     }
-
-    otpclient_window_rebuild_groups (self->window);
-    otpclient_window_set_db_actions_enabled (self->window, TRUE);
 }
 
 static void
@@ -718,29 +721,7 @@ on_unlock_done (GObject      *source_object,
      * via on_password_cleared but do not affect the unlock outcome. */
     self->migrating_legacy_keyring = FALSE;
 
-    /* Populate first, *then* swap out the loading page, otherwise
-     * non-empty databases briefly flash the empty-state placeholder. */
-    populate_window_from_db (self);
-    if (self->window != NULL)
-    {
-        otpclient_window_hide_loading (self->window);
-        otpclient_window_start_otp_timer (self->window);
-        otpclient_window_sync_active_flag (self->window);
-
-        /* Issue #464: tokens that failed validation were set aside so the rest
-         * of the database could open. Tell the user they are preserved; the
-         * dedicated repair dialog arrives in 5.2.0. */
-        guint quarantined = db_get_quarantined_count (self->db_data);
-        if (quarantined > 0)
-        {
-            g_autofree gchar *msg = g_strdup_printf (
-                ngettext ("%u token could not be loaded and was kept for repair",
-                          "%u tokens could not be loaded and were kept for repair",
-                          quarantined),
-                quarantined);
-            otpclient_window_show_error_toast (self->window, msg);
-        }
-    }
+    show_loaded_db (self);
     if (self->app_locked)
         lock_app_unlock (self);
 }
@@ -822,6 +803,17 @@ otpclient_application_purge_secrets (OTPClientApplication *self)
      * observes the generation mismatch and performs the purge safely. */
     if (!self->unlock_in_progress)
         database_data_purge_secrets (self->db_data);
+    if (self->db_cache != NULL)
+        db_cache_clear (self->db_cache);
+}
+
+void
+otpclient_application_forget_db (OTPClientApplication *self,
+                                 const gchar          *db_path)
+{
+    g_return_if_fail (OTPCLIENT_IS_APPLICATION (self));
+    if (self->db_cache != NULL && db_path != NULL)
+        db_cache_remove (self->db_cache, db_path);
 }
 
 static void
@@ -943,6 +935,19 @@ maybe_migrate_v4_secret_service (OTPClientApplication *self)
     g_settings_set_boolean (self->settings, "secret-service-v4-migrated", TRUE);
 }
 
+static void
+on_low_memory_warning (GMemoryMonitor                *monitor,
+                       GMemoryMonitorWarningLevel     level,
+                       OTPClientApplication          *self)
+{
+    (void) monitor;
+    (void) level;
+
+    /* The cached databases are only a shortcut; a switch back unlocks again */
+    if (self->db_cache != NULL)
+        db_cache_clear (self->db_cache);
+}
+
 static void
 init_database (OTPClientApplication *self)
 {
@@ -963,6 +968,12 @@ init_database (OTPClientApplication *self)
         return;
     }
 
+    self->db_cache = db_cache_new (DB_CACHE_MAX_ENTRIES,
+                                   (gsize) (memlock_value * SECMEM_SIZE_THRESHOLD_RATIO));
+    self->memory_monitor = g_memory_monitor_dup_default ();
+    g_signal_connect (self->memory_monitor, "low-memory-warning",
+                      G_CALLBACK (on_low_memory_warning), self);
+
     /* Load the full database list (handles v4 migration) */
     g_autoptr (GPtrArray) db_list = gui_misc_get_db_list ();
     if (db_list == NULL || db_list->len == 0)
@@ -1016,6 +1027,7 @@ init_database (OTPClientApplication *self)
     const gchar *db_path = database_entry_get_path (primary_entry);
 
     self->db_data = database_data_new (db_path, memlock_value);
+    self->db_data->backup_generations = gsettings_common_get_backup_generations ();
 
     maybe_migrate_v4_secret_service (self);
 
@@ -1110,6 +1122,7 @@ GSettingsSchemaSource *schema_source = g_settings_schema_source_get_default ();
         self->use_secret_service = g_settings_get_boolean (self->settings, "secret-service");
         self->search_provider_enabled = g_settings_get_boolean (self->settings, "search-provider-enabled");
         self->search_provider_keyword = g_settings_get_string (self->settings, "search-provider-keyword");
+        self->search_provider_keep_unlocked = g_settings_get_boolean (self->settings, "search-provider-keep-unlocked");
         self->show_validity_seconds = g_settings_get_boolean (self->settings, "show-validity-seconds");
         self->validity_color = g_settings_get_string (self->settings, "validity-color");
         self->validity_warning_color = g_settings_get_string (self->settings, "validity-warning-color");
@@ -1126,6 +1139,7 @@ GSettingsSchemaSource *schema_source = g_settings_schema_source_get_default ();
         self->use_secret_service = FALSE;
         self->search_provider_enabled = TRUE;
         self->search_provider_keyword = g_strdup ("otp");
+        self->search_provider_keep_unlocked = FALSE;
         self->show_validity_seconds = FALSE;
         self->validity_color = g_strdup ("#008000");
         self->validity_warning_color = g_strdup ("#ffa500");
@@ -1200,6 +1214,11 @@ otpclient_application_dispose (GObject *object)
     g_clear_pointer (&self->validity_color, g_free);
     g_clear_pointer (&self->validity_warning_color, g_free);
 
+    if (self->memory_monitor != NULL)
+        g_signal_handlers_disconnect_by_data (self->memory_monitor, self);
+    g_clear_object (&self->memory_monitor);
+    g_clear_pointer (&self->db_cache, db_cache_free);
+
     if (self->db_data != NULL)
     {
         database_data_free (self->db_data);
@@ -1306,6 +1325,9 @@ otpclient_application_set_db_data (OTPClientApplication *self,
 
     database_data_free (self->db_data);
 
+    /* Never keep a second, older copy of the database being opened */
+    if (db_data != NULL && self->db_cache != NULL)
+        db_cache_remove (self->db_cache, db_data->db_path);
     self->db_data = db_data;
 }
 
@@ -1328,19 +1350,50 @@ otpclient_application_switch_to_db (OTPClientApplication *self,
         otpclient_window_clear_clipboard_now (self->window);
         otpclient_window_invalidate_cross_db (self->window);
 
-        GListStore *store = otpclient_window_get_otp_store (self->window);
+        OTPTokenModel *store = otpclient_window_get_otp_store (self->window);
         if (store != NULL)
-            g_list_store_remove_all (store);
+            otp_token_model_remove_all (store);
         otpclient_window_set_db_actions_enabled (self->window, FALSE);
     }
 
-    otpclient_application_set_db_data (self, NULL);
+    /* Keep the outgoing database unlocked (the cache purges it if it is
+     * locked or too big) and reuse the incoming one if it is still there. */
+    DatabaseData *outgoing = g_steal_pointer (&self->db_data);
+    if (self->db_cache != NULL)
+    {
+        DatabaseData *cached = db_cache_take (self->db_cache, db_path);
+        if (outgoing != NULL && !self->app_locked)
+        {
+            /* Let an in-flight save land while its callbacks still match
+             * the window state they were queued for. */
+            db_commit_quiesce (outgoing);
+            db_cache_put (self->db_cache, outgoing);
+        }
+        else
+        {
+            database_data_free (outgoing);
+        }
+        db_cache_make_room (self->db_cache,
+                            db_cache_estimate_cost (db_path));
+
+        if (cached != NULL)
+        {
+            self->db_data = cached;
+            show_loaded_db (self);
+            return;
+        }
+    }
+    else
+    {
+        database_data_free (outgoing);
+    }
 
     gint32 memlock_value = 0;
     if (set_memlock_value (&memlock_value) == MEMLOCK_ERR)
         memlock_value = DEFAULT_MEMLOCK_VALUE;
 
     self->db_data = database_data_new (db_path, memlock_value);
+    self->db_data->backup_generations = gsettings_common_get_backup_generations ();
 
     if (self->use_secret_service)
     {
@@ -1485,6 +1538,20 @@ void otpclient_application_set_search_provider_keyword (OTPClientApplication *se
         g_settings_set_string (self->settings, "search-provider-keyword", self->search_provider_keyword);
 }
 
+gboolean otpclient_application_get_search_provider_keep_unlocked (OTPClientApplication *self)
+{
+    g_return_val_if_fail (OTPCLIENT_IS_APPLICATION (self), FALSE);
+    return self->search_provider_keep_unlocked;
+}
+
+void otpclient_application_set_search_provider_keep_unlocked (OTPClientApplication *self, gboolean keep)
+{
+    g_return_if_fail (OTPCLIENT_IS_APPLICATION (self));
+    self->search_provider_keep_unlocked = keep;
+    if (self->settings != NULL)
+        g_settings_set_boolean (self->settings, "search-provider-keep-unlocked", keep);
+}
+
 gboolean otpclient_application_get_show_validity_seconds (OTPClientApplication *self)
 {
     g_return_val_if_fail (OTPCLIENT_IS_APPLICATION (self), FALSE);
@@ -1565,6 +1632,7 @@ void otpclient_application_reload_settings (OTPClientApplication *self)
     self->search_provider_enabled = g_settings_get_boolean (self->settings, "search-provider-enabled");
     g_free (self->search_provider_keyword);
     self->search_provider_keyword = g_settings_get_string (self->settings, "search-provider-keyword");
+    self->search_provider_keep_unlocked = g_settings_get_boolean (self->settings, "search-provider-keep-unlocked");
     self->show_validity_seconds = g_settings_get_boolean (self->settings, "show-validity-seconds");
     g_free (self->validity_color);
     self->validity_color = g_settings_get_string (self->settings, "validity-color");
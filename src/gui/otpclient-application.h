@@ -36,6 +36,11 @@ gboolean              otpclient_application_submit_unlock_password (
                                                            gchar               **error_message);
 void                  otpclient_application_purge_secrets (OTPClientApplication *self);
 
+/* Drops the unlocked copy of db_path kept for quick switching, if any
+ * (the database was removed from the list). */
+void                  otpclient_application_forget_db (OTPClientApplication *self,
+                                                       const gchar          *db_path);
+
 gboolean              otpclient_application_get_show_next_otp (OTPClientApplication *self);
 void                  otpclient_application_set_show_next_otp (OTPClientApplication *self,
                                                                gboolean              show);
@@ -72,6 +77,10 @@ const gchar          *otpclient_application_get_search_provider_keyword (OTPClie
 void                  otpclient_application_set_search_provider_keyword (OTPClientApplication *self,
                                                                          const gchar          *keyword);
 
+gboolean              otpclient_application_get_search_provider_keep_unlocked (OTPClientApplication *self);
+void                  otpclient_application_set_search_provider_keep_unlocked (OTPClientApplication *self,
+                                                                               gboolean              keep);
+
 gboolean              otpclient_application_get_show_validity_seconds (OTPClientApplication *self);
 void                  otpclient_application_set_show_validity_seconds (OTPClientApplication *self,
                                                                        gboolean              show);
@@ -10,4 +10,6 @@ typedef struct _OTPClientWindow OTPClientWindow;
 
 typedef struct _OTPEntry OTPEntry;
 
+typedef struct _OTPTokenModel OTPTokenModel;
+
 G_END_DECLS
\ No newline at end of file
@@ -1,17 +1,28 @@
 #pragma once
 
 #include "otpclient-window.h"
+#include "otp-rotation.h"
+#include "search-index.h"
 #include <jansson.h>
 
 G_BEGIN_DECLS
 
 #define HOTP_FLUSH_DEBOUNCE_SECONDS 5
 
+/* Upper bound on one sleep of the TOTP refresh timer. GLib timeouts follow
+ * the monotonic clock, so this caps how long a wall-clock jump goes
+ * unnoticed. Resume from suspend re-arms the timer right away. */
+#define OTP_REFRESH_MAX_SLEEP_MS 5000
+
 /* HOTP has no periodic rotation, so a reveal cannot be tied to a validity
  * window. Use a short fixed timeout that matches the typical use case
  * (paste the code somewhere, then it disappears). */
 #define HOTP_REVEAL_SECONDS 30
 
+/* Above this many rows the search filter runs incrementally, in idle
+ * chunks, so a keystroke never blocks the frame on a full pass. */
+#define SEARCH_INCREMENTAL_MIN_ITEMS 5000
+
 #define BACKUP_AGE_WARN_DAYS 30
 #define BACKUP_BANNER_SNOOZE_DAYS 7
 
@@ -27,7 +38,10 @@ typedef struct
     GtkWidget *label;
     GtkWidget *level_bar;
     GtkWidget *box;
-    guint timeout_id;
+    OTPClientWindow *window;    /* not owned */
+    gboolean tracked;           /* in window->validity_rows */
+    gboolean styled;
+    gboolean warning;
     guint remaining;
     guint period;
 } ValidityWidgets;
@@ -57,7 +71,7 @@ struct _OTPClientWindow
     GtkWidget *loading_status_page;
     GtkWidget *locked_status_page;
     GtkWidget *locked_unlock_button;
-    GListStore *otp_store;
+    OTPTokenModel *otp_store;
     GtkFilterListModel *filter_model;
     GtkCustomFilter *search_filter;
     GtkSortListModel *sort_model;
@@ -65,7 +79,21 @@ struct _OTPClientWindow
 
     GListStore *db_store;
 
+    /* TOTP refresh: otp_refresh_timer_id sleeps until the wheel's next
+     * rotation boundary. Each wakeup refills the wheel from the entries the
+     * token models have built (the bound rows), not from every token. */
     guint otp_refresh_timer_id;
+    OTPRotationWheel *otp_rotation;
+
+    /* Validity column: the shown widgets (ValidityWidgets, not owned) are
+     * updated together from one tick callback on otp_list, which only runs
+     * while there are any. Their colours come from the two classes styled
+     * by validity_css. */
+    GPtrArray *validity_rows;
+    guint validity_tick_id;
+    gint64 validity_last_second;
+    GtkCssProvider *validity_css;
+    gchar *validity_css_colors;
 
     /* Drag-and-drop state */
     GtkWidget *dnd_highlight_row;
@@ -75,21 +103,40 @@ struct _OTPClientWindow
     GtkWidget *group_dropdown;
     GtkStringList *group_list_model;
     gchar *active_group_filter;  /* NULL = "All", "" = "Ungrouped", non-empty = group name */
+    GPtrArray *group_names_lower; /* lowered group names, item i + 1 of group_list_model */
     gboolean syncing_group_filter;
 
     /* Search filter cache: lowered forms of the search box contents, refreshed
      * whenever the filter is invalidated (search text changed / group changed /
      * cross-db load completed). search_filter_func runs once per visible row,
-     * so caching here avoids re-lowering the query string N times per keystroke. */
+     * so caching here avoids re-lowering the query string N times per keystroke.
+     * Comparing the old and new forms tells GTK whether a keystroke narrowed
+     * or widened the query, so it only re-checks the rows that can change. */
     gchar *search_lower;
     gchar *search_group_lower;
+    gboolean search_autoselect_pending;
+
+    /* Ranked search: search_index (shared by both token models) narrows a
+     * query to search_candidates (recomputed lazily when the query or the
+     * index changes) so the filter does one set lookup per row; while there is free text, the sort model puts the best match
+     * (prefix > word start > substring > words, then usage) first.
+     * Scores are cached on the entries per search_generation. usage_counts
+     * counts copies per issuer/account for this session. */
+    SearchIndex *search_index;
+    GHashTable *search_candidates;
+    guint search_candidates_stamp;
+    gboolean search_candidates_valid;
+    GtkSorter *column_sorter;
+    GtkSorter *ranked_sorter;
+    guint search_generation;
+    GHashTable *usage_counts;
 
     /* Cross-database search */
-    GListStore *cross_db_store;
+    OTPTokenModel *cross_db_store;
     GtkFlattenListModel *flatten_model;
     gboolean cross_db_loaded;
     gboolean cross_db_loading;
-    GCancellable *cross_db_cancellable;
+    GHashTable *cross_db_jobs;      /* db path -> GCancellable of its running load */
     GCancellable *webcam_cancellable;
     GCancellable *clipboard_cancellable;
     GCancellable *file_dialog_cancellable;
@@ -4,8 +4,12 @@
 #include "otpclient-window.h"
 #include "otpclient-window-private.h"
 #include "otp-entry.h"
+#include "otp-token-model.h"
+#include "search-query.h"
 #include "database-sidebar.h"
 #include "db-common.h"
+#include "db-cache.h"
+#include "db-commit.h"
 #include "qrcode-parser.h"
 #include "google-migration.h"
 #include "webcam-scanner.h"
@@ -30,7 +34,10 @@ static void refresh_otp_value_cells (OTPClientWindow *self);
 static void on_hide_otps_changed   (GObject *gobject, GParamSpec *pspec, gpointer user_data);
 static void otpclient_window_constructed (GObject *object);
 static void copy_otp_to_clipboard_and_notify (OTPClientWindow *self, OTPEntry *entry);
-static void refresh_search_cache (OTPClientWindow *self);
+static gboolean refresh_search_cache (OTPClientWindow *self, GtkFilterChange *change);
+static void apply_search_filter (OTPClientWindow *self, GtkFilterChange change);
+static void on_filter_pending_changed (GtkFilterListModel *model, GParamSpec *pspec, OTPClientWindow *self);
+static void on_db_modified (gpointer user_data);
 
 static inline gboolean
 window_is_locked (OTPClientWindow *self)
@@ -40,12 +47,13 @@ window_is_locked (OTPClientWindow *self)
     return app != NULL && otpclient_application_get_app_locked (app);
 }
 
+static void validity_track (ValidityWidgets *widgets,
+                            gboolean         track);
+
 static void
 validity_widgets_free (ValidityWidgets *widgets)
 {
-    if (widgets->timeout_id != 0)
-        g_source_remove (widgets->timeout_id);
-
+    validity_track (widgets, FALSE);
     g_free (widgets);
 }
 
@@ -69,12 +77,110 @@ show_error_toast (OTPClientWindow *self, const gchar *format, ...)
     adw_toast_overlay_add_toast (ADW_TOAST_OVERLAY (self->toast_overlay), toast);
 }
 
+/* Edits made from the window are written by the background commit queue, so
+ * the UI already shows the change when the write finishes. On failure the
+ * queue has rolled the live array back; tell the user and rebuild the store
+ * from it. */
+typedef struct {
+    GWeakRef     window_ref;
+    const gchar *failure_prefix;    /* translated, static */
+    gboolean     forget_deleted_token;
+} CommitFeedback;
+
 static void
-validity_update_display (ValidityWidgets *widgets)
+on_commit_done (DatabaseData *db_data,
+                const GError *error,
+                gpointer      user_data)
 {
-    if (widgets == NULL)
+    (void) db_data;
+    CommitFeedback *feedback = user_data;
+    g_autoptr (OTPClientWindow) self = g_weak_ref_get (&feedback->window_ref);
+
+    if (error != NULL && self != NULL && !self->disposing && !window_is_locked (self))
+    {
+        if (feedback->forget_deleted_token && self->deleted_token != NULL)
+        {
+            /* The rollback brought the token back; undo would duplicate it. */
+            json_decref (self->deleted_token);
+            self->deleted_token = NULL;
+        }
+        show_error_toast (self, "%s: %s", feedback->failure_prefix, error->message);
+        on_db_modified (self);
+    }
+
+    g_weak_ref_clear (&feedback->window_ref);
+    g_free (feedback);
+}
+
+static gboolean
+commit_in_background (OTPClientWindow *self,
+                      DatabaseData    *db_data,
+                      const gchar     *failure_prefix,
+                      gboolean         forget_deleted_token)
+{
+    CommitFeedback *feedback = g_new0 (CommitFeedback, 1);
+    g_weak_ref_init (&feedback->window_ref, self);
+    feedback->failure_prefix = failure_prefix;
+    feedback->forget_deleted_token = forget_deleted_token;
+
+    GError *err = NULL;
+    if (!db_commit_async (db_data, NULL, NULL, on_commit_done, feedback, &err))
+    {
+        show_error_toast (self, "%s: %s", failure_prefix, err->message);
+        g_clear_error (&err);
+        g_weak_ref_clear (&feedback->window_ref);
+        g_free (feedback);
+        on_db_modified (self);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Both level bar colours come from one display-wide provider: a bar
+ * switches by toggling a static class, and the provider is only reloaded
+ * when the colour settings change. */
+static void
+validity_sync_css (OTPClientWindow *self)
+{
+    OTPClientApplication *app = OTPCLIENT_APPLICATION (g_application_get_default ());
+    if (app == NULL)
+        return;
+
+    const gchar *color = otpclient_application_get_validity_color (app);
+    const gchar *warning_color = otpclient_application_get_validity_warning_color (app);
+    g_autofree gchar *colors = g_strdup_printf ("%s\n%s", color, warning_color);
+    if (g_strcmp0 (colors, self->validity_css_colors) == 0)
+        return;
+
+    if (self->validity_css == NULL)
+    {
+        self->validity_css = gtk_css_provider_new ();
+        gtk_style_context_add_provider_for_display (
+            gtk_widget_get_display (GTK_WIDGET (self)),
+            GTK_STYLE_PROVIDER (self->validity_css),
+            GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);
+    }
+    g_autofree gchar *css = g_strdup_printf (
+        "levelbar.validity-normal trough block.filled { background-color: %s; }\n"
+        "levelbar.validity-warning trough block.filled { background-color: %s; }",
+        color, warning_color);
+    gtk_css_provider_load_from_string (self->validity_css, css);
+    g_free (self->validity_css_colors);
+    self->validity_css_colors = g_steal_pointer (&colors);
+}
+
+static void
+validity_update_display (ValidityWidgets *widgets,
+                         gint64           now)
+{
+    if (widgets == NULL || widgets->period == 0)
         return;
 
+    /* Recompute from wallclock. At rollover `remaining` becomes `period`
+     * again and the bar refills the moment the OTP rotates - the refresh
+     * wheel updates the OTP value in parallel. */
+    widgets->remaining = widgets->period - (guint) ((now / G_USEC_PER_SEC) % widgets->period);
+
     OTPClientApplication *app = OTPCLIENT_APPLICATION (
         g_application_get_default ());
     gboolean show_seconds = app != NULL &&
@@ -82,103 +188,85 @@ validity_update_display (ValidityWidgets *widgets)
 
     if (show_seconds)
     {
-        if (widgets->label != NULL && GTK_IS_LABEL (widgets->label))
-        {
-            gchar label_text[8];
-            g_snprintf (label_text, sizeof label_text, "%us", widgets->remaining);
-            gtk_label_set_text (GTK_LABEL (widgets->label), label_text);
-            gtk_widget_set_visible (widgets->label, TRUE);
-        }
-        if (widgets->level_bar != NULL)
-            gtk_widget_set_visible (widgets->level_bar, FALSE);
+        gchar label_text[8];
+        g_snprintf (label_text, sizeof label_text, "%us", widgets->remaining);
+        gtk_label_set_text (GTK_LABEL (widgets->label), label_text);
+        gtk_widget_set_visible (widgets->label, TRUE);
+        gtk_widget_set_visible (widgets->level_bar, FALSE);
+        return;
     }
-    else
-    {
-        if (widgets->label != NULL)
-            gtk_widget_set_visible (widgets->label, FALSE);
-        if (widgets->level_bar != NULL && GTK_IS_LEVEL_BAR (widgets->level_bar))
-        {
-            gdouble fraction = (widgets->period > 0)
-                ? (gdouble) widgets->remaining / widgets->period
-                : 0.0;
-            gtk_level_bar_set_value (GTK_LEVEL_BAR (widgets->level_bar), fraction);
-
-            /* Apply color based on remaining time */
-            const gchar *color;
-            if (widgets->remaining <= widgets->period / 4)
-                color = otpclient_application_get_validity_warning_color (app);
-            else
-                color = otpclient_application_get_validity_color (app);
-
-            GtkCssProvider *provider = g_object_get_data (G_OBJECT (widgets->level_bar), "css-provider");
-            if (provider == NULL)
-            {
-                provider = gtk_css_provider_new ();
-                g_object_set_data_full (G_OBJECT (widgets->level_bar), "css-provider",
-                                        provider, g_object_unref);
-                gtk_widget_add_css_class (widgets->level_bar, "otp-validity");
-                gtk_style_context_add_provider_for_display (
-                    gtk_widget_get_display (widgets->level_bar),
-                    GTK_STYLE_PROVIDER (provider),
-                    GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);
-                g_object_set_data (G_OBJECT (widgets->level_bar), "last-color", NULL);
-            }
-            const gchar *last_color = g_object_get_data (G_OBJECT (widgets->level_bar), "last-color");
-            if (last_color == NULL || g_strcmp0 (last_color, color) != 0)
-            {
-                g_autofree gchar *css = g_strdup_printf (
-                    "levelbar.otp-validity trough block.filled { background-color: %s; }", color);
-                gtk_css_provider_load_from_string (provider, css);
-                g_object_set_data_full (G_OBJECT (widgets->level_bar), "last-color",
-                                        g_strdup (color), g_free);
-            }
 
-            gtk_widget_set_visible (widgets->level_bar, TRUE);
-        }
+    gtk_widget_set_visible (widgets->label, FALSE);
+    gtk_level_bar_set_value (GTK_LEVEL_BAR (widgets->level_bar),
+                             (gdouble) widgets->remaining / widgets->period);
+
+    /* Apply color based on remaining time */
+    gboolean warning = widgets->remaining <= widgets->period / 4;
+    if (!widgets->styled || warning != widgets->warning)
+    {
+        gtk_widget_remove_css_class (widgets->level_bar, warning ? "validity-normal" : "validity-warning");
+        gtk_widget_add_css_class (widgets->level_bar, warning ? "validity-warning" : "validity-normal");
+        widgets->warning = warning;
+        widgets->styled = TRUE;
     }
+    gtk_widget_set_visible (widgets->level_bar, TRUE);
 }
 
+/* One clock for every shown validity widget. It runs on the list's frame
+ * clock, so it pauses with the window, but does work only when the second
+ * changes. */
 static gboolean
-validity_tick (gpointer data)
+validity_clock_tick (GtkWidget     *widget,
+                     GdkFrameClock *frame_clock,
+                     gpointer       user_data)
 {
-    GtkListItem *list_item = GTK_LIST_ITEM (data);
-    ValidityWidgets *widgets;
+    (void) widget;
+    (void) frame_clock;
+    OTPClientWindow *self = OTPCLIENT_WINDOW (user_data);
 
-    if (!GTK_IS_LIST_ITEM (list_item))
-        return G_SOURCE_REMOVE;
+    gint64 now = g_get_real_time ();
+    if (now / G_USEC_PER_SEC == self->validity_last_second)
+        return G_SOURCE_CONTINUE;
+    self->validity_last_second = now / G_USEC_PER_SEC;
 
-    GtkWidget *child = gtk_list_item_get_child (list_item);
-    if (child == NULL || !GTK_IS_WIDGET (child))
-        return G_SOURCE_REMOVE;
+    validity_sync_css (self);
+    for (guint i = 0; i < self->validity_rows->len; i++)
+        validity_update_display (g_ptr_array_index (self->validity_rows, i), now);
 
-    widgets = g_object_get_data (G_OBJECT (list_item), "validity-widgets");
+    return G_SOURCE_CONTINUE;
+}
 
-    if (widgets == NULL)
-        return G_SOURCE_REMOVE;
+/* Adds widgets to (or drops them from) the ones the clock updates, starting
+ * the clock for the first and stopping it after the last. */
+static void
+validity_track (ValidityWidgets *widgets,
+                gboolean         track)
+{
+    OTPClientWindow *self = widgets->window;
+    if (self == NULL || self->validity_rows == NULL || track == widgets->tracked)
+        return;
+
+    widgets->tracked = track;
+    if (track)
+        g_ptr_array_add (self->validity_rows, widgets);
+    else
+        g_ptr_array_remove_fast (self->validity_rows, widgets);
 
-    if (!gtk_list_item_get_selected (list_item))
+    if (self->validity_rows->len > 0 && self->validity_tick_id == 0)
     {
-        widgets->timeout_id = 0;
-        return G_SOURCE_REMOVE;
+        self->validity_tick_id = gtk_widget_add_tick_callback (self->otp_list,
+                                                               validity_clock_tick,
+                                                               self, NULL);
     }
-
-    /* Recompute from wallclock instead of decrementing a counter and
-     * giving up at 0. At rollover (now % period == 0), `remaining`
-     * becomes `period` automatically and the bar refills the moment the
-     * OTP rotates - otp_refresh_tick handles updating the OTP value in
-     * parallel. */
-    if (widgets->period > 0)
+    else if (self->validity_rows->len == 0 && self->validity_tick_id != 0)
     {
-        gint64 now = g_get_real_time () / G_USEC_PER_SEC;
-        widgets->remaining = widgets->period - (guint32) (now % widgets->period);
+        gtk_widget_remove_tick_callback (self->otp_list, self->validity_tick_id);
+        self->validity_tick_id = 0;
     }
-    validity_update_display (widgets);
-
-    return G_SOURCE_CONTINUE;
 }
 
 /* Decide whether the validity bar/seconds should be visible right now and
- * (re)arm or stop the per-row timer accordingly. The bar only makes sense
+ * start or stop updating them accordingly. The bar only makes sense
  * when the OTP is also visible - when "Hide OTPs by default" is on and the
  * row is not currently revealed, the cell is blank and a countdown next to
  * empty space is just visual noise. */
@@ -200,32 +288,20 @@ validity_apply_visibility (GtkListItem *list_item)
     gboolean revealed = entry != NULL && otp_entry_get_revealed (entry);
     gboolean show_bar = selected && entry != NULL && (!hide || revealed);
 
-    if (widgets->timeout_id != 0)
-    {
-        g_source_remove (widgets->timeout_id);
-        widgets->timeout_id = 0;
-    }
-
     if (show_bar)
     {
         guint32 period = otp_entry_get_period (entry);
-        if (period == 0)
-            period = 30;
-        gint64 now = g_get_real_time () / G_USEC_PER_SEC;
-        widgets->period = period;
-        widgets->remaining = period - (guint32) (now % period);
-        validity_update_display (widgets);
+        widgets->period = (period == 0) ? 30 : period;
+        if (widgets->window != NULL)
+            validity_sync_css (widgets->window);
+        validity_update_display (widgets, g_get_real_time ());
         gtk_widget_set_visible (widgets->box, TRUE);
-        widgets->timeout_id = g_timeout_add_seconds_full (G_PRIORITY_DEFAULT,
-                                                          1,
-                                                          validity_tick,
-                                                          g_object_ref (list_item),
-                                                          g_object_unref);
     }
     else
     {
         gtk_widget_set_visible (widgets->box, FALSE);
     }
+    validity_track (widgets, show_bar);
 }
 
 static void
@@ -266,12 +342,7 @@ validity_list_item_unbind (GtkSignalListItemFactory *factory,
     if (widgets == NULL)
         return;
 
-    if (widgets->timeout_id != 0)
-    {
-        g_source_remove (widgets->timeout_id);
-        widgets->timeout_id = 0;
-    }
-
+    validity_track (widgets, FALSE);
     gtk_widget_set_visible (widgets->label, FALSE);
 }
 
@@ -307,7 +378,9 @@ render_otp_value_label (GtkWidget *label,
         return;
     }
 
-    const gchar *current = otp_entry_get_otp_value (entry);
+    /* Codes are computed here, for rows actually on screen and unmasked,
+     * rather than for every token when the database is loaded. */
+    const gchar *current = otp_entry_ensure_otp (entry);
     if (current == NULL || *current == '\0')
     {
         gtk_label_set_use_markup (GTK_LABEL (label), FALSE);
@@ -317,10 +390,11 @@ render_otp_value_label (GtkWidget *label,
 
     if (app != NULL && otpclient_application_get_show_next_otp (app))
     {
-        g_autofree gchar *next = otp_entry_get_next_otp (entry);
+        gchar *next = otp_entry_get_next_otp (entry);
         if (next != NULL)
         {
             g_autofree gchar *combined = g_strdup_printf ("%s  [%s]", current, next);
+            sensitive_secure_free (next);
             gtk_label_set_use_markup (GTK_LABEL (label), FALSE);
             gtk_label_set_text (GTK_LABEL (label), combined);
             return;
@@ -381,23 +455,18 @@ otp_text_column_bind (GtkSignalListItemFactory *factory,
             text = otp_entry_get_issuer (entry);
             break;
         case OTP_COLUMN_VALUE:
-            /* For cross-DB entries we never computed the OTP upfront; do it
-             * the first time the row is bound for display. The result is
-             * cached on the entry so subsequent rebinds are free. */
-            if (otp_entry_get_db_name (entry) != NULL)
-            {
-                const gchar *cached = otp_entry_get_otp_value (entry);
-                if (cached == NULL || cached[0] == '\0')
-                    otp_entry_update_otp (entry);
-            }
             /* Drop any signal connections from a prior entry - labels are
              * recycled across rows as the user scrolls. Then connect to the
              * new entry so reveal/hide and HOTP/TOTP updates re-render in
-             * place. */
+             * place. The view count tells the rotation tick which entries
+             * are on screen; render_otp_value_label computes the code. */
             {
                 OTPEntry *prev = g_object_get_data (G_OBJECT (label), "value-bound-entry");
                 if (prev != NULL && prev != entry)
+                {
                     g_signal_handlers_disconnect_by_data (prev, label);
+                    otp_entry_remove_view (prev);
+                }
                 if (prev != entry)
                 {
                     g_signal_connect (entry, "notify::revealed",
@@ -405,6 +474,7 @@ otp_text_column_bind (GtkSignalListItemFactory *factory,
                     g_signal_connect (entry, "notify::otp-value",
                                       G_CALLBACK (on_otp_entry_notify_refresh), label);
                     g_object_set_data (G_OBJECT (label), "value-bound-entry", entry);
+                    otp_entry_add_view (entry);
                 }
             }
             render_otp_value_label (label, entry);
@@ -447,7 +517,10 @@ otp_text_column_unbind (GtkSignalListItemFactory *factory,
 
     OTPEntry *entry = g_object_get_data (G_OBJECT (label), "value-bound-entry");
     if (entry != NULL)
+    {
         g_signal_handlers_disconnect_by_data (entry, label);
+        otp_entry_remove_view (entry);
+    }
     g_object_set_data (G_OBJECT (label), "value-bound-entry", NULL);
 }
 
@@ -457,9 +530,9 @@ otp_validity_column_setup (GtkSignalListItemFactory *factory,
                            gpointer                  user_data)
 {
     (void) factory;
-    (void) user_data;
 
     ValidityWidgets *widgets = g_new0 (ValidityWidgets, 1);
+    widgets->window = user_data;
 
     GtkWidget *box = gtk_box_new (GTK_ORIENTATION_VERTICAL, 0);
     gtk_widget_set_visible (box, FALSE);
@@ -550,12 +623,13 @@ add_text_column (GtkColumnView *view,
 }
 
 static void
-add_validity_column (GtkColumnView *view)
+add_validity_column (OTPClientWindow *self,
+                     GtkColumnView   *view)
 {
     GtkListItemFactory *factory = gtk_signal_list_item_factory_new ();
     GtkColumnViewColumn *view_column = gtk_column_view_column_new (_("Validity"), factory);
 
-    g_signal_connect (factory, "setup", G_CALLBACK (otp_validity_column_setup), NULL);
+    g_signal_connect (factory, "setup", G_CALLBACK (otp_validity_column_setup), self);
     g_signal_connect (factory, "bind", G_CALLBACK (otp_validity_column_bind), NULL);
     g_signal_connect (factory, "unbind", G_CALLBACK (validity_list_item_unbind), NULL);
 
@@ -565,66 +639,135 @@ add_validity_column (GtkColumnView *view)
     gtk_column_view_append_column (view, view_column);
 }
 
-static gboolean
-otp_refresh_tick (gpointer user_data)
+/* Refreshes one TOTP entry whose period just rolled over. Entries that are
+ * neither on screen nor revealed keep their stale code: the step check in
+ * otp_entry_ensure_otp recomputes it once a row binds them again. */
+static void
+otp_entry_rotated (OTPClientWindow *self,
+                   OTPEntry        *entry,
+                   gboolean         show_next)
 {
-    OTPClientWindow *self = OTPCLIENT_WINDOW (user_data);
+    if (!otp_entry_has_view (entry) && !otp_entry_get_revealed (entry))
+        return;
 
-    if (self->otp_store == NULL)
-        return G_SOURCE_REMOVE;
+    otp_entry_ensure_otp (entry);
 
-    OTPClientApplication *app = OTPCLIENT_APPLICATION (
-        gtk_window_get_application (GTK_WINDOW (self)));
-    gboolean show_next = (app != NULL && otpclient_application_get_show_next_otp (app));
+    /* Reveal lifetime is tied to the validity window: if this entry was
+     * revealed when the period rolled over, either auto-roll (re-copy +
+     * re-notify the new value if this entry still owns the clipboard
+     * and the user opted into "show next OTP", and only once per reveal
+     * session) or hide it. */
+    if (!otp_entry_get_revealed (entry))
+        return;
 
-    guint n = g_list_model_get_n_items (G_LIST_MODEL (self->otp_store));
-    for (guint i = 0; i < n; i++)
+    g_autoptr (OTPEntry) clip_owner = g_weak_ref_get (&self->clipboard_owner_entry);
+    gboolean owns_clipboard = (clip_owner == entry);
+
+    if (show_next && owns_clipboard && !otp_entry_get_roll_consumed (entry))
     {
-        g_autoptr (OTPEntry) entry = g_list_model_get_item (G_LIST_MODEL (self->otp_store), i);
-        if (entry == NULL)
-            continue;
+        copy_otp_to_clipboard_and_notify (self, entry);
+        otp_entry_mark_roll_consumed (entry);
+    }
+    else
+    {
+        if (owns_clipboard)
+            g_weak_ref_set (&self->clipboard_owner_entry, NULL);
+        otp_entry_set_revealed (entry, FALSE);
+    }
+}
 
-        const gchar *type = otp_entry_get_otp_type (entry);
-        if (type == NULL || g_ascii_strcasecmp (type, "TOTP") != 0)
-            continue;
+static gboolean otp_refresh_tick (gpointer user_data);
 
-        guint32 period = otp_entry_get_period (entry);
-        if (period == 0)
-            continue;
+static void
+otp_refresh_arm (OTPClientWindow *self,
+                 guint            delay_ms)
+{
+    if (self->otp_refresh_timer_id != 0)
+        g_source_remove (self->otp_refresh_timer_id);
+    self->otp_refresh_timer_id = g_timeout_add (delay_ms, otp_refresh_tick, self);
+}
+
+static void
+otp_refresh_track_live (OTPClientWindow *self,
+                        OTPTokenModel   *model,
+                        gint64           now,
+                        gboolean         show_next)
+{
+    if (model == NULL)
+        return;
 
-        gint64 now = g_get_real_time () / G_USEC_PER_SEC;
-        guint32 remaining = period - (guint32)(now % period);
-        /* Not on a rotation boundary: nothing to do. */
-        if (remaining != period)
+    g_autoptr (GPtrArray) live = otp_token_model_get_live (model);
+    for (guint i = 0; i < live->len; i++)
+    {
+        OTPEntry *entry = g_ptr_array_index (live, i);
+        if (!otp_rotation_wheel_add (self->otp_rotation, entry, now))
             continue;
+        /* Bound after the wheel was last filled and already past a
+         * boundary: the advance could not have seen it. */
+        if (!otp_entry_is_current (entry))
+            otp_entry_rotated (self, entry, show_next);
+    }
+}
 
-        otp_entry_update_otp (entry);
+/* Sleeps until the earliest rotation boundary instead of polling every
+ * second. Only the entries the token models have built are tracked: the
+ * bound rows, plus whatever is revealed or held elsewhere, so an idle window
+ * over thousands of tokens costs one wakeup per boundary and touches a
+ * screenful of entries. */
+static gboolean
+otp_refresh_tick (gpointer user_data)
+{
+    OTPClientWindow *self = OTPCLIENT_WINDOW (user_data);
 
-        /* Reveal lifetime is tied to the validity window: if this entry was
-         * revealed when the period rolled over, either auto-roll (re-copy +
-         * re-notify the new value if this entry still owns the clipboard
-         * and the user opted into "show next OTP", and only once per reveal
-         * session) or hide it. */
-        if (!otp_entry_get_revealed (entry))
-            continue;
+    self->otp_refresh_timer_id = 0;
+    if (self->otp_store == NULL || self->otp_rotation == NULL)
+        return G_SOURCE_REMOVE;
 
-        g_autoptr (OTPEntry) clip_owner = g_weak_ref_get (&self->clipboard_owner_entry);
-        gboolean owns_clipboard = (clip_owner == entry);
+    OTPClientApplication *app = OTPCLIENT_APPLICATION (
+        gtk_window_get_application (GTK_WINDOW (self)));
+    gboolean show_next = (app != NULL && otpclient_application_get_show_next_otp (app));
+    gint64 now = g_get_real_time () / G_USEC_PER_SEC;
 
-        if (show_next && owns_clipboard && !otp_entry_get_roll_consumed (entry))
-        {
-            copy_otp_to_clipboard_and_notify (self, entry);
-            otp_entry_mark_roll_consumed (entry);
-        }
-        else
+    GPtrArray *due = otp_rotation_wheel_advance (self->otp_rotation, now);
+    if (due != NULL)
+    {
+        /* Generate the shown codes together first; otp_entry_rotated then
+         * finds them current and only handles reveal and clipboard. */
+        g_autoptr (GPtrArray) shown = g_ptr_array_sized_new (due->len);
+        for (guint i = 0; i < due->len; i++)
         {
-            if (owns_clipboard)
-                g_weak_ref_set (&self->clipboard_owner_entry, NULL);
-            otp_entry_set_revealed (entry, FALSE);
+            OTPEntry *entry = g_ptr_array_index (due, i);
+            if ((otp_entry_has_view (entry) || otp_entry_get_revealed (entry)) &&
+                !otp_entry_is_current (entry))
+                g_ptr_array_add (shown, entry);
         }
+        otp_entry_update_batch ((OTPEntry **) shown->pdata, shown->len);
+
+        for (guint i = 0; i < due->len; i++)
+            otp_entry_rotated (self, g_ptr_array_index (due, i), show_next);
+        g_ptr_array_unref (due);
     }
 
-    return G_SOURCE_CONTINUE;
+    /* Let go of the wheel's references before trimming, or no entry could
+     * ever be dropped, then refill it with what is still alive. */
+    otp_rotation_wheel_clear (self->otp_rotation);
+    otp_token_model_trim (self->otp_store);
+    if (self->cross_db_store != NULL)
+        otp_token_model_trim (self->cross_db_store);
+    otp_refresh_track_live (self, self->otp_store, now, show_next);
+    otp_refresh_track_live (self, self->cross_db_store, now, show_next);
+
+    gint64 delay_ms = OTP_REFRESH_MAX_SLEEP_MS;
+    gint64 next = otp_rotation_wheel_next_boundary (self->otp_rotation);
+    if (next != G_MAXINT64)
+    {
+        /* Round up so the wakeup lands on or just after the boundary. */
+        gint64 until = next * G_USEC_PER_SEC - g_get_real_time ();
+        delay_ms = CLAMP ((until + 999) / 1000, 0, OTP_REFRESH_MAX_SLEEP_MS);
+    }
+    otp_refresh_arm (self, (guint) delay_ms);
+
+    return G_SOURCE_REMOVE;
 }
 
 void
@@ -635,7 +778,9 @@ otpclient_window_start_otp_timer (OTPClientWindow *self)
     if (self->otp_refresh_timer_id != 0)
         return;
 
-    self->otp_refresh_timer_id = g_timeout_add_seconds (1, otp_refresh_tick, self);
+    if (self->otp_rotation == NULL)
+        self->otp_rotation = otp_rotation_wheel_new ();
+    otp_refresh_arm (self, 0);
 }
 
 void
@@ -648,6 +793,19 @@ otpclient_window_stop_otp_timer (OTPClientWindow *self)
         g_source_remove (self->otp_refresh_timer_id);
         self->otp_refresh_timer_id = 0;
     }
+    /* Drop the wheel's entry references along with the timer. */
+    g_clear_pointer (&self->otp_rotation, otp_rotation_wheel_free);
+}
+
+void
+otpclient_window_resync_otp_timer (OTPClientWindow *self)
+{
+    g_return_if_fail (OTPCLIENT_IS_WINDOW (self));
+
+    /* The pending timeout did not advance while suspended; check the wall
+     * clock now instead. */
+    if (self->otp_refresh_timer_id != 0)
+        otp_refresh_arm (self, 0);
 }
 
 /* ── Cross-database search ─────────────────────────────────────────── */
@@ -679,114 +837,122 @@ cross_db_deactivate (OTPClientWindow *self)
     gtk_filter_list_model_set_model (self->filter_model, G_LIST_MODEL (self->otp_store));
 }
 
+/* Each database other than the open one is loaded by its own job: Secret
+ * Service lookup, Argon2id, decrypt and parse. The jobs of one load run on a
+ * small thread pool and publish their tokens as each finishes, so the first
+ * results show after one KDF rather than after all of them. */
 typedef struct {
-    GPtrArray *db_list;    /* array of DbListEntry (owned) */
-    gchar *current_db_path;
+    gchar *path;
+    gchar *name;
     gint32 max_file_size;
     GWeakRef window_ref;
-} CrossDbTaskData;
+    gint claimed;
+} CrossDbJob;
 
 static void
-cross_db_task_data_free (gpointer data)
+cross_db_job_free (gpointer data)
 {
-    CrossDbTaskData *td = data;
-    g_weak_ref_clear (&td->window_ref);
-    g_free (td->current_db_path);
-    if (td->db_list != NULL)
-        g_ptr_array_unref (td->db_list);
-    g_free (td);
+    CrossDbJob *job = data;
+    g_weak_ref_clear (&job->window_ref);
+    g_free (job->path);
+    g_free (job->name);
+    g_free (job);
 }
 
-static void
-cross_db_load_thread (GTask        *task,
-                      gpointer      source,
-                      gpointer      task_data,
-                      GCancellable *cancellable)
+/* One worker per core, but no more than the secure memory pool can hold
+ * decrypted databases at once. */
+static guint
+cross_db_worker_count (GPtrArray *jobs,
+                       gint32     max_file_size)
 {
-    (void) source;
-    CrossDbTaskData *td = task_data;
-    GListStore *result = g_list_store_new (OTP_TYPE_ENTRY);
-
-    for (guint i = 0; i < td->db_list->len; i++)
+    gsize largest = 0;
+    for (guint i = 0; i < jobs->len; i++)
     {
-        if (g_cancellable_is_cancelled (cancellable)) {
-            g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_CANCELLED,
-                                     "Cross-database load cancelled");
-            g_object_unref (result);
-            return;
-        }
-
-        DbListEntry *dbe = g_ptr_array_index (td->db_list, i);
+        CrossDbJob *job = g_task_get_task_data (g_ptr_array_index (jobs, i));
+        largest = MAX (largest, db_cache_estimate_cost (job->path));
+    }
 
-        /* Skip the currently active database */
-        if (g_strcmp0 (dbe->path, td->current_db_path) == 0)
-            continue;
+    guint workers = g_get_num_processors ();
+    if (max_file_size > 0 && largest > 0)
+    {
+        gsize budget = (gsize) (max_file_size * SECMEM_SIZE_THRESHOLD_RATIO);
+        workers = (guint) MIN ((gsize) workers, budget / largest);
+    }
+    return CLAMP (workers, 1, MAX (jobs->len, 1));
+}
 
-        /* Look up password from Secret Service */
-        gchar *pwd = secret_password_lookup_sync (OTPCLIENT_SCHEMA, cancellable, NULL,
-                                                   "string", dbe->path, NULL);
-        if (pwd == NULL)
-            continue;   /* No password stored for this DB -- skip it */
+static void
+cross_db_run_job (GTask *task)
+{
+    CrossDbJob *job = g_task_get_task_data (task);
+    GCancellable *cancellable = g_task_get_cancellable (task);
 
-        DatabaseData *db_data = database_data_new (dbe->path, td->max_file_size);
-        db_data->key = secure_strdup (pwd);
-        secret_password_free (pwd);
+    if (g_task_return_error_if_cancelled (task))
+        return;
 
-        GError *err = NULL;
-        load_db (db_data, &err);
-        if (err != NULL || db_data->in_memory_json_data == NULL)
-        {
-            if (err != NULL)
-                g_clear_error (&err);
-            database_data_free (db_data);
-            continue;
-        }
+    /* Look up password from Secret Service */
+    gchar *pwd = secret_password_lookup_sync (OTPCLIENT_SCHEMA, cancellable, NULL,
+                                               "string", job->path, NULL);
+    if (pwd == NULL)
+    {
+        /* No password stored for this DB -- nothing to show */
+        g_task_return_pointer (task, NULL, NULL);
+        return;
+    }
 
-        gsize idx;
-        json_t *obj;
-        json_array_foreach (db_data->in_memory_json_data, idx, obj)
-        {
-            const gchar *label = json_string_value (json_object_get (obj, "label"));
-            const gchar *issuer = json_string_value (json_object_get (obj, "issuer"));
-            const gchar *type = json_string_value (json_object_get (obj, "type"));
-            const gchar *algo = json_string_value (json_object_get (obj, "algo"));
-            const gchar *secret_str = json_string_value (json_object_get (obj, "secret"));
-            gint64 period = json_integer_value (json_object_get (obj, "period"));
-            gint64 counter = json_integer_value (json_object_get (obj, "counter"));
-            gint64 digits = json_integer_value (json_object_get (obj, "digits"));
-
-            if (period <= 0) period = 30;
-            if (digits <= 0) digits = 6;
-            if (type == NULL) type = "TOTP";
-            if (algo == NULL) algo = "SHA1";
-
-            OTPEntry *entry = otp_entry_new (
-                label ? label : "",
-                issuer ? issuer : "",
-                NULL,
-                type,
-                (guint32) period,
-                (guint64) counter,
-                algo,
-                (guint32) digits,
-                secret_str);
-
-            const gchar *group = json_string_value (json_object_get (obj, "group"));
-            if (group != NULL)
-                otp_entry_set_group (entry, group);
-            otp_entry_set_db_name (entry, dbe->name);
-            /* OTP is computed lazily - see otp_text_column_bind /
-             * on_otp_selection_changed. Computing every cross-DB entry's OTP
-             * upfront wastes cycles when the user only opens search to find
-             * one token. */
-            g_list_store_append (result, entry);
-            g_object_unref (entry);
-        }
+    DatabaseData *db_data = database_data_new (job->path, job->max_file_size);
+    db_data->key = secure_strdup (pwd);
+    secret_password_free (pwd);
 
+    GError *err = NULL;
+    load_db (db_data, &err);
+    if (err != NULL || db_data->in_memory_json_data == NULL)
+    {
+        if (err != NULL)
+            g_task_return_error (task, err);
+        else
+            g_task_return_pointer (task, NULL, NULL);
         database_data_free (db_data);
+        return;
     }
 
-    g_task_return_pointer (task, result, g_object_unref);
+    /* Only the token references are kept; OTPEntry objects are built
+     * when search results are bound, and their codes when shown. */
+    json_t *tokens = json_incref (db_data->in_memory_json_data);
+    database_data_free (db_data);
+    g_task_return_pointer (task, tokens, json_free);
+}
+
+/* A job can be reached by its pool and by the fallback in
+ * cross_db_trigger_load; only the first one runs it. */
+static gboolean
+cross_db_claim_job (GTask *task)
+{
+    CrossDbJob *job = g_task_get_task_data (task);
+    return g_atomic_int_compare_and_exchange (&job->claimed, FALSE, TRUE);
+}
+
+static void
+cross_db_load_one (gpointer data,
+                   gpointer user_data)
+{
+    (void) user_data;
+    GTask *task = data;
+    if (cross_db_claim_job (task))
+        cross_db_run_job (task);
+    g_object_unref (task);
+}
+
+static void
+cross_db_load_in_thread (GTask        *task,
+                         gpointer      source_object,
+                         gpointer      task_data,
+                         GCancellable *cancellable)
+{
+    (void) source_object;
+    (void) task_data;
+    (void) cancellable;
+    cross_db_run_job (task);
 }
 
 static void
@@ -795,48 +961,64 @@ cross_db_load_done (GObject      *source,
                     gpointer      user_data)
 {
     (void) source;
+    (void) user_data;
 
-    CrossDbTaskData *td = user_data;
-    g_autoptr (OTPClientWindow) self = g_weak_ref_get (&td->window_ref);
-    if (self == NULL)
-        return;
-
-    self->cross_db_loading = FALSE;
+    GTask *task = G_TASK (result);
+    CrossDbJob *job = g_task_get_task_data (task);
+    g_autoptr (OTPClientWindow) self = g_weak_ref_get (&job->window_ref);
 
     GError *err = NULL;
-    GListStore *store = g_task_propagate_pointer (G_TASK (result), &err);
-    if (err != NULL) {
+    json_t *tokens = g_task_propagate_pointer (task, &err);
+    if (err != NULL)
+    {
         if (!g_error_matches (err, G_IO_ERROR, G_IO_ERROR_CANCELLED))
-            g_warning ("Cross-database load failed: %s", err->message);
+            g_warning ("Cross-database load of %s failed: %s", job->path, err->message);
         g_clear_error (&err);
-        return;
     }
-    if (store == NULL)
-        return;
-
-    if (self->disposing)
+    /* A cancelled job was already dropped from cross_db_jobs. */
+    if (self == NULL || self->disposing || self->cross_db_jobs == NULL
+        || g_hash_table_lookup (self->cross_db_jobs, job->path) != g_task_get_cancellable (task))
     {
-        g_object_unref (store);
+        if (tokens != NULL)
+            json_decref (tokens);
         return;
     }
+    g_hash_table_remove (self->cross_db_jobs, job->path);
 
-    g_clear_object (&self->cross_db_store);
-    self->cross_db_store = store;
-    self->cross_db_loaded = TRUE;
+    if (tokens != NULL)
+    {
+        otp_token_model_append (self->cross_db_store, tokens, job->name);
+        json_decref (tokens);
 
-    /* Rebuild the flatten model with the new cross-db store */
-    g_clear_object (&self->flatten_model);
+        /* If there's an active search, show the new rows right away */
+        const gchar *text = gtk_editable_get_text (GTK_EDITABLE (self->search_entry));
+        if (text != NULL && text[0] != '\0')
+            cross_db_activate (self);
+    }
 
-    /* If there's an active search, wire up the flatten model */
-    const gchar *text = gtk_editable_get_text (GTK_EDITABLE (self->search_entry));
-    if (text != NULL && text[0] != '\0')
+    if (g_hash_table_size (self->cross_db_jobs) == 0)
     {
-        cross_db_activate (self);
-        refresh_search_cache (self);
-        gtk_filter_changed (GTK_FILTER (self->search_filter), GTK_FILTER_CHANGE_DIFFERENT);
+        self->cross_db_loading = FALSE;
+        self->cross_db_loaded = TRUE;
     }
 }
 
+/* Cancels every job still running; their results are dropped. */
+static void
+cross_db_cancel_jobs (OTPClientWindow *self)
+{
+    if (self->cross_db_jobs != NULL)
+    {
+        GHashTableIter iter;
+        gpointer cancellable;
+        g_hash_table_iter_init (&iter, self->cross_db_jobs);
+        while (g_hash_table_iter_next (&iter, NULL, &cancellable))
+            g_cancellable_cancel (G_CANCELLABLE (cancellable));
+        g_hash_table_remove_all (self->cross_db_jobs);
+    }
+    self->cross_db_loading = FALSE;
+}
+
 static void
 cross_db_trigger_load (OTPClientWindow *self)
 {
@@ -860,83 +1042,221 @@ cross_db_trigger_load (OTPClientWindow *self)
         return;
     }
 
+    if (self->cross_db_store == NULL)
+    {
+        self->cross_db_store = otp_token_model_new ();
+        otp_token_model_set_search_index (self->cross_db_store, self->search_index);
+        /* The flatten model has to pick up the new store */
+        g_clear_object (&self->flatten_model);
+    }
+    if (self->cross_db_jobs == NULL)
+        self->cross_db_jobs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_object_unref);
+
+    GPtrArray *tasks = g_ptr_array_new_with_free_func (g_object_unref);
+    for (guint i = 0; i < db_list->len; i++)
+    {
+        DbListEntry *dbe = g_ptr_array_index (db_list, i);
+
+        /* Skip the currently active database */
+        if (g_strcmp0 (dbe->path, db_data->db_path) == 0
+            || g_hash_table_contains (self->cross_db_jobs, dbe->path))
+            continue;
+
+        CrossDbJob *job = g_new0 (CrossDbJob, 1);
+        job->path = g_strdup (dbe->path);
+        job->name = g_strdup (dbe->name);
+        job->max_file_size = db_data->max_file_size_from_memlock;
+        g_weak_ref_init (&job->window_ref, self);
+
+        GCancellable *cancellable = g_cancellable_new ();
+        g_hash_table_insert (self->cross_db_jobs, g_strdup (dbe->path), cancellable);
+        GTask *task = g_task_new (NULL, cancellable, cross_db_load_done, NULL);
+        g_task_set_task_data (task, job, cross_db_job_free);
+        g_ptr_array_add (tasks, task);
+    }
+    g_ptr_array_unref (db_list);
+
+    if (tasks->len == 0)
+    {
+        g_ptr_array_unref (tasks);
+        return;
+    }
+
     self->cross_db_loading = TRUE;
-    g_clear_object (&self->cross_db_cancellable);
-    self->cross_db_cancellable = g_cancellable_new ();
-
-    CrossDbTaskData *td = g_new0 (CrossDbTaskData, 1);
-    td->db_list = db_list;
-    td->current_db_path = g_strdup (db_data->db_path);
-    td->max_file_size = db_data->max_file_size_from_memlock;
-    g_weak_ref_init (&td->window_ref, self);
-
-    GTask *task = g_task_new (NULL, self->cross_db_cancellable, cross_db_load_done, td);
-    g_task_set_task_data (task, td, cross_db_task_data_free);
-    g_task_run_in_thread (task, cross_db_load_thread);
-    g_object_unref (task);
+    guint workers = cross_db_worker_count (tasks, db_data->max_file_size_from_memlock);
+    /* The pool drops its reference once the job has run, or when it is freed
+     * with the job still queued */
+    GThreadPool *pool = g_thread_pool_new_full (cross_db_load_one, NULL, g_object_unref,
+                                                (gint) workers, FALSE, NULL);
+    for (guint i = 0; i < tasks->len; i++)
+        thread_pool_push_queued (pool, g_object_ref (g_ptr_array_index (tasks, i)),
+                                 "a database search load");
+    if (g_thread_pool_get_num_threads (pool) == 0 && g_thread_pool_unprocessed (pool) > 0)
+    {
+        /* Not one worker could be started, and nothing else pushes to this
+         * pool to start one later: hand what is left to GTask's own pool */
+        for (guint i = 0; i < tasks->len; i++)
+        {
+            GTask *task = g_ptr_array_index (tasks, i);
+            if (cross_db_claim_job (task))
+                g_task_run_in_thread (task, cross_db_load_in_thread);
+        }
+        g_thread_pool_free (pool, TRUE, FALSE);
+    }
+    else
+    {
+        /* Frees itself once the queued jobs have run */
+        g_thread_pool_free (pool, FALSE, FALSE);
+    }
+    g_ptr_array_unref (tasks);
 }
 
 void
 otpclient_window_invalidate_cross_db (OTPClientWindow *self)
 {
     g_return_if_fail (OTPCLIENT_IS_WINDOW (self));
+    cross_db_cancel_jobs (self);
     self->cross_db_loaded = FALSE;
     if (self->cross_db_store != NULL)
-        g_list_store_remove_all (self->cross_db_store);
+        otp_token_model_remove_all (self->cross_db_store);
 }
 
 /* Re-derive search_lower / search_group_lower from the live search entry text.
- * Must be called from every code path that ends with gtk_filter_changed on the
- * search filter - otherwise the per-row filter will run against stale strings. */
-static void
-refresh_search_cache (OTPClientWindow *self)
+ * Must be called from every code path that ends with apply_search_filter -
+ * otherwise the per-row filter will run against stale strings. Returns FALSE
+ * when the query did not change; otherwise change (if non-NULL) says how the
+ * new query relates to the previous one. */
+static gboolean
+refresh_search_cache (OTPClientWindow *self,
+                      GtkFilterChange *change)
+{
+    g_autofree gchar *group_lower = NULL;
+    g_autofree gchar *text_lower = NULL;
+    search_query_parse (gtk_editable_get_text (GTK_EDITABLE (self->search_entry)),
+                        &group_lower, &text_lower);
+
+    GtkFilterChange how = GTK_FILTER_CHANGE_DIFFERENT;
+    gboolean changed = search_query_diff (self->search_group_lower, self->search_lower,
+                                          group_lower, text_lower, &how);
+    if (change != NULL)
+        *change = how;
+
+    g_free (self->search_group_lower);
+    self->search_group_lower = g_steal_pointer (&group_lower);
+    g_free (self->search_lower);
+    self->search_lower = g_steal_pointer (&text_lower);
+    if (changed)
+    {
+        self->search_candidates_valid = FALSE;
+        self->search_generation++;
+    }
+    return changed;
+}
+
+/* The tokens that can match the current query, or NULL for all of them.
+ * Looked up again only when the query or the indexed tokens changed. */
+static GHashTable *
+current_search_candidates (OTPClientWindow *self)
 {
-    g_clear_pointer (&self->search_lower, g_free);
-    g_clear_pointer (&self->search_group_lower, g_free);
+    if (self->search_index == NULL)
+        return NULL;
 
-    const gchar *text = gtk_editable_get_text (GTK_EDITABLE (self->search_entry));
-    if (text == NULL || text[0] == '\0')
-        return;
+    guint stamp = search_index_get_stamp (self->search_index);
+    if (!self->search_candidates_valid || stamp != self->search_candidates_stamp)
+    {
+        g_clear_pointer (&self->search_candidates, g_hash_table_unref);
+        self->search_candidates = search_index_lookup (self->search_index,
+                                                       self->search_group_lower,
+                                                       self->search_lower);
+        self->search_candidates_stamp = stamp;
+        self->search_candidates_valid = TRUE;
+    }
+    return self->search_candidates;
+}
+
+static gchar *
+usage_key (OTPEntry *entry)
+{
+    return g_strdup_printf ("%s\x1f%s", otp_entry_get_issuer_lower (entry),
+                            otp_entry_get_account_lower (entry));
+}
 
-    const gchar *remaining_text = text;
-    g_autofree gchar *search_group = NULL;
+G_DEFINE_QUARK (otp-search-score, otp_search_score)
 
-    if (g_str_has_prefix (text, "group:"))
+/* Match rank (in thousands) plus how often the entry was copied. Cached on
+ * the entry for the current query: the sorter asks O(n log n) times. */
+static guint
+search_score (OTPClientWindow *self,
+              OTPEntry        *entry)
+{
+    guint generation = self->search_generation & 0xffff;
+    guint cached = GPOINTER_TO_UINT (g_object_get_qdata (G_OBJECT (entry), otp_search_score_quark ()));
+    if (cached != 0 && (cached >> 16) == generation)
+        return (cached & 0xffff) - 1;
+
+    SearchRank rank = search_query_rank (otp_entry_get_account_lower (entry),
+                                         otp_entry_get_issuer_lower (entry),
+                                         self->search_lower);
+    guint usage = 0;
+    if (self->usage_counts != NULL)
     {
-        const gchar *rest = text + 6;
-        const gchar *space = strchr (rest, ' ');
-        if (space != NULL)
-        {
-            search_group = g_strndup (rest, space - rest);
-            remaining_text = space + 1;
-        }
-        else
-        {
-            search_group = g_strdup (rest);
-            remaining_text = NULL;
-        }
+        g_autofree gchar *key = usage_key (entry);
+        usage = GPOINTER_TO_UINT (g_hash_table_lookup (self->usage_counts, key));
     }
-    else if (text[0] == '#' && text[1] != '\0')
+    guint score = (guint) rank * 1000 + MIN (usage, 999);
+    g_object_set_qdata (G_OBJECT (entry), otp_search_score_quark (),
+                        GUINT_TO_POINTER ((generation << 16) | (score + 1)));
+    return score;
+}
+
+static gint
+ranked_sort_func (gconstpointer a,
+                  gconstpointer b,
+                  gpointer      user_data)
+{
+    OTPClientWindow *self = OTPCLIENT_WINDOW (user_data);
+    guint score_a = search_score (self, OTP_ENTRY ((gpointer) a));
+    guint score_b = search_score (self, OTP_ENTRY ((gpointer) b));
+    /* Best first */
+    return (score_a < score_b) - (score_a > score_b);
+}
+
+/* With no query and no group selected every row matches: detach the filter
+ * so the model passes rows through without building an entry for each.
+ * Otherwise (re)attach it, or tell it how the query changed. Huge lists are
+ * filtered incrementally. Ranking follows the free text. */
+static void
+apply_search_filter (OTPClientWindow *self,
+                     GtkFilterChange  change)
+{
+    gboolean active = (self->search_lower != NULL || self->search_group_lower != NULL
+                       || self->active_group_filter != NULL);
+    GtkFilter *current = gtk_filter_list_model_get_filter (self->filter_model);
+
+    /* Rank only while there is free text: any custom sorter makes the sort
+     * model visit every row, so the plain column sorter stays otherwise. */
+    GtkSorter *sorter = (self->search_lower != NULL) ? self->ranked_sorter : self->column_sorter;
+    if (gtk_sort_list_model_get_sorter (self->sort_model) != sorter)
+        gtk_sort_list_model_set_sorter (self->sort_model, sorter);
+    else if (sorter != NULL && sorter == self->ranked_sorter)
+        gtk_sorter_changed (sorter, GTK_SORTER_CHANGE_DIFFERENT);
+
+    if (!active)
     {
-        const gchar *rest = text + 1;
-        const gchar *space = strchr (rest, ' ');
-        if (space != NULL)
-        {
-            search_group = g_strndup (rest, space - rest);
-            remaining_text = space + 1;
-        }
-        else
-        {
-            search_group = g_strdup (rest);
-            remaining_text = NULL;
-        }
+        if (current != NULL)
+            gtk_filter_list_model_set_filter (self->filter_model, NULL);
+        return;
     }
 
-    if (search_group != NULL)
-        self->search_group_lower = g_utf8_strdown (search_group, -1);
+    GListModel *source = gtk_filter_list_model_get_model (self->filter_model);
+    guint n_source = (source != NULL) ? g_list_model_get_n_items (source) : 0;
+    gtk_filter_list_model_set_incremental (self->filter_model,
+                                           n_source >= SEARCH_INCREMENTAL_MIN_ITEMS);
 
-    if (remaining_text != NULL && remaining_text[0] != '\0')
-        self->search_lower = g_utf8_strdown (remaining_text, -1);
+    if (current == NULL)
+        gtk_filter_list_model_set_filter (self->filter_model, GTK_FILTER (self->search_filter));
+    else
+        gtk_filter_changed (GTK_FILTER (self->search_filter), change);
 }
 
 static gboolean
@@ -964,7 +1284,16 @@ search_filter_func (gpointer item,
         }
     }
 
-    /* --- Search text filter (uses cached lowered strings) --- */
+    /* --- Search text filter: index candidates, then the cached lowered
+     * strings confirm the match --- */
+    GHashTable *candidates = current_search_candidates (self);
+    if (candidates != NULL)
+    {
+        json_t *token = otp_token_model_get_entry_token (entry);
+        if (token != NULL && !g_hash_table_contains (candidates, token))
+            return FALSE;
+    }
+
     if (self->search_group_lower != NULL)
     {
         const gchar *eg_lower = otp_entry_get_group_lower (entry);
@@ -975,11 +1304,9 @@ search_filter_func (gpointer item,
     if (self->search_lower == NULL)
         return TRUE;
 
-    const gchar *account_lower = otp_entry_get_account_lower (entry);
-    const gchar *issuer_lower  = otp_entry_get_issuer_lower (entry);
-
-    return (g_strstr_len (account_lower, -1, self->search_lower) != NULL ||
-            g_strstr_len (issuer_lower,  -1, self->search_lower) != NULL);
+    return search_query_rank (otp_entry_get_account_lower (entry),
+                              otp_entry_get_issuer_lower (entry),
+                              self->search_lower) != SEARCH_RANK_NONE;
 }
 
 /* Show a banner reminding the user to take a backup. We surface it when:
@@ -1102,7 +1429,12 @@ on_otp_store_items_changed (GListModel *model,
     (void) position;
     (void) removed;
     (void) added;
-    update_empty_state (OTPCLIENT_WINDOW (user_data));
+    OTPClientWindow *self = OTPCLIENT_WINDOW (user_data);
+    update_empty_state (self);
+
+    /* Refill the rotation wheel once the batch of changes is over. */
+    if (self->otp_rotation != NULL)
+        otp_refresh_arm (self, 0);
 }
 
 void
@@ -1186,15 +1518,13 @@ otpclient_window_clear_displayed_otps (OTPClientWindow *self)
     if (self->otp_store == NULL)
         return;
 
-    guint n = g_list_model_get_n_items (G_LIST_MODEL (self->otp_store));
-    for (guint i = 0; i < n; i++)
+    /* Tokens without an entry have no code to clear. */
+    g_autoptr (GPtrArray) live = otp_token_model_get_live (self->otp_store);
+    for (guint i = 0; i < live->len; i++)
     {
-        g_autoptr (OTPEntry) entry = g_list_model_get_item (G_LIST_MODEL (self->otp_store), i);
-        if (entry != NULL)
-        {
-            otp_entry_set_revealed (entry, FALSE);
-            otp_entry_set_otp_value (entry, "");
-        }
+        OTPEntry *entry = g_ptr_array_index (live, i);
+        otp_entry_set_revealed (entry, FALSE);
+        otp_entry_set_otp_value (entry, "");
     }
 
     g_weak_ref_set (&self->clipboard_owner_entry, NULL);
@@ -1213,20 +1543,34 @@ otpclient_window_refresh_content_page (OTPClientWindow *self)
 static void
 setup_otp_view (OTPClientWindow *self)
 {
-    self->otp_store = G_LIST_STORE (g_object_ref_sink (g_list_store_new (OTP_TYPE_ENTRY)));
+    self->otp_store = otp_token_model_new ();
+    self->search_index = search_index_new ();
+    self->usage_counts = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    otp_token_model_set_search_index (self->otp_store, self->search_index);
     g_signal_connect (self->otp_store, "items-changed",
                       G_CALLBACK (on_otp_store_items_changed), self);
 
     self->search_filter = gtk_custom_filter_new (search_filter_func, self, NULL);
-    self->filter_model = gtk_filter_list_model_new (G_LIST_MODEL (self->otp_store),
-                                                     GTK_FILTER (self->search_filter));
+    /* The filter is attached once there is something to filter by, see
+     * apply_search_filter. */
+    self->filter_model = gtk_filter_list_model_new (G_LIST_MODEL (self->otp_store), NULL);
+    g_signal_connect (self->filter_model, "notify::pending",
+                      G_CALLBACK (on_filter_pending_changed), self);
 
     add_text_column (GTK_COLUMN_VIEW (self->otp_list), _("Account"), OTP_COLUMN_ACCOUNT);
     add_text_column (GTK_COLUMN_VIEW (self->otp_list), _("Issuer"), OTP_COLUMN_ISSUER);
     add_text_column (GTK_COLUMN_VIEW (self->otp_list), _("OTP Value"), OTP_COLUMN_VALUE);
-    add_validity_column (GTK_COLUMN_VIEW (self->otp_list));
+    self->validity_rows = g_ptr_array_new ();
+    add_validity_column (self, GTK_COLUMN_VIEW (self->otp_list));
 
     GtkSorter *column_sorter = gtk_column_view_get_sorter (GTK_COLUMN_VIEW (self->otp_list));
+    self->column_sorter = column_sorter ? g_object_ref (column_sorter) : NULL;
+    /* While searching: best match first, then the column order. */
+    GtkMultiSorter *ranked = gtk_multi_sorter_new ();
+    gtk_multi_sorter_append (ranked, GTK_SORTER (gtk_custom_sorter_new (ranked_sort_func, self, NULL)));
+    if (column_sorter != NULL)
+        gtk_multi_sorter_append (ranked, g_object_ref (column_sorter));
+    self->ranked_sorter = GTK_SORTER (ranked);
     self->sort_model = gtk_sort_list_model_new (g_object_ref (G_LIST_MODEL (self->filter_model)),
                                                  column_sorter ? g_object_ref (column_sorter) : NULL);
 
@@ -1263,6 +1607,51 @@ search_func (OTPClientWindow *self,
         gtk_widget_grab_focus (self->search_entry);
 }
 
+/* Auto-select when search narrows to a single result or ranks one match
+ * above the rest. An incremental filter is still adding rows while pending,
+ * so wait for it to finish. */
+static void
+search_autoselect_single (OTPClientWindow *self)
+{
+    const gchar *text = gtk_editable_get_text (GTK_EDITABLE (self->search_entry));
+    if (text == NULL || text[0] == '\0')
+        return;
+    if (gtk_filter_list_model_get_pending (self->filter_model) > 0)
+    {
+        self->search_autoselect_pending = TRUE;
+        return;
+    }
+    self->search_autoselect_pending = FALSE;
+
+    guint n = g_list_model_get_n_items (G_LIST_MODEL (self->filter_model));
+    gboolean select_first = (n == 1);
+    if (n > 1 && self->search_lower != NULL
+        && gtk_sort_list_model_get_sorter (self->sort_model) == self->ranked_sorter)
+    {
+        /* Also when the top row is a clearly better kind of match (say the
+         * only prefix match) than the next one. */
+        g_autoptr (OTPEntry) first = g_list_model_get_item (G_LIST_MODEL (self->sort_model), 0);
+        g_autoptr (OTPEntry) second = g_list_model_get_item (G_LIST_MODEL (self->sort_model), 1);
+        select_first = search_score (self, first) / 1000 > search_score (self, second) / 1000;
+    }
+    if (select_first)
+    {
+        self->suppress_selection_action = TRUE;
+        gtk_single_selection_set_selected (self->otp_selection, 0);
+        self->suppress_selection_action = FALSE;
+    }
+}
+
+static void
+on_filter_pending_changed (GtkFilterListModel *model,
+                           GParamSpec         *pspec,
+                           OTPClientWindow    *self)
+{
+    (void) pspec;
+    if (self->search_autoselect_pending && gtk_filter_list_model_get_pending (model) == 0)
+        search_autoselect_single (self);
+}
+
 static void
 search_text_changed (GtkEntry        *entry,
                      OTPClientWindow *win)
@@ -1278,8 +1667,8 @@ search_text_changed (GtkEntry        *entry,
         if (!win->cross_db_loaded && !win->cross_db_loading)
             cross_db_trigger_load (win);
 
-        /* Switch to flatten model if cross-DB data is available */
-        if (win->cross_db_loaded && win->cross_db_store != NULL
+        /* Switch to flatten model once any other database has loaded */
+        if (win->cross_db_store != NULL
             && g_list_model_get_n_items (G_LIST_MODEL (win->cross_db_store)) > 0)
             cross_db_activate (win);
     }
@@ -1290,36 +1679,24 @@ search_text_changed (GtkEntry        *entry,
     }
 
     /* Sync search group prefix -> dropdown */
+    gboolean group_filter_cleared = FALSE;
     if (!win->syncing_group_filter && win->group_list_model != NULL)
     {
-        g_autofree gchar *search_group = NULL;
-        if (g_str_has_prefix (text, "group:"))
-        {
-            const gchar *rest = text + 6;
-            const gchar *space = strchr (rest, ' ');
-            search_group = space ? g_strndup (rest, space - rest) : g_strdup (rest);
-        }
-        else if (text[0] == '#' && text[1] != '\0')
-        {
-            const gchar *rest = text + 1;
-            const gchar *space = strchr (rest, ' ');
-            search_group = space ? g_strndup (rest, space - rest) : g_strdup (rest);
-        }
+        g_autofree gchar *search_group = search_query_get_group (text);
 
         if (search_group != NULL)
         {
-            /* Find matching group in dropdown and select it */
-            guint n_items = g_list_model_get_n_items (G_LIST_MODEL (win->group_list_model));
+            /* Find matching group in dropdown and select it. The lowered
+             * names are cached by rebuild_group_list. */
             g_autofree gchar *sg_lower = g_utf8_strdown (search_group, -1);
             win->syncing_group_filter = TRUE;
             gboolean found = FALSE;
-            for (guint i = 1; i < n_items - 1; i++)
+            for (guint i = 0; win->group_names_lower != NULL && i < win->group_names_lower->len; i++)
             {
-                const gchar *item = gtk_string_list_get_string (win->group_list_model, i);
-                g_autofree gchar *item_lower = g_utf8_strdown (item, -1);
+                const gchar *item_lower = g_ptr_array_index (win->group_names_lower, i);
                 if (g_strstr_len (item_lower, -1, sg_lower) != NULL)
                 {
-                    gtk_drop_down_set_selected (GTK_DROP_DOWN (win->group_dropdown), i);
+                    gtk_drop_down_set_selected (GTK_DROP_DOWN (win->group_dropdown), i + 1);
                     found = TRUE;
                     break;
                 }
@@ -1332,23 +1709,29 @@ search_text_changed (GtkEntry        *entry,
         {
             /* Search cleared: reset dropdown to "All" */
             win->syncing_group_filter = TRUE;
+            group_filter_cleared = (win->active_group_filter != NULL);
             g_clear_pointer (&win->active_group_filter, g_free);
             gtk_drop_down_set_selected (GTK_DROP_DOWN (win->group_dropdown), 0);
             win->syncing_group_filter = FALSE;
         }
     }
 
-    refresh_search_cache (win);
-    gtk_filter_changed (GTK_FILTER (win->search_filter), GTK_FILTER_CHANGE_DIFFERENT);
-
-    /* Auto-select when search narrows to a single result */
-    guint n = g_list_model_get_n_items (G_LIST_MODEL (win->filter_model));
-    if (n == 1)
+    /* Typing onto the query only narrows it and backspace only widens it,
+     * so GTK re-checks just the shown (or just the hidden) rows. */
+    GtkFilterChange change = GTK_FILTER_CHANGE_DIFFERENT;
+    gboolean query_changed = refresh_search_cache (win, &change);
+    if (group_filter_cleared)
     {
-        win->suppress_selection_action = TRUE;
-        gtk_single_selection_set_selected (win->otp_selection, 0);
-        win->suppress_selection_action = FALSE;
+        if (query_changed && change != GTK_FILTER_CHANGE_LESS_STRICT)
+            change = GTK_FILTER_CHANGE_DIFFERENT;
+        else
+            change = GTK_FILTER_CHANGE_LESS_STRICT;
+        query_changed = TRUE;
     }
+    if (query_changed)
+        apply_search_filter (win, change);
+
+    search_autoselect_single (win);
 }
 
 static void on_otp_selection_changed (GtkSingleSelection *selection,
@@ -1711,7 +2094,7 @@ otpclient_window_clear_clipboard_now (OTPClientWindow *self)
 static void
 copy_otp_to_clipboard_and_notify (OTPClientWindow *self, OTPEntry *entry)
 {
-    const gchar *otp_value = otp_entry_get_otp_value (entry);
+    const gchar *otp_value = otp_entry_ensure_otp (entry);
     if (otp_value == NULL || otp_value[0] == '\0')
         return;
 
@@ -1728,6 +2111,13 @@ copy_otp_to_clipboard_and_notify (OTPClientWindow *self, OTPEntry *entry)
 
     g_weak_ref_set (&self->clipboard_owner_entry, entry);
 
+    if (self->usage_counts != NULL)
+    {
+        gchar *key = usage_key (entry);
+        guint count = GPOINTER_TO_UINT (g_hash_table_lookup (self->usage_counts, key));
+        g_hash_table_replace (self->usage_counts, key, GUINT_TO_POINTER (count + 1));
+    }
+
     if (self->clipboard_clear_timer_id != 0)
         g_source_remove (self->clipboard_clear_timer_id);
     guint clear_timeout = 30;
@@ -1777,7 +2167,7 @@ trigger_otp_action_for_entry (OTPClientWindow *self, OTPEntry *entry)
                 otp_entry_set_counter (entry, new_counter);
                 otp_entry_update_otp (entry);
 
-                json_t *token_obj = json_array_get (db_data->in_memory_json_data, json_pos);
+                json_t *token_obj = db_token_for_write (db_data->in_memory_json_data, json_pos);
                 if (token_obj != NULL)
                 {
                     json_object_set_new (token_obj, "counter", json_integer ((json_int_t) new_counter));
@@ -1791,13 +2181,9 @@ trigger_otp_action_for_entry (OTPClientWindow *self, OTPEntry *entry)
         }
     }
 
-    /* For cross-DB entries, the cached OTP may be missing (never computed)
-     * or stale (TOTP rotated since the row was first bound). Recompute now
-     * so the user always copies a fresh code. */
-    if (otp_entry_get_db_name (entry) != NULL)
-        otp_entry_update_otp (entry);
-
-    const gchar *otp_value = otp_entry_get_otp_value (entry);
+    /* The cached OTP may be missing (the row was never shown unmasked) or
+     * stale (TOTP rotated while the row was off screen). */
+    const gchar *otp_value = otp_entry_ensure_otp (entry);
     if (otp_value == NULL || otp_value[0] == '\0')
         return;
 
@@ -1854,21 +2240,14 @@ on_otp_selection_changed (GtkSingleSelection *selection,
 static guint
 find_store_pos_for_entry (OTPClientWindow *self, OTPEntry *entry)
 {
-    guint n = g_list_model_get_n_items (G_LIST_MODEL (self->otp_store));
-    for (guint i = 0; i < n; i++)
-    {
-        g_autoptr (OTPEntry) e = g_list_model_get_item (G_LIST_MODEL (self->otp_store), i);
-        if (e == entry)
-            return i;
-    }
-    return GTK_INVALID_LIST_POSITION;
+    return otp_token_model_find (self->otp_store, entry);
 }
 
 /* Resolve the current selection to a JSON-array index.
  *
  * The selection wraps sort+filter+store, so the bare selection position
  * reflects the filtered+sorted view - not the underlying store or the
- * JSON. on_db_modified() rebuilds otp_store from the JSON array in
+ * JSON. on_db_modified() syncs otp_store with the JSON array in
  * order, so the store position equals the JSON index. Look up the
  * selected item itself rather than trusting the selection position.
  *
@@ -2116,9 +2495,8 @@ on_drop (GtkDropTarget *target,
     if (insert_pos == source_pos)
         return FALSE;
 
-    /* Reorder in GListStore */
-    g_list_store_remove (self->otp_store, source_pos);
-    g_list_store_insert (self->otp_store, insert_pos, source_entry);
+    /* Reorder in the token model */
+    otp_token_model_move (self->otp_store, source_pos, insert_pos);
 
     /* Reorder in the JSON database */
     OTPClientApplication *app = OTPCLIENT_APPLICATION (
@@ -2138,13 +2516,7 @@ on_drop (GtkDropTarget *target,
                 json_decref (item);
             }
 
-            GError *err = NULL;
-            update_db (db_data, &err);
-            if (err != NULL)
-            {
-                show_error_toast (self, _("Failed to save reordered tokens: %s"), err->message);
-                g_clear_error (&err);
-            }
+            commit_in_background (self, db_data, _("Failed to save reordered tokens"), FALSE);
         }
     }
 
@@ -2228,8 +2600,7 @@ otpclient_window_dispose (GObject *object)
     OTPClientWindow *win = OTPCLIENT_WINDOW(object);
     win->disposing = TRUE;
 
-    if (win->cross_db_cancellable != NULL)
-        g_cancellable_cancel (win->cross_db_cancellable);
+    cross_db_cancel_jobs (win);
     if (win->webcam_cancellable != NULL)
         g_cancellable_cancel (win->webcam_cancellable);
     if (win->clipboard_cancellable != NULL)
@@ -2258,26 +2629,39 @@ otpclient_window_dispose (GObject *object)
         g_source_remove (win->otp_refresh_timer_id);
         win->otp_refresh_timer_id = 0;
     }
+    g_clear_pointer (&win->otp_rotation, otp_rotation_wheel_free);
 
     if (win->otp_list && GTK_IS_COLUMN_VIEW (win->otp_list))
         gtk_column_view_set_model (GTK_COLUMN_VIEW (win->otp_list), NULL);
 
+    if (win->validity_tick_id != 0 && win->otp_list != NULL)
+        gtk_widget_remove_tick_callback (win->otp_list, win->validity_tick_id);
+    win->validity_tick_id = 0;
+    g_clear_pointer (&win->validity_rows, g_ptr_array_unref);
+
     if (win->otp_selection)
         gtk_single_selection_set_model (win->otp_selection, NULL);
 
     g_clear_object (&win->otp_selection);
     g_clear_object (&win->sort_model);
     g_clear_object (&win->filter_model);
+    g_clear_object (&win->search_filter);
+    g_clear_object (&win->ranked_sorter);
+    g_clear_object (&win->column_sorter);
+    g_clear_pointer (&win->search_candidates, g_hash_table_unref);
+    g_clear_pointer (&win->search_index, search_index_unref);
+    g_clear_pointer (&win->usage_counts, g_hash_table_unref);
     g_clear_object (&win->otp_store);
     g_clear_object (&win->db_store);
     g_clear_object (&win->cross_db_store);
     g_clear_object (&win->flatten_model);
-    g_clear_object (&win->cross_db_cancellable);
+    g_clear_pointer (&win->cross_db_jobs, g_hash_table_unref);
     g_clear_object (&win->webcam_cancellable);
     g_clear_object (&win->clipboard_cancellable);
     g_clear_object (&win->file_dialog_cancellable);
     g_clear_object (&win->group_list_model);
     g_clear_pointer (&win->active_group_filter, g_free);
+    g_clear_pointer (&win->group_names_lower, g_ptr_array_unref);
     g_clear_pointer (&win->search_lower, g_free);
     g_clear_pointer (&win->search_group_lower, g_free);
     g_clear_object (&win->settings);
@@ -2295,6 +2679,17 @@ otpclient_window_dispose (GObject *object)
         g_clear_object (&win->dnd_css_provider);
     }
 
+    if (win->validity_css != NULL)
+    {
+        GdkDisplay *display = gtk_widget_get_display (GTK_WIDGET (win));
+        if (display != NULL)
+            gtk_style_context_remove_provider_for_display (
+                display,
+                GTK_STYLE_PROVIDER (win->validity_css));
+        g_clear_object (&win->validity_css);
+    }
+    g_clear_pointer (&win->validity_css_colors, g_free);
+
     gtk_widget_dispose_template (GTK_WIDGET (object), OTPCLIENT_TYPE_WINDOW);
     G_OBJECT_CLASS (otpclient_window_parent_class)->dispose (object);
 }
@@ -2312,21 +2707,23 @@ otpclient_window_flush_pending_writes (OTPClientWindow *self,
         self->hotp_flush_timeout_id = 0;
     }
 
-    if (!self->hotp_counter_dirty)
-        return TRUE;
-
     OTPClientApplication *app = OTPCLIENT_APPLICATION (
         gtk_window_get_application (GTK_WINDOW (self)));
     if (app == NULL)
-        return FALSE;
+        return !self->hotp_counter_dirty;
 
     DatabaseData *db_data = otpclient_application_get_db_data (app);
     if (db_data == NULL || db_data->in_memory_json_data == NULL)
-        return FALSE;
+        return !self->hotp_counter_dirty;
 
+    /* Queue the deferred counters behind whatever edits are still in flight,
+     * then wait for all of them: the caller is about to lock or quit. */
     GError *local_error = NULL;
-    update_db (db_data, &local_error);
-    if (local_error != NULL)
+    gboolean ok = !self->hotp_counter_dirty ||
+                  db_commit_async (db_data, NULL, NULL, NULL, NULL, &local_error);
+    if (ok)
+        ok = db_commit_flush (db_data, &local_error);
+    if (!ok)
     {
         if (error != NULL)
             g_propagate_error (error, local_error);
@@ -2335,6 +2732,8 @@ otpclient_window_flush_pending_writes (OTPClientWindow *self,
                        local_error->message);
             g_clear_error (&local_error);
         }
+        /* Either way the live array is back at the last committed state. */
+        self->hotp_counter_dirty = FALSE;
         return FALSE;
     }
     self->hotp_counter_dirty = FALSE;
@@ -2346,7 +2745,19 @@ hotp_flush_debounce_cb (gpointer user_data)
 {
     OTPClientWindow *self = OTPCLIENT_WINDOW (user_data);
     self->hotp_flush_timeout_id = 0;
-    otpclient_window_flush_pending_writes (self, NULL);
+
+    if (!self->hotp_counter_dirty)
+        return G_SOURCE_REMOVE;
+
+    OTPClientApplication *app = OTPCLIENT_APPLICATION (
+        gtk_window_get_application (GTK_WINDOW (self)));
+    DatabaseData *db_data = app != NULL ? otpclient_application_get_db_data (app) : NULL;
+    if (db_data == NULL || db_data->in_memory_json_data == NULL)
+        return G_SOURCE_REMOVE;
+
+    /* Nobody is waiting on this one, so it can go through the queue. */
+    self->hotp_counter_dirty = FALSE;
+    commit_in_background (self, db_data, _("Failed to persist HOTP counters"), FALSE);
     return G_SOURCE_REMOVE;
 }
 
@@ -2370,15 +2781,13 @@ otpclient_window_secure_lock_cleanup (OTPClientWindow *self)
         self->deleted_token = NULL;
     }
 
-    if (self->cross_db_cancellable != NULL)
-        g_cancellable_cancel (self->cross_db_cancellable);
+    cross_db_cancel_jobs (self);
     if (self->webcam_cancellable != NULL)
         g_cancellable_cancel (self->webcam_cancellable);
     if (self->clipboard_cancellable != NULL)
         g_cancellable_cancel (self->clipboard_cancellable);
     if (self->file_dialog_cancellable != NULL)
         g_cancellable_cancel (self->file_dialog_cancellable);
-    g_clear_object (&self->cross_db_cancellable);
     g_clear_object (&self->webcam_cancellable);
     g_clear_object (&self->clipboard_cancellable);
     g_clear_object (&self->file_dialog_cancellable);
@@ -2388,13 +2797,19 @@ otpclient_window_secure_lock_cleanup (OTPClientWindow *self)
     cross_db_deactivate (self);
     g_clear_object (&self->flatten_model);
     if (self->cross_db_store != NULL)
-        g_list_store_remove_all (self->cross_db_store);
+        otp_token_model_remove_all (self->cross_db_store);
     if (self->otp_store != NULL)
-        g_list_store_remove_all (self->otp_store);
+        otp_token_model_remove_all (self->otp_store);
 
     g_clear_pointer (&self->search_lower, g_free);
     g_clear_pointer (&self->search_group_lower, g_free);
+    g_clear_pointer (&self->search_candidates, g_hash_table_unref);
+    self->search_candidates_valid = FALSE;
+    if (self->usage_counts != NULL)
+        g_hash_table_remove_all (self->usage_counts);
     g_clear_pointer (&self->active_group_filter, g_free);
+    if (self->group_names_lower != NULL)
+        g_ptr_array_set_size (self->group_names_lower, 0);
     if (self->group_list_model != NULL) {
         guint groups = g_list_model_get_n_items (
             G_LIST_MODEL (self->group_list_model));
@@ -2402,6 +2817,10 @@ otpclient_window_secure_lock_cleanup (OTPClientWindow *self)
     }
     if (self->search_entry != NULL)
         gtk_editable_set_text (GTK_EDITABLE (self->search_entry), "");
+    /* The caches were cleared above, so the text change alone does not
+     * detach the filter. */
+    if (self->filter_model != NULL)
+        apply_search_filter (self, GTK_FILTER_CHANGE_LESS_STRICT);
 }
 
 static void
@@ -2414,7 +2833,7 @@ schedule_hotp_flush (OTPClientWindow *self)
                                 hotp_flush_debounce_cb, self);
 }
 
-GListStore *
+OTPTokenModel *
 otpclient_window_get_otp_store (OTPClientWindow *self)
 {
     g_return_val_if_fail (OTPCLIENT_IS_WINDOW (self), NULL);
@@ -2464,8 +2883,14 @@ rebuild_group_list (OTPClientWindow *self)
 
     self->group_list_model = gtk_string_list_new (NULL);
     gtk_string_list_append (self->group_list_model, _("All"));
+    if (self->group_names_lower == NULL)
+        self->group_names_lower = g_ptr_array_new_with_free_func (g_free);
+    g_ptr_array_set_size (self->group_names_lower, 0);
     for (GList *l = group_names; l != NULL; l = l->next)
+    {
         gtk_string_list_append (self->group_list_model, (const gchar *) l->data);
+        g_ptr_array_add (self->group_names_lower, g_utf8_strdown (l->data, -1));
+    }
     gtk_string_list_append (self->group_list_model, _("Ungrouped"));
 
     self->syncing_group_filter = TRUE;
@@ -2537,8 +2962,8 @@ on_group_dropdown_changed (GtkDropDown     *dropdown,
         self->active_group_filter = g_strdup (group_name);
     }
 
-    refresh_search_cache (self);
-    gtk_filter_changed (GTK_FILTER (self->search_filter), GTK_FILTER_CHANGE_DIFFERENT);
+    refresh_search_cache (self, NULL);
+    apply_search_filter (self, GTK_FILTER_CHANGE_DIFFERENT);
 }
 
 static void
@@ -2554,48 +2979,13 @@ on_db_modified (gpointer user_data)
     if (db_data == NULL || db_data->in_memory_json_data == NULL)
         return;
 
-    GListStore *store = self->otp_store;
-
     /* Suppress selection-change side effects (clipboard copy, notifications)
-     * while we tear down and rebuild the store. */
+     * while the store is reconciled with the new token array. Only the
+     * added, removed or edited tokens are spliced; every other entry keeps
+     * its row, selection and cached code. */
     self->suppress_selection_action = TRUE;
 
-    g_list_store_remove_all (store);
-
-    gsize index;
-    json_t *obj;
-    json_array_foreach (db_data->in_memory_json_data, index, obj)
-    {
-        const gchar *type = json_string_value (json_object_get (obj, "type"));
-        const gchar *label = json_string_value (json_object_get (obj, "label"));
-        const gchar *issuer = json_string_value (json_object_get (obj, "issuer"));
-        const gchar *secret = json_string_value (json_object_get (obj, "secret"));
-        const gchar *algo = json_string_value (json_object_get (obj, "algo"));
-        guint32 digits = (guint32) json_integer_value (json_object_get (obj, "digits"));
-        guint32 period = 30;
-        guint64 counter = 0;
-
-        if (digits < 4) digits = 6;
-
-        if (type != NULL && g_ascii_strcasecmp (type, "HOTP") == 0)
-            counter = (guint64) json_integer_value (json_object_get (obj, "counter"));
-        else
-            period = (guint32) json_integer_value (json_object_get (obj, "period"));
-
-        if (period < 1) period = 30;
-
-        OTPEntry *entry = otp_entry_new (label, issuer, NULL,
-                                          type ? type : "TOTP",
-                                          period, counter,
-                                          algo ? algo : "SHA1",
-                                          digits, secret);
-        const gchar *group = json_string_value (json_object_get (obj, "group"));
-        if (group != NULL)
-            otp_entry_set_group (entry, group);
-        otp_entry_update_otp (entry);
-        g_list_store_append (store, entry);
-        g_object_unref (entry);
-    }
+    otp_token_model_sync (self->otp_store, db_data->in_memory_json_data);
 
     rebuild_group_list (self);
 
@@ -3036,6 +3426,15 @@ on_backup_tokens_save_complete (GObject      *source,
         return;
     }
 
+    /* The copy has to stand on its own, without the journal next to it. */
+    GError *checkpoint_err = NULL;
+    if (!db_checkpoint (db_data, &checkpoint_err)) {
+        show_error_toast (self, _("Failed to back up the database: %s"), checkpoint_err->message);
+        g_clear_error (&checkpoint_err);
+        window_async_context_free (ctx);
+        return;
+    }
+
     g_autofree gchar *error_msg = db_copy_to (db_data->db_path, path);
     if (error_msg != NULL) {
         show_error_toast (self, "%s", error_msg);
@@ -3188,15 +3587,8 @@ on_undo_delete (AdwToast *toast,
     json_decref (self->deleted_token);
     self->deleted_token = NULL;
 
-    GError *err = NULL;
-    update_db (db_data, &err);
-    if (err != NULL) {
-        show_error_toast (self, _("Failed to restore deleted token: %s"), err->message);
-        g_clear_error (&err);
-        return;
-    }
-
-    on_db_modified (self);
+    if (commit_in_background (self, db_data, _("Failed to restore deleted token"), FALSE))
+        on_db_modified (self);
 }
 
 static void
@@ -3226,16 +3618,12 @@ on_delete_response (AdwAlertDialog *dialog,
     /* Save a copy for undo */
     if (self->deleted_token != NULL)
         json_decref (self->deleted_token);
-    self->deleted_token = json_deep_copy (json_array_get (db_data->in_memory_json_data, pos));
+    self->deleted_token = json_incref (json_array_get (db_data->in_memory_json_data, pos));
     self->deleted_token_pos = pos;
 
     json_array_remove (db_data->in_memory_json_data, pos);
 
-    GError *err = NULL;
-    update_db (db_data, &err);
-    if (err != NULL) {
-        show_error_toast (self, _("Failed to delete token: %s"), err->message);
-        g_clear_error (&err);
+    if (!commit_in_background (self, db_data, _("Failed to delete token"), TRUE)) {
         json_decref (self->deleted_token);
         self->deleted_token = NULL;
         return;
@@ -3319,7 +3707,7 @@ action_show_qr (GtkWidget  *widget,
 typedef struct {
     GWeakRef         window_ref;
     guint            token_pos;
-    json_t          *token_json;   /* deep copy, owned */
+    json_t          *token_json;   /* reference, owned */
     gchar           *target_db_path;
 } MoveTokenContext;
 
@@ -3367,6 +3755,7 @@ on_move_target_password (const gchar  *current_password,
 
     /* Open and decrypt the target database */
     DatabaseData *target = database_data_new (ctx->target_db_path, memlock);
+    target->backup_generations = gsettings_common_get_backup_generations ();
     target->key = gcry_calloc_secure (strlen (password) + 1, 1);
     if (target->key == NULL) {
         database_data_free (target);
@@ -3495,7 +3884,7 @@ action_move_token (GtkWidget  *widget,
     MoveTokenContext *ctx = g_new0 (MoveTokenContext, 1);
     g_weak_ref_init (&ctx->window_ref, self);
     ctx->token_pos = pos;
-    ctx->token_json = json_deep_copy (token_obj);
+    ctx->token_json = json_incref (token_obj);
 
     const gchar *account = json_string_value (json_object_get (token_obj, "label"));
     g_autofree gchar *body = g_strdup_printf (_("Select the database to move \"%s\" to:"),
@@ -3583,7 +3972,7 @@ action_set_group (GtkWidget  *widget,
     if (db_data == NULL || db_data->in_memory_json_data == NULL)
         return;
 
-    json_t *token_obj = json_array_get (db_data->in_memory_json_data, pos);
+    json_t *token_obj = db_token_for_write (db_data->in_memory_json_data, pos);
     if (token_obj == NULL)
         return;
 
@@ -3593,14 +3982,8 @@ action_set_group (GtkWidget  *widget,
     else
         json_object_del (token_obj, "group");
 
-    GError *err = NULL;
-    update_db (db_data, &err);
-    if (err != NULL)
-    {
-        show_error_toast (self, _("Failed to change group: %s"), err->message);
-        g_clear_error (&err);
+    if (!commit_in_background (self, db_data, _("Failed to change group"), FALSE))
         return;
-    }
 
     /* Defer store rebuild so the popover menu can close cleanly first,
      * avoiding "Broken accounting of active state" warnings. */
@@ -3630,20 +4013,14 @@ action_remove_from_group (GtkWidget  *widget,
     if (db_data == NULL || db_data->in_memory_json_data == NULL)
         return;
 
-    json_t *token_obj = json_array_get (db_data->in_memory_json_data, pos);
+    json_t *token_obj = db_token_for_write (db_data->in_memory_json_data, pos);
     if (token_obj == NULL)
         return;
 
     json_object_del (token_obj, "group");
 
-    GError *err = NULL;
-    update_db (db_data, &err);
-    if (err != NULL)
-    {
-        show_error_toast (self, _("Failed to remove token from group: %s"), err->message);
-        g_clear_error (&err);
+    if (!commit_in_background (self, db_data, _("Failed to remove token from group"), FALSE))
         return;
-    }
 
     /* Defer store rebuild so the popover menu can close cleanly first. */
     g_idle_add_full (G_PRIORITY_DEFAULT, on_db_modified_idle,
@@ -3700,22 +4077,13 @@ on_new_group_response (AdwAlertDialog  *dialog,
         return;
     }
 
-    json_t *token_obj = json_array_get (db_data->in_memory_json_data, ctx->token_pos);
+    json_t *token_obj = db_token_for_write (db_data->in_memory_json_data, ctx->token_pos);
     if (token_obj != NULL)
     {
         json_object_set_new (token_obj, "group", json_string (group_name));
 
-        GError *err = NULL;
-        update_db (db_data, &err);
-        if (err != NULL)
-        {
-            show_error_toast (self, _("Failed to assign group: %s"), err->message);
-            g_clear_error (&err);
-        }
-        else
-        {
+        if (commit_in_background (self, db_data, _("Failed to assign group"), FALSE))
             on_db_modified (self);
-        }
     }
 
     g_weak_ref_clear (&ctx->window_ref);
@@ -3988,7 +4356,7 @@ on_new_db_password_received (const gchar  *current_password,
     if (old_db != NULL)
     {
         otpclient_window_stop_otp_timer (self);
-        g_list_store_remove_all (self->otp_store);
+        otp_token_model_remove_all (self->otp_store);
     }
 
     gint32 memlock = 0;
@@ -3996,6 +4364,7 @@ on_new_db_password_received (const gchar  *current_password,
 
     /* Create new DatabaseData */
     DatabaseData *db_data = database_data_new (db_path, memlock);
+    db_data->backup_generations = gsettings_common_get_backup_generations ();
     g_free (db_path);
     db_path = NULL;
     db_data->key = gcry_calloc_secure (strlen (password) + 1, 1);
@@ -4166,12 +4535,13 @@ on_open_db_password_received (const gchar  *current_password,
 
     /* Stop current DB */
     otpclient_window_stop_otp_timer (self);
-    g_list_store_remove_all (self->otp_store);
+    otp_token_model_remove_all (self->otp_store);
 
     gint32 memlock = 0;
     set_memlock_value (&memlock);
 
     DatabaseData *db_data = database_data_new (db_path, memlock);
+    db_data->backup_generations = gsettings_common_get_backup_generations ();
     g_free (db_path);
     db_path = NULL;
     db_data->key = gcry_calloc_secure (strlen (password) + 1, 1);
@@ -4189,7 +4559,7 @@ on_open_db_password_received (const gchar  *current_password,
         show_error_toast (self, _("Could not open database: %s"), err->message);
         g_clear_error (&err);
         /* load_db's v1->v2 migration and legacy_kdf_migration paths can set
-         * in_memory_json_data / objects_hash before failing. The previous
+         * in_memory_json_data / token_index before failing. The previous
          * open-coded cleanup leaked both. database_data_free handles them. */
         database_data_free (db_data);
         return TRUE;
@@ -4532,8 +4902,9 @@ on_remove_dialog_response (AdwAlertDialog  *dialog,
         if (db_data != NULL &&
             g_strcmp0 (db_data->db_path, database_entry_get_path (entry)) == 0) {
             otpclient_window_stop_otp_timer (self);
-            g_list_store_remove_all (self->otp_store);
+            otp_token_model_remove_all (self->otp_store);
         }
+        otpclient_application_forget_db (app, database_entry_get_path (entry));
     }
 
     otpclient_window_sync_active_flag (self);
@@ -4593,25 +4964,15 @@ on_db_entry_name_changed (DatabaseEntry *entry,
 static void
 refresh_otp_value_cells (OTPClientWindow *self)
 {
-    if (self->otp_store != NULL)
-    {
-        guint n = g_list_model_get_n_items (G_LIST_MODEL (self->otp_store));
-        for (guint i = 0; i < n; i++)
-        {
-            g_autoptr (OTPEntry) entry = g_list_model_get_item (G_LIST_MODEL (self->otp_store), i);
-            if (entry != NULL)
-                g_object_notify (G_OBJECT (entry), "otp-value");
-        }
-    }
-    if (self->cross_db_store != NULL)
+    OTPTokenModel *models[] = { self->otp_store, self->cross_db_store };
+    for (gsize m = 0; m < G_N_ELEMENTS (models); m++)
     {
-        guint n = g_list_model_get_n_items (G_LIST_MODEL (self->cross_db_store));
-        for (guint i = 0; i < n; i++)
-        {
-            g_autoptr (OTPEntry) entry = g_list_model_get_item (G_LIST_MODEL (self->cross_db_store), i);
-            if (entry != NULL)
-                g_object_notify (G_OBJECT (entry), "otp-value");
-        }
+        if (models[m] == NULL)
+            continue;
+        /* Bound cells always have an entry; the rest render at bind time. */
+        g_autoptr (GPtrArray) live = otp_token_model_get_live (models[m]);
+        for (guint i = 0; i < live->len; i++)
+            g_object_notify (G_OBJECT (g_ptr_array_index (live, i)), "otp-value");
     }
 }
 
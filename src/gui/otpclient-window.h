@@ -11,12 +11,13 @@ G_DECLARE_FINAL_TYPE (OTPClientWindow, otpclient_window, OTPCLIENT, WINDOW, AdwA
 
 GtkWidget          *otpclient_window_new            (OTPClientApplication *application);
 
-GListStore         *otpclient_window_get_otp_store  (OTPClientWindow *self);
+OTPTokenModel      *otpclient_window_get_otp_store  (OTPClientWindow *self);
 
 GtkSingleSelection *otpclient_window_get_otp_selection (OTPClientWindow *self);
 
 void                otpclient_window_start_otp_timer (OTPClientWindow *self);
 void                otpclient_window_stop_otp_timer  (OTPClientWindow *self);
+void                otpclient_window_resync_otp_timer (OTPClientWindow *self);
 
 void                otpclient_window_add_database    (OTPClientWindow *self,
                                                       const gchar     *name,
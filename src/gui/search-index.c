@@ -0,0 +1,304 @@
+#include <string.h>
+#include "search-index.h"
+
+/* Posting lists hold token ids in ascending order (ids only grow and a
+ * compaction renumbers in order), so lists intersect by binary search.
+ * Removed tokens leave their id dead in the postings until the dead ones
+ * outnumber the live ones and everything is renumbered. */
+
+#define FIELD_TEXT  1
+#define FIELD_GROUP 2
+
+#define COMPACT_MIN_DEAD 64
+
+typedef struct {
+    guint32 id;
+    guint refs;
+} IndexedToken;
+
+struct _SearchIndex {
+    gint ref_count;
+    GHashTable *tokens;         // json_t * (reference) -> IndexedToken
+    GPtrArray *slots;           // id -> json_t *, NULL once removed
+    GHashTable *postings;       // trigram -> GArray of guint32 ids
+    guint n_dead;
+    guint stamp;
+};
+
+
+static void
+collect_trigrams (GArray      *out,
+                  const gchar *lower,
+                  guint8       field)
+{
+    gsize len = (lower != NULL) ? strlen (lower) : 0;
+    for (gsize i = 0; i + 3 <= len; i++) {
+        guint32 trigram = ((guint32) field << 24) |
+                          ((guint32) (guint8) lower[i] << 16) |
+                          ((guint32) (guint8) lower[i + 1] << 8) |
+                          (guint32) (guint8) lower[i + 2];
+        g_array_append_val (out, trigram);
+    }
+}
+
+
+static void
+collect_field (GArray      *out,
+               json_t      *token,
+               const gchar *key,
+               guint8       field)
+{
+    const gchar *value = json_string_value (json_object_get (token, key));
+    if (value == NULL)
+        return;
+    g_autofree gchar *lower = g_utf8_strdown (value, -1);
+    collect_trigrams (out, lower, field);
+}
+
+
+static gint
+compare_guint32 (gconstpointer a,
+                 gconstpointer b)
+{
+    guint32 x = *(const guint32 *) a, y = *(const guint32 *) b;
+    return (x > y) - (x < y);
+}
+
+
+static void
+index_token (SearchIndex *index,
+             json_t      *token,
+             guint32      id)
+{
+    GArray *trigrams = g_array_new (FALSE, FALSE, sizeof (guint32));
+    collect_field (trigrams, token, "label", FIELD_TEXT);
+    collect_field (trigrams, token, "issuer", FIELD_TEXT);
+    collect_field (trigrams, token, "group", FIELD_GROUP);
+    g_array_sort (trigrams, compare_guint32);
+
+    for (guint i = 0; i < trigrams->len; i++) {
+        guint32 trigram = g_array_index (trigrams, guint32, i);
+        if (i > 0 && trigram == g_array_index (trigrams, guint32, i - 1))
+            continue;
+        GArray *posting = g_hash_table_lookup (index->postings, GUINT_TO_POINTER (trigram));
+        if (posting == NULL) {
+            posting = g_array_new (FALSE, FALSE, sizeof (guint32));
+            g_hash_table_insert (index->postings, GUINT_TO_POINTER (trigram), posting);
+        }
+        g_array_append_val (posting, id);
+    }
+    g_array_unref (trigrams);
+}
+
+
+SearchIndex *
+search_index_new (void)
+{
+    SearchIndex *index = g_new0 (SearchIndex, 1);
+    index->ref_count = 1;
+    index->tokens = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                           (GDestroyNotify) json_decref, g_free);
+    index->slots = g_ptr_array_new ();
+    index->postings = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                             NULL, (GDestroyNotify) g_array_unref);
+    return index;
+}
+
+
+SearchIndex *
+search_index_ref (SearchIndex *index)
+{
+    g_return_val_if_fail (index != NULL, NULL);
+    g_atomic_int_inc (&index->ref_count);
+    return index;
+}
+
+
+void
+search_index_unref (SearchIndex *index)
+{
+    if (index == NULL || !g_atomic_int_dec_and_test (&index->ref_count))
+        return;
+    g_hash_table_unref (index->postings);
+    g_ptr_array_unref (index->slots);
+    g_hash_table_unref (index->tokens);
+    g_free (index);
+}
+
+
+void
+search_index_clear (SearchIndex *index)
+{
+    g_return_if_fail (index != NULL);
+    g_hash_table_remove_all (index->postings);
+    g_ptr_array_set_size (index->slots, 0);
+    g_hash_table_remove_all (index->tokens);
+    index->n_dead = 0;
+    index->stamp++;
+}
+
+
+void
+search_index_add (SearchIndex *index,
+                  json_t      *token)
+{
+    g_return_if_fail (index != NULL);
+    if (token == NULL)
+        return;
+
+    IndexedToken *indexed = g_hash_table_lookup (index->tokens, token);
+    if (indexed != NULL) {
+        indexed->refs++;
+        return;
+    }
+
+    indexed = g_new (IndexedToken, 1);
+    indexed->id = index->slots->len;
+    indexed->refs = 1;
+    g_hash_table_insert (index->tokens, json_incref (token), indexed);
+    g_ptr_array_add (index->slots, token);
+    index_token (index, token, indexed->id);
+    index->stamp++;
+}
+
+
+static void
+compact (SearchIndex *index)
+{
+    GPtrArray *live = g_ptr_array_new ();
+    for (guint i = 0; i < index->slots->len; i++) {
+        json_t *token = g_ptr_array_index (index->slots, i);
+        if (token != NULL)
+            g_ptr_array_add (live, token);
+    }
+
+    g_hash_table_remove_all (index->postings);
+    g_ptr_array_set_size (index->slots, 0);
+    index->n_dead = 0;
+    for (guint i = 0; i < live->len; i++) {
+        json_t *token = g_ptr_array_index (live, i);
+        IndexedToken *indexed = g_hash_table_lookup (index->tokens, token);
+        indexed->id = i;
+        g_ptr_array_add (index->slots, token);
+        index_token (index, token, i);
+    }
+    g_ptr_array_unref (live);
+}
+
+
+void
+search_index_remove (SearchIndex *index,
+                     json_t      *token)
+{
+    g_return_if_fail (index != NULL);
+
+    IndexedToken *indexed = (token != NULL) ? g_hash_table_lookup (index->tokens, token) : NULL;
+    if (indexed == NULL || --indexed->refs > 0)
+        return;
+
+    g_ptr_array_index (index->slots, indexed->id) = NULL;
+    g_hash_table_remove (index->tokens, token);
+    index->n_dead++;
+    index->stamp++;
+
+    guint n_live = g_hash_table_size (index->tokens);
+    if (n_live == 0)
+        search_index_clear (index);
+    else if (index->n_dead >= COMPACT_MIN_DEAD && index->n_dead > n_live)
+        compact (index);
+}
+
+
+guint
+search_index_get_n_tokens (SearchIndex *index)
+{
+    g_return_val_if_fail (index != NULL, 0);
+    return g_hash_table_size (index->tokens);
+}
+
+
+guint
+search_index_get_stamp (SearchIndex *index)
+{
+    g_return_val_if_fail (index != NULL, 0);
+    return index->stamp;
+}
+
+
+static gboolean
+posting_contains (GArray  *posting,
+                  guint32  id)
+{
+    guint lo = 0, hi = posting->len;
+    while (lo < hi) {
+        guint mid = lo + (hi - lo) / 2;
+        guint32 value = g_array_index (posting, guint32, mid);
+        if (value == id)
+            return TRUE;
+        if (value < id)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return FALSE;
+}
+
+
+static gint
+compare_posting_length (gconstpointer a,
+                        gconstpointer b)
+{
+    guint x = (*(GArray * const *) a)->len, y = (*(GArray * const *) b)->len;
+    return (x > y) - (x < y);
+}
+
+
+GHashTable *
+search_index_lookup (SearchIndex *index,
+                     const gchar *group_lower,
+                     const gchar *text_lower)
+{
+    g_return_val_if_fail (index != NULL, NULL);
+
+    GArray *trigrams = g_array_new (FALSE, FALSE, sizeof (guint32));
+    collect_trigrams (trigrams, group_lower, FIELD_GROUP);
+    if (text_lower != NULL) {
+        g_auto (GStrv) words = g_strsplit (text_lower, " ", -1);
+        for (guint i = 0; words[i] != NULL; i++)
+            collect_trigrams (trigrams, words[i], FIELD_TEXT);
+    }
+    if (trigrams->len == 0) {
+        g_array_unref (trigrams);
+        return NULL;
+    }
+
+    GHashTable *candidates = g_hash_table_new (g_direct_hash, g_direct_equal);
+    GPtrArray *postings = g_ptr_array_new ();
+    for (guint i = 0; i < trigrams->len; i++) {
+        GArray *posting = g_hash_table_lookup (index->postings,
+                                               GUINT_TO_POINTER (g_array_index (trigrams, guint32, i)));
+        if (posting == NULL)
+            goto out;   // a trigram no token has: nothing can match
+        g_ptr_array_add (postings, posting);
+    }
+
+    // Walk the rarest list and probe the others.
+    g_ptr_array_sort (postings, compare_posting_length);
+    GArray *rarest = g_ptr_array_index (postings, 0);
+    for (guint i = 0; i < rarest->len; i++) {
+        guint32 id = g_array_index (rarest, guint32, i);
+        json_t *token = g_ptr_array_index (index->slots, id);
+        if (token == NULL)
+            continue;
+        gboolean everywhere = TRUE;
+        for (guint p = 1; p < postings->len && everywhere; p++)
+            everywhere = posting_contains (g_ptr_array_index (postings, p), id);
+        if (everywhere)
+            g_hash_table_add (candidates, token);
+    }
+
+out:
+    g_ptr_array_unref (postings);
+    g_array_unref (trigrams);
+    return candidates;
+}
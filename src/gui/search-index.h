@@ -0,0 +1,48 @@
+#pragma once
+
+#include <glib.h>
+#include <jansson.h>
+
+G_BEGIN_DECLS
+
+/* Trigram index over the account, issuer and group of database tokens,
+ * keyed by the token object (tokens are immutable, see db_token_for_write).
+ * A lookup returns the tokens that can contain every needle by intersecting
+ * the posting lists of the needles' trigrams, so its cost follows the
+ * rarest trigram rather than the number of tokens. The result is a superset:
+ * the caller still verifies each candidate. */
+
+typedef struct _SearchIndex SearchIndex;
+
+SearchIndex *search_index_new          (void);
+
+SearchIndex *search_index_ref          (SearchIndex *index);
+
+void         search_index_unref        (SearchIndex *index);
+
+/* Adding the same token twice needs two removals. */
+void         search_index_add          (SearchIndex *index,
+                                        json_t      *token);
+
+void         search_index_remove       (SearchIndex *index,
+                                        json_t      *token);
+
+void         search_index_clear        (SearchIndex *index);
+
+guint        search_index_get_n_tokens (SearchIndex *index);
+
+/* Changes whenever a token is added or removed, so a caller can tell that
+ * a lookup it kept is out of date. */
+guint        search_index_get_stamp    (SearchIndex *index);
+
+/* Candidates (a set of json_t *) for tokens whose group contains group_lower
+ * and whose account or issuer contain every space-separated word of
+ * text_lower. Returns NULL when no needle is long enough to use the index,
+ * meaning every token is a candidate. */
+GHashTable  *search_index_lookup       (SearchIndex *index,
+                                        const gchar *group_lower,
+                                        const gchar *text_lower);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (SearchIndex, search_index_unref)
+
+G_END_DECLS
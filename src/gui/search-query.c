@@ -0,0 +1,160 @@
+#include <string.h>
+#include "search-query.h"
+
+typedef enum {
+    NEEDLE_SAME,
+    NEEDLE_LONGER,
+    NEEDLE_SHORTER,
+    NEEDLE_OTHER
+} NeedleChange;
+
+
+static const gchar *
+group_prefix_end (const gchar  *text,
+                  const gchar **rest)
+{
+    if (text == NULL)
+        return NULL;
+
+    if (g_str_has_prefix (text, "group:"))
+        *rest = text + 6;
+    else if (text[0] == '#' && text[1] != '\0')
+        *rest = text + 1;
+    else
+        return NULL;
+
+    const gchar *space = strchr (*rest, ' ');
+    return (space != NULL) ? space : *rest + strlen (*rest);
+}
+
+
+gchar *
+search_query_get_group (const gchar *text)
+{
+    const gchar *rest = NULL;
+    const gchar *end = group_prefix_end (text, &rest);
+    return (end != NULL) ? g_strndup (rest, end - rest) : NULL;
+}
+
+
+void
+search_query_parse (const gchar  *text,
+                    gchar       **group_lower,
+                    gchar       **text_lower)
+{
+    *group_lower = NULL;
+    *text_lower = NULL;
+    if (text == NULL || text[0] == '\0')
+        return;
+
+    const gchar *rest = NULL;
+    const gchar *end = group_prefix_end (text, &rest);
+    const gchar *remaining = text;
+    if (end != NULL) {
+        *group_lower = g_utf8_strdown (rest, end - rest);
+        remaining = (*end == ' ') ? end + 1 : NULL;
+    }
+
+    if (remaining != NULL && remaining[0] != '\0')
+        *text_lower = g_utf8_strdown (remaining, -1);
+}
+
+
+static gboolean
+starts_word (const gchar *haystack,
+             const gchar *at)
+{
+    if (at == haystack)
+        return TRUE;
+    const gchar *prev = g_utf8_find_prev_char (haystack, at);
+    return prev == NULL || !g_unichar_isalnum (g_utf8_get_char (prev));
+}
+
+
+static SearchRank
+rank_field (const gchar *haystack,
+            const gchar *needle)
+{
+    const gchar *hit = strstr (haystack, needle);
+    if (hit == NULL)
+        return SEARCH_RANK_NONE;
+    if (hit == haystack)
+        return SEARCH_RANK_PREFIX;
+    for (; hit != NULL; hit = strstr (hit + 1, needle)) {
+        if (starts_word (haystack, hit))
+            return SEARCH_RANK_WORD_START;
+    }
+    return SEARCH_RANK_SUBSTRING;
+}
+
+
+SearchRank
+search_query_rank (const gchar *account_lower,
+                   const gchar *issuer_lower,
+                   const gchar *text_lower)
+{
+    if (text_lower == NULL)
+        return SEARCH_RANK_PREFIX;
+
+    SearchRank rank = MAX (rank_field (account_lower, text_lower),
+                           rank_field (issuer_lower, text_lower));
+    if (rank != SEARCH_RANK_NONE || strchr (text_lower, ' ') == NULL)
+        return rank;
+
+    // "github work" finds work@github.com: every word, in any field.
+    g_auto (GStrv) words = g_strsplit (text_lower, " ", -1);
+    for (guint i = 0; words[i] != NULL; i++) {
+        if (words[i][0] != '\0' &&
+            strstr (account_lower, words[i]) == NULL &&
+            strstr (issuer_lower, words[i]) == NULL)
+            return SEARCH_RANK_NONE;
+    }
+    return SEARCH_RANK_WORDS;
+}
+
+
+static NeedleChange
+compare_needles (const gchar *old_needle,
+                 const gchar *new_needle)
+{
+    if (g_strcmp0 (old_needle, new_needle) == 0)
+        return NEEDLE_SAME;
+    // No needle matches everything.
+    if (old_needle == NULL || (new_needle != NULL && strstr (new_needle, old_needle) != NULL))
+        return NEEDLE_LONGER;
+    if (new_needle == NULL || strstr (old_needle, new_needle) != NULL)
+        return NEEDLE_SHORTER;
+    return NEEDLE_OTHER;
+}
+
+
+gboolean
+search_query_diff (const gchar     *old_group_lower,
+                   const gchar     *old_text_lower,
+                   const gchar     *new_group_lower,
+                   const gchar     *new_text_lower,
+                   GtkFilterChange *change)
+{
+    NeedleChange group = compare_needles (old_group_lower, new_group_lower);
+    NeedleChange text = compare_needles (old_text_lower, new_text_lower);
+
+    if (group == NEEDLE_SAME && text == NEEDLE_SAME)
+        return FALSE;
+
+    NeedleChange both = (group == NEEDLE_SAME) ? text : group;
+    if (text != NEEDLE_SAME && text != both)
+        both = NEEDLE_OTHER;
+
+    switch (both) {
+        case NEEDLE_LONGER:
+            *change = GTK_FILTER_CHANGE_MORE_STRICT;
+            break;
+        case NEEDLE_SHORTER:
+            *change = GTK_FILTER_CHANGE_LESS_STRICT;
+            break;
+        default:
+            *change = GTK_FILTER_CHANGE_DIFFERENT;
+            break;
+    }
+    return TRUE;
+}
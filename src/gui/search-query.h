@@ -0,0 +1,47 @@
+#pragma once
+
+#include <gtk/gtk.h>
+
+G_BEGIN_DECLS
+
+/* The search box accepts an optional group prefix ("group:NAME" or "#NAME",
+ * ended by a space) followed by free text matched against account and
+ * issuer: every space-separated word must appear in one of them. */
+
+/* How well an entry matches the free text, best last. */
+typedef enum {
+    SEARCH_RANK_NONE,
+    SEARCH_RANK_WORDS,          // each word somewhere, not the text as a whole
+    SEARCH_RANK_SUBSTRING,
+    SEARCH_RANK_WORD_START,     // the text starts a word of account or issuer
+    SEARCH_RANK_PREFIX          // account or issuer starts with the text
+} SearchRank;
+
+/* Returns the group named by the prefix as typed, or NULL without one. */
+gchar    *search_query_get_group (const gchar      *text);
+
+/* Splits text into the lowered group and free-text needles; a part that is
+ * absent (or free text that is empty) is set to NULL. */
+void      search_query_parse     (const gchar      *text,
+                                  gchar           **group_lower,
+                                  gchar           **text_lower);
+
+/* SEARCH_RANK_NONE when the free text does not match; a NULL text matches
+ * everything. */
+SearchRank search_query_rank     (const gchar      *account_lower,
+                                  const gchar      *issuer_lower,
+                                  const gchar      *text_lower);
+
+/* Compares two parsed queries. A needle only matches text that contains it
+ * (word by word for the free text), so a query whose needles contain the
+ * old ones can only drop rows
+ * (GTK_FILTER_CHANGE_MORE_STRICT, typing) and one whose needles are
+ * contained in the old ones can only add rows (LESS_STRICT, backspace).
+ * Returns FALSE when the queries are the same and the filter need not run. */
+gboolean  search_query_diff      (const gchar      *old_group_lower,
+                                  const gchar      *old_text_lower,
+                                  const gchar      *new_group_lower,
+                                  const gchar      *new_text_lower,
+                                  GtkFilterChange  *change);
+
+G_END_DECLS
@@ -0,0 +1,238 @@
+#include <string.h>
+#include "search-matcher.h"
+
+/* Trigrams are the three bytes of the casefolded UTF-8 packed into a guint32,
+ * so they are exact keys. Label and issuer feed the same postings: a term has
+ * to sit inside one field, and an entry with all of the term's trigrams
+ * spread over both is a false positive that search_terms_match drops. */
+
+struct _SearchTerms {
+    GPtrArray *folded;          // longest first
+};
+
+struct _EntryIndex {
+    GHashTable *postings;       // trigram -> GArray of guint32 ids, ascending
+    guint n_entries;
+};
+
+
+static gint
+compare_longest_first (gconstpointer a,
+                       gconstpointer b)
+{
+    const gchar *x = *(const gchar * const *) a, *y = *(const gchar * const *) b;
+    gsize lx = strlen (x), ly = strlen (y);
+    if (lx != ly)
+        return (lx < ly) ? 1 : -1;
+    return strcmp (x, y);
+}
+
+
+SearchTerms *
+search_terms_compile (gchar **terms)
+{
+    if (terms == NULL)
+        return NULL;
+
+    GPtrArray *all = g_ptr_array_new_with_free_func (g_free);
+    for (gsize i = 0; terms[i] != NULL; i++) {
+        if (terms[i][0] != '\0')
+            g_ptr_array_add (all, g_utf8_casefold (terms[i], -1));
+    }
+    g_ptr_array_sort (all, compare_longest_first);
+
+    GPtrArray *folded = g_ptr_array_new_with_free_func (g_free);
+    for (guint i = 0; i < all->len; i++) {
+        const gchar *term = g_ptr_array_index (all, i);
+        gboolean implied = FALSE;
+        for (guint k = 0; k < folded->len && !implied; k++)
+            implied = (strstr (g_ptr_array_index (folded, k), term) != NULL);
+        if (!implied)
+            g_ptr_array_add (folded, g_strdup (term));
+    }
+    g_ptr_array_unref (all);
+
+    if (folded->len == 0) {
+        g_ptr_array_unref (folded);
+        return NULL;
+    }
+    SearchTerms *compiled = g_new0 (SearchTerms, 1);
+    compiled->folded = folded;
+    return compiled;
+}
+
+
+void
+search_terms_free (SearchTerms *terms)
+{
+    if (terms == NULL)
+        return;
+    g_ptr_array_unref (terms->folded);
+    g_free (terms);
+}
+
+
+guint
+search_terms_get_n_terms (const SearchTerms *terms)
+{
+    return (terms != NULL) ? terms->folded->len : 0;
+}
+
+
+gboolean
+search_terms_match (const SearchTerms *terms,
+                    const gchar       *label_fold,
+                    const gchar       *issuer_fold)
+{
+    if (terms == NULL || label_fold == NULL)
+        return FALSE;
+    for (guint i = 0; i < terms->folded->len; i++) {
+        const gchar *term = g_ptr_array_index (terms->folded, i);
+        if (strstr (label_fold, term) == NULL &&
+            (issuer_fold == NULL || strstr (issuer_fold, term) == NULL))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+
+static void
+collect_trigrams (GArray      *out,
+                  const gchar *fold)
+{
+    gsize len = (fold != NULL) ? strlen (fold) : 0;
+    for (gsize i = 0; i + 3 <= len; i++) {
+        guint32 trigram = ((guint32) (guint8) fold[i] << 16) |
+                          ((guint32) (guint8) fold[i + 1] << 8) |
+                          (guint32) (guint8) fold[i + 2];
+        g_array_append_val (out, trigram);
+    }
+}
+
+
+EntryIndex *
+entry_index_new (void)
+{
+    EntryIndex *index = g_new0 (EntryIndex, 1);
+    index->postings = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                             NULL, (GDestroyNotify) g_array_unref);
+    return index;
+}
+
+
+void
+entry_index_free (EntryIndex *index)
+{
+    if (index == NULL)
+        return;
+    g_hash_table_unref (index->postings);
+    g_free (index);
+}
+
+
+guint
+entry_index_add (EntryIndex  *index,
+                 const gchar *label_fold,
+                 const gchar *issuer_fold)
+{
+    g_return_val_if_fail (index != NULL, 0);
+
+    guint32 id = index->n_entries++;
+    GArray *trigrams = g_array_new (FALSE, FALSE, sizeof (guint32));
+    collect_trigrams (trigrams, label_fold);
+    collect_trigrams (trigrams, issuer_fold);
+    for (guint i = 0; i < trigrams->len; i++) {
+        gpointer key = GUINT_TO_POINTER (g_array_index (trigrams, guint32, i));
+        GArray *posting = g_hash_table_lookup (index->postings, key);
+        if (posting == NULL) {
+            posting = g_array_new (FALSE, FALSE, sizeof (guint32));
+            g_hash_table_insert (index->postings, key, posting);
+        }
+        // Ids only grow, so a repeat within this entry is the last element.
+        if (posting->len == 0 || g_array_index (posting, guint32, posting->len - 1) != id)
+            g_array_append_val (posting, id);
+    }
+    g_array_unref (trigrams);
+    return id;
+}
+
+
+guint
+entry_index_get_n_entries (const EntryIndex *index)
+{
+    g_return_val_if_fail (index != NULL, 0);
+    return index->n_entries;
+}
+
+
+static gboolean
+posting_contains (GArray  *posting,
+                  guint32  id)
+{
+    guint lo = 0, hi = posting->len;
+    while (lo < hi) {
+        guint mid = lo + (hi - lo) / 2;
+        guint32 value = g_array_index (posting, guint32, mid);
+        if (value == id)
+            return TRUE;
+        if (value < id)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return FALSE;
+}
+
+
+static gint
+compare_posting_length (gconstpointer a,
+                        gconstpointer b)
+{
+    guint x = (*(GArray * const *) a)->len, y = (*(GArray * const *) b)->len;
+    return (x > y) - (x < y);
+}
+
+
+GArray *
+entry_index_lookup (const EntryIndex  *index,
+                    const SearchTerms *terms)
+{
+    g_return_val_if_fail (index != NULL, NULL);
+
+    GArray *trigrams = g_array_new (FALSE, FALSE, sizeof (guint32));
+    for (guint i = 0; i < search_terms_get_n_terms (terms); i++)
+        collect_trigrams (trigrams, g_ptr_array_index (terms->folded, i));
+    if (trigrams->len == 0) {
+        g_array_unref (trigrams);
+        return NULL;
+    }
+
+    GArray *candidates = g_array_new (FALSE, FALSE, sizeof (guint32));
+    GPtrArray *postings = g_ptr_array_new ();
+    for (guint i = 0; i < trigrams->len; i++) {
+        GArray *posting = g_hash_table_lookup (index->postings,
+                                               GUINT_TO_POINTER (g_array_index (trigrams, guint32, i)));
+        if (posting == NULL)
+            goto out;   // a trigram no entry has: nothing can match
+        g_ptr_array_add (postings, posting);
+    }
+
+    // Walk the rarest list and probe the others, rarest first.
+    g_ptr_array_sort (postings, compare_posting_length);
+    GArray *rarest = g_ptr_array_index (postings, 0);
+    for (guint i = 0; i < rarest->len; i++) {
+        guint32 id = g_array_index (rarest, guint32, i);
+        gboolean everywhere = TRUE;
+        for (guint p = 1; p < postings->len && everywhere; p++) {
+            GArray *posting = g_ptr_array_index (postings, p);
+            everywhere = (posting == rarest) || posting_contains (posting, id);
+        }
+        if (everywhere)
+            g_array_append_val (candidates, id);
+    }
+
+out:
+    g_ptr_array_unref (postings);
+    g_array_unref (trigrams);
+    return candidates;
+}
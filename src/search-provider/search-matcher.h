@@ -0,0 +1,56 @@
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Matching for the desktop search provider, where a query is a list of terms
+ * and an entry matches when every term is a substring of its casefolded
+ * label or issuer.
+ *
+ * SearchTerms is a query compiled once per call: terms are casefolded,
+ * duplicates and terms contained in another term are dropped (they cannot
+ * fail where the longer one passes), and the rest are checked longest first
+ * since long terms reject soonest.
+ *
+ * EntryIndex is a trigram index over the entry list, built with it and never
+ * changed afterwards (the provider rebuilds both on reload). Ids are the
+ * order of entry_index_add, i.e. positions in the caller's entry array. */
+
+typedef struct _SearchTerms SearchTerms;
+
+typedef struct _EntryIndex EntryIndex;
+
+/* NULL when no term is left, which matches nothing. */
+SearchTerms *search_terms_compile      (gchar            **terms);
+
+void         search_terms_free         (SearchTerms       *terms);
+
+guint        search_terms_get_n_terms  (const SearchTerms *terms);
+
+gboolean     search_terms_match        (const SearchTerms *terms,
+                                        const gchar       *label_fold,
+                                        const gchar       *issuer_fold);
+
+EntryIndex  *entry_index_new           (void);
+
+void         entry_index_free          (EntryIndex        *index);
+
+/* Takes the already casefolded fields. Returns the entry's id. */
+guint        entry_index_add           (EntryIndex        *index,
+                                        const gchar       *label_fold,
+                                        const gchar       *issuer_fold);
+
+guint        entry_index_get_n_entries (const EntryIndex  *index);
+
+/* Ids (ascending guint32) of the entries that contain every trigram of every
+ * term. A superset: candidates still go through search_terms_match. Returns
+ * NULL when no term is long enough to use the index, meaning every entry is
+ * a candidate. */
+GArray      *entry_index_lookup        (const EntryIndex  *index,
+                                        const SearchTerms *terms);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (SearchTerms, search_terms_free)
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (EntryIndex, entry_index_free)
+
+G_END_DECLS
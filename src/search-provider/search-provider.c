@@ -4,17 +4,19 @@
 #include <jansson.h>
 #include <libsecret/secret.h>
 #include <gcrypt.h>
-#include <cotp.h>
 #include <string.h>
 #include <time.h>
-#include <limits.h>
 
 #include "../common/common.h"
 #include "../common/db-common.h"
+#include "../common/db-journal.h"
 #include "../common/file-size.h"
+#include "../common/gquarks.h"
+#include "../common/otp-context.h"
 #include "../common/otp-validation.h"
 #include "../common/secret-schema.h"
 #include "../common/gsettings-common.h"
+#include "search-matcher.h"
 
 #define KRUNNER_BUS "com.github.paolostivanin.OTPClient.KRunner"
 #define KRUNNER_PATH "/com/github/paolostivanin/OTPClient/KRunner"
@@ -29,6 +31,9 @@ static gint32 global_max_file_size = 0;
 #define CACHE_TTL_SECONDS 60
 
 static GPtrArray  *cached_entries = NULL;
+/* Trigram index over cached_entries, ids are positions in it. Built and
+ * replaced together with it. */
+static EntryIndex *cached_index = NULL;
 static gint64      cached_at = 0;
 /* path (gchar*) -> GFileMonitor*. Diffed across reloads so monitors for
  * unchanged DB paths survive without a brief monitor-less window during
@@ -56,6 +61,44 @@ typedef struct {
 
 static GHashTable *g_kdf_cache = NULL;
 
+/* Opt-in (search-provider-keep-unlocked): even with g_kdf_cache warm, every
+ * Activate/Run still pays a keyring round trip, a file read and a decrypt to
+ * get at one token. With the setting on, a token that was activated keeps a
+ * keyed OtpContext (HMAC pad states in secure memory; neither the secret nor
+ * the json is kept) so the next activation only stats the file and hashes
+ * the time step.
+ *
+ * An entry is trusted only while the db file and its journal still have the
+ * identity they had before the token was read, for at most
+ * OTP_CTX_CACHE_TTL_SECONDS after that read. The file monitor and
+ * idle_wipe_check drop entries sooner. */
+#define OTP_CTX_CACHE_TTL_SECONDS 600
+
+typedef struct {
+    DbFileStamp db;
+    DbFileStamp journal;
+} DbIdentity;
+
+typedef struct {
+    OtpContext *ctx;
+    gchar      *db_path;
+    gchar      *label;
+    gchar      *issuer;
+    gboolean    steam;
+    guint       digits;
+    guint       period;
+    DbIdentity  identity;
+    gint64      expires_at_us;
+} OtpCtxCacheEntry;
+
+static GHashTable *g_otp_ctx_cache = NULL;   /* "index:path" -> OtpCtxCacheEntry* */
+
+/* Activations and entry reloads run on worker threads (see g_activate_pool),
+ * so g_kdf_cache and g_otp_ctx_cache are shared with the main thread. The
+ * lock is held only around the table operations and the HMAC of a cached
+ * context, never across a keyring lookup or a KDF. */
+static GMutex g_cache_lock;
+
 /* Per-sender token bucket for Activate/Run. Without it, any session-bus peer
  * can spam OTP delivery (which sends a notification carrying the live code)
  * at unlimited rate. Match queries are not rate-limited here because the
@@ -78,6 +121,7 @@ typedef struct {
     gchar *query;
     gchar *db_path;
     gchar *label;
+    gchar *issuer;
     gsize  json_index;
     gint64 expires_at_us;
 } ActivationCapability;
@@ -99,16 +143,50 @@ typedef struct otp_search_entry_t {
     gchar *db_name;
     gchar *db_path;        /* needed to recompute OTP on Run/Activate */
     gsize  json_index;     /* position of the token within the DB's JSON array */
-    /* Pre-folded copies for entry_matches_terms - avoid casefolding per query. */
+    /* Pre-folded copies for matching and the index - avoid casefolding per query. */
     gchar *label_fold;
     gchar *issuer_fold;
 } OtpSearchEntry;
 
+typedef struct {
+    gchar *path;
+    gchar *name;
+    guint  index;          /* position in db-list, part of the entry ids */
+} DbSource;
+
+/* D-Bus calls are dispatched on the main loop, which has to stay free: a
+ * keyring round trip or an Argon2id derive there holds up every other query
+ * from the shell. Entry reloads go to g_search_pool (one thread, and one
+ * reload at a time that every waiting query shares); Activate/Run go to
+ * g_activate_pool, so an activation that has to derive a key never delays a
+ * search. The rate bucket bounds how much activation work can queue up.
+ * Everything but the work itself (caches of entries and capabilities, file
+ * monitors, replies) stays on the main thread. */
+#define ACTIVATE_WORKERS 2
+static GThreadPool *g_search_pool = NULL;
+static GThreadPool *g_activate_pool = NULL;
+/* Jobs handed to GTask's pool because theirs had no worker (see
+ * search_pool_push); shutdown waits for them like for the pools. */
+static gint         g_stranded_jobs = 0;
+
+/* Queries waiting for a reload. A newer query from the same sender on the
+ * same interface supersedes an older one: it is answered with no results
+ * right away, as KRunner sends a Match per keystroke. */
+typedef struct {
+    GDBusMethodInvocation *inv;
+    gchar                **terms;       /* keyword already stripped */
+    gboolean               krunner;
+} PendingQuery;
+
+static GPtrArray *g_pending_queries = NULL;
+static gboolean   g_entries_reloading = FALSE;
+/* Bumped by the file monitor, so a reload that raced a write is not
+ * trusted for CACHE_TTL_SECONDS. */
+static guint      g_entries_generation = 0;
+
 static void otp_search_entry_free (OtpSearchEntry *entry);
-static GPtrArray *load_entries_uncached (void);
-static GPtrArray *get_entries (void);
-static gboolean entry_matches_terms (const OtpSearchEntry *entry, gchar **terms, gsize terms_len);
-static gchar *get_entry_otp_value (json_t *obj);
+static void otp_ctx_cache_invalidate_path (const gchar *db_path);
+static void otp_ctx_cache_clear (void);
 static gchar *compute_otp_for_entry (const OtpSearchEntry *entry);
 static void send_notification (const gchar *label, const gchar *otp_value);
 static void copy_to_clipboard (GDBusConnection *conn, const gchar *text, gboolean is_kde);
@@ -193,19 +271,21 @@ kdf_cache_entry_free (KdfCacheEntry *entry)
 static void
 kdf_cache_invalidate_path (const gchar *db_path)
 {
-    if (g_kdf_cache == NULL || db_path == NULL)
+    if (db_path == NULL)
         return;
-    g_hash_table_remove (g_kdf_cache, db_path);
+    g_mutex_lock (&g_cache_lock);
+    if (g_kdf_cache != NULL)
+        g_hash_table_remove (g_kdf_cache, db_path);
+    g_mutex_unlock (&g_cache_lock);
 }
 
 
 static void
 kdf_cache_clear (void)
 {
-    if (g_kdf_cache == NULL)
-        return;
-    g_hash_table_destroy (g_kdf_cache);
-    g_kdf_cache = NULL;
+    g_mutex_lock (&g_cache_lock);
+    g_clear_pointer (&g_kdf_cache, g_hash_table_destroy);
+    g_mutex_unlock (&g_cache_lock);
 }
 
 
@@ -216,19 +296,19 @@ static void
 kdf_cache_apply_to_db_data (DatabaseData *db_data,
                             const gchar  *db_path)
 {
-    if (g_kdf_cache == NULL || db_data == NULL || db_path == NULL)
+    if (db_data == NULL || db_path == NULL)
         return;
-    KdfCacheEntry *cache = g_hash_table_lookup (g_kdf_cache, db_path);
-    if (cache == NULL || cache->derived_key == NULL)
-        return;
-    if (db_data->cached_derived_key == NULL)
+    g_mutex_lock (&g_cache_lock);
+    KdfCacheEntry *cache = (g_kdf_cache != NULL) ? g_hash_table_lookup (g_kdf_cache, db_path) : NULL;
+    if (cache != NULL && cache->derived_key != NULL && db_data->cached_derived_key == NULL)
         db_data->cached_derived_key = gcry_malloc_secure (ARGON2ID_KEYLEN);
-    if (db_data->cached_derived_key == NULL)
-        return;
-    memcpy (db_data->cached_derived_key, cache->derived_key, ARGON2ID_KEYLEN);
-    memcpy (db_data->cached_salt, cache->salt, KDF_SALT_SIZE);
-    memcpy (db_data->cached_pwd_hash, cache->pwd_hash, sizeof (cache->pwd_hash));
-    db_data->has_cached_key = TRUE;
+    if (cache != NULL && cache->derived_key != NULL && db_data->cached_derived_key != NULL) {
+        memcpy (db_data->cached_derived_key, cache->derived_key, ARGON2ID_KEYLEN);
+        memcpy (db_data->cached_salt, cache->salt, KDF_SALT_SIZE);
+        memcpy (db_data->cached_pwd_hash, cache->pwd_hash, sizeof (cache->pwd_hash));
+        db_data->has_cached_key = TRUE;
+    }
+    g_mutex_unlock (&g_cache_lock);
 }
 
 
@@ -242,10 +322,6 @@ kdf_cache_capture_from_db_data (const DatabaseData *db_data,
     if (db_data == NULL || db_path == NULL || !db_data->has_cached_key ||
         db_data->cached_derived_key == NULL)
         return;
-    if (g_kdf_cache == NULL)
-        g_kdf_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                             g_free,
-                                             (GDestroyNotify) kdf_cache_entry_free);
     KdfCacheEntry *entry = g_new0 (KdfCacheEntry, 1);
     entry->derived_key = gcry_malloc_secure (ARGON2ID_KEYLEN);
     if (entry->derived_key == NULL) {
@@ -255,7 +331,14 @@ kdf_cache_capture_from_db_data (const DatabaseData *db_data,
     memcpy (entry->derived_key, db_data->cached_derived_key, ARGON2ID_KEYLEN);
     memcpy (entry->salt, db_data->cached_salt, KDF_SALT_SIZE);
     memcpy (entry->pwd_hash, db_data->cached_pwd_hash, sizeof (entry->pwd_hash));
+
+    g_mutex_lock (&g_cache_lock);
+    if (g_kdf_cache == NULL)
+        g_kdf_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                             g_free,
+                                             (GDestroyNotify) kdf_cache_entry_free);
     g_hash_table_replace (g_kdf_cache, g_strdup (db_path), entry);
+    g_mutex_unlock (&g_cache_lock);
 }
 
 
@@ -305,11 +388,13 @@ idle_wipe_check (gpointer user_data)
     if (g_last_activity_us != 0 &&
         now - g_last_activity_us >= IDLE_WIPE_SECONDS * G_USEC_PER_SEC) {
         kdf_cache_clear ();
+        otp_ctx_cache_clear ();
         if (cached_entries != NULL) {
             g_ptr_array_free (cached_entries, TRUE);
             cached_entries = NULL;
             cached_at = 0;
         }
+        g_clear_pointer (&cached_index, entry_index_free);
         activation_capabilities_clear ();
         rate_buckets_clear ();
         g_last_activity_us = 0;
@@ -328,6 +413,7 @@ activation_capability_free (ActivationCapability *cap)
     g_free (cap->query);
     g_free (cap->db_path);
     g_free (cap->label);
+    g_free (cap->issuer);
     g_free (cap);
 }
 
@@ -403,6 +489,7 @@ issue_activation_capability (const gchar          *sender,
     cap->query = g_strdup (query != NULL ? query : "");
     cap->db_path = g_strdup (entry->db_path);
     cap->label = g_strdup (entry->label);
+    cap->issuer = g_strdup (entry->issuer);
     cap->json_index = entry->json_index;
     cap->expires_at_us = g_get_monotonic_time () + ACTIVATION_CAP_TTL_US;
     g_hash_table_insert (g_activation_caps, g_strdup (id), cap);
@@ -445,8 +532,22 @@ consume_activation_capability (const gchar *id,
 }
 
 
-static gchar *
-get_entry_otp_value (json_t *obj)
+static void
+otp_ctx_cache_entry_free (OtpCtxCacheEntry *entry)
+{
+    if (entry == NULL)
+        return;
+    otp_context_free (entry->ctx);
+    g_free (entry->db_path);
+    g_free (entry->label);
+    g_free (entry->issuer);
+    g_free (entry);
+}
+
+
+/* Keys a context for a TOTP token, the only kind the provider lists. */
+static OtpCtxCacheEntry *
+otp_ctx_cache_entry_new (json_t *obj)
 {
     GError *validation_err = NULL;
     if (!otp_validate_token_object (obj, 0, &validation_err)) {
@@ -458,31 +559,146 @@ get_entry_otp_value (json_t *obj)
 
     const gchar *secret = json_string_value (json_object_get (obj, "secret"));
     const gchar *type = json_string_value (json_object_get (obj, "type"));
-    if (!secret || !type) return NULL;
+    if (!secret || !type || g_ascii_strcasecmp (type, "TOTP") != 0) return NULL;
 
-    cotp_error_t cotp_err;
+    const gchar *label = json_string_value (json_object_get (obj, "label"));
     const gchar *issuer = json_string_value (json_object_get (obj, "issuer"));
-    gint digits = (gint)json_integer_value (json_object_get (obj, "digits"));
-    gint algo = get_algo_int_from_str (json_string_value (json_object_get (obj, "algo")));
-    gchar *token = NULL;
-
-    if (g_ascii_strcasecmp (type, "TOTP") == 0) {
-        gint period = (gint)json_integer_value (json_object_get (obj, "period"));
-        time_t now = time (NULL);
-        if (now < 0 || (guint64) now > (guint64) LONG_MAX)
-            return NULL;
-        long current_ts = (long) now;
-        if (issuer != NULL && g_ascii_strcasecmp (issuer, "steam") == 0) {
-            token = get_steam_totp_at (secret, current_ts, period, &cotp_err);
-        } else {
-            token = get_totp_at (secret, current_ts, digits, period, algo, &cotp_err);
+    gboolean steam = (issuer != NULL && g_ascii_strcasecmp (issuer, "steam") == 0);
+    OtpContext *ctx = otp_context_new (secret,
+                                       steam ? "SHA1" : json_string_value (json_object_get (obj, "algo")),
+                                       NULL);
+    if (ctx == NULL) return NULL;
+
+    OtpCtxCacheEntry *entry = g_new0 (OtpCtxCacheEntry, 1);
+    entry->ctx = ctx;
+    entry->label = g_strdup (label);
+    entry->issuer = g_strdup (issuer ? issuer : "");
+    entry->steam = steam;
+    entry->digits = (guint) json_integer_value (json_object_get (obj, "digits"));
+    entry->period = (guint) json_integer_value (json_object_get (obj, "period"));
+    return entry;
+}
+
+
+static gchar *
+otp_ctx_cache_entry_code (const OtpCtxCacheEntry *entry)
+{
+    gint64 now = g_get_real_time () / G_USEC_PER_SEC;
+    if (entry->steam)
+        return otp_context_steam_at (entry->ctx, now, entry->period);
+    return otp_context_totp_at (entry->ctx, now, entry->period, entry->digits);
+}
+
+
+static gboolean
+db_identity_read (const gchar *db_path,
+                  DbIdentity  *identity)
+{
+    g_autofree gchar *journal = db_journal_path (db_path);
+    db_file_stamp_read (journal, &identity->journal);
+    return db_file_stamp_read (db_path, &identity->db);
+}
+
+
+static gboolean
+db_identity_equal (const DbIdentity *a,
+                   const DbIdentity *b)
+{
+    if (!db_file_stamp_equal (&a->db, &b->db))
+        return FALSE;
+    // No journal on either side is a match too.
+    if (!a->journal.valid || !b->journal.valid)
+        return a->journal.valid == b->journal.valid;
+    return db_file_stamp_equal (&a->journal, &b->journal);
+}
+
+
+static gchar *
+otp_ctx_cache_key (const OtpSearchEntry *entry)
+{
+    return g_strdup_printf ("%" G_GSIZE_FORMAT ":%s", entry->json_index, entry->db_path);
+}
+
+
+/* Returns the code from a still trusted context, NULL on any miss (and drops
+ * the entry unless it simply was not there). */
+static gchar *
+otp_ctx_cache_lookup (const OtpSearchEntry *entry,
+                      const DbIdentity     *identity)
+{
+    g_autofree gchar *key = otp_ctx_cache_key (entry);
+    gchar *otp = NULL;
+    g_mutex_lock (&g_cache_lock);
+    OtpCtxCacheEntry *cached = (g_otp_ctx_cache != NULL) ? g_hash_table_lookup (g_otp_ctx_cache, key) : NULL;
+    if (cached != NULL) {
+        if (g_get_monotonic_time () >= cached->expires_at_us ||
+            !db_identity_equal (&cached->identity, identity) ||
+            g_strcmp0 (cached->label, entry->label) != 0 ||
+            g_strcmp0 (cached->issuer, entry->issuer) != 0)
+            g_hash_table_remove (g_otp_ctx_cache, key);
+        else
+            otp = otp_ctx_cache_entry_code (cached);
+    }
+    g_mutex_unlock (&g_cache_lock);
+    return otp;
+}
+
+
+/* Computes the code for obj and, when identity is given (the setting is on
+ * and the file could be stat'ed before it was read), keeps the context. */
+static gchar *
+otp_ctx_cache_compute (json_t               *obj,
+                       const OtpSearchEntry *entry,
+                       const DbIdentity     *identity)
+{
+    OtpCtxCacheEntry *cached = otp_ctx_cache_entry_new (obj);
+    if (cached == NULL) return NULL;
+    gchar *otp = otp_ctx_cache_entry_code (cached);
+    if (otp == NULL || identity == NULL || g_strcmp0 (cached->label, entry->label) != 0 ||
+        g_strcmp0 (cached->issuer, entry->issuer) != 0) {
+        otp_ctx_cache_entry_free (cached);
+        return otp;
+    }
+
+    cached->db_path = g_strdup (entry->db_path);
+    cached->identity = *identity;
+    cached->expires_at_us = g_get_monotonic_time () + OTP_CTX_CACHE_TTL_SECONDS * G_USEC_PER_SEC;
+    g_mutex_lock (&g_cache_lock);
+    if (g_otp_ctx_cache == NULL)
+        g_otp_ctx_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                 (GDestroyNotify) otp_ctx_cache_entry_free);
+    g_hash_table_replace (g_otp_ctx_cache, otp_ctx_cache_key (entry), cached);
+    g_mutex_unlock (&g_cache_lock);
+    return otp;
+}
+
+
+static void
+otp_ctx_cache_invalidate_path (const gchar *db_path)
+{
+    if (db_path == NULL)
+        return;
+    g_mutex_lock (&g_cache_lock);
+    if (g_otp_ctx_cache != NULL) {
+        GHashTableIter iter;
+        gpointer value;
+        g_hash_table_iter_init (&iter, g_otp_ctx_cache);
+        while (g_hash_table_iter_next (&iter, NULL, &value)) {
+            if (g_strcmp0 (((OtpCtxCacheEntry *) value)->db_path, db_path) == 0)
+                g_hash_table_iter_remove (&iter);
         }
     }
+    g_mutex_unlock (&g_cache_lock);
+}
+
 
-    if (token == NULL) return NULL;
-    gchar *result = secure_strdup (token);
-    sensitive_free (token);
-    return result;
+static void
+otp_ctx_cache_clear (void)
+{
+    /* gcry_md_close in otp_context_free wipes the pad states. */
+    g_mutex_lock (&g_cache_lock);
+    g_clear_pointer (&g_otp_ctx_cache, g_hash_table_destroy);
+    g_mutex_unlock (&g_cache_lock);
 }
 
 
@@ -556,7 +772,7 @@ load_entries_from_db (GPtrArray   *entries,
         entry->db_name = g_strdup (db_name);
         entry->db_path = g_strdup (db_path);
         entry->json_index = index;
-        /* Pre-casefold for entry_matches_terms - done once at load instead of
+        /* Pre-casefold for search_terms_match - done once at load instead of
          * once per term per query. Live OTP codes are no longer cached: they're
          * recomputed on demand in compute_otp_for_entry, so a heap inspection
          * of the daemon shows only labels/issuers, not active codes. */
@@ -587,14 +803,17 @@ on_db_file_changed (GFileMonitor      *monitor G_GNUC_UNUSED,
         event == G_FILE_MONITOR_EVENT_MOVED_OUT)
     {
         cached_at = 0;
+        g_entries_generation++;
         /* Drop the KDF cache entry for this specific path: a password change
          * yields a new salt + new derived key, so the stale entry would just
          * cause a wasted memcmp on the next call. Wiping it sooner also
          * shortens the lifetime of the old derived key in secure memory. */
         if (file != NULL) {
             g_autofree gchar *path = g_file_get_path (file);
-            if (path != NULL)
+            if (path != NULL) {
                 kdf_cache_invalidate_path (path);
+                otp_ctx_cache_invalidate_path (path);
+            }
         }
     }
 }
@@ -656,65 +875,172 @@ sync_file_monitors (GPtrArray *desired_paths)
 }
 
 
-static GPtrArray *
-load_entries_uncached (void)
+static void
+db_source_free (DbSource *source)
 {
-    GPtrArray *entries = g_ptr_array_new_with_free_func ((GDestroyNotify) otp_search_entry_free);
+    if (source == NULL) return;
+    g_free (source->path);
+    g_free (source->name);
+    g_free (source);
+}
 
-    /* Collect the desired set of paths, then diff our current monitor set
-     * against it - see sync_file_monitors. */
-    g_autoptr (GPtrArray) desired_paths = g_ptr_array_new ();
+
+/* Main thread: the configured databases, with a file monitor kept on each
+ * (monitors fire on the main context of the thread that made them). */
+static GPtrArray *
+collect_db_sources (void)
+{
+    GPtrArray *sources = g_ptr_array_new_with_free_func ((GDestroyNotify) db_source_free);
 
     g_autoptr (GPtrArray) db_list = gsettings_common_get_db_list ();
-    g_autofree gchar *fallback_path = NULL;
     if (db_list != NULL && db_list->len > 0)
     {
         for (guint i = 0; i < db_list->len; i++)
         {
             DbListEntry *dbe = g_ptr_array_index (db_list, i);
-            if (dbe->path != NULL)
-                g_ptr_array_add (desired_paths, dbe->path);
+            if (dbe->path == NULL)
+                continue;
+            DbSource *source = g_new0 (DbSource, 1);
+            source->path = g_strdup (dbe->path);
+            source->name = g_strdup (dbe->name);
+            source->index = i;
+            g_ptr_array_add (sources, source);
         }
     }
     else
     {
-        fallback_path = gsettings_common_get_db_path ();
+        gchar *fallback_path = gsettings_common_get_db_path ();
         if (fallback_path != NULL)
-            g_ptr_array_add (desired_paths, fallback_path);
+        {
+            DbSource *source = g_new0 (DbSource, 1);
+            source->path = fallback_path;
+            g_ptr_array_add (sources, source);
+        }
     }
 
+    /* Diff our current monitor set against the desired one - see
+     * sync_file_monitors. */
+    g_autoptr (GPtrArray) desired_paths = g_ptr_array_new ();
+    for (guint i = 0; i < sources->len; i++)
+        g_ptr_array_add (desired_paths, ((DbSource *) g_ptr_array_index (sources, i))->path);
     sync_file_monitors (desired_paths);
 
-    if (db_list != NULL && db_list->len > 0)
+    return sources;
+}
+
+
+typedef struct {
+    GPtrArray  *entries;
+    EntryIndex *index;
+} LoadedEntries;
+
+
+static void
+loaded_entries_free (LoadedEntries *loaded)
+{
+    if (loaded->entries != NULL)
+        g_ptr_array_free (loaded->entries, TRUE);
+    entry_index_free (loaded->index);
+    g_free (loaded);
+}
+
+
+/* A task whose pool had no worker to start also goes to GTask's own pool,
+ * and a later push may still start one that reaches it: only the first to
+ * claim it runs it. */
+static gboolean
+search_task_claim (GTask *task)
+{
+    return g_object_replace_data (G_OBJECT (task), "otpclient-search-claimed",
+                                  NULL, GINT_TO_POINTER (TRUE), NULL, NULL);
+}
+
+
+/* Takes task. The pool drops its reference once the job has run, and the
+ * job stays queued even when no worker could be started for it; if the pool
+ * has no worker at all, fallback runs it on GTask's pool instead. */
+static void
+search_pool_push (GThreadPool     *pool,
+                  GTask           *task,
+                  GTaskThreadFunc  fallback,
+                  const gchar     *what)
+{
+    if (thread_pool_push_queued (pool, task, what) || !search_task_claim (task))
+        return;
+    g_atomic_int_inc (&g_stranded_jobs);
+    g_task_run_in_thread (task, fallback);
+}
+
+
+/* Called by a fallback once its job has returned. */
+static void
+search_stranded_job_done (void)
+{
+    g_atomic_int_add (&g_stranded_jobs, -1);
+    g_main_context_wakeup (NULL);
+}
+
+
+/* Jobs stranded in a pool without a worker already ran through GTask's pool;
+ * don't wait for a worker to drop them. Everything else runs to the end. */
+static void
+search_pool_free (GThreadPool *pool)
+{
+    gboolean stranded = g_thread_pool_get_num_threads (pool) == 0;
+    g_thread_pool_free (pool, stranded, TRUE);
+}
+
+
+static void
+entries_reload_run (GTask *task)
+{
+    GPtrArray *sources = g_task_get_task_data (task);
+    LoadedEntries *loaded = g_new0 (LoadedEntries, 1);
+    loaded->entries = g_ptr_array_new_with_free_func ((GDestroyNotify) otp_search_entry_free);
+    for (guint i = 0; i < sources->len; i++)
     {
-        for (guint i = 0; i < db_list->len; i++)
-        {
-            DbListEntry *dbe = g_ptr_array_index (db_list, i);
-            load_entries_from_db (entries, dbe->path, dbe->name, i);
-        }
+        DbSource *source = g_ptr_array_index (sources, i);
+        load_entries_from_db (loaded->entries, source->path, source->name, source->index);
     }
-    else if (fallback_path != NULL)
+    /* Indexed here rather than on the main loop: it is the expensive half
+     * of a reload with many tokens. */
+    loaded->index = entry_index_new ();
+    for (guint i = 0; i < loaded->entries->len; i++)
     {
-        load_entries_from_db (entries, fallback_path, NULL, 0);
+        OtpSearchEntry *entry = g_ptr_array_index (loaded->entries, i);
+        entry_index_add (loaded->index, entry->label_fold, entry->issuer_fold);
     }
+    g_task_return_pointer (task, loaded, (GDestroyNotify) loaded_entries_free);
+}
 
-    return entries;
+
+static void
+entries_reload_worker (gpointer data,
+                       gpointer user_data G_GNUC_UNUSED)
+{
+    GTask *task = data;
+    if (search_task_claim (task))
+        entries_reload_run (task);
+    g_object_unref (task);
 }
 
 
-static GPtrArray *
-get_entries (void)
+static void
+entries_reload_in_thread (GTask        *task,
+                          gpointer      source_object G_GNUC_UNUSED,
+                          gpointer      task_data G_GNUC_UNUSED,
+                          GCancellable *cancellable G_GNUC_UNUSED)
 {
-    gint64 now = time (NULL);
-    if (cached_entries != NULL && cached_at != 0 && (now - cached_at) < CACHE_TTL_SECONDS)
-        return cached_entries;
+    entries_reload_run (task);
+    search_stranded_job_done ();
+}
 
-    if (cached_entries != NULL)
-        g_ptr_array_free (cached_entries, TRUE);
 
-    cached_entries = load_entries_uncached ();
-    cached_at = now;
-    return cached_entries;
+static gboolean
+entries_are_fresh (void)
+{
+    gint64 now = time (NULL);
+    return cached_entries != NULL && cached_at != 0 && (now - cached_at) < CACHE_TTL_SECONDS;
 }
 
 
@@ -786,34 +1112,43 @@ strip_keyword_or_skip (gchar  **terms,
 
 
 static gboolean
-entry_matches_terms (const OtpSearchEntry *entry,
-                     gchar               **terms,
-                     gsize                 terms_len)
-{
-    if (terms_len == 0 || !entry->label_fold) return FALSE;
-    for (gsize i = 0; i < terms_len; i++) {
-        if (!terms[i]) continue;
-        g_autofree gchar *t_fold = g_utf8_casefold (terms[i], -1);
-        if (!g_strstr_len (entry->label_fold, -1, t_fold) &&
-            !g_strstr_len (entry->issuer_fold, -1, t_fold))
-            return FALSE;
-    }
-    return TRUE;
+fetched_token_matches (json_t               *obj,
+                       const OtpSearchEntry *entry)
+{
+    const gchar *issuer = json_string_value (json_object_get (obj, "issuer"));
+    return g_strcmp0 (json_string_value (json_object_get (obj, "label")), entry->label) == 0 &&
+           g_strcmp0 (issuer != NULL ? issuer : "", entry->issuer) == 0;
 }
 
 
 static gchar *
 compute_otp_for_entry (const OtpSearchEntry *entry)
 {
-    /* Open, decrypt, look up the JSON object, compute the OTP, then wipe
+    /* Open, decrypt the one token record, compute the OTP, then wipe
      * everything. The Argon2id derivation pays the user-visible latency, but
      * the cached derived key in db_data->cached_derived_key + the file
      * monitor + the 60 s entry cache mean this only happens on the first Run
      * after the DB has changed. The trade vs caching the OTP value: heap
-     * inspection of the daemon never reveals an active OTP. */
+     * inspection of the daemon never reveals an active OTP. With
+     * search-provider-keep-unlocked on, g_otp_ctx_cache short-cuts all of
+     * this for tokens activated recently. */
     if (entry == NULL || entry->db_path == NULL) return NULL;
     if (!gsettings_common_get_use_secret_service ()) return NULL;
 
+    /* Stat before anything is read: if the file changes after this point the
+     * stored identity is already stale and the next call reads it again. */
+    DbIdentity identity;
+    gboolean keep = gsettings_common_get_search_provider_keep_unlocked ();
+    if (!keep)
+        otp_ctx_cache_clear ();
+    else if (!db_identity_read (entry->db_path, &identity))
+        keep = FALSE;
+    if (keep) {
+        gchar *cached_otp = otp_ctx_cache_lookup (entry, &identity);
+        if (cached_otp != NULL)
+            return cached_otp;
+    }
+
     GError *ss_err = NULL;
     /* Issue #448: v4 fallback so a v4 upgrader who has not opened the GUI
      * yet still gets OTP values from the search provider. */
@@ -835,13 +1170,34 @@ compute_otp_for_entry (const OtpSearchEntry *entry)
      * derive and overwrites the cache below. */
     kdf_cache_apply_to_db_data (db_data, entry->db_path);
 
+    /* v4 seals each token separately, so read and decrypt only this one
+     * instead of the whole file. The label/issuer check catches an index that
+     * no longer lines up with load_db's (tokens quarantined or renamed on
+     * load). Anything but a wrong key falls back to the full load below. */
     GError *err = NULL;
-    load_db (db_data, &err);
     gchar *otp = NULL;
+    json_t *fetched = db_fetch_token (db_data, entry->json_index, &err);
+    if (fetched != NULL && fetched_token_matches (fetched, entry)) {
+        otp = otp_ctx_cache_compute (fetched, entry, keep ? &identity : NULL);
+        kdf_cache_capture_from_db_data (db_data, entry->db_path);
+        json_decref (fetched);
+        database_data_free (db_data);
+        return otp;
+    }
+    if (fetched != NULL)
+        json_decref (fetched);
+    if (err != NULL && err->domain == bad_tag_gquark ()) {
+        g_clear_error (&err);
+        database_data_free (db_data);
+        return NULL;
+    }
+    g_clear_error (&err);
+
+    load_db (db_data, &err);
     if (err == NULL && db_data->in_memory_json_data != NULL) {
         json_t *obj = json_array_get (db_data->in_memory_json_data, entry->json_index);
         if (obj != NULL)
-            otp = get_entry_otp_value (obj);
+            otp = otp_ctx_cache_compute (obj, entry, keep ? &identity : NULL);
         /* try_decrypt_v2 populates db_data->cached_* on success; persist
          * those into g_kdf_cache so the next call hits. Capturing only on
          * success keeps a wrong-password attempt from poisoning the cache. */
@@ -972,24 +1328,313 @@ send_notification (const gchar *label,
     GVariantBuilder actions, hints;
     g_variant_builder_init (&actions, G_VARIANT_TYPE ("as"));
     g_variant_builder_init (&hints, G_VARIANT_TYPE ("a{sv}"));
-    GVariant *reply = g_dbus_connection_call_sync (conn,
-                                                    "org.freedesktop.Notifications",
-                                                    "/org/freedesktop/Notifications",
-                                                    "org.freedesktop.Notifications",
-                                                    "Notify",
-                                                    g_variant_new ("(susssasa{sv}i)",
-                                                                   "OTPClient", (guint32)0,
-                                                                   "com.github.paolostivanin.OTPClient",
-                                                                   "OTP Token", body,
-                                                                   &actions, &hints, (gint32)5000),
-                                                    NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL, NULL);
-    if (reply != NULL)
-        g_variant_unref (reply);
+    /* Fire-and-forget: the reply (a notification id) is not needed, and
+     * waiting for it would hold the main loop on the notification daemon. */
+    g_dbus_connection_call (conn,
+                            "org.freedesktop.Notifications",
+                            "/org/freedesktop/Notifications",
+                            "org.freedesktop.Notifications",
+                            "Notify",
+                            g_variant_new ("(susssasa{sv}i)",
+                                           "OTPClient", (guint32)0,
+                                           "com.github.paolostivanin.OTPClient",
+                                           "OTP Token", body,
+                                           &actions, &hints, (gint32)5000),
+                            NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL, NULL, NULL);
     g_object_unref (conn);
     sensitive_g_free (body);
 }
 
 
+/* Entries (borrowed from entries) matching every term, in entries order.
+ * The terms are folded once for the whole query and, when index is set,
+ * only the index's candidates are checked. */
+static GPtrArray *
+find_matching_entries (gchar            **terms,
+                       GPtrArray         *entries,
+                       const EntryIndex  *index)
+{
+    GPtrArray *matches = g_ptr_array_new ();
+    if (terms == NULL || entries == NULL)
+        return matches;
+    g_autoptr (SearchTerms) compiled = search_terms_compile (terms);
+    if (compiled == NULL)
+        return matches;
+
+    g_autoptr (GArray) candidates = (index != NULL) ? entry_index_lookup (index, compiled) : NULL;
+    guint n = (candidates != NULL) ? candidates->len : entries->len;
+    for (guint i = 0; i < n; i++) {
+        guint pos = (candidates != NULL) ? g_array_index (candidates, guint32, i) : i;
+        OtpSearchEntry *e = g_ptr_array_index (entries, pos);
+        if (search_terms_match (compiled, e->label_fold, e->issuer_fold))
+            g_ptr_array_add (matches, e);
+    }
+    return matches;
+}
+
+
+static GVariant *
+gnome_results (GDBusMethodInvocation *inv,
+               gchar                **terms,
+               GPtrArray             *matches)
+{
+    GVariantBuilder builder;
+    g_variant_builder_init (&builder, G_VARIANT_TYPE ("as"));
+    if (matches->len > 0) {
+        g_autofree gchar *normalized_query = normalize_terms (terms);
+        for (guint i = 0; i < matches->len; i++) {
+            OtpSearchEntry *e = g_ptr_array_index (matches, i);
+            g_autofree gchar *cap = issue_activation_capability (
+                g_dbus_method_invocation_get_sender (inv),
+                normalized_query, e);
+            if (cap != NULL)
+                g_variant_builder_add (&builder, "s", cap);
+        }
+    }
+    return g_variant_new ("(as)", &builder);
+}
+
+
+static GVariant *
+krunner_results (GDBusMethodInvocation *inv,
+                 gchar                **terms,
+                 GPtrArray             *matches)
+{
+    GVariantBuilder builder;
+    g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(sssida{sv})"));
+    if (matches->len > 0) {
+        g_autofree gchar *normalized_query = normalize_terms (terms);
+        for (guint i = 0; i < matches->len; i++) {
+            OtpSearchEntry *e = g_ptr_array_index (matches, i);
+            g_autofree gchar *cap = issue_activation_capability (
+                g_dbus_method_invocation_get_sender (inv),
+                normalized_query, e);
+            if (cap == NULL)
+                continue;
+            GVariantBuilder props;
+            g_variant_builder_init (&props, G_VARIANT_TYPE ("a{sv}"));
+            // Deliberately do NOT include the OTP value in the subtitle:
+            // any process on the session bus can poll Match. The code is
+            // only handed out via Run, where the user sees a notification.
+            g_autofree gchar *sub = NULL;
+            if (e->db_name != NULL && e->db_name[0] != '\0')
+                sub = (e->issuer && *e->issuer)
+                    ? g_strdup_printf ("%s - %s", e->db_name, e->issuer)
+                    : g_strdup (e->db_name);
+            else
+                sub = g_strdup (e->issuer ? e->issuer : "");
+            g_variant_builder_add (&props, "{sv}", "subtext", g_variant_new_string (sub));
+            g_variant_builder_add (&props, "{sv}", "category", g_variant_new_string ("OTPClient"));
+            g_variant_builder_add (&builder, "(sssida{sv})",
+                                   cap, e->label,
+                                   "com.github.paolostivanin.OTPClient",
+                                   (gint32)0, (gdouble)1.0, &props);
+        }
+    }
+    GVariant *res = g_variant_builder_end (&builder);
+    return g_variant_new_tuple (&res, 1);
+}
+
+
+/* terms NULL (keyword missing) or entries NULL answer with no results.
+ * index, when set, covers entries. */
+static void
+reply_to_query (GDBusMethodInvocation *inv,
+                gchar                **terms,
+                gboolean               krunner,
+                GPtrArray             *entries,
+                const EntryIndex      *index)
+{
+    g_autoptr (GPtrArray) matches = find_matching_entries (terms, entries, index);
+    g_dbus_method_invocation_return_value (inv, krunner ? krunner_results (inv, terms, matches)
+                                                        : gnome_results (inv, terms, matches));
+}
+
+
+static void
+pending_query_free (PendingQuery *query)
+{
+    g_strfreev (query->terms);
+    g_free (query);
+}
+
+
+static void
+on_entries_reloaded (GObject      *source G_GNUC_UNUSED,
+                     GAsyncResult *res,
+                     gpointer      user_data)
+{
+    g_entries_reloading = FALSE;
+    LoadedEntries *loaded = g_task_propagate_pointer (G_TASK (res), NULL);
+    if (cached_entries != NULL)
+        g_ptr_array_free (cached_entries, TRUE);
+    g_clear_pointer (&cached_index, entry_index_free);
+    if (loaded != NULL) {
+        cached_entries = g_steal_pointer (&loaded->entries);
+        cached_index = g_steal_pointer (&loaded->index);
+        loaded_entries_free (loaded);
+    } else {
+        cached_entries = g_ptr_array_new_with_free_func ((GDestroyNotify) otp_search_entry_free);
+    }
+    /* A file changed while loading: still answer with this, but reload on
+     * the next query. */
+    cached_at = (GPOINTER_TO_UINT (user_data) == g_entries_generation) ? time (NULL) : 0;
+
+    if (g_pending_queries == NULL)
+        return;
+    g_autoptr (GPtrArray) pending = g_steal_pointer (&g_pending_queries);
+    for (guint i = 0; i < pending->len; i++) {
+        PendingQuery *query = g_ptr_array_index (pending, i);
+        reply_to_query (query->inv, query->terms, query->krunner, cached_entries, cached_index);
+    }
+}
+
+
+static void
+entries_reload_start (void)
+{
+    if (g_entries_reloading)
+        return;
+    g_entries_reloading = TRUE;
+
+    GTask *task = g_task_new (NULL, NULL, on_entries_reloaded,
+                              GUINT_TO_POINTER (g_entries_generation));
+    g_task_set_task_data (task, collect_db_sources (), (GDestroyNotify) g_ptr_array_unref);
+    search_pool_push (g_search_pool, task, entries_reload_in_thread, "the search entries reload");
+}
+
+
+/* Takes terms. Answers from the entries cache when it is fresh, otherwise
+ * parks the query until the reload lands. */
+static void
+answer_query (GDBusMethodInvocation *inv,
+              gchar                **terms,
+              gboolean               krunner)
+{
+    const gchar *sender = g_dbus_method_invocation_get_sender (inv);
+    if (g_pending_queries != NULL) {
+        for (guint i = g_pending_queries->len; i > 0; i--) {
+            PendingQuery *older = g_ptr_array_index (g_pending_queries, i - 1);
+            if (older->krunner != krunner ||
+                g_strcmp0 (g_dbus_method_invocation_get_sender (older->inv), sender) != 0)
+                continue;
+            reply_to_query (older->inv, NULL, older->krunner, NULL, NULL);
+            g_ptr_array_remove_index (g_pending_queries, i - 1);
+        }
+    }
+
+    if (terms == NULL || entries_are_fresh ()) {
+        reply_to_query (inv, terms, krunner, cached_entries, cached_index);
+        g_strfreev (terms);
+        return;
+    }
+
+    if (g_pending_queries == NULL)
+        g_pending_queries = g_ptr_array_new_with_free_func ((GDestroyNotify) pending_query_free);
+    PendingQuery *query = g_new0 (PendingQuery, 1);
+    query->inv = inv;
+    query->terms = terms;
+    query->krunner = krunner;
+    g_ptr_array_add (g_pending_queries, query);
+    entries_reload_start ();
+}
+
+
+typedef struct {
+    GDBusMethodInvocation *inv;
+    gchar                 *db_path;
+    gchar                 *label;
+    gchar                 *issuer;
+    gsize                  json_index;
+    gboolean               is_kde;
+} ActivationJob;
+
+
+static void
+activation_job_free (ActivationJob *job)
+{
+    g_free (job->db_path);
+    g_free (job->label);
+    g_free (job->issuer);
+    g_free (job);
+}
+
+
+static void
+activation_run (GTask *task)
+{
+    ActivationJob *job = g_task_get_task_data (task);
+    OtpSearchEntry e = {0};
+    e.db_path = job->db_path;
+    e.label = job->label;
+    e.issuer = job->issuer;
+    e.json_index = job->json_index;
+    g_task_return_pointer (task, compute_otp_for_entry (&e), (GDestroyNotify) sensitive_secure_free);
+}
+
+
+static void
+activation_worker (gpointer data,
+                   gpointer user_data G_GNUC_UNUSED)
+{
+    GTask *task = data;
+    if (search_task_claim (task))
+        activation_run (task);
+    g_object_unref (task);
+}
+
+
+static void
+activation_in_thread (GTask        *task,
+                      gpointer      source_object G_GNUC_UNUSED,
+                      gpointer      task_data G_GNUC_UNUSED,
+                      GCancellable *cancellable G_GNUC_UNUSED)
+{
+    activation_run (task);
+    search_stranded_job_done ();
+}
+
+
+static void
+on_activation_done (GObject      *source G_GNUC_UNUSED,
+                    GAsyncResult *res,
+                    gpointer      user_data G_GNUC_UNUSED)
+{
+    ActivationJob *job = g_task_get_task_data (G_TASK (res));
+    gchar *otp = g_task_propagate_pointer (G_TASK (res), NULL);
+    copy_to_clipboard (g_dbus_method_invocation_get_connection (job->inv), otp, job->is_kde);
+    send_notification (job->label, otp);
+    sensitive_secure_free (otp);
+    g_dbus_method_invocation_return_value (job->inv, NULL);
+}
+
+
+/* Takes cap. The reply goes out once the code has been delivered. */
+static void
+start_activation (GDBusMethodInvocation *inv,
+                  ActivationCapability  *cap,
+                  gboolean               is_kde)
+{
+    if (cap == NULL) {
+        g_dbus_method_invocation_return_value (inv, NULL);
+        return;
+    }
+
+    ActivationJob *job = g_new0 (ActivationJob, 1);
+    job->inv = inv;
+    job->db_path = g_strdup (cap->db_path);
+    job->label = g_strdup (cap->label);
+    job->issuer = g_strdup (cap->issuer);
+    job->json_index = cap->json_index;
+    job->is_kde = is_kde;
+    activation_capability_free (cap);
+
+    GTask *task = g_task_new (NULL, NULL, on_activation_done, NULL);
+    g_task_set_task_data (task, job, (GDestroyNotify) activation_job_free);
+    search_pool_push (g_activate_pool, task, activation_in_thread, "a search result activation");
+}
+
+
 static void
 handle_gnome_call (GDBusConnection       *conn,
                    const gchar           *sender,
@@ -1000,7 +1645,7 @@ handle_gnome_call (GDBusConnection       *conn,
                    GDBusMethodInvocation *inv,
                    gpointer               data)
 {
-    (void)sender; (void)path; (void)iface; (void)data;
+    (void)conn; (void)sender; (void)path; (void)iface; (void)data;
     g_last_activity_us = g_get_monotonic_time ();
 
     if (g_strcmp0 (method, "GetInitialResultSet") == 0 || g_strcmp0 (method, "GetSubsearchResultSet") == 0) {
@@ -1012,26 +1657,11 @@ handle_gnome_call (GDBusConnection       *conn,
             g_variant_get (params, "(^as^as)", &prev_results, &terms);
             g_strfreev (prev_results);
         }
-        GVariantBuilder builder;
-        g_variant_builder_init (&builder, G_VARIANT_TYPE ("as"));
-        g_auto(GStrv) stripped = NULL;
-        if (strip_keyword_or_skip (terms, &stripped)) {
-            GPtrArray *entries = get_entries ();
-            gsize stripped_len = g_strv_length (stripped);
-            g_autofree gchar *normalized_query = normalize_terms (stripped);
-            for (guint i = 0; i < entries->len; i++) {
-                OtpSearchEntry *e = g_ptr_array_index (entries, i);
-                if (entry_matches_terms (e, stripped, stripped_len)) {
-                    g_autofree gchar *cap = issue_activation_capability (
-                        g_dbus_method_invocation_get_sender (inv),
-                        normalized_query, e);
-                    if (cap != NULL)
-                        g_variant_builder_add (&builder, "s", cap);
-                }
-            }
-        }
-        g_dbus_method_invocation_return_value (inv, g_variant_new ("(as)", &builder));
+        /* stripped stays NULL without the keyword: no results. */
+        gchar **stripped = NULL;
+        strip_keyword_or_skip (terms, &stripped);
         g_strfreev (terms);
+        answer_query (inv, stripped, FALSE);
     } else if (g_strcmp0 (method, "GetResultMetas") == 0) {
         gchar **ids;
         g_variant_get (params, "(^as)", &ids);
@@ -1076,24 +1706,11 @@ handle_gnome_call (GDBusConnection       *conn,
         g_autofree gchar *normalized_query = NULL;
         if (strip_keyword_or_skip (terms, &stripped))
             normalized_query = normalize_terms (stripped);
-        gchar *otp = NULL;
-        g_autofree gchar *label = NULL;
         ActivationCapability *cap = (normalized_query != NULL)
             ? consume_activation_capability (id, g_dbus_method_invocation_get_sender (inv), normalized_query)
             : NULL;
-        if (cap != NULL) {
-            OtpSearchEntry e = {0};
-            e.db_path = cap->db_path;
-            e.json_index = cap->json_index;
-            otp = compute_otp_for_entry (&e);
-            label = g_strdup (cap->label);
-            activation_capability_free (cap);
-        }
         g_strfreev (terms);
-        copy_to_clipboard (conn, otp, FALSE);
-        send_notification (label, otp);
-        sensitive_secure_free (otp);
-        g_dbus_method_invocation_return_value (inv, NULL);
+        start_activation (inv, cap, FALSE);
     } else {
         g_dbus_method_invocation_return_value (inv, NULL);
     }
@@ -1110,52 +1727,18 @@ handle_krunner_call (GDBusConnection       *conn,
                      GDBusMethodInvocation *inv,
                      gpointer               data)
 {
-    (void)sender; (void)path; (void)iface; (void)data;
+    (void)conn; (void)sender; (void)path; (void)iface; (void)data;
     g_last_activity_us = g_get_monotonic_time ();
 
     if (g_strcmp0 (method, "Match") == 0) {
         const gchar *query;
         g_variant_get (params, "(&s)", &query);
-        GVariantBuilder builder;
-        g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(sssida{sv})"));
+        gchar **stripped = NULL;
         if (query && *query) {
             g_auto(GStrv) terms = g_strsplit_set (query, " \t", -1);
-            g_auto(GStrv) stripped = NULL;
-            if (strip_keyword_or_skip (terms, &stripped)) {
-                gsize stripped_len = g_strv_length (stripped);
-                g_autofree gchar *normalized_query = normalize_terms (stripped);
-                GPtrArray *entries = get_entries ();
-                for (guint i = 0; i < entries->len; i++) {
-                    OtpSearchEntry *e = g_ptr_array_index (entries, i);
-                    if (!entry_matches_terms (e, stripped, stripped_len)) continue;
-                    g_autofree gchar *cap = issue_activation_capability (
-                        g_dbus_method_invocation_get_sender (inv),
-                        normalized_query, e);
-                    if (cap == NULL)
-                        continue;
-                    GVariantBuilder props;
-                    g_variant_builder_init (&props, G_VARIANT_TYPE ("a{sv}"));
-                    // Deliberately do NOT include the OTP value in the subtitle:
-                    // any process on the session bus can poll Match. The code is
-                    // only handed out via Run, where the user sees a notification.
-                    g_autofree gchar *sub = NULL;
-                    if (e->db_name != NULL && e->db_name[0] != '\0')
-                        sub = (e->issuer && *e->issuer)
-                            ? g_strdup_printf ("%s - %s", e->db_name, e->issuer)
-                            : g_strdup (e->db_name);
-                    else
-                        sub = g_strdup (e->issuer ? e->issuer : "");
-                    g_variant_builder_add (&props, "{sv}", "subtext", g_variant_new_string (sub));
-                    g_variant_builder_add (&props, "{sv}", "category", g_variant_new_string ("OTPClient"));
-                    g_variant_builder_add (&builder, "(sssida{sv})",
-                                           cap, e->label,
-                                           "com.github.paolostivanin.OTPClient",
-                                           (gint32)0, (gdouble)1.0, &props);
-                }
-            }
+            strip_keyword_or_skip (terms, &stripped);
         }
-        GVariant *res = g_variant_builder_end (&builder);
-        g_dbus_method_invocation_return_value (inv, g_variant_new_tuple (&res, 1));
+        answer_query (inv, stripped, TRUE);
     } else if (g_strcmp0 (method, "Run") == 0) {
         // Same gate as the GNOME ActivateResult path: no keyword set means
         // the provider refuses to deliver codes, even via id lookup.
@@ -1170,22 +1753,9 @@ handle_krunner_call (GDBusConnection       *conn,
         }
         const gchar *id;
         g_variant_get (params, "(&s&s)", &id, NULL);
-        gchar *otp = NULL;
-        g_autofree gchar *label = NULL;
-        ActivationCapability *cap = consume_activation_capability (
-            id, g_dbus_method_invocation_get_sender (inv), NULL);
-        if (cap != NULL) {
-            OtpSearchEntry e = {0};
-            e.db_path = cap->db_path;
-            e.json_index = cap->json_index;
-            otp = compute_otp_for_entry (&e);
-            label = g_strdup (cap->label);
-            activation_capability_free (cap);
-        }
-        copy_to_clipboard (conn, otp, TRUE);
-        send_notification (label, otp);
-        sensitive_secure_free (otp);
-        g_dbus_method_invocation_return_value (inv, NULL);
+        start_activation (inv, consume_activation_capability (
+                              id, g_dbus_method_invocation_get_sender (inv), NULL),
+                          TRUE);
     } else if (g_strcmp0 (method, "Actions") == 0) {
         GVariant *empty = g_variant_new_array (G_VARIANT_TYPE ("(sss)"), NULL, 0);
         g_dbus_method_invocation_return_value (inv, g_variant_new_tuple (&empty, 1));
@@ -1275,6 +1845,11 @@ main (int    argc,
     }
 
     main_loop = g_main_loop_new (NULL, FALSE);
+    /* Jobs dropped by search_pool_free still hold the pool's reference */
+    g_search_pool = g_thread_pool_new_full (entries_reload_worker, NULL, g_object_unref,
+                                            1, FALSE, NULL);
+    g_activate_pool = g_thread_pool_new_full (activation_worker, NULL, g_object_unref,
+                                              ACTIVATE_WORKERS, FALSE, NULL);
     if (force_kde)
         g_bus_own_name (G_BUS_TYPE_SESSION, KRUNNER_BUS, G_BUS_NAME_OWNER_FLAGS_NONE,
                         on_krunner_bus_acquired, NULL, on_name_lost, NULL, NULL);
@@ -1284,14 +1859,24 @@ main (int    argc,
     g_last_activity_us = g_get_monotonic_time ();
     g_timeout_add_seconds (60, idle_wipe_check, NULL);
     g_main_loop_run (main_loop);
+    /* Let running and queued jobs finish so nothing touches the caches
+     * after they are wiped, then deliver what they produced. */
+    search_pool_free (g_search_pool);
+    search_pool_free (g_activate_pool);
+    while (g_atomic_int_get (&g_stranded_jobs) > 0)
+        g_main_context_iteration (NULL, TRUE);
+    while (g_main_context_iteration (NULL, FALSE));
+    g_clear_pointer (&g_pending_queries, g_ptr_array_unref);
     clear_file_monitors ();
     if (cached_entries != NULL) {
         g_ptr_array_free (cached_entries, TRUE);
         cached_entries = NULL;
     }
+    g_clear_pointer (&cached_index, entry_index_free);
     /* Wipe derived keys + per-sender state on shutdown. The kdf_cache entry
      * destroy callback explicit_bzero's the derived key before gcry_free. */
     kdf_cache_clear ();
+    otp_ctx_cache_clear ();
     rate_buckets_clear ();
     activation_capabilities_clear ();
     g_clear_pointer (&g_keyword, g_free);
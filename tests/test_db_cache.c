@@ -0,0 +1,263 @@
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <jansson.h>
+#include "common.h"
+#include "db-common.h"
+#include "db-cache.h"
+
+/* The cache keeps switched-away databases unlocked. What matters is that
+ * nothing stays in memory longer than it should: every eviction (count,
+ * budget, lock, removal, file changed on disk) must wipe the key and the
+ * tokens, and a database that changed on disk must never be handed back. */
+
+typedef struct {
+    gchar *dir;
+    gchar *paths[3];
+} Fixture;
+
+static DatabaseData *
+saved_db (const gchar *path,
+          guint        n_tokens)
+{
+    DatabaseData *db_data = database_data_new (path, DEFAULT_MEMLOCK_VALUE);
+    db_data->key = secure_strdup ("password");
+    db_data->argon2id_iter = ARGON2ID_MIN_ITER;
+    db_data->argon2id_memcost = ARGON2ID_MIN_MC;
+    db_data->argon2id_parallelism = ARGON2ID_MIN_PARAL;
+    db_data->current_db_version = DB_VERSION;
+    db_data->in_memory_json_data = json_array ();
+    for (guint i = 0; i < n_tokens; i++) {
+        g_autofree gchar *label = g_strdup_printf ("user%u", i);
+        json_array_append_new (db_data->in_memory_json_data,
+                               build_json_obj ("TOTP", label, "Example", "JBSWY3DPEHPK3PXP",
+                                               6, "SHA1", 30, 0, NULL));
+    }
+
+    GError *err = NULL;
+    update_db (db_data, &err);
+    g_assert_no_error (err);
+    return db_data;
+}
+
+static void
+fixture_setup (Fixture       *f,
+               gconstpointer  user_data)
+{
+    (void) user_data;
+    GError *err = NULL;
+    f->dir = g_dir_make_tmp ("otpclient-db-cache-XXXXXX", &err);
+    g_assert_no_error (err);
+    for (guint i = 0; i < G_N_ELEMENTS (f->paths); i++)
+        f->paths[i] = g_strdup_printf ("%s/db%u.enc", f->dir, i);
+}
+
+static void
+fixture_teardown (Fixture       *f,
+                  gconstpointer  user_data)
+{
+    (void) user_data;
+    for (guint i = 0; i < G_N_ELEMENTS (f->paths); i++) {
+        const gchar *suffixes[] = { "", ".lock", ".bak", ".journal" };
+        for (guint s = 0; s < G_N_ELEMENTS (suffixes); s++) {
+            g_autofree gchar *path = g_strconcat (f->paths[i], suffixes[s], NULL);
+            g_unlink (path);
+        }
+        g_free (f->paths[i]);
+    }
+    g_rmdir (f->dir);
+    g_free (f->dir);
+}
+
+static void
+assert_purged (DatabaseData *db_data)
+{
+    g_assert_null (db_data->key);
+    g_assert_null (db_data->in_memory_json_data);
+    g_assert_false (db_data->has_cached_key);
+}
+
+static void
+test_take (Fixture       *f,
+           gconstpointer  user_data)
+{
+    (void) user_data;
+    DbCache *cache = db_cache_new (4, G_MAXSIZE);
+    DatabaseData *a = saved_db (f->paths[0], 3);
+
+    db_cache_put (cache, a);
+    g_assert_cmpuint (db_cache_get_n_entries (cache), ==, 1);
+    g_assert_null (db_cache_take (cache, f->paths[1]));
+
+    // Handed back as it was: key, tokens and derived key.
+    DatabaseData *back = db_cache_take (cache, f->paths[0]);
+    g_assert_true (back == a);
+    g_assert_nonnull (back->key);
+    g_assert_cmpuint (json_array_size (back->in_memory_json_data), ==, 3);
+    g_assert_cmpuint (db_cache_get_n_entries (cache), ==, 0);
+    g_assert_null (db_cache_take (cache, f->paths[0]));
+
+    // A locked database has nothing worth keeping.
+    database_data_purge_secrets (back);
+    database_data_ref (back);
+    db_cache_put (cache, back);
+    g_assert_cmpuint (db_cache_get_n_entries (cache), ==, 0);
+    database_data_unref (back);
+
+    db_cache_free (cache);
+}
+
+static void
+test_eviction (Fixture       *f,
+               gconstpointer  user_data)
+{
+    (void) user_data;
+    DatabaseData *dbs[3];
+    for (guint i = 0; i < 3; i++) {
+        dbs[i] = saved_db (f->paths[i], 2);
+        // Keep them alive to look at them after eviction.
+        database_data_ref (dbs[i]);
+    }
+
+    // By count: the least recently used goes first.
+    DbCache *cache = db_cache_new (2, G_MAXSIZE);
+    db_cache_put (cache, dbs[0]);
+    db_cache_put (cache, dbs[1]);
+    db_cache_put (cache, dbs[2]);
+    g_assert_cmpuint (db_cache_get_n_entries (cache), ==, 2);
+    assert_purged (dbs[0]);
+    g_assert_nonnull (dbs[1]->key);
+
+    // Making room for the database being opened.
+    db_cache_make_room (cache, G_MAXSIZE / 2);
+    g_assert_cmpuint (db_cache_get_n_entries (cache), ==, 2);
+    db_cache_free (cache);
+    assert_purged (dbs[1]);
+    assert_purged (dbs[2]);
+    for (guint i = 0; i < 3; i++)
+        database_data_unref (dbs[i]);
+
+    // By secure memory budget.
+    gsize cost = db_cache_estimate_cost (f->paths[0]);
+    g_assert_cmpuint (cost, >, 0);
+    cache = db_cache_new (4, 2 * cost + cost / 2);
+    for (guint i = 0; i < 3; i++) {
+        dbs[i] = saved_db (f->paths[i], 2);
+        database_data_ref (dbs[i]);
+        db_cache_put (cache, dbs[i]);
+    }
+    g_assert_cmpuint (db_cache_get_n_entries (cache), ==, 2);
+    assert_purged (dbs[0]);
+    db_cache_make_room (cache, cost);
+    g_assert_cmpuint (db_cache_get_n_entries (cache), ==, 1);
+    assert_purged (dbs[1]);
+
+    db_cache_remove (cache, f->paths[2]);
+    g_assert_cmpuint (db_cache_get_n_entries (cache), ==, 0);
+    assert_purged (dbs[2]);
+    for (guint i = 0; i < 3; i++)
+        database_data_unref (dbs[i]);
+
+    // Lock / memory pressure.
+    dbs[0] = saved_db (f->paths[0], 2);
+    database_data_ref (dbs[0]);
+    db_cache_put (cache, dbs[0]);
+    db_cache_clear (cache);
+    g_assert_cmpuint (db_cache_get_n_entries (cache), ==, 0);
+    assert_purged (dbs[0]);
+    database_data_unref (dbs[0]);
+
+    db_cache_free (cache);
+}
+
+static void
+test_changed_on_disk (Fixture       *f,
+                      gconstpointer  user_data)
+{
+    (void) user_data;
+    DbCache *cache = db_cache_new (4, G_MAXSIZE);
+    DatabaseData *a = saved_db (f->paths[0], 2);
+    database_data_ref (a);
+    db_cache_put (cache, a);
+
+    DbFileStamp before, after;
+    g_assert_true (db_file_stamp_read (f->paths[0], &before));
+    g_assert_true (db_file_stamp_read (f->paths[0], &after));
+    g_assert_true (db_file_stamp_equal (&before, &after));
+
+    // Rewritten by another process (same bytes, new file): load it again.
+    gchar *contents = NULL;
+    gsize len = 0;
+    g_assert_true (g_file_get_contents (f->paths[0], &contents, &len, NULL));
+    g_assert_true (g_file_set_contents (f->paths[0], contents, (gssize) len, NULL));
+    g_free (contents);
+    g_assert_true (db_file_stamp_read (f->paths[0], &after));
+    g_assert_false (db_file_stamp_equal (&before, &after));
+    g_assert_false (db_file_stamp_read (f->paths[1], &after));
+
+    g_assert_null (db_cache_take (cache, f->paths[0]));
+    g_assert_cmpuint (db_cache_get_n_entries (cache), ==, 0);
+    assert_purged (a);
+    database_data_unref (a);
+
+    db_cache_free (cache);
+}
+
+static void
+test_switch_time (Fixture       *f,
+                  gconstpointer  user_data)
+{
+    (void) user_data;
+    if (!g_test_perf ()) {
+        g_test_skip ("Switch timing only runs with -m perf");
+        return;
+    }
+
+    DatabaseData *dbs[2] = { saved_db (f->paths[0], 200), saved_db (f->paths[1], 200) };
+    database_data_free (dbs[1]);
+
+    // Cold: what a switch costs without the cache.
+    DatabaseData *cold = database_data_new (f->paths[1], DEFAULT_MEMLOCK_VALUE);
+    cold->key = secure_strdup ("password");
+    GError *err = NULL;
+    g_test_timer_start ();
+    load_db (cold, &err);
+    gdouble cold_time = g_test_timer_elapsed ();
+    g_assert_no_error (err);
+
+    DbCache *cache = db_cache_new (4, G_MAXSIZE);
+    DatabaseData *current = cold;
+    const guint rounds = 100;
+    gdouble total = 0, worst = 0;
+    db_cache_put (cache, dbs[0]);
+    for (guint i = 0; i < rounds; i++) {
+        const gchar *target = f->paths[i % 2];
+        g_test_timer_start ();
+        DatabaseData *next = db_cache_take (cache, target);
+        db_cache_put (cache, current);
+        gdouble elapsed = g_test_timer_elapsed ();
+        g_assert_nonnull (next);
+        current = next;
+        total += elapsed;
+        worst = MAX (worst, elapsed);
+    }
+    g_test_message ("200 tokens: unlock %.1f ms (minimum KDF cost), cached switch %.3f ms average, %.3f ms worst",
+                    cold_time * 1000.0, total * 1000.0 / rounds, worst * 1000.0);
+
+    database_data_free (current);
+    db_cache_free (cache);
+}
+
+int
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+    gchar *init_err = init_libs (DEFAULT_MEMLOCK_VALUE);
+    g_assert_null (init_err);
+
+    g_test_add ("/db-cache/take", Fixture, NULL, fixture_setup, test_take, fixture_teardown);
+    g_test_add ("/db-cache/eviction", Fixture, NULL, fixture_setup, test_eviction, fixture_teardown);
+    g_test_add ("/db-cache/changed-on-disk", Fixture, NULL, fixture_setup, test_changed_on_disk, fixture_teardown);
+    g_test_add ("/db-cache/switch-time", Fixture, NULL, fixture_setup, test_switch_time, fixture_teardown);
+
+    return g_test_run ();
+}
@@ -0,0 +1,385 @@
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <jansson.h>
+#include <stdio.h>
+#include "common.h"
+#include "db-common.h"
+#include "db-journal.h"
+#include "gquarks.h"
+
+/* Small edits go to an AES-GCM journal next to the database instead of a full
+ * re-encrypt. The main file must stay byte-identical while they do, a reload
+ * must replay them, a torn append must be dropped, a tampered record must
+ * refuse to load, and a second handle's journaled edit must still trip the
+ * stale-write check. */
+
+static json_t *
+valid_totp (const gchar *label)
+{
+    return build_json_obj ("TOTP", label, "Example", "JBSWY3DPEHPK3PXP",
+                           6, "SHA1", 30, 0, NULL);
+}
+
+static DatabaseData *
+make_saved_db (gchar **dir_out,
+               gchar **path_out)
+{
+    GError *err = NULL;
+    gchar *dir = g_dir_make_tmp ("otpclient-db-journal-XXXXXX", &err);
+    g_assert_no_error (err);
+
+    gchar *path = g_build_filename (dir, "test.enc", NULL);
+    DatabaseData *db_data = database_data_new (path, DEFAULT_MEMLOCK_VALUE);
+    db_data->key = secure_strdup ("journal-password");
+    db_data->argon2id_iter = ARGON2ID_MIN_ITER;
+    db_data->argon2id_memcost = ARGON2ID_MIN_MC;
+    db_data->argon2id_parallelism = ARGON2ID_MIN_PARAL;
+    db_data->current_db_version = DB_VERSION;
+    db_data->in_memory_json_data = json_array ();
+    json_array_append_new (db_data->in_memory_json_data, valid_totp ("alice"));
+    json_array_append_new (db_data->in_memory_json_data, valid_totp ("bob"));
+    json_array_append_new (db_data->in_memory_json_data, valid_totp ("carol"));
+
+    update_db (db_data, &err);
+    g_assert_no_error (err);
+
+    *dir_out = dir;
+    *path_out = path;
+    return db_data;
+}
+
+static DatabaseData *
+open_db (const gchar  *path,
+         GError      **err)
+{
+    DatabaseData *db_data = database_data_new (path, DEFAULT_MEMLOCK_VALUE);
+    db_data->key = secure_strdup ("journal-password");
+    load_db (db_data, err);
+    return db_data;
+}
+
+static void
+cleanup (DatabaseData *db_data,
+         gchar        *dir,
+         gchar        *path)
+{
+    database_data_free (db_data);
+    const gchar *suffixes[] = { "", ".lock", ".bak", ".journal", ".bak.journal", ".bak.lock" };
+    for (guint i = 0; i < G_N_ELEMENTS (suffixes); i++) {
+        g_autofree gchar *p = g_strconcat (path, suffixes[i], NULL);
+        g_unlink (p);
+    }
+    g_rmdir (dir);
+    g_free (path);
+    g_free (dir);
+}
+
+static gchar *
+read_file (const gchar *path,
+           gsize       *len)
+{
+    gchar *contents = NULL;
+    GError *err = NULL;
+    g_assert_true (g_file_get_contents (path, &contents, len, &err));
+    g_assert_no_error (err);
+    return contents;
+}
+
+static gboolean
+rename_mutation (json_t   *candidate,
+                 gpointer  user_data,
+                 GError  **err)
+{
+    (void) err;
+    json_t *token = db_token_for_write (candidate, 1);
+    json_object_set_new (token, "label", json_string (user_data));
+    json_object_del (token, "group");
+    return TRUE;
+}
+
+static gboolean
+insert_mutation (json_t   *candidate,
+                 gpointer  user_data,
+                 GError  **err)
+{
+    (void) err;
+    json_array_insert_new (candidate, 0, valid_totp (user_data));
+    return TRUE;
+}
+
+static gboolean
+delete_mutation (json_t   *candidate,
+                 gpointer  user_data,
+                 GError  **err)
+{
+    (void) user_data;
+    (void) err;
+    json_array_remove (candidate, json_array_size (candidate) - 1);
+    return TRUE;
+}
+
+static void
+test_small_edits_append (void)
+{
+    gchar *dir = NULL;
+    gchar *path = NULL;
+    DatabaseData *db_data = make_saved_db (&dir, &path);
+    g_autofree gchar *journal = db_journal_path (path);
+
+    gsize main_len = 0;
+    g_autofree gchar *main_before = read_file (path, &main_len);
+
+    GError *err = NULL;
+    g_assert_true (db_transaction (db_data, rename_mutation, "bobby", &err));
+    g_assert_true (db_transaction (db_data, insert_mutation, "dave", &err));
+    g_assert_true (db_transaction (db_data, delete_mutation, NULL, &err));
+    g_assert_no_error (err);
+
+    gsize main_after_len = 0;
+    g_autofree gchar *main_after = read_file (path, &main_after_len);
+    g_assert_cmpmem (main_before, main_len, main_after, main_after_len);
+    g_assert_true (g_file_test (journal, G_FILE_TEST_IS_REGULAR));
+    g_assert_cmpuint (db_data->journal_frames, ==, 3);
+
+    DatabaseData *reader = open_db (path, &err);
+    g_assert_no_error (err);
+    g_assert_true (json_equal (reader->in_memory_json_data, db_data->in_memory_json_data));
+    g_assert_cmpuint (reader->journal_frames, ==, 3);
+
+    // The reader can keep appending where the writer stopped.
+    g_assert_true (db_transaction (reader, rename_mutation, "robert", &err));
+    g_assert_no_error (err);
+    DatabaseData *again = open_db (path, &err);
+    g_assert_no_error (err);
+    g_assert_true (json_equal (again->in_memory_json_data, reader->in_memory_json_data));
+
+    database_data_free (again);
+    database_data_free (reader);
+    cleanup (db_data, dir, path);
+}
+
+static void
+test_torn_tail_dropped (void)
+{
+    gchar *dir = NULL;
+    gchar *path = NULL;
+    DatabaseData *db_data = make_saved_db (&dir, &path);
+    g_autofree gchar *journal = db_journal_path (path);
+
+    GError *err = NULL;
+    g_assert_true (db_transaction (db_data, rename_mutation, "bobby", &err));
+    json_t *after_first = json_deep_copy (db_data->in_memory_json_data);
+    g_assert_true (db_transaction (db_data, insert_mutation, "dave", &err));
+    g_assert_no_error (err);
+
+    // Simulate a crash halfway through the second append.
+    gsize len = 0;
+    g_autofree gchar *contents = read_file (journal, &len);
+    g_assert_true (g_file_set_contents (journal, contents, (gssize) (len - 5), &err));
+    g_assert_no_error (err);
+
+    DatabaseData *reader = open_db (path, &err);
+    g_assert_no_error (err);
+    g_assert_true (json_equal (reader->in_memory_json_data, after_first));
+    g_assert_cmpuint (reader->journal_frames, ==, 1);
+
+    // The next append overwrites the torn bytes.
+    g_assert_true (db_transaction (reader, insert_mutation, "erin", &err));
+    g_assert_no_error (err);
+    DatabaseData *again = open_db (path, &err);
+    g_assert_no_error (err);
+    g_assert_true (json_equal (again->in_memory_json_data, reader->in_memory_json_data));
+
+    json_decref (after_first);
+    database_data_free (again);
+    database_data_free (reader);
+    cleanup (db_data, dir, path);
+}
+
+static void
+test_tampered_record_rejected (void)
+{
+    gchar *dir = NULL;
+    gchar *path = NULL;
+    DatabaseData *db_data = make_saved_db (&dir, &path);
+    g_autofree gchar *journal = db_journal_path (path);
+
+    GError *err = NULL;
+    g_assert_true (db_transaction (db_data, rename_mutation, "bobby", &err));
+    g_assert_true (db_transaction (db_data, insert_mutation, "dave", &err));
+    g_assert_no_error (err);
+
+    // Flip a ciphertext byte of the first record; only the last one may be torn.
+    FILE *fp = g_fopen (journal, "r+b");
+    g_assert_nonnull (fp);
+    long pos = DB_JOURNAL_HEADER_SIZE + 4 + IV_SIZE + 2;
+    g_assert_cmpint (fseek (fp, pos, SEEK_SET), ==, 0);
+    int byte = fgetc (fp);
+    g_assert_cmpint (fseek (fp, pos, SEEK_SET), ==, 0);
+    g_assert_cmpint (fputc (byte ^ 0x01, fp), !=, EOF);
+    fclose (fp);
+
+    DatabaseData *reader = open_db (path, &err);
+    g_assert_error (err, bad_tag_gquark (), BAD_TAG_ERRCODE);
+    g_assert_null (reader->in_memory_json_data);
+    g_clear_error (&err);
+
+    database_data_free (reader);
+    cleanup (db_data, dir, path);
+}
+
+static void
+test_journaled_edit_is_stale_for_others (void)
+{
+    gchar *dir = NULL;
+    gchar *path = NULL;
+    DatabaseData *first = make_saved_db (&dir, &path);
+
+    GError *err = NULL;
+    DatabaseData *second = open_db (path, &err);
+    g_assert_no_error (err);
+    g_assert_true (db_transaction (second, rename_mutation, "from-second", &err));
+    g_assert_no_error (err);
+
+    // The main file did not change, but the journal did.
+    json_t *before = json_deep_copy (first->in_memory_json_data);
+    g_assert_false (db_transaction (first, rename_mutation, "from-first", &err));
+    g_assert_error (err, generic_error_gquark (), GENERIC_ERRCODE);
+    g_clear_error (&err);
+    g_assert_true (json_equal (first->in_memory_json_data, before));
+
+    json_decref (before);
+    database_data_free (second);
+    cleanup (first, dir, path);
+}
+
+static void
+test_checkpoint_folds_journal (void)
+{
+    gchar *dir = NULL;
+    gchar *path = NULL;
+    DatabaseData *db_data = make_saved_db (&dir, &path);
+    g_autofree gchar *journal = db_journal_path (path);
+
+    // Crossing the size threshold rewrites the main file and drops the journal.
+    db_test_set_journal_checkpoint_size (DB_JOURNAL_HEADER_SIZE + 400);
+    GError *err = NULL;
+    for (guint i = 0; i < 8; i++) {
+        g_autofree gchar *label = g_strdup_printf ("bob-%u", i);
+        g_assert_true (db_transaction (db_data, rename_mutation, label, &err));
+        g_assert_no_error (err);
+        g_assert_cmpuint (db_data->journal_len, <=, DB_JOURNAL_HEADER_SIZE + 400);
+    }
+    db_test_set_journal_checkpoint_size (0);
+
+    DatabaseData *reader = open_db (path, &err);
+    g_assert_no_error (err);
+    g_assert_true (json_equal (reader->in_memory_json_data, db_data->in_memory_json_data));
+    database_data_free (reader);
+
+    // An explicit checkpoint (used before copying the file) leaves no journal.
+    g_assert_true (db_transaction (db_data, insert_mutation, "dave", &err));
+    g_assert_true (g_file_test (journal, G_FILE_TEST_EXISTS));
+    g_assert_true (db_checkpoint (db_data, &err));
+    g_assert_no_error (err);
+    g_assert_false (g_file_test (journal, G_FILE_TEST_EXISTS));
+
+    reader = open_db (path, &err);
+    g_assert_no_error (err);
+    g_assert_true (json_equal (reader->in_memory_json_data, db_data->in_memory_json_data));
+    g_assert_cmpuint (reader->journal_frames, ==, 0);
+
+    database_data_free (reader);
+    cleanup (db_data, dir, path);
+}
+
+static void
+test_backup_keeps_journal (void)
+{
+    gchar *dir = NULL;
+    gchar *path = NULL;
+    DatabaseData *db_data = make_saved_db (&dir, &path);
+    g_autofree gchar *bak = g_strconcat (path, ".bak", NULL);
+    g_autofree gchar *bak_journal = db_journal_path (bak);
+
+    // The checkpoint replaces the main file and the journal on top of it;
+    // restoring the backup must give back both, not just the old main file.
+    GError *err = NULL;
+    for (guint round = 0; round < 2; round++) {
+        g_autofree gchar *label = g_strdup_printf ("bob-%u", round);
+        g_autofree gchar *inserted = g_strdup_printf ("dave-%u", round);
+        g_assert_true (db_transaction (db_data, rename_mutation, label, &err));
+        g_assert_true (db_transaction (db_data, insert_mutation, inserted, &err));
+        g_assert_no_error (err);
+        g_assert_cmpuint (db_data->journal_frames, ==, 2);
+        json_t *before = json_deep_copy (db_data->in_memory_json_data);
+
+        g_assert_true (db_checkpoint (db_data, &err));
+        g_assert_no_error (err);
+        g_assert_true (g_file_test (bak_journal, G_FILE_TEST_IS_REGULAR));
+
+        DatabaseData *restored = open_db (bak, &err);
+        g_assert_no_error (err);
+        g_assert_cmpuint (restored->journal_frames, ==, 2);
+        g_assert_true (json_equal (restored->in_memory_json_data, before));
+        database_data_free (restored);
+        json_decref (before);
+    }
+
+    cleanup (db_data, dir, path);
+}
+
+static void
+test_commit_cost_vs_size (void)
+{
+    if (!g_test_perf ()) {
+        g_test_skip ("Commit timing only runs with -m perf");
+        return;
+    }
+
+    const guint sizes[] = { 100, 1000, 10000 };
+    for (guint s = 0; s < G_N_ELEMENTS (sizes); s++) {
+        gchar *dir = NULL;
+        gchar *path = NULL;
+        DatabaseData *db_data = make_saved_db (&dir, &path);
+        for (guint i = 0; i < sizes[s]; i++) {
+            g_autofree gchar *label = g_strdup_printf ("token-%05u", i);
+            json_array_append_new (db_data->in_memory_json_data, valid_totp (label));
+        }
+        GError *err = NULL;
+        update_db (db_data, &err);
+        g_assert_no_error (err);
+
+        g_test_timer_start ();
+        g_assert_true (db_transaction (db_data, rename_mutation, "renamed", &err));
+        gdouble journaled = g_test_timer_elapsed ();
+        g_assert_no_error (err);
+
+        g_test_timer_start ();
+        g_assert_true (db_checkpoint (db_data, &err));
+        gdouble full = g_test_timer_elapsed ();
+        g_assert_no_error (err);
+
+        g_test_message ("%6u tokens: journaled rename %7.2f ms, full write %7.2f ms",
+                        sizes[s] + 3, journaled * 1000.0, full * 1000.0);
+        cleanup (db_data, dir, path);
+    }
+}
+
+int
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+    gchar *init_err = init_libs (DEFAULT_MEMLOCK_VALUE);
+    g_assert_null (init_err);
+
+    g_test_add_func ("/db-journal/small-edits-append",  test_small_edits_append);
+    g_test_add_func ("/db-journal/torn-tail-dropped",   test_torn_tail_dropped);
+    g_test_add_func ("/db-journal/tampered-record",     test_tampered_record_rejected);
+    g_test_add_func ("/db-journal/stale-for-others",    test_journaled_edit_is_stale_for_others);
+    g_test_add_func ("/db-journal/checkpoint",          test_checkpoint_folds_journal);
+    g_test_add_func ("/db-journal/backup-keeps-journal", test_backup_keeps_journal);
+    g_test_add_func ("/db-journal/commit-cost-vs-size", test_commit_cost_vs_size);
+
+    return g_test_run ();
+}
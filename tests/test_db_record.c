@@ -0,0 +1,287 @@
+#define _DEFAULT_SOURCE
+#include <glib.h>
+#include <gcrypt.h>
+#include <jansson.h>
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+#include "db-common.h"
+#include "db-record.h"
+#include "gquarks.h"
+
+/* v5 records encode ordinary tokens in a compact binary form and keep the
+ * JSON of anything else. Both kinds must decode to a token json_equal to the
+ * one that was written, v4 records must stay plain JSON, and truncated or
+ * inconsistent records must be rejected rather than half-decoded. */
+
+static json_t *
+roundtrip (json_t *token,
+           gint32  version,
+           guint8 *kind_out)
+{
+    gsize size = db_record_size (token, version);
+    g_assert_cmpuint (size, >, 0);
+    guint8 *buf = gcry_malloc_secure (size);
+    g_assert_cmpuint (db_record_write (token, version, buf, size), ==, size);
+    // A buffer one byte short must be refused, not overrun.
+    g_assert_cmpuint (db_record_write (token, version, buf, size - 1), ==, 0);
+    g_assert_cmpuint (db_record_write (token, version, buf, size), ==, size);
+    if (kind_out != NULL)
+        *kind_out = buf[0];
+
+    GError *err = NULL;
+    json_t *decoded = db_record_read (buf, size, version, &err);
+    g_assert_no_error (err);
+    g_assert_nonnull (decoded);
+    g_assert_true (json_equal (decoded, token));
+    explicit_bzero (buf, size);
+    gcry_free (buf);
+    return decoded;
+}
+
+static void
+assert_binary_roundtrip (json_t *token)
+{
+    guint8 kind = 0xff;
+    json_decref (roundtrip (token, DB_VERSION, &kind));
+    g_assert_cmpuint (kind, ==, DB_RECORD_KIND_BINARY);
+    json_decref (token);
+}
+
+static void
+assert_json_roundtrip (json_t *token)
+{
+    guint8 kind = 0xff;
+    json_decref (roundtrip (token, DB_VERSION, &kind));
+    g_assert_cmpuint (kind, ==, DB_RECORD_KIND_JSON);
+    json_decref (token);
+}
+
+static void
+test_binary_roundtrip (void)
+{
+    assert_binary_roundtrip (build_json_obj ("TOTP", "alice", "Example", "JBSWY3DPEHPK3PXP",
+                                             6, "SHA1", 30, 0, NULL));
+    assert_binary_roundtrip (build_json_obj ("HOTP", "bob", "Example", "JBSWY3DPEHPK3PXP",
+                                             8, "SHA512", 0, G_GUINT64_CONSTANT (1) << 47, "work"));
+    assert_binary_roundtrip (build_json_obj ("TOTP", "", "", "JBSWY3DPEHPK3PXP",
+                                             7, "SHA256", 60, 0, NULL));
+    assert_binary_roundtrip (build_json_obj ("TOTP", "résumé ✓", "Ünïcödé", "JBSWY3DPEHPK3PXP",
+                                             6, "SHA1", 30, 0, "グループ"));
+
+    // Steam tokens are stored as TOTP with five digits.
+    json_t *steam = build_json_obj ("TOTP", "steam", "Steam", "JBSWY3DPEHPK3PXP",
+                                    5, "SHA1", 30, 0, NULL);
+    guint8 kind = 0xff;
+    gsize json_len = json_dumpb (steam, NULL, 0, JSON_COMPACT);
+    g_assert_cmpuint (db_record_size (steam, DB_VERSION), <, json_len / 2);
+    json_decref (roundtrip (steam, DB_VERSION, &kind));
+    g_assert_cmpuint (kind, ==, DB_RECORD_KIND_BINARY);
+    json_decref (steam);
+}
+
+static void
+test_json_fallback (void)
+{
+    json_t *token = build_json_obj ("TOTP", "extra", "Example", "JBSWY3DPEHPK3PXP",
+                                    6, "SHA1", 30, 0, NULL);
+    json_object_set_new (token, "icon", json_string ("github"));
+    assert_json_roundtrip (token);
+
+    // Spellings other than the canonical ones are kept as they are.
+    assert_json_roundtrip (build_json_obj ("totp", "lower", "Example", "JBSWY3DPEHPK3PXP",
+                                           6, "sha1", 30, 0, NULL));
+
+    token = build_json_obj ("HOTP", "negative", "Example", "JBSWY3DPEHPK3PXP",
+                            6, "SHA1", 0, 0, NULL);
+    json_object_set_new (token, "counter", json_integer (-1));
+    assert_json_roundtrip (token);
+
+    token = build_json_obj ("TOTP", "both", "Example", "JBSWY3DPEHPK3PXP",
+                            6, "SHA1", 30, 0, NULL);
+    json_object_set_new (token, "counter", json_integer (3));
+    assert_json_roundtrip (token);
+
+    token = build_json_obj ("TOTP", "nul", "Example", "JBSWY3DPEHPK3PXP",
+                            6, "SHA1", 30, 0, NULL);
+    json_object_set_new (token, "label", json_stringn ("a\0b", 3));
+    assert_json_roundtrip (token);
+
+    token = build_json_obj ("TOTP", "typed", "Example", "JBSWY3DPEHPK3PXP",
+                            6, "SHA1", 30, 0, NULL);
+    json_object_set_new (token, "group", json_integer (42));
+    assert_json_roundtrip (token);
+}
+
+static void
+test_v4_records_are_json (void)
+{
+    json_t *token = build_json_obj ("TOTP", "alice", "Example", "JBSWY3DPEHPK3PXP",
+                                    6, "SHA1", 30, 0, NULL);
+    gsize size = db_record_size (token, 4);
+    g_assert_cmpuint (size, ==, json_dumpb (token, NULL, 0, JSON_COMPACT));
+    guint8 kind = 0;
+    json_decref (roundtrip (token, 4, &kind));
+    g_assert_cmpuint (kind, ==, '{');
+    json_decref (token);
+}
+
+static void
+assert_rejected (const guint8 *record,
+                 gsize         len)
+{
+    GError *err = NULL;
+    g_assert_null (db_record_read (record, len, DB_VERSION, &err));
+    g_assert_nonnull (err);
+    g_clear_error (&err);
+}
+
+static void
+test_malformed_records (void)
+{
+    json_t *token = build_json_obj ("HOTP", "bob", "Example", "JBSWY3DPEHPK3PXP",
+                                    6, "SHA1", 0, 300, "work");
+    gsize size = db_record_size (token, DB_VERSION);
+    guint8 *buf = g_malloc (size + 1);
+    g_assert_cmpuint (db_record_write (token, DB_VERSION, buf, size), ==, size);
+    json_decref (token);
+
+    assert_rejected (buf, 0);
+    for (gsize len = 1; len < size; len++)
+        assert_rejected (buf, len);
+    // Trailing bytes after the last field.
+    buf[size] = 0;
+    assert_rejected (buf, size + 1);
+
+    guint8 saved;
+    const gsize fields[] = { 0, 1, 2, 4 };   // kind, type, algo, flags
+    for (guint i = 0; i < G_N_ELEMENTS (fields); i++) {
+        saved = buf[fields[i]];
+        buf[fields[i]] = 0x7f;
+        assert_rejected (buf, size);
+        buf[fields[i]] = saved;
+    }
+
+    // A string that is not UTF-8: the label starts after the fixed part,
+    // the two-byte counter varint and the label's length byte.
+    saved = buf[8];
+    buf[8] = 0xff;
+    assert_rejected (buf, size);
+    buf[8] = saved;
+
+    // An unterminated counter varint.
+    guint8 endless[] = { DB_RECORD_KIND_BINARY, 0, 0, 6, 0,
+                         0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x01 };
+    assert_rejected (endless, sizeof (endless));
+
+    GError *err = NULL;
+    json_t *decoded = db_record_read (buf, size, DB_VERSION, &err);
+    g_assert_no_error (err);
+    json_decref (decoded);
+    g_free (buf);
+}
+
+static json_t *
+synthetic_tokens (guint n)
+{
+    const gchar *algos[] = { "SHA1", "SHA256", "SHA512" };
+    json_t *tokens = json_array ();
+    for (guint i = 0; i < n; i++) {
+        g_autofree gchar *label = g_strdup_printf ("user%u@example.com", i);
+        g_autofree gchar *issuer = g_strdup_printf ("Service %u", i % 97);
+        json_t *token = (i % 5 == 0)
+            ? build_json_obj ("HOTP", label, issuer, "JBSWY3DPEHPK3PXPJBSWY3DPEHPK3PXP",
+                              6, algos[i % 3], 0, i, NULL)
+            : build_json_obj ("TOTP", label, issuer, "JBSWY3DPEHPK3PXPJBSWY3DPEHPK3PXP",
+                              (i % 4 == 0) ? 8 : 6, algos[i % 3], 30, 0,
+                              (i % 3 == 0) ? "work" : NULL);
+        json_array_append_new (tokens, token);
+    }
+    return tokens;
+}
+
+static void
+test_size_and_speed_vs_json (void)
+{
+    if (!g_test_perf ()) {
+        g_test_skip ("Encoding comparison only runs with -m perf");
+        return;
+    }
+
+    // 100k parsed tokens do not fit the secure pool, and the secrets here
+    // are synthetic: let jansson use the ordinary heap for this test only.
+    json_set_alloc_funcs (malloc, free);
+    const guint sizes[] = { 1000, 10000, 100000 };
+    for (guint s = 0; s < G_N_ELEMENTS (sizes); s++) {
+        json_t *tokens = synthetic_tokens (sizes[s]);
+        gsize n = json_array_size (tokens);
+
+        // JSON: one record per token, as v4 stores them.
+        g_test_timer_start ();
+        gsize json_bytes = 0;
+        GPtrArray *json_records = g_ptr_array_new_with_free_func ((GDestroyNotify) g_bytes_unref);
+        for (gsize i = 0; i < n; i++) {
+            json_t *token = json_array_get (tokens, i);
+            gsize len = db_record_size (token, 4);
+            guint8 *buf = g_malloc (len);
+            g_assert_cmpuint (db_record_write (token, 4, buf, len), ==, len);
+            g_ptr_array_add (json_records, g_bytes_new_take (buf, len));
+            json_bytes += len;
+        }
+        gdouble json_write = g_test_timer_elapsed ();
+
+        g_test_timer_start ();
+        gsize bin_bytes = 0;
+        GPtrArray *bin_records = g_ptr_array_new_with_free_func ((GDestroyNotify) g_bytes_unref);
+        for (gsize i = 0; i < n; i++) {
+            json_t *token = json_array_get (tokens, i);
+            gsize len = db_record_size (token, DB_VERSION);
+            guint8 *buf = g_malloc (len);
+            g_assert_cmpuint (db_record_write (token, DB_VERSION, buf, len), ==, len);
+            g_ptr_array_add (bin_records, g_bytes_new_take (buf, len));
+            bin_bytes += len;
+        }
+        gdouble bin_write = g_test_timer_elapsed ();
+
+        gdouble reads[2];
+        GPtrArray *records[2] = { json_records, bin_records };
+        const gint32 versions[2] = { 4, DB_VERSION };
+        for (guint k = 0; k < 2; k++) {
+            g_test_timer_start ();
+            for (guint i = 0; i < records[k]->len; i++) {
+                gsize len = 0;
+                const guint8 *data = g_bytes_get_data (g_ptr_array_index (records[k], i), &len);
+                json_t *token = db_record_read (data, len, versions[k], NULL);
+                g_assert_nonnull (token);
+                json_decref (token);
+            }
+            reads[k] = g_test_timer_elapsed ();
+        }
+
+        g_test_message ("%6u tokens: JSON %9" G_GSIZE_FORMAT " B, write %8.2f ms, read %8.2f ms | "
+                        "binary %9" G_GSIZE_FORMAT " B (%4.1f%%), write %8.2f ms, read %8.2f ms",
+                        sizes[s], json_bytes, json_write * 1000.0, reads[0] * 1000.0,
+                        bin_bytes, 100.0 * (gdouble) bin_bytes / (gdouble) json_bytes,
+                        bin_write * 1000.0, reads[1] * 1000.0);
+        g_ptr_array_unref (json_records);
+        g_ptr_array_unref (bin_records);
+        json_decref (tokens);
+    }
+    json_set_alloc_funcs (gcry_malloc_secure, gcry_free);
+}
+
+int
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+    gchar *init_err = init_libs (DEFAULT_MEMLOCK_VALUE);
+    g_assert_null (init_err);
+
+    g_test_add_func ("/db-record/binary-roundtrip",   test_binary_roundtrip);
+    g_test_add_func ("/db-record/json-fallback",      test_json_fallback);
+    g_test_add_func ("/db-record/v4-records-json",    test_v4_records_are_json);
+    g_test_add_func ("/db-record/malformed",          test_malformed_records);
+    g_test_add_func ("/db-record/size-and-speed",     test_size_and_speed_vs_json);
+
+    return g_test_run ();
+}
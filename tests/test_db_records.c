@@ -0,0 +1,506 @@
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gcrypt.h>
+#include <jansson.h>
+#include <stdio.h>
+#include <string.h>
+#include "common.h"
+#include "db-common.h"
+#include "db-record.h"
+#include "gquarks.h"
+
+/* v4 seals every token as its own record behind an index, so one token can
+ * be decrypted without the rest. Saves must produce the current version
+ * (v5, binary records), v3 and v4 files must still open and migrate, db_fetch_token must return exactly what load_db sees at
+ * that position, and tampering with one record must fail both the full load
+ * and the fetch of that record without affecting the others. Records are
+ * decrypted one at a time on load, so only the largest record (not the file)
+ * is bounded by the secure memory limit. */
+
+static json_t *
+valid_totp (const gchar *label)
+{
+    return build_json_obj ("TOTP", label, "Example", "JBSWY3DPEHPK3PXP",
+                           6, "SHA1", 30, 0, NULL);
+}
+
+static DatabaseData *
+make_db_data (const gchar *path,
+              guint        n_tokens)
+{
+    DatabaseData *db_data = database_data_new (path, DEFAULT_MEMLOCK_VALUE);
+    db_data->key = secure_strdup ("records-password");
+    db_data->argon2id_iter = ARGON2ID_MIN_ITER;
+    db_data->argon2id_memcost = ARGON2ID_MIN_MC;
+    db_data->argon2id_parallelism = ARGON2ID_MIN_PARAL;
+    db_data->current_db_version = DB_VERSION;
+    db_data->in_memory_json_data = json_array ();
+    for (guint i = 0; i < n_tokens; i++) {
+        g_autofree gchar *label = g_strdup_printf ("token-%05u", i);
+        json_array_append_new (db_data->in_memory_json_data, valid_totp (label));
+    }
+    return db_data;
+}
+
+static gchar *
+make_tmp_dir (gchar **path_out)
+{
+    GError *err = NULL;
+    gchar *dir = g_dir_make_tmp ("otpclient-db-records-XXXXXX", &err);
+    g_assert_no_error (err);
+    *path_out = g_build_filename (dir, "test.enc", NULL);
+    return dir;
+}
+
+static void
+cleanup (DatabaseData *db_data,
+         gchar        *dir,
+         gchar        *path)
+{
+    database_data_free (db_data);
+    const gchar *suffixes[] = { "", ".lock", ".bak", ".journal" };
+    for (guint i = 0; i < G_N_ELEMENTS (suffixes); i++) {
+        g_autofree gchar *p = g_strconcat (path, suffixes[i], NULL);
+        g_unlink (p);
+    }
+    g_rmdir (dir);
+    g_free (path);
+    g_free (dir);
+}
+
+static DatabaseData *
+open_reader (const gchar *path,
+             const gchar *password)
+{
+    DatabaseData *reader = database_data_new (path, DEFAULT_MEMLOCK_VALUE);
+    reader->key = secure_strdup (password);
+    return reader;
+}
+
+/* What the search provider does between activations: hand a fresh handle the
+ * derived key it cached from an earlier unlock. */
+static DatabaseData *
+open_reader_with_cached_key (const DatabaseData *source)
+{
+    DatabaseData *reader = open_reader (source->db_path, source->key);
+    g_assert_true (source->has_cached_key);
+    reader->cached_derived_key = gcry_malloc_secure (ARGON2ID_KEYLEN);
+    memcpy (reader->cached_derived_key, source->cached_derived_key, ARGON2ID_KEYLEN);
+    memcpy (reader->cached_salt, source->cached_salt, KDF_SALT_SIZE);
+    memcpy (reader->cached_pwd_hash, source->cached_pwd_hash, sizeof (reader->cached_pwd_hash));
+    reader->has_cached_key = TRUE;
+    return reader;
+}
+
+static guint32
+file_version (const gchar *path)
+{
+    gchar *contents = NULL;
+    gsize len = 0;
+    g_assert_true (g_file_get_contents (path, &contents, &len, NULL));
+    g_assert_cmpuint (len, >=, DB_HEADER_NAME_LEN + 4);
+    const guint8 *p = (const guint8 *) contents + DB_HEADER_NAME_LEN;
+    guint32 version = ((guint32) p[0] << 24) | ((guint32) p[1] << 16) | ((guint32) p[2] << 8) | p[3];
+    g_free (contents);
+    return version;
+}
+
+static void
+put_be32 (guint8 *p,
+          guint32 v)
+{
+    p[0] = (guint8) (v >> 24);
+    p[1] = (guint8) (v >> 16);
+    p[2] = (guint8) (v >> 8);
+    p[3] = (guint8) v;
+}
+
+/* Writes `json` the way v3 builds did: one AES-GCM blob under the header. */
+static void
+write_v3_file (const gchar *path,
+               const gchar *password,
+               const gchar *json)
+{
+    guint8 header[DB_V3_HEADER_SIZE] = {0};
+    memcpy (header, DB_HEADER_NAME, DB_HEADER_NAME_LEN);
+    put_be32 (header + DB_HEADER_NAME_LEN, 3);
+    guint8 *iv = header + DB_HEADER_NAME_LEN + 4;
+    guint8 *salt = iv + IV_SIZE;
+    gcry_create_nonce (iv, IV_SIZE);
+    gcry_create_nonce (salt, KDF_SALT_SIZE);
+    put_be32 (salt + KDF_SALT_SIZE, ARGON2ID_MIN_ITER);
+    put_be32 (salt + KDF_SALT_SIZE + 4, ARGON2ID_MIN_MC);
+    put_be32 (salt + KDF_SALT_SIZE + 8, ARGON2ID_MIN_PARAL);
+
+    const unsigned long params[4] = { ARGON2ID_TAGLEN, ARGON2ID_MIN_ITER, ARGON2ID_MIN_MC, ARGON2ID_MIN_PARAL };
+    guint8 key[ARGON2ID_KEYLEN];
+    gcry_kdf_hd_t kdf;
+    g_assert_cmpint (gcry_kdf_open (&kdf, GCRY_KDF_ARGON2, GCRY_KDF_ARGON2ID, params, 4,
+                                    password, strlen (password), salt, KDF_SALT_SIZE,
+                                    NULL, 0, NULL, 0), ==, 0);
+    g_assert_cmpint (gcry_kdf_compute (kdf, NULL), ==, 0);
+    g_assert_cmpint (gcry_kdf_final (kdf, sizeof (key), key), ==, 0);
+    gcry_kdf_close (kdf);
+
+    gsize len = strlen (json);
+    gsize file_len = sizeof (header) + len + TAG_SIZE;
+    guint8 *file = g_malloc (file_len);
+    memcpy (file, header, sizeof (header));
+
+    gcry_cipher_hd_t hd;
+    g_assert_cmpint (gcry_cipher_open (&hd, GCRY_CIPHER_AES256, GCRY_CIPHER_MODE_GCM, 0), ==, 0);
+    g_assert_cmpint (gcry_cipher_setkey (hd, key, sizeof (key)), ==, 0);
+    g_assert_cmpint (gcry_cipher_setiv (hd, iv, IV_SIZE), ==, 0);
+    g_assert_cmpint (gcry_cipher_authenticate (hd, header, sizeof (header)), ==, 0);
+    g_assert_cmpint (gcry_cipher_encrypt (hd, file + sizeof (header), len, json, len), ==, 0);
+    g_assert_cmpint (gcry_cipher_gettag (hd, file + sizeof (header) + len, TAG_SIZE), ==, 0);
+    gcry_cipher_close (hd);
+
+    GError *err = NULL;
+    g_assert_true (g_file_set_contents (path, (const gchar *) file, (gssize) file_len, &err));
+    g_assert_no_error (err);
+    g_free (file);
+}
+
+static void
+test_save_writes_current_version (void)
+{
+    gchar *path = NULL;
+    gchar *dir = make_tmp_dir (&path);
+    DatabaseData *writer = make_db_data (path, 3);
+
+    GError *err = NULL;
+    update_db (writer, &err);
+    g_assert_no_error (err);
+    g_assert_cmpuint (file_version (path), ==, DB_VERSION);
+
+    DatabaseData *reader = open_reader (path, "records-password");
+    load_db (reader, &err);
+    g_assert_no_error (err);
+    g_assert_cmpint (reader->current_db_version, ==, DB_VERSION);
+    g_assert_true (json_equal (reader->in_memory_json_data, writer->in_memory_json_data));
+    database_data_free (reader);
+
+    // An empty database still authenticates its header.
+    json_array_clear (writer->in_memory_json_data);
+    update_db (writer, &err);
+    g_assert_no_error (err);
+    g_assert_true (db_checkpoint (writer, &err));
+    g_assert_no_error (err);
+    reader = open_reader (path, "wrong-password");
+    load_db (reader, &err);
+    g_assert_error (err, bad_tag_gquark (), BAD_TAG_ERRCODE);
+    g_clear_error (&err);
+    database_data_free (reader);
+
+    reader = open_reader (path, "records-password");
+    load_db (reader, &err);
+    g_assert_no_error (err);
+    g_assert_cmpuint (json_array_size (reader->in_memory_json_data), ==, 0);
+    database_data_free (reader);
+
+    cleanup (writer, dir, path);
+}
+
+static void
+test_fetch_matches_load (void)
+{
+    gchar *path = NULL;
+    gchar *dir = make_tmp_dir (&path);
+    DatabaseData *writer = make_db_data (path, 5);
+
+    GError *err = NULL;
+    update_db (writer, &err);
+    g_assert_no_error (err);
+
+    for (gsize i = 0; i < 5; i++) {
+        DatabaseData *reader = open_reader_with_cached_key (writer);
+        json_t *token = db_fetch_token (reader, i, &err);
+        g_assert_no_error (err);
+        g_assert_true (json_equal (token, json_array_get (writer->in_memory_json_data, i)));
+        json_decref (token);
+        database_data_free (reader);
+    }
+
+    // Without a cached key the fetch derives it and leaves it cached.
+    DatabaseData *reader = open_reader (path, "records-password");
+    json_t *token = db_fetch_token (reader, 4, &err);
+    g_assert_no_error (err);
+    g_assert_nonnull (token);
+    g_assert_true (reader->has_cached_key);
+    json_decref (token);
+
+    g_assert_null (db_fetch_token (reader, 5, &err));
+    g_assert_error (err, generic_error_gquark (), GENERIC_ERRCODE);
+    g_clear_error (&err);
+    database_data_free (reader);
+
+    reader = open_reader (path, "wrong-password");
+    g_assert_null (db_fetch_token (reader, 0, &err));
+    g_assert_error (err, bad_tag_gquark (), BAD_TAG_ERRCODE);
+    g_clear_error (&err);
+    database_data_free (reader);
+
+    cleanup (writer, dir, path);
+}
+
+static gboolean
+rename_first_mutation (json_t   *candidate,
+                       gpointer  user_data,
+                       GError  **err)
+{
+    (void) user_data;
+    (void) err;
+    json_object_set_new (db_token_for_write (candidate, 0), "label", json_string ("renamed"));
+    return TRUE;
+}
+
+static void
+test_fetch_refuses_pending_journal (void)
+{
+    gchar *path = NULL;
+    gchar *dir = make_tmp_dir (&path);
+    DatabaseData *writer = make_db_data (path, 3);
+
+    GError *err = NULL;
+    update_db (writer, &err);
+    g_assert_no_error (err);
+    g_assert_true (db_transaction (writer, rename_first_mutation, NULL, &err));
+    g_assert_no_error (err);
+
+    // The rename only lives in the journal: the record on disk is stale.
+    DatabaseData *reader = open_reader_with_cached_key (writer);
+    g_assert_null (db_fetch_token (reader, 0, &err));
+    g_assert_error (err, generic_error_gquark (), GENERIC_ERRCODE);
+    g_clear_error (&err);
+    database_data_free (reader);
+
+    g_assert_true (db_checkpoint (writer, &err));
+    g_assert_no_error (err);
+    reader = open_reader_with_cached_key (writer);
+    json_t *token = db_fetch_token (reader, 0, &err);
+    g_assert_no_error (err);
+    g_assert_cmpstr (json_string_value (json_object_get (token, "label")), ==, "renamed");
+    json_decref (token);
+    database_data_free (reader);
+
+    cleanup (writer, dir, path);
+}
+
+static void
+test_v3_file_migrates (void)
+{
+    gchar *path = NULL;
+    gchar *dir = make_tmp_dir (&path);
+    DatabaseData *expected = make_db_data (path, 4);
+    // Jansson allocates from gcrypt's secure pool (see init_libs).
+    gchar *json = json_dumps (expected->in_memory_json_data, JSON_COMPACT);
+    write_v3_file (path, "records-password", json);
+    gcry_free (json);
+    g_assert_cmpuint (file_version (path), ==, 3);
+
+    // A v3 file can only be read in full.
+    GError *err = NULL;
+    DatabaseData *reader = open_reader (path, "records-password");
+    g_assert_null (db_fetch_token (reader, 0, &err));
+    g_assert_error (err, generic_error_gquark (), GENERIC_ERRCODE);
+    g_clear_error (&err);
+
+    load_db (reader, &err);
+    g_assert_no_error (err);
+    g_assert_true (json_equal (reader->in_memory_json_data, expected->in_memory_json_data));
+    g_assert_cmpint (reader->current_db_version, ==, DB_VERSION);
+    g_assert_cmpuint (file_version (path), ==, DB_VERSION);
+
+    DatabaseData *fetcher = open_reader_with_cached_key (reader);
+    json_t *token = db_fetch_token (fetcher, 3, &err);
+    g_assert_no_error (err);
+    g_assert_true (json_equal (token, json_array_get (expected->in_memory_json_data, 3)));
+    json_decref (token);
+
+    database_data_free (fetcher);
+    database_data_free (reader);
+    cleanup (expected, dir, path);
+}
+
+static void
+test_v4_file_migrates (void)
+{
+    gchar *path = NULL;
+    gchar *dir = make_tmp_dir (&path);
+    DatabaseData *expected = make_db_data (path, 4);
+    json_array_append_new (expected->in_memory_json_data,
+                           build_json_obj ("HOTP", "counter", "Example", "JBSWY3DPEHPK3PXP",
+                                           8, "SHA256", 0, 42, "work"));
+    GError *err = NULL;
+    db_test_set_save_version (4);
+    update_db (expected, &err);
+    db_test_set_save_version (0);
+    g_assert_no_error (err);
+    g_assert_cmpuint (file_version (path), ==, 4);
+
+    // v4 records are plain JSON and can still be read one at a time.
+    DatabaseData *fetcher = open_reader_with_cached_key (expected);
+    json_t *token = db_fetch_token (fetcher, 4, &err);
+    g_assert_no_error (err);
+    g_assert_true (json_equal (token, json_array_get (expected->in_memory_json_data, 4)));
+    json_decref (token);
+    database_data_free (fetcher);
+
+    DatabaseData *reader = open_reader (path, "records-password");
+    load_db (reader, &err);
+    g_assert_no_error (err);
+    g_assert_true (json_equal (reader->in_memory_json_data, expected->in_memory_json_data));
+    g_assert_cmpint (reader->current_db_version, ==, DB_VERSION);
+    g_assert_cmpuint (file_version (path), ==, DB_VERSION);
+
+    fetcher = open_reader_with_cached_key (reader);
+    token = db_fetch_token (fetcher, 4, &err);
+    g_assert_no_error (err);
+    g_assert_true (json_equal (token, json_array_get (expected->in_memory_json_data, 4)));
+    json_decref (token);
+
+    database_data_free (fetcher);
+    database_data_free (reader);
+    cleanup (expected, dir, path);
+}
+
+static void
+test_tampered_record_isolated (void)
+{
+    gchar *path = NULL;
+    gchar *dir = make_tmp_dir (&path);
+    DatabaseData *writer = make_db_data (path, 3);
+
+    GError *err = NULL;
+    update_db (writer, &err);
+    g_assert_no_error (err);
+
+    // Flip the first ciphertext byte of record 1.
+    gsize first = db_record_size (json_array_get (writer->in_memory_json_data, 0), DB_VERSION);
+    gsize record_1 = DB_V4_PREFIX_SIZE + 3 * DB_V4_INDEX_ENTRY_SIZE + first + TAG_SIZE;
+    FILE *fp = g_fopen (path, "r+b");
+    g_assert_nonnull (fp);
+    g_assert_cmpint (fseek (fp, (long) record_1, SEEK_SET), ==, 0);
+    int byte = fgetc (fp);
+    g_assert_cmpint (fseek (fp, (long) record_1, SEEK_SET), ==, 0);
+    g_assert_cmpint (fputc (byte ^ 0x01, fp), !=, EOF);
+    fclose (fp);
+
+    DatabaseData *reader = open_reader_with_cached_key (writer);
+    load_db (reader, &err);
+    g_assert_error (err, bad_tag_gquark (), BAD_TAG_ERRCODE);
+    g_assert_null (reader->in_memory_json_data);
+    g_clear_error (&err);
+
+    g_assert_null (db_fetch_token (reader, 1, &err));
+    g_assert_error (err, bad_tag_gquark (), BAD_TAG_ERRCODE);
+    g_clear_error (&err);
+
+    json_t *token = db_fetch_token (reader, 2, &err);
+    g_assert_no_error (err);
+    g_assert_true (json_equal (token, json_array_get (writer->in_memory_json_data, 2)));
+    json_decref (token);
+
+    database_data_free (reader);
+    cleanup (writer, dir, path);
+}
+
+static void
+test_load_streams_past_file_cap (void)
+{
+    gchar *path = NULL;
+    gchar *dir = make_tmp_dir (&path);
+    DatabaseData *writer = make_db_data (path, 50);
+
+    GError *err = NULL;
+    update_db (writer, &err);
+    g_assert_no_error (err);
+
+    // A limit the whole file exceeds, but every single record fits in.
+    GStatBuf st;
+    g_assert_cmpint (g_stat (path, &st), ==, 0);
+    gint32 cap = (gint32) st.st_size;
+    g_assert_false (db_too_big_for_secure_memory (path, cap));
+    DatabaseData *reader = open_reader (path, "records-password");
+    reader->max_file_size_from_memlock = cap;
+    load_db (reader, &err);
+    g_assert_no_error (err);
+    g_assert_true (json_equal (reader->in_memory_json_data, writer->in_memory_json_data));
+    database_data_free (reader);
+
+    // A limit smaller than one record is still refused, by load_db.
+    reader = open_reader (path, "records-password");
+    reader->max_file_size_from_memlock = 32;
+    load_db (reader, &err);
+    g_assert_error (err, file_too_big_gquark (), FILE_TOO_BIG_ERRCODE);
+    g_assert_null (reader->in_memory_json_data);
+    g_clear_error (&err);
+    database_data_free (reader);
+
+    // Pre-v4 files are decrypted whole, so the file size keeps gating them.
+    gchar *json = json_dumps (writer->in_memory_json_data, JSON_COMPACT);
+    write_v3_file (path, "records-password", json);
+    gcry_free (json);
+    g_assert_cmpint (g_stat (path, &st), ==, 0);
+    g_assert_true (db_too_big_for_secure_memory (path, (gint32) st.st_size));
+
+    cleanup (writer, dir, path);
+}
+
+static void
+test_fetch_latency_vs_size (void)
+{
+    if (!g_test_perf ()) {
+        g_test_skip ("Fetch timing only runs with -m perf");
+        return;
+    }
+
+    const guint sizes[] = { 100, 1000, 10000 };
+    for (guint s = 0; s < G_N_ELEMENTS (sizes); s++) {
+        gchar *path = NULL;
+        gchar *dir = make_tmp_dir (&path);
+        DatabaseData *writer = make_db_data (path, sizes[s]);
+        GError *err = NULL;
+        update_db (writer, &err);
+        g_assert_no_error (err);
+
+        DatabaseData *reader = open_reader_with_cached_key (writer);
+        g_test_timer_start ();
+        load_db (reader, &err);
+        gdouble full = g_test_timer_elapsed ();
+        g_assert_no_error (err);
+        database_data_free (reader);
+
+        reader = open_reader_with_cached_key (writer);
+        g_test_timer_start ();
+        json_t *token = db_fetch_token (reader, sizes[s] - 1, &err);
+        gdouble single = g_test_timer_elapsed ();
+        g_assert_no_error (err);
+        json_decref (token);
+        database_data_free (reader);
+
+        g_test_message ("%6u tokens: full load %8.3f ms, single fetch %6.3f ms",
+                        sizes[s], full * 1000.0, single * 1000.0);
+        cleanup (writer, dir, path);
+    }
+}
+
+int
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+    gchar *init_err = init_libs (DEFAULT_MEMLOCK_VALUE);
+    g_assert_null (init_err);
+
+    g_test_add_func ("/db-records/save-writes-current",     test_save_writes_current_version);
+    g_test_add_func ("/db-records/fetch-matches-load",      test_fetch_matches_load);
+    g_test_add_func ("/db-records/fetch-refuses-journal",   test_fetch_refuses_pending_journal);
+    g_test_add_func ("/db-records/v3-migrates",             test_v3_file_migrates);
+    g_test_add_func ("/db-records/v4-migrates",             test_v4_file_migrates);
+    g_test_add_func ("/db-records/tampered-record",         test_tampered_record_isolated);
+    g_test_add_func ("/db-records/load-streams-past-cap",   test_load_streams_past_file_cap);
+    g_test_add_func ("/db-records/fetch-latency-vs-size",   test_fetch_latency_vs_size);
+
+    return g_test_run ();
+}
@@ -118,17 +118,17 @@ test_corrupted_ciphertext_rejected (void)
     update_db (writer, &err);
     g_assert_no_error (err);
 
-    /* Flip a single byte just past the v3 header so AES-GCM tag verification
-     * fails. The header bytes themselves are authenticated additional data;
-     * flipping inside them would still trip the tag check but via a different
-     * path. We target the ciphertext region to assert that body corruption is
-     * caught, not just header tampering. */
+    /* Flip the last ciphertext byte of the last token record so AES-GCM tag
+     * verification fails. The header bytes themselves are authenticated
+     * additional data; flipping inside them would still trip the tag check
+     * but via a different path. We target a record to assert that body
+     * corruption is caught, not just header tampering. */
     FILE *fp = g_fopen (path, "r+b");
     g_assert_nonnull (fp);
-    g_assert_cmpint (fseek (fp, DB_V3_HEADER_SIZE + 4, SEEK_SET), ==, 0);
+    g_assert_cmpint (fseek (fp, -(TAG_SIZE + 1), SEEK_END), ==, 0);
     int byte = fgetc (fp);
     g_assert_cmpint (byte, !=, EOF);
-    g_assert_cmpint (fseek (fp, DB_V3_HEADER_SIZE + 4, SEEK_SET), ==, 0);
+    g_assert_cmpint (fseek (fp, -(TAG_SIZE + 1), SEEK_END), ==, 0);
     g_assert_cmpint (fputc (byte ^ 0xff, fp), !=, EOF);
     fclose (fp);
 
@@ -1,10 +1,37 @@
+#define _GNU_SOURCE
 #include <glib.h>
 #include <glib/gstdio.h>
 #include <jansson.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
 #include "common.h"
 #include "db-common.h"
+#include "db-commit.h"
 #include "gquarks.h"
 
+/* Defined in the executable, so GLib's thread creation lands here first.
+ * While refuse_spawns is set no new thread can start, which is how the
+ * commit queue ends up without a worker. */
+static gint refuse_spawns = 0;
+static gint spawns_refused = 0;
+
+int
+pthread_create (pthread_t             *thread,
+                const pthread_attr_t  *attr,
+                void                *(*start_routine) (void *),
+                void                  *arg)
+{
+    static int (*real_create) (pthread_t *, const pthread_attr_t *, void *(*) (void *), void *) = NULL;
+    if (g_atomic_int_get (&refuse_spawns)) {
+        g_atomic_int_inc (&spawns_refused);
+        return EAGAIN;
+    }
+    if (real_create == NULL)
+        real_create = dlsym (RTLD_NEXT, "pthread_create");
+    return real_create (thread, attr, start_routine, arg);
+}
+
 static json_t *
 valid_totp (const gchar *label)
 {
@@ -45,6 +72,17 @@ cleanup_db_data (DatabaseData *db_data,
     g_unlink (path);
     g_autofree gchar *lock_path = g_strconcat (path, ".lock", NULL);
     g_unlink (lock_path);
+    g_autofree gchar *journal_path = g_strconcat (path, ".journal", NULL);
+    g_unlink (journal_path);
+    for (guint i = 0; i <= DB_BACKUP_GENERATIONS_MAX; i++) {
+        g_autofree gchar *bak_path = (i == 0) ? g_strconcat (path, ".bak", NULL)
+                                              : g_strdup_printf ("%s.bak.%u", path, i);
+        g_autofree gchar *bak_journal = g_strconcat (bak_path, ".journal", NULL);
+        g_autofree gchar *bak_lock = g_strconcat (bak_path, ".lock", NULL);
+        g_unlink (bak_path);
+        g_unlink (bak_journal);
+        g_unlink (bak_lock);
+    }
     g_rmdir (dir);
     g_free (path);
     g_free (dir);
@@ -68,7 +106,7 @@ edit_token_mutation (json_t   *candidate,
 {
     (void) user_data;
     (void) err;
-    json_t *obj = json_array_get (candidate, 0);
+    json_t *obj = db_token_for_write (candidate, 0);
     json_object_set_new (obj, "label", json_string ("alice-edited"));
     return TRUE;
 }
@@ -204,6 +242,177 @@ test_stale_snapshot_rejected (void)
     cleanup_db_data (first, dir, path);
 }
 
+static void
+test_snapshot_shares_tokens (void)
+{
+    gchar *dir = NULL;
+    gchar *path = NULL;
+    DatabaseData *db_data = make_db_data (&dir, &path);
+
+    GError *err = NULL;
+    g_assert_true (db_transaction (db_data, append_token_mutation, NULL, &err));
+    g_assert_no_error (err);
+
+    // The committed snapshot holds the same token objects, not copies.
+    g_assert_nonnull (db_data->committed_json_data);
+    g_assert_true (db_data->committed_json_data != db_data->in_memory_json_data);
+    for (gsize i = 0; i < json_array_size (db_data->in_memory_json_data); i++)
+        g_assert_true (json_array_get (db_data->committed_json_data, i) ==
+                       json_array_get (db_data->in_memory_json_data, i));
+
+    // Writing through a live token copies it and leaves the snapshot alone.
+    json_t *committed_token = json_array_get (db_data->committed_json_data, 0);
+    json_t *token = db_token_for_write (db_data->in_memory_json_data, 0);
+    g_assert_nonnull (token);
+    g_assert_true (token != committed_token);
+    json_object_set_new (token, "label", json_string ("alice-edited"));
+    g_assert_cmpstr (json_string_value (json_object_get (committed_token, "label")), ==, "alice");
+    g_assert_null (db_token_for_write (db_data->in_memory_json_data, 7));
+
+    // Rolling back puts the shared tokens back without copying them.
+    db_rollback_to_committed (db_data);
+    g_assert_true (json_array_get (db_data->in_memory_json_data, 0) == committed_token);
+    g_assert_cmpstr (json_string_value (json_object_get (committed_token, "label")), ==, "alice");
+
+    cleanup_db_data (db_data, dir, path);
+}
+
+static void
+test_unchanged_file_not_rehashed (void)
+{
+    gchar *dir = NULL;
+    gchar *path = NULL;
+    DatabaseData *db_data = make_db_data (&dir, &path);
+
+    GError *err = NULL;
+    update_db (db_data, &err);
+    g_assert_no_error (err);
+    g_assert_true (db_data->loaded_file_stamp.valid);
+
+    // Our own saves leave the stat identity in place: nothing is read back.
+    guint hashed = db_test_get_file_hash_count ();
+    g_assert_true (db_transaction (db_data, append_token_mutation, NULL, &err));
+    g_assert_no_error (err);
+    g_assert_true (db_checkpoint (db_data, &err));
+    g_assert_no_error (err);
+    g_assert_true (db_transaction (db_data, edit_token_mutation, NULL, &err));
+    g_assert_no_error (err);
+    g_assert_cmpuint (db_test_get_file_hash_count (), ==, hashed);
+
+    // Same bytes under a new inode: hashed once, then trusted again.
+    g_assert_true (db_checkpoint (db_data, &err));
+    g_assert_no_error (err);
+    gchar *contents = NULL;
+    gsize len = 0;
+    g_assert_true (g_file_get_contents (path, &contents, &len, NULL));
+    g_assert_true (g_file_set_contents (path, contents, (gssize) len, NULL));
+    g_free (contents);
+    g_assert_true (db_transaction (db_data, delete_token_mutation, NULL, &err));
+    g_assert_no_error (err);
+    g_assert_cmpuint (db_test_get_file_hash_count (), ==, hashed + 1);
+    g_assert_true (db_transaction (db_data, append_token_mutation, NULL, &err));
+    g_assert_no_error (err);
+    g_assert_cmpuint (db_test_get_file_hash_count (), ==, hashed + 1);
+
+    cleanup_db_data (db_data, dir, path);
+}
+
+static GBytes *
+read_file_bytes (const gchar *path)
+{
+    gchar *contents = NULL;
+    gsize len = 0;
+    if (!g_file_get_contents (path, &contents, &len, NULL))
+        return NULL;
+    return g_bytes_new_take (contents, len);
+}
+
+static void
+assert_file_holds (const gchar *path,
+                   GBytes      *expected)
+{
+    g_autoptr(GBytes) actual = read_file_bytes (path);
+    g_assert_nonnull (actual);
+    g_assert_true (g_bytes_equal (actual, expected));
+}
+
+// Restoring a backup: what opening it in the app would show.
+static gsize
+backup_token_count (const gchar *bak_path)
+{
+    DatabaseData *restored = database_data_new (bak_path, DEFAULT_MEMLOCK_VALUE);
+    restored->key = secure_strdup ("old-password");
+    GError *err = NULL;
+    load_db (restored, &err);
+    g_assert_no_error (err);
+    gsize n = json_array_size (restored->in_memory_json_data);
+    database_data_free (restored);
+    return n;
+}
+
+static void
+test_backup_ring (void)
+{
+    gchar *dir = NULL;
+    gchar *path = NULL;
+    DatabaseData *db_data = make_db_data (&dir, &path);
+    db_data->backup_generations = 2;
+    g_autofree gchar *bak = g_strconcat (path, ".bak", NULL);
+    g_autofree gchar *bak1 = g_strconcat (path, ".bak.1", NULL);
+    g_autofree gchar *bak2 = g_strconcat (path, ".bak.2", NULL);
+    g_autofree gchar *bak3 = g_strconcat (path, ".bak.3", NULL);
+    g_autofree gchar *bak_tmp = g_strconcat (path, ".bak.tmp", NULL);
+
+    GError *err = NULL;
+    update_db (db_data, &err);
+    g_assert_no_error (err);
+    g_assert_false (g_file_test (bak, G_FILE_TEST_EXISTS));
+
+    // Every full rewrite keeps the file it replaced as .bak and shifts the
+    // older ones down the ring, dropping whatever falls off its end. The
+    // token added before each checkpoint was journaled: every generation
+    // must still have it.
+    GBytes *generations[5] = { NULL };
+    generations[0] = read_file_bytes (path);
+    for (guint gen = 1; gen < G_N_ELEMENTS (generations); gen++) {
+        g_assert_true (db_transaction (db_data, append_token_mutation, NULL, &err));
+        g_assert_no_error (err);
+        g_assert_true (db_checkpoint (db_data, &err));
+        g_assert_no_error (err);
+        generations[gen] = read_file_bytes (path);
+        g_assert_false (g_bytes_equal (generations[gen], generations[gen - 1]));
+        assert_file_holds (bak, generations[gen - 1]);
+        if (gen >= 2)
+            assert_file_holds (bak1, generations[gen - 2]);
+        if (gen >= 3)
+            assert_file_holds (bak2, generations[gen - 3]);
+        // Generation gen started from 1 token and gained one per checkpoint.
+        g_assert_cmpuint (backup_token_count (bak), ==, gen + 1);
+        if (gen >= 2)
+            g_assert_cmpuint (backup_token_count (bak1), ==, gen);
+        if (gen >= 3)
+            g_assert_cmpuint (backup_token_count (bak2), ==, gen - 1);
+    }
+    g_assert_false (g_file_test (bak3, G_FILE_TEST_EXISTS));
+    g_autofree gchar *bak3_journal = g_strconcat (bak3, ".journal", NULL);
+    g_assert_false (g_file_test (bak3_journal, G_FILE_TEST_EXISTS));
+    g_assert_false (g_file_test (bak_tmp, G_FILE_TEST_EXISTS));
+
+    GStatBuf st;
+    g_assert_cmpint (g_stat (bak, &st), ==, 0);
+    g_assert_cmpint (st.st_mode & 0777, ==, 0600);
+
+    // A journaled edit leaves the main file, and so the backups, alone.
+    g_assert_true (db_transaction (db_data, edit_token_mutation, NULL, &err));
+    g_assert_no_error (err);
+    assert_file_holds (path, generations[4]);
+    assert_file_holds (bak, generations[3]);
+
+    for (guint gen = 0; gen < G_N_ELEMENTS (generations); gen++)
+        g_bytes_unref (generations[gen]);
+    cleanup_db_data (db_data, dir, path);
+}
+
 static void
 test_lock_unsupported_fallback (void)
 {
@@ -236,6 +445,166 @@ test_lock_unsupported_fallback (void)
     cleanup_db_data (db_data, dir, path);
 }
 
+typedef struct {
+    guint calls;
+    guint failures;
+} CommitCounter;
+
+static void
+count_commit (DatabaseData *db_data,
+              const GError *error,
+              gpointer      user_data)
+{
+    (void) db_data;
+    CommitCounter *counter = user_data;
+    counter->calls++;
+    if (error != NULL)
+        counter->failures++;
+}
+
+static void
+test_async_commits_coalesce (void)
+{
+    gchar *dir = NULL;
+    gchar *path = NULL;
+    DatabaseData *db_data = make_db_data (&dir, &path);
+
+    GError *err = NULL;
+    update_db (db_data, &err);
+    g_assert_no_error (err);
+    gint seq_before = db_data->commit_seq;
+
+    // Every change is visible in the live array as soon as it's submitted;
+    // the worker may merge any of them into one write.
+    CommitCounter counter = { 0, 0 };
+    for (guint i = 0; i < 16; i++) {
+        g_assert_true (db_commit_async (db_data, append_token_mutation, NULL,
+                                        count_commit, &counter, &err));
+        g_assert_no_error (err);
+    }
+    g_assert_cmpuint (json_array_size (db_data->in_memory_json_data), ==, 17);
+
+    g_assert_true (db_commit_flush (db_data, &err));
+    g_assert_no_error (err);
+    g_assert_cmpuint (counter.calls, ==, 16);
+    g_assert_cmpuint (counter.failures, ==, 0);
+    g_assert_cmpint (db_data->commit_seq - seq_before, >=, 1);
+    g_assert_cmpint (db_data->commit_seq - seq_before, <=, 16);
+    g_assert_true (json_equal (db_data->committed_json_data, db_data->in_memory_json_data));
+
+    DatabaseData *reloaded = database_data_new (path, DEFAULT_MEMLOCK_VALUE);
+    reloaded->key = secure_strdup ("old-password");
+    load_db (reloaded, &err);
+    g_assert_no_error (err);
+    g_assert_true (json_equal (reloaded->in_memory_json_data, db_data->in_memory_json_data));
+    database_data_free (reloaded);
+
+    cleanup_db_data (db_data, dir, path);
+}
+
+static void
+test_async_failure_rolls_back (void)
+{
+    gchar *dir = NULL;
+    gchar *path = NULL;
+    DatabaseData *db_data = make_db_data (&dir, &path);
+
+    GError *err = NULL;
+    update_db (db_data, &err);
+    g_assert_no_error (err);
+    json_t *before = json_deep_copy (db_data->in_memory_json_data);
+
+    CommitCounter counter = { 0, 0 };
+    db_test_set_fail_encrypt (TRUE);
+    g_assert_true (db_commit_async (db_data, append_token_mutation, NULL,
+                                    count_commit, &counter, &err));
+    g_assert_true (db_commit_async (db_data, edit_token_mutation, NULL,
+                                    count_commit, &counter, &err));
+    g_assert_no_error (err);
+
+    g_assert_false (db_commit_flush (db_data, &err));
+    g_assert_error (err, generic_error_gquark (), GENERIC_ERRCODE);
+    g_clear_error (&err);
+    db_test_set_fail_encrypt (FALSE);
+
+    g_assert_cmpuint (counter.calls, ==, 2);
+    g_assert_cmpuint (counter.failures, ==, 2);
+    g_assert_true (json_equal (db_data->in_memory_json_data, before));
+
+    // The queue is usable again once the failure has been reported.
+    g_assert_true (db_commit_async (db_data, delete_token_mutation, NULL,
+                                    count_commit, &counter, &err));
+    g_assert_true (db_commit_flush (db_data, &err));
+    g_assert_no_error (err);
+    g_assert_cmpuint (counter.calls, ==, 3);
+    g_assert_cmpuint (json_array_size (db_data->in_memory_json_data), ==, 0);
+
+    json_decref (before);
+    cleanup_db_data (db_data, dir, path);
+}
+
+static void
+noop_job (gpointer data,
+          gpointer user_data)
+{
+    (void) data;
+    (void) user_data;
+}
+
+static void
+test_async_without_worker (void)
+{
+    /* The queue's pool could not start its worker: every change must still
+     * reach the disk and report back instead of waiting on a thread that
+     * never comes, and flushing or freeing the queue must not hang. */
+    if (g_test_subprocess ()) {
+        g_log_set_always_fatal (G_LOG_FATAL_MASK);
+
+        gchar *dir = NULL;
+        gchar *path = NULL;
+        DatabaseData *db_data = make_db_data (&dir, &path);
+
+        GError *err = NULL;
+        update_db (db_data, &err);
+        g_assert_no_error (err);
+
+        // The first shared pool starts GLib's spawner thread, which aborts
+        // rather than fails when it can't; get that out of the way. Idle
+        // threads left by the key derivation must not stand in for a worker.
+        g_thread_pool_free (g_thread_pool_new (noop_job, NULL, 1, FALSE, NULL), FALSE, TRUE);
+        g_thread_pool_set_max_unused_threads (0);
+
+        CommitCounter counter = { 0, 0 };
+        g_atomic_int_set (&refuse_spawns, 1);
+        for (guint i = 0; i < 4; i++) {
+            g_assert_true (db_commit_async (db_data, append_token_mutation, NULL,
+                                            count_commit, &counter, &err));
+            g_assert_no_error (err);
+        }
+        g_assert_true (db_commit_flush (db_data, &err));
+        g_assert_no_error (err);
+        g_atomic_int_set (&refuse_spawns, 0);
+
+        g_assert_cmpint (g_atomic_int_get (&spawns_refused), >, 0);
+        g_assert_cmpuint (counter.calls, ==, 4);
+        g_assert_cmpuint (counter.failures, ==, 0);
+        g_assert_true (json_equal (db_data->committed_json_data, db_data->in_memory_json_data));
+
+        DatabaseData *reloaded = database_data_new (path, DEFAULT_MEMLOCK_VALUE);
+        reloaded->key = secure_strdup ("old-password");
+        load_db (reloaded, &err);
+        g_assert_no_error (err);
+        g_assert_true (json_equal (reloaded->in_memory_json_data, db_data->in_memory_json_data));
+        database_data_free (reloaded);
+
+        cleanup_db_data (db_data, dir, path);
+        return;
+    }
+    g_test_trap_subprocess (NULL, 30 * G_USEC_PER_SEC, G_TEST_SUBPROCESS_DEFAULT);
+    g_test_trap_assert_passed ();
+    g_test_trap_assert_stderr ("*Couldn't start a worker thread for the database commit queue*");
+}
+
 int
 main (int argc, char **argv)
 {
@@ -248,7 +617,13 @@ main (int argc, char **argv)
     g_test_add_func ("/db-transaction/password-change-failure", test_password_change_failure_restores_key);
     g_test_add_func ("/db-transaction/kdf-failure", test_kdf_failure_restores_params);
     g_test_add_func ("/db-transaction/stale-snapshot", test_stale_snapshot_rejected);
+    g_test_add_func ("/db-transaction/snapshot-shares-tokens", test_snapshot_shares_tokens);
+    g_test_add_func ("/db-transaction/unchanged-file-not-rehashed", test_unchanged_file_not_rehashed);
+    g_test_add_func ("/db-transaction/backup-ring", test_backup_ring);
     g_test_add_func ("/db-transaction/lock-unsupported-fallback", test_lock_unsupported_fallback);
+    g_test_add_func ("/db-transaction/async-coalesce", test_async_commits_coalesce);
+    g_test_add_func ("/db-transaction/async-failure-rollback", test_async_failure_rolls_back);
+    g_test_add_func ("/db-transaction/async-without-worker", test_async_without_worker);
 
     return g_test_run ();
 }
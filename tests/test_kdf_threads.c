@@ -0,0 +1,253 @@
+#define _GNU_SOURCE
+#include <glib.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include "common.h"
+#include "db-common.h"
+
+/* kdf_compute_threaded() hands Argon2id lanes to a shared thread pool instead
+ * of running them all on the calling thread. Argon2 lanes only synchronise at
+ * segment boundaries, so the schedule must not change the output: the threaded
+ * key has to match the serial gcry_kdf_compute (hd, NULL) key bit for bit, for
+ * every lane count and pool size. In perf mode (-m perf) the binary also times
+ * the KDF dialog presets against the pool size, which is the unlock stall the
+ * user sees. */
+
+static const guint8 test_salt[KDF_SALT_SIZE] = {
+    0x4f, 0x54, 0x50, 0x43, 0x6c, 0x69, 0x65, 0x6e, 0x74, 0x2d, 0x6b, 0x64, 0x66, 0x2d, 0x74, 0x65,
+    0x73, 0x74, 0x2d, 0x73, 0x61, 0x6c, 0x74, 0x2d, 0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,
+};
+
+static const gchar *test_password = "correct horse battery staple";
+
+/* Defined in the executable, so GLib's thread creation lands here first.
+ * While refuse_spawns is set no new thread can start, which is the one way
+ * g_thread_pool_push() fails. */
+static gint refuse_spawns = 0;
+static gint spawns_refused = 0;
+
+int
+pthread_create (pthread_t             *thread,
+                const pthread_attr_t  *attr,
+                void                *(*start_routine) (void *),
+                void                  *arg)
+{
+    static int (*real_create) (pthread_t *, const pthread_attr_t *, void *(*) (void *), void *) = NULL;
+    if (g_atomic_int_get (&refuse_spawns)) {
+        g_atomic_int_inc (&spawns_refused);
+        return EAGAIN;
+    }
+    if (real_create == NULL)
+        real_create = dlsym (RTLD_NEXT, "pthread_create");
+    return real_create (thread, attr, start_routine, arg);
+}
+
+static gboolean
+derive (gulong    iter,
+        gulong    memcost,
+        gulong    parallelism,
+        gboolean  threaded,
+        guint8    out[ARGON2ID_KEYLEN])
+{
+    const unsigned long params[4] = {ARGON2ID_TAGLEN, iter, memcost, parallelism};
+    gcry_kdf_hd_t hd;
+    if (gcry_kdf_open (&hd, GCRY_KDF_ARGON2, GCRY_KDF_ARGON2ID,
+                       params, 4,
+                       test_password, strlen (test_password),
+                       test_salt, KDF_SALT_SIZE,
+                       NULL, 0, NULL, 0) != GPG_ERR_NO_ERROR)
+        return FALSE;
+
+    gcry_error_t gc_err = threaded ? kdf_compute_threaded (hd) : gcry_kdf_compute (hd, NULL);
+    if (gc_err == GPG_ERR_NO_ERROR)
+        gc_err = gcry_kdf_final (hd, ARGON2ID_KEYLEN, out);
+    gcry_kdf_close (hd);
+
+    return gc_err == GPG_ERR_NO_ERROR;
+}
+
+static void
+test_threaded_matches_serial (void)
+{
+    /* Cover single-lane, the dialog's lane counts and the header ceiling, with
+     * the pool both wider and narrower than the lane count. */
+    const gulong lanes[] = { 1, 2, 4, ARGON2ID_MAX_PARAL };
+    const gint pool_sizes[] = { 1, 2, 3, 8 };
+
+    for (guint l = 0; l < G_N_ELEMENTS (lanes); l++) {
+        guint8 serial[ARGON2ID_KEYLEN];
+        g_assert_true (derive (2, ARGON2ID_MIN_MC, lanes[l], FALSE, serial));
+
+        for (guint p = 0; p < G_N_ELEMENTS (pool_sizes); p++) {
+            guint8 threaded[ARGON2ID_KEYLEN];
+            kdf_set_max_threads (pool_sizes[p]);
+            g_assert_true (derive (2, ARGON2ID_MIN_MC, lanes[l], TRUE, threaded));
+            g_assert_cmpmem (serial, sizeof (serial), threaded, sizeof (threaded));
+        }
+    }
+    kdf_set_max_threads (0);
+}
+
+static gpointer
+concurrent_derive_thread (gpointer user_data)
+{
+    guint8 *out = user_data;
+    return GINT_TO_POINTER (derive (2, ARGON2ID_MIN_MC, 4, TRUE, out));
+}
+
+static void
+test_concurrent_derivations (void)
+{
+    /* The GUI can derive for the unlocked DB and for cross-DB search at the same
+     * time; each call must only wait for its own lanes. */
+    kdf_set_max_threads (2);
+
+    guint8 expected[ARGON2ID_KEYLEN];
+    g_assert_true (derive (2, ARGON2ID_MIN_MC, 4, FALSE, expected));
+
+    guint8 results[4][ARGON2ID_KEYLEN];
+    GThread *threads[4];
+    for (guint i = 0; i < G_N_ELEMENTS (threads); i++)
+        threads[i] = g_thread_new ("kdf-test", concurrent_derive_thread, results[i]);
+    for (guint i = 0; i < G_N_ELEMENTS (threads); i++) {
+        g_assert_true (GPOINTER_TO_INT (g_thread_join (threads[i])));
+        g_assert_cmpmem (expected, sizeof (expected), results[i], sizeof (results[i]));
+    }
+
+    kdf_set_max_threads (0);
+}
+
+static void
+test_worker_spawn_failure (void)
+{
+    /* A lane whose push could not start a worker is still queued: it must
+     * run exactly once, on the worker that exists or on the waiting thread.
+     * A fresh process so the pool starts out with that single worker. */
+    if (g_test_subprocess ()) {
+        // The pool warns about every refused thread.
+        g_log_set_always_fatal (G_LOG_FATAL_MASK);
+
+        guint8 serial[ARGON2ID_KEYLEN];
+        g_assert_true (derive (2, ARGON2ID_MIN_MC, 4, FALSE, serial));
+
+        guint8 threaded[ARGON2ID_KEYLEN];
+        kdf_set_max_threads (4);
+        g_assert_true (derive (2, ARGON2ID_MIN_MC, 1, TRUE, threaded));
+        g_atomic_int_set (&refuse_spawns, 1);
+        g_assert_true (derive (2, ARGON2ID_MIN_MC, 4, TRUE, threaded));
+        g_atomic_int_set (&refuse_spawns, 0);
+
+        g_assert_cmpint (g_atomic_int_get (&spawns_refused), >, 0);
+        g_assert_cmpmem (serial, sizeof (serial), threaded, sizeof (threaded));
+        // Again, with lanes possibly left over from a double run.
+        g_assert_true (derive (2, ARGON2ID_MIN_MC, 4, TRUE, threaded));
+        g_assert_cmpmem (serial, sizeof (serial), threaded, sizeof (threaded));
+        kdf_set_max_threads (0);
+        return;
+    }
+    g_test_trap_subprocess (NULL, 0, G_TEST_SUBPROCESS_DEFAULT);
+    g_test_trap_assert_passed ();
+    g_test_trap_assert_stderr ("*Couldn't start a worker thread for an Argon2 lane*");
+}
+
+static void
+noop_job (gpointer data,
+          gpointer user_data)
+{
+    (void) data;
+    (void) user_data;
+}
+
+static void
+test_cold_pool_spawn_failure (void)
+{
+    /* No worker was ever started, so nothing in the pool will ever pick the
+     * lanes up: the unlock must run them all on the waiting thread instead of
+     * hanging. */
+    if (g_test_subprocess ()) {
+        g_log_set_always_fatal (G_LOG_FATAL_MASK);
+
+        guint8 serial[ARGON2ID_KEYLEN];
+        g_assert_true (derive (2, ARGON2ID_MIN_MC, 4, FALSE, serial));
+
+        // The first shared pool starts GLib's spawner thread, which aborts
+        // rather than fails when it can't; get that out of the way.
+        g_thread_pool_free (g_thread_pool_new (noop_job, NULL, 1, FALSE, NULL), FALSE, TRUE);
+
+        guint8 threaded[ARGON2ID_KEYLEN];
+        kdf_set_max_threads (4);
+        g_atomic_int_set (&refuse_spawns, 1);
+        g_assert_true (derive (2, ARGON2ID_MIN_MC, 4, TRUE, threaded));
+        g_atomic_int_set (&refuse_spawns, 0);
+
+        g_assert_cmpint (g_atomic_int_get (&spawns_refused), >, 0);
+        g_assert_cmpmem (serial, sizeof (serial), threaded, sizeof (threaded));
+        // The first worker that does start meets the stale tickets first.
+        g_assert_true (derive (2, ARGON2ID_MIN_MC, 4, TRUE, threaded));
+        g_assert_cmpmem (serial, sizeof (serial), threaded, sizeof (threaded));
+        kdf_set_max_threads (0);
+        return;
+    }
+    g_test_trap_subprocess (NULL, 30 * G_USEC_PER_SEC, G_TEST_SUBPROCESS_DEFAULT);
+    g_test_trap_assert_passed ();
+    g_test_trap_assert_stderr ("*Couldn't start a worker thread for an Argon2 lane*");
+}
+
+static void
+test_preset_latency_vs_cores (void)
+{
+    if (!g_test_perf ()) {
+        g_test_skip ("Unlock latency measurement only runs with -m perf");
+        return;
+    }
+
+    static const struct {
+        const gchar *name;
+        gulong iter;
+        gulong memcost;
+        gulong parallelism;
+    } presets[] = {
+        { "Standard", ARGON2ID_STANDARD_ITER, ARGON2ID_STANDARD_MC, ARGON2ID_STANDARD_PARAL },
+        { "Strong",   ARGON2ID_STRONG_ITER,   ARGON2ID_STRONG_MC,   ARGON2ID_STRONG_PARAL },
+        { "Paranoid", ARGON2ID_PARANOID_ITER, ARGON2ID_PARANOID_MC, ARGON2ID_PARANOID_PARAL },
+    };
+
+    guint max_cores = g_get_num_processors ();
+    for (guint i = 0; i < G_N_ELEMENTS (presets); i++) {
+        gdouble serial_s = 0;
+        for (guint cores = 1; cores <= max_cores; cores *= 2) {
+            guint8 key[ARGON2ID_KEYLEN];
+            kdf_set_max_threads ((gint) cores);
+            g_test_timer_start ();
+            g_assert_true (derive (presets[i].iter, presets[i].memcost, presets[i].parallelism, TRUE, key));
+            gdouble elapsed = g_test_timer_elapsed ();
+            if (cores == 1)
+                serial_s = elapsed;
+            g_test_message ("%-8s (t=%lu, m=%lu KiB, p=%lu) cores=%-2u %8.1f ms  speedup %.2fx",
+                            presets[i].name, presets[i].iter, presets[i].memcost, presets[i].parallelism,
+                            cores, elapsed * 1000.0, serial_s / elapsed);
+            // Past the lane count extra cores have nothing to do.
+            if (cores >= presets[i].parallelism)
+                break;
+        }
+    }
+    kdf_set_max_threads (0);
+}
+
+int
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+    gchar *init_err = init_libs (DEFAULT_MEMLOCK_VALUE);
+    g_assert_null (init_err);
+
+    g_test_add_func ("/kdf-threads/threaded-matches-serial", test_threaded_matches_serial);
+    g_test_add_func ("/kdf-threads/concurrent-derivations",  test_concurrent_derivations);
+    g_test_add_func ("/kdf-threads/worker-spawn-failure",    test_worker_spawn_failure);
+    g_test_add_func ("/kdf-threads/cold-pool-spawn-failure", test_cold_pool_spawn_failure);
+    g_test_add_func ("/kdf-threads/preset-latency-vs-cores", test_preset_latency_vs_cores);
+
+    return g_test_run ();
+}
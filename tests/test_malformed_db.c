@@ -50,7 +50,7 @@ fill_v3_header (guint8 *bytes,
                 guint32 parallelism)
 {
     memcpy (bytes, DB_HEADER_NAME, DB_HEADER_NAME_LEN);
-    write_be32_test (bytes + DB_HEADER_NAME_LEN, DB_VERSION);
+    write_be32_test (bytes + DB_HEADER_NAME_LEN, 3);
 
     guint8 *salt = bytes + DB_HEADER_NAME_LEN + 4 + IV_SIZE;
     write_be32_test (salt + KDF_SALT_SIZE, iter);
@@ -135,7 +135,7 @@ test_truncated_v3_header_rejected (void)
 {
     guint8 bytes[DB_HEADER_NAME_LEN + sizeof (gint32) + 1] = {0};
     memcpy (bytes, DB_HEADER_NAME, DB_HEADER_NAME_LEN);
-    write_be32_test (bytes + DB_HEADER_NAME_LEN, DB_VERSION);
+    write_be32_test (bytes + DB_HEADER_NAME_LEN, 3);
 
     gchar *dir = NULL;
     gchar *path = write_tmp_file ("truncated-v3.enc", bytes, sizeof bytes, &dir);
@@ -20,6 +20,62 @@ test_steam_generation (void)
     g_object_unref (entry);
 }
 
+static void
+count_notify (GObject    *object,
+              GParamSpec *pspec,
+              gpointer    user_data)
+{
+    (void) object;
+    (void) pspec;
+    (*(guint *) user_data)++;
+}
+
+static void
+test_lazy_otp_cache (void)
+{
+    OTPEntry *entry = otp_entry_new (
+        "bob", "Example", NULL, "HOTP", 30, 0, "SHA1", 6,
+        "JBSWY3DPEHPK3PXP");
+    guint notifies = 0;
+    g_signal_connect (entry, "notify::otp-value", G_CALLBACK (count_notify), &notifies);
+
+    // Nothing is computed until someone asks for the code.
+    g_assert_null (otp_entry_get_otp_value (entry));
+
+    cotp_error_t err = NO_ERROR;
+    gchar *expected = get_hotp ("JBSWY3DPEHPK3PXP", 0, 6, COTP_SHA1, &err);
+    g_assert_cmpint (err, ==, NO_ERROR);
+    g_assert_cmpstr (otp_entry_ensure_otp (entry), ==, expected);
+    g_assert_cmpstr (otp_entry_ensure_otp (entry), ==, expected);
+    g_assert_cmpuint (notifies, ==, 1);
+    sensitive_free (expected);
+
+    // A new counter is a new step.
+    otp_entry_set_counter (entry, 1);
+    expected = get_hotp ("JBSWY3DPEHPK3PXP", 1, 6, COTP_SHA1, &err);
+    g_assert_cmpstr (otp_entry_ensure_otp (entry), ==, expected);
+    g_assert_cmpuint (notifies, ==, 2);
+    sensitive_free (expected);
+
+    // A value blanked from outside holds until the step changes.
+    otp_entry_set_otp_value (entry, "");
+    g_assert_cmpstr (otp_entry_ensure_otp (entry), ==, "");
+    otp_entry_set_counter (entry, 2);
+    expected = get_hotp ("JBSWY3DPEHPK3PXP", 2, 6, COTP_SHA1, &err);
+    g_assert_cmpstr (otp_entry_ensure_otp (entry), ==, expected);
+    sensitive_free (expected);
+
+    g_assert_false (otp_entry_has_view (entry));
+    otp_entry_add_view (entry);
+    otp_entry_add_view (entry);
+    otp_entry_remove_view (entry);
+    g_assert_true (otp_entry_has_view (entry));
+    otp_entry_remove_view (entry);
+    g_assert_false (otp_entry_has_view (entry));
+
+    g_object_unref (entry);
+}
+
 int
 main (int argc, char **argv)
 {
@@ -27,5 +83,6 @@ main (int argc, char **argv)
     gchar *init_err = init_libs (DEFAULT_MEMLOCK_VALUE);
     g_assert_null (init_err);
     g_test_add_func ("/otp-entry/steam", test_steam_generation);
+    g_test_add_func ("/otp-entry/lazy-cache", test_lazy_otp_cache);
     return g_test_run ();
 }
@@ -1,8 +1,10 @@
 #include <glib.h>
+#include <gcrypt.h>
 #include <cotp.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include "otp-context.h"
 
 /* RFC 6238 Appendix B + RFC 4226 Appendix D reference test vectors.
  *
@@ -137,10 +139,189 @@ test_invalid_base32_secret_sets_err (void)
     g_assert_cmpint (err, ==, INVALID_B32_INPUT);
 }
 
+/* OtpContext must give exactly what libcotp gives for the same token, since
+ * the app switched to it: every algorithm, digit count, Steam, HOTP, and the
+ * secret spellings validation accepts (lowercase, spaces, padding). */
+static void
+test_context_matches_cotp (void)
+{
+    const gchar *secrets[] = { "JBSWY3DPEHPK3PXP", "GEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQ",
+                               "KRSXG5CTMVRXEZLUKN2XAZLSKNSWG4TFOQ======" };
+    const gchar *algos[] = { "SHA1", "SHA256", "SHA512" };
+    const int cotp_algos[] = { COTP_SHA1, COTP_SHA256, COTP_SHA512 };
+    const long times[] = { 0L, 59L, 1111111109L, 1700000000L, 20000000000L };
+
+    for (guint s = 0; s < G_N_ELEMENTS (secrets); s++) {
+        for (guint a = 0; a < G_N_ELEMENTS (algos); a++) {
+            GError *err = NULL;
+            OtpContext *ctx = otp_context_new (secrets[s], algos[a], &err);
+            g_assert_no_error (err);
+            for (guint digits = MIN_DIGITS; digits <= MAX_DIGITS; digits++) {
+                for (guint t = 0; t < G_N_ELEMENTS (times); t++) {
+                    cotp_error_t cerr = NO_ERROR;
+                    gchar *expected = get_totp_at (secrets[s], times[t], (int) digits, 30, cotp_algos[a], &cerr);
+                    g_assert_cmpint (cerr, ==, NO_ERROR);
+                    gchar *code = otp_context_totp_at (ctx, times[t], 30, digits);
+                    g_assert_cmpstr (code, ==, expected);
+                    gcry_free (code);
+                    free (expected);
+                }
+                cotp_error_t cerr = NO_ERROR;
+                gchar *expected = get_hotp (secrets[s], 12345, (int) digits, cotp_algos[a], &cerr);
+                g_assert_cmpint (cerr, ==, NO_ERROR);
+                gchar *code = otp_context_hotp (ctx, 12345, digits);
+                g_assert_cmpstr (code, ==, expected);
+                gcry_free (code);
+                free (expected);
+            }
+            otp_context_free (ctx);
+        }
+
+        OtpContext *steam = otp_context_new (secrets[s], "SHA1", NULL);
+        for (guint t = 0; t < G_N_ELEMENTS (times); t++) {
+            cotp_error_t cerr = NO_ERROR;
+            gchar *expected = get_steam_totp_at (secrets[s], times[t], 30, &cerr);
+            g_assert_cmpint (cerr, ==, NO_ERROR);
+            gchar *code = otp_context_steam_at (steam, times[t], 30);
+            g_assert_cmpstr (code, ==, expected);
+            gcry_free (code);
+            free (expected);
+        }
+        otp_context_free (steam);
+    }
+
+    // Spellings validation accepts decode to the same key.
+    OtpContext *plain = otp_context_new ("JBSWY3DPEHPK3PXP", NULL, NULL);
+    OtpContext *loose = otp_context_new ("jbsw y3dp ehpk 3pxp==", "sha1", NULL);
+    g_assert_nonnull (loose);
+    gchar *a = otp_context_totp_at (plain, 1700000000L, 30, 6);
+    gchar *b = otp_context_totp_at (loose, 1700000000L, 30, 6);
+    g_assert_cmpstr (a, ==, b);
+    gcry_free (a);
+    gcry_free (b);
+    otp_context_free (plain);
+    otp_context_free (loose);
+
+    GError *err = NULL;
+    g_assert_null (otp_context_new ("not-base-32!", "SHA1", &err));
+    g_assert_nonnull (err);
+    g_clear_error (&err);
+    g_assert_null (otp_context_new ("====", "SHA1", &err));
+    g_clear_error (&err);
+    g_assert_null (otp_context_new ("JBSWY3DPEHPK3PXP", "MD5", &err));
+    g_clear_error (&err);
+}
+
+/* The batch path is what the window uses when a period rolls over, so it is
+ * held to the RFC vectors directly: every TOTP and HOTP vector above in one
+ * interleaved batch over three contexts, plus a Steam code and an item
+ * without a context. */
+static void
+test_batch_rfc_vectors (void)
+{
+    static const long times[] = { 59L, 1111111109L, 1111111111L, 1234567890L, 2000000000L, 20000000000L };
+    static const gchar *expected_totp[3][6] = {
+        { "94287082", "07081804", "14050471", "89005924", "69279037", "65353130" },
+        { "46119246", "68084774", "67062674", "91819424", "90698825", "77737706" },
+        { "90693936", "25091201", "99943326", "93441116", "38618901", "47863826" },
+    };
+    static const gchar *expected_hotp[] = {
+        "755224", "287082", "359152", "969429", "338314",
+        "254676", "287922", "162583", "399871", "520489",
+    };
+    const char *ascii[] = { SECRET_SHA1_ASCII, SECRET_SHA256_ASCII, SECRET_SHA512_ASCII };
+    const gchar *algos[] = { "SHA1", "SHA256", "SHA512" };
+
+    OtpContext *ctx[3];
+    for (guint a = 0; a < 3; a++) {
+        gchar *b32 = ascii_to_base32 (ascii[a]);
+        GError *err = NULL;
+        ctx[a] = otp_context_new (b32, algos[a], &err);
+        g_assert_no_error (err);
+        free (b32);
+    }
+
+    GArray *items = g_array_new (FALSE, TRUE, sizeof (OtpBatchItem));
+    GPtrArray *expected = g_ptr_array_new ();
+    for (guint t = 0; t < G_N_ELEMENTS (times); t++) {
+        for (guint a = 0; a < 3; a++) {
+            OtpBatchItem item = { ctx[a], (guint64) times[t] / 30, 8, NULL };
+            g_array_append_val (items, item);
+            g_ptr_array_add (expected, (gpointer) expected_totp[a][t]);
+        }
+        if (t < G_N_ELEMENTS (expected_hotp)) {
+            OtpBatchItem item = { ctx[0], t, 6, NULL };
+            g_array_append_val (items, item);
+            g_ptr_array_add (expected, (gpointer) expected_hotp[t]);
+        }
+    }
+    for (guint c = G_N_ELEMENTS (times); c < G_N_ELEMENTS (expected_hotp); c++) {
+        OtpBatchItem item = { ctx[0], c, 6, NULL };
+        g_array_append_val (items, item);
+        g_ptr_array_add (expected, (gpointer) expected_hotp[c]);
+    }
+    gchar *steam = otp_context_steam_at (ctx[0], 1700000000L, 30);
+    OtpBatchItem steam_item = { ctx[0], 1700000000L / 30, OTP_CONTEXT_STEAM, NULL };
+    g_array_append_val (items, steam_item);
+    g_ptr_array_add (expected, steam);
+    OtpBatchItem no_ctx = { NULL, 1, 6, NULL };
+    g_array_append_val (items, no_ctx);
+    g_ptr_array_add (expected, NULL);
+
+    otp_context_generate_batch ((OtpBatchItem *) items->data, items->len);
+    for (guint i = 0; i < items->len; i++) {
+        OtpBatchItem *item = &g_array_index (items, OtpBatchItem, i);
+        g_assert_cmpstr (item->code, ==, g_ptr_array_index (expected, i));
+        gcry_free (item->code);
+    }
+
+    gcry_free (steam);
+    g_ptr_array_unref (expected);
+    g_array_unref (items);
+    for (guint a = 0; a < 3; a++)
+        otp_context_free (ctx[a]);
+}
+
+static void
+test_context_throughput (void)
+{
+    if (!g_test_perf ()) {
+        g_test_skip ("Throughput only runs with -m perf");
+        return;
+    }
+
+    const gchar *algos[] = { "SHA1", "SHA256", "SHA512" };
+    const int cotp_algos[] = { COTP_SHA1, COTP_SHA256, COTP_SHA512 };
+    const gchar *secret = "GEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQ";
+    const guint rounds = 100000;
+    for (guint a = 0; a < G_N_ELEMENTS (algos); a++) {
+        g_test_timer_start ();
+        for (guint i = 0; i < rounds; i++) {
+            cotp_error_t cerr = NO_ERROR;
+            free (get_totp_at (secret, 1700000000L + 30L * i, 6, 30, cotp_algos[a], &cerr));
+        }
+        gdouble cotp_time = g_test_timer_elapsed ();
+
+        OtpContext *ctx = otp_context_new (secret, algos[a], NULL);
+        g_test_timer_start ();
+        for (guint i = 0; i < rounds; i++)
+            gcry_free (otp_context_totp_at (ctx, 1700000000L + 30L * i, 30, 6));
+        gdouble ctx_time = g_test_timer_elapsed ();
+        otp_context_free (ctx);
+
+        g_test_message ("%-6s libcotp %9.0f codes/s, context %9.0f codes/s (x%.1f)",
+                        algos[a], rounds / cotp_time, rounds / ctx_time, cotp_time / ctx_time);
+    }
+}
+
 int
 main (int argc, char **argv)
 {
     g_test_init (&argc, &argv, NULL);
+    // OtpContext keeps keys and codes in secure memory.
+    gcry_check_version (NULL);
+    gcry_control (GCRYCTL_INIT_SECMEM, 65536, 0);
+    gcry_control (GCRYCTL_INITIALIZATION_FINISHED, 0);
 
     g_test_add_func ("/otp-generation/rfc6238-sha1",   test_rfc6238_sha1_vectors);
     g_test_add_func ("/otp-generation/rfc6238-sha256", test_rfc6238_sha256_vectors);
@@ -148,6 +329,9 @@ main (int argc, char **argv)
     g_test_add_func ("/otp-generation/rfc4226-hotp",   test_rfc4226_hotp_vectors);
     g_test_add_func ("/otp-generation/zero-pad",       test_totp_zero_pads_short_value);
     g_test_add_func ("/otp-generation/invalid-b32",    test_invalid_base32_secret_sets_err);
+    g_test_add_func ("/otp-generation/context-matches-cotp", test_context_matches_cotp);
+    g_test_add_func ("/otp-generation/batch-rfc-vectors",    test_batch_rfc_vectors);
+    g_test_add_func ("/otp-generation/context-throughput",   test_context_throughput);
 
     return g_test_run ();
 }
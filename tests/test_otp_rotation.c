@@ -0,0 +1,185 @@
+#include <glib.h>
+#include <gio/gio.h>
+#include "common.h"
+#include "otp-entry.h"
+#include "otp-rotation.h"
+
+/* The window sleeps until the rotation wheel's next boundary and refreshes
+ * only the entries it returns. Each period must roll on its own boundary,
+ * HOTP entries must never be returned, and a clock that jumps forward or back
+ * past the current window must make the affected entries due at once. */
+
+static OTPEntry *
+make_entry (const gchar *type,
+            guint32      period)
+{
+    return otp_entry_new ("alice", "Example", NULL, type, period, 0, "SHA1", 6,
+                          "JBSWY3DPEHPK3PXP");
+}
+
+static GListStore *
+make_store (guint n_30,
+            guint n_60,
+            guint n_hotp)
+{
+    GListStore *store = g_list_store_new (OTP_TYPE_ENTRY);
+    for (guint i = 0; i < n_30 + n_60 + n_hotp; i++) {
+        OTPEntry *entry = (i < n_30) ? make_entry ("TOTP", 30)
+                        : (i < n_30 + n_60) ? make_entry ("TOTP", 60)
+                        : make_entry ("HOTP", 30);
+        g_list_store_append (store, entry);
+        g_object_unref (entry);
+    }
+    return store;
+}
+
+static guint
+n_due (OTPRotationWheel *wheel,
+       gint64            now)
+{
+    g_autoptr (GPtrArray) due = otp_rotation_wheel_advance (wheel, now);
+    return due != NULL ? due->len : 0;
+}
+
+static void
+test_rolls_per_period (void)
+{
+    GListStore *store = make_store (3, 2, 4);
+    OTPRotationWheel *wheel = otp_rotation_wheel_new ();
+    otp_rotation_wheel_rebuild (wheel, G_LIST_MODEL (store), 1030);
+    g_assert_cmpuint (otp_rotation_wheel_get_n_entries (wheel), ==, 5);
+
+    g_assert_cmpint (otp_rotation_wheel_next_boundary (wheel), ==, 1050);
+    g_assert_cmpuint (n_due (wheel, 1049), ==, 0);
+    g_assert_cmpuint (n_due (wheel, 1050), ==, 3);
+    // A second wakeup in the same second finds nothing left to do.
+    g_assert_cmpuint (n_due (wheel, 1050), ==, 0);
+
+    // 1080 is a boundary of both periods.
+    g_assert_cmpint (otp_rotation_wheel_next_boundary (wheel), ==, 1080);
+    g_assert_cmpuint (n_due (wheel, 1080), ==, 5);
+    g_assert_cmpint (otp_rotation_wheel_next_boundary (wheel), ==, 1110);
+
+    otp_rotation_wheel_clear (wheel);
+    g_assert_cmpuint (otp_rotation_wheel_get_n_entries (wheel), ==, 0);
+    g_assert_cmpint (otp_rotation_wheel_next_boundary (wheel), ==, G_MAXINT64);
+    g_assert_null (otp_rotation_wheel_advance (wheel, 5000));
+
+    otp_rotation_wheel_free (wheel);
+    g_object_unref (store);
+}
+
+static void
+test_clock_jumps (void)
+{
+    GListStore *store = make_store (3, 2, 0);
+    OTPRotationWheel *wheel = otp_rotation_wheel_new ();
+    otp_rotation_wheel_rebuild (wheel, G_LIST_MODEL (store), 5000);
+
+    // Back, but still inside the windows the codes were computed for.
+    g_assert_cmpuint (n_due (wheel, 4985), ==, 0);
+
+    // Forward by hours, as after a suspend: everything is due once, and the
+    // next boundaries follow the new time.
+    g_assert_cmpuint (n_due (wheel, 20005), ==, 5);
+    g_assert_cmpint (otp_rotation_wheel_next_boundary (wheel), ==, 20010);
+    g_assert_cmpuint (n_due (wheel, 20006), ==, 0);
+
+    // Back past the current windows.
+    g_assert_cmpuint (n_due (wheel, 10000), ==, 5);
+    g_assert_cmpint (otp_rotation_wheel_next_boundary (wheel), ==, 10020);
+
+    otp_rotation_wheel_free (wheel);
+    g_object_unref (store);
+}
+
+static void
+test_holds_references (void)
+{
+    GListStore *store = make_store (1, 0, 0);
+    OTPRotationWheel *wheel = otp_rotation_wheel_new ();
+    otp_rotation_wheel_rebuild (wheel, G_LIST_MODEL (store), 0);
+
+    OTPEntry *entry = g_list_model_get_item (G_LIST_MODEL (store), 0);
+    GWeakRef weak;
+    g_weak_ref_init (&weak, entry);
+    g_object_unref (entry);
+
+    // The store drops the entry; the wheel keeps it until it is rebuilt.
+    g_list_store_remove_all (store);
+    g_autoptr (GPtrArray) due = otp_rotation_wheel_advance (wheel, 30);
+    g_assert_nonnull (due);
+    g_assert_true (g_ptr_array_index (due, 0) == entry);
+    g_clear_pointer (&due, g_ptr_array_unref);
+
+    otp_rotation_wheel_rebuild (wheel, G_LIST_MODEL (store), 30);
+    g_assert_null (g_weak_ref_get (&weak));
+    g_weak_ref_clear (&weak);
+
+    otp_rotation_wheel_free (wheel);
+    g_object_unref (store);
+}
+
+static void
+test_idle_cost (void)
+{
+    if (!g_test_perf ()) {
+        g_test_skip ("Idle cost timing only runs with -m perf");
+        return;
+    }
+
+    // One simulated hour of the window sitting idle, with the old per-second
+    // sweep of the whole store next to the wheel's boundary wakeups.
+    const guint seconds = 3600;
+    const guint sizes[] = { 500, 5000 };
+    for (guint s = 0; s < G_N_ELEMENTS (sizes); s++) {
+        GListStore *store = make_store (sizes[s] * 9 / 10, sizes[s] / 10, 0);
+        GListModel *model = G_LIST_MODEL (store);
+
+        guint swept = 0;
+        g_test_timer_start ();
+        for (guint t = 1; t <= seconds; t++) {
+            guint n = g_list_model_get_n_items (model);
+            for (guint i = 0; i < n; i++) {
+                g_autoptr (OTPEntry) entry = g_list_model_get_item (model, i);
+                if (g_ascii_strcasecmp (otp_entry_get_otp_type (entry), "TOTP") == 0 &&
+                    t % otp_entry_get_period (entry) == 0)
+                    swept++;
+            }
+        }
+        gdouble sweep_elapsed = g_test_timer_elapsed ();
+
+        OTPRotationWheel *wheel = otp_rotation_wheel_new ();
+        otp_rotation_wheel_rebuild (wheel, model, 0);
+        guint wakeups = 0, touched = 0;
+        g_test_timer_start ();
+        for (gint64 now = otp_rotation_wheel_next_boundary (wheel); now <= seconds;
+             now = otp_rotation_wheel_next_boundary (wheel)) {
+            wakeups++;
+            touched += n_due (wheel, now);
+        }
+        gdouble wheel_elapsed = g_test_timer_elapsed ();
+        g_assert_cmpuint (wakeups, ==, seconds / 30);
+        g_assert_cmpuint (touched, ==, swept);
+
+        g_test_message ("%5u entries, 1 h idle: sweep %u wakeups %8.2f ms | wheel %u wakeups %8.2f ms",
+                        sizes[s], seconds, sweep_elapsed * 1000.0, wakeups, wheel_elapsed * 1000.0);
+        otp_rotation_wheel_free (wheel);
+        g_object_unref (store);
+    }
+}
+
+int
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+    gchar *init_err = init_libs (DEFAULT_MEMLOCK_VALUE);
+    g_assert_null (init_err);
+
+    g_test_add_func ("/otp-rotation/rolls-per-period", test_rolls_per_period);
+    g_test_add_func ("/otp-rotation/clock-jumps",      test_clock_jumps);
+    g_test_add_func ("/otp-rotation/holds-references", test_holds_references);
+    g_test_add_func ("/otp-rotation/idle-cost",        test_idle_cost);
+
+    return g_test_run ();
+}
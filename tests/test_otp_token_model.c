@@ -0,0 +1,332 @@
+#include <glib.h>
+#include <gio/gio.h>
+#include <gcrypt.h>
+#include <jansson.h>
+#include <stdlib.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include "common.h"
+#include "otp-entry.h"
+#include "otp-token-model.h"
+
+/* The window's OTP list is an OTPTokenModel over the database's token array.
+ * Unchanged tokens must keep their OTPEntry across syncs, and an edit,
+ * insertion or removal must reach the model as one items-changed covering
+ * only the tokens that changed. Entries are built only for the positions
+ * someone asks for and dropped again once nothing else holds them. */
+
+typedef struct {
+    guint signals;
+    guint removed;
+    guint added;
+    guint position;
+} Churn;
+
+static void
+on_items_changed (GListModel *model,
+                  guint       position,
+                  guint       removed,
+                  guint       added,
+                  gpointer    user_data)
+{
+    (void) model;
+    Churn *churn = user_data;
+    churn->signals++;
+    churn->removed += removed;
+    churn->added += added;
+    churn->position = position;
+}
+
+static json_t *
+make_tokens (guint n)
+{
+    json_t *tokens = json_array ();
+    for (guint i = 0; i < n; i++) {
+        g_autofree gchar *label = g_strdup_printf ("account-%05u", i);
+        json_array_append_new (tokens, build_json_obj ("TOTP", label, "Example", "JBSWY3DPEHPK3PXP",
+                                                       6, "SHA1", 30, 0, NULL));
+    }
+    return tokens;
+}
+
+/* Edits go through a copy, the way db_token_for_write makes them. */
+static void
+rename_token (json_t      *tokens,
+              gsize        index,
+              const gchar *label)
+{
+    json_t *copy = json_copy (json_array_get (tokens, index));
+    json_object_set_new (copy, "label", json_string (label));
+    json_array_set_new (tokens, index, copy);
+}
+
+static GPtrArray *
+snapshot_entries (OTPTokenModel *model)
+{
+    GPtrArray *entries = g_ptr_array_new_with_free_func (g_object_unref);
+    guint n = g_list_model_get_n_items (G_LIST_MODEL (model));
+    for (guint i = 0; i < n; i++)
+        g_ptr_array_add (entries, g_list_model_get_item (G_LIST_MODEL (model), i));
+    return entries;
+}
+
+/* Borrowed: the model keeps the entry until it is trimmed. */
+static OTPEntry *
+entry_at (OTPTokenModel *model,
+          guint          position)
+{
+    OTPEntry *entry = g_list_model_get_item (G_LIST_MODEL (model), position);
+    g_object_unref (entry);
+    return entry;
+}
+
+static void
+test_initial_and_noop (void)
+{
+    json_t *tokens = make_tokens (5);
+    OTPTokenModel *model = otp_token_model_new ();
+    Churn churn = { 0 };
+    g_signal_connect (model, "items-changed", G_CALLBACK (on_items_changed), &churn);
+
+    otp_token_model_sync (model, tokens);
+    g_assert_cmpuint (churn.signals, ==, 1);
+    g_assert_cmpuint (churn.added, ==, 5);
+    g_assert_cmpstr (otp_entry_get_account (entry_at (model, 3)), ==, "account-00003");
+
+    // Same array, or a copy sharing the token objects: nothing to do.
+    otp_token_model_sync (model, tokens);
+    json_t *snapshot = json_copy (tokens);
+    otp_token_model_sync (model, snapshot);
+    g_assert_cmpuint (churn.signals, ==, 1);
+
+    // Equal content in new objects (a reload) is not the same token.
+    json_t *reloaded = json_deep_copy (tokens);
+    otp_token_model_sync (model, reloaded);
+    g_assert_cmpuint (churn.signals, ==, 2);
+    g_assert_cmpuint (churn.removed, ==, 5);
+
+    otp_token_model_sync (model, NULL);
+    g_assert_cmpuint (g_list_model_get_n_items (G_LIST_MODEL (model)), ==, 0);
+    g_assert_null (g_list_model_get_item (G_LIST_MODEL (model), 0));
+
+    json_decref (reloaded);
+    json_decref (snapshot);
+    g_object_unref (model);
+    json_decref (tokens);
+}
+
+static void
+test_minimal_splices (void)
+{
+    json_t *tokens = make_tokens (20);
+    OTPTokenModel *model = otp_token_model_new ();
+    otp_token_model_sync (model, tokens);
+    g_autoptr (GPtrArray) before = snapshot_entries (model);
+    otp_entry_set_revealed (g_ptr_array_index (before, 4), TRUE);
+
+    Churn churn = { 0 };
+    g_signal_connect (model, "items-changed", G_CALLBACK (on_items_changed), &churn);
+
+    // One edit: one row out, one row in, everything else untouched.
+    rename_token (tokens, 7, "renamed");
+    otp_token_model_sync (model, tokens);
+    g_assert_cmpuint (churn.signals, ==, 1);
+    g_assert_cmpuint (churn.position, ==, 7);
+    g_assert_cmpuint (churn.removed, ==, 1);
+    g_assert_cmpuint (churn.added, ==, 1);
+    g_assert_cmpstr (otp_entry_get_account (entry_at (model, 7)), ==, "renamed");
+    for (guint i = 0; i < 20; i++) {
+        if (i != 7)
+            g_assert_true (entry_at (model, i) == g_ptr_array_index (before, i));
+    }
+    g_assert_true (otp_entry_get_revealed (entry_at (model, 4)));
+
+    // Removal and append.
+    churn = (Churn) { 0 };
+    json_array_remove (tokens, 2);
+    otp_token_model_sync (model, tokens);
+    json_array_append_new (tokens, build_json_obj ("HOTP", "new", "Example", "JBSWY3DPEHPK3PXP",
+                                                   6, "SHA1", 30, 3, NULL));
+    otp_token_model_sync (model, tokens);
+    g_assert_cmpuint (churn.signals, ==, 2);
+    g_assert_cmpuint (churn.removed, ==, 1);
+    g_assert_cmpuint (churn.added, ==, 1);
+    g_assert_cmpuint (g_list_model_get_n_items (G_LIST_MODEL (model)), ==, 20);
+    g_assert_true (entry_at (model, 2) == g_ptr_array_index (before, 3));
+    g_assert_cmpuint (otp_entry_get_counter (entry_at (model, 19)), ==, 3);
+
+    // A token moved from the front to the back keeps its entry.
+    churn = (Churn) { 0 };
+    json_t *moved = json_incref (json_array_get (tokens, 0));
+    json_array_remove (tokens, 0);
+    json_array_append_new (tokens, moved);
+    otp_token_model_sync (model, tokens);
+    g_assert_cmpuint (churn.signals, ==, 1);
+    g_assert_true (entry_at (model, 19) == g_ptr_array_index (before, 0));
+
+    g_object_unref (model);
+    json_decref (tokens);
+}
+
+static void
+test_lazy_entries (void)
+{
+    json_t *tokens = make_tokens (100);
+    OTPTokenModel *model = otp_token_model_new ();
+    otp_token_model_sync (model, tokens);
+    g_assert_cmpuint (g_list_model_get_n_items (G_LIST_MODEL (model)), ==, 100);
+    g_assert_cmpuint (otp_token_model_get_n_live (model), ==, 0);
+
+    // Asking for an item builds that one entry and no other.
+    OTPEntry *held = g_list_model_get_item (G_LIST_MODEL (model), 40);
+    OTPEntry *revealed = g_list_model_get_item (G_LIST_MODEL (model), 41);
+    otp_entry_set_revealed (revealed, TRUE);
+    g_object_unref (revealed);
+    OTPEntry *dropped = g_list_model_get_item (G_LIST_MODEL (model), 42);
+    g_object_unref (dropped);
+    g_assert_cmpuint (otp_token_model_get_n_live (model), ==, 3);
+    g_assert_cmpuint (otp_token_model_find (model, held), ==, 40);
+    g_assert_cmpuint (otp_token_model_find (model, NULL), ==, G_MAXUINT);
+
+    // Trim keeps what is held elsewhere or revealed.
+    otp_token_model_trim (model);
+    g_assert_cmpuint (otp_token_model_get_n_live (model), ==, 2);
+    g_autoptr (GPtrArray) live = otp_token_model_get_live (model);
+    g_assert_cmpuint (live->len, ==, 2);
+    g_assert_true (g_ptr_array_index (live, 0) == held);
+    g_assert_true (entry_at (model, 41) == revealed);
+
+    // A dropped entry comes back from its token.
+    OTPEntry *rebuilt = entry_at (model, 42);
+    g_assert_cmpstr (otp_entry_get_account (rebuilt), ==, "account-00042");
+    g_assert_cmpuint (otp_token_model_find (model, rebuilt), ==, 42);
+
+    // Moving a record keeps its entry, as a removal then an insertion.
+    Churn churn = { 0 };
+    g_signal_connect (model, "items-changed", G_CALLBACK (on_items_changed), &churn);
+    otp_token_model_move (model, 40, 10);
+    g_assert_cmpuint (churn.signals, ==, 2);
+    g_assert_cmpuint (churn.position, ==, 10);
+    g_assert_true (entry_at (model, 10) == held);
+    g_assert_cmpstr (otp_entry_get_account (entry_at (model, 40)), ==, "account-00039");
+
+    otp_token_model_remove_all (model);
+    g_assert_cmpuint (otp_token_model_get_n_live (model), ==, 0);
+    g_assert_cmpuint (otp_token_model_find (model, held), ==, G_MAXUINT);
+    // Our reference outlives the model's.
+    g_assert_cmpstr (otp_entry_get_account (held), ==, "account-00040");
+
+    g_object_unref (held);
+    g_object_unref (model);
+    json_decref (tokens);
+}
+
+static void
+test_append_other_database (void)
+{
+    json_t *tokens = make_tokens (3);
+    OTPTokenModel *model = otp_token_model_new ();
+    otp_token_model_append (model, tokens, "work");
+    otp_token_model_append (model, tokens, NULL);
+    g_assert_cmpuint (g_list_model_get_n_items (G_LIST_MODEL (model)), ==, 6);
+    g_assert_cmpstr (otp_entry_get_db_name (entry_at (model, 1)), ==, "work");
+    g_assert_null (otp_entry_get_db_name (entry_at (model, 4)));
+
+    // The model holds the tokens: the database may go away first.
+    json_decref (tokens);
+    g_assert_cmpstr (otp_entry_get_account (entry_at (model, 5)), ==, "account-00002");
+
+    g_object_unref (model);
+}
+
+static gsize
+heap_in_use (void)
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    struct mallinfo2 info = mallinfo2 ();
+    return info.uordblks + info.hblkhd;
+#else
+    return 0;
+#endif
+}
+
+static void
+test_memory_and_build_cost (void)
+{
+    if (!g_test_perf ()) {
+        g_test_skip ("Model size and timing only run with -m perf");
+        return;
+    }
+
+    // 50k parsed tokens do not fit the secure pool, and the secrets here are
+    // synthetic: let jansson use the ordinary heap for this test only.
+    json_set_alloc_funcs (malloc, free);
+    const guint sizes[] = { 1000, 10000, 50000 };
+    for (guint s = 0; s < G_N_ELEMENTS (sizes); s++) {
+        json_t *tokens = make_tokens (sizes[s]);
+
+        // One OTPEntry per token in a GListStore, as the window used to keep.
+        gsize heap_before = heap_in_use ();
+        g_test_timer_start ();
+        GListStore *store = g_list_store_new (OTP_TYPE_ENTRY);
+        {
+            OTPTokenModel *builder = otp_token_model_new ();
+            otp_token_model_append (builder, tokens, NULL);
+            for (guint i = 0; i < sizes[s]; i++) {
+                OTPEntry *entry = g_list_model_get_item (G_LIST_MODEL (builder), i);
+                g_list_store_append (store, entry);
+                g_object_unref (entry);
+            }
+            g_object_unref (builder);
+        }
+        gdouble store_elapsed = g_test_timer_elapsed ();
+        gsize store_heap = heap_in_use () - heap_before;
+        g_object_unref (store);
+
+        // The token model, with one screenful of rows bound.
+        heap_before = heap_in_use ();
+        g_test_timer_start ();
+        OTPTokenModel *model = otp_token_model_new ();
+        otp_token_model_sync (model, tokens);
+        gdouble model_elapsed = g_test_timer_elapsed ();
+        g_autoptr (GPtrArray) bound = g_ptr_array_new_with_free_func (g_object_unref);
+        for (guint i = 0; i < 40; i++)
+            g_ptr_array_add (bound, g_list_model_get_item (G_LIST_MODEL (model), i));
+        gsize model_heap = heap_in_use () - heap_before;
+
+        Churn churn = { 0 };
+        g_signal_connect (model, "items-changed", G_CALLBACK (on_items_changed), &churn);
+        rename_token (tokens, sizes[s] / 2, "renamed");
+        g_test_timer_start ();
+        otp_token_model_sync (model, tokens);
+        gdouble edit_elapsed = g_test_timer_elapsed ();
+        g_assert_cmpuint (churn.removed + churn.added, ==, 2);
+
+        g_test_message ("%5u tokens: GListStore %8.2f ms %9" G_GSIZE_FORMAT " B | "
+                        "token model %7.2f ms %9" G_GSIZE_FORMAT " B (%u entries), one edit %7.3f ms",
+                        sizes[s], store_elapsed * 1000.0, store_heap,
+                        model_elapsed * 1000.0, model_heap, otp_token_model_get_n_live (model),
+                        edit_elapsed * 1000.0);
+        g_ptr_array_set_size (bound, 0);
+        g_object_unref (model);
+        json_decref (tokens);
+    }
+    json_set_alloc_funcs (gcry_malloc_secure, gcry_free);
+}
+
+int
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+    gchar *init_err = init_libs (DEFAULT_MEMLOCK_VALUE);
+    g_assert_null (init_err);
+
+    g_test_add_func ("/otp-token-model/initial-and-noop",      test_initial_and_noop);
+    g_test_add_func ("/otp-token-model/minimal-splices",       test_minimal_splices);
+    g_test_add_func ("/otp-token-model/lazy-entries",          test_lazy_entries);
+    g_test_add_func ("/otp-token-model/append-other-database", test_append_other_database);
+    g_test_add_func ("/otp-token-model/memory-and-build-cost", test_memory_and_build_cost);
+
+    return g_test_run ();
+}
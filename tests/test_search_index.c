@@ -0,0 +1,225 @@
+#include <glib.h>
+#include <jansson.h>
+#include <stdlib.h>
+#include <string.h>
+#include "search-index.h"
+
+/* The index only prunes: every token that matches the query has to be among
+ * the candidates, and a stale posting must never bring back a removed token.
+ * The checks below compare lookups against a plain scan of the same tokens. */
+
+static json_t *
+make_token (const gchar *label,
+            const gchar *issuer,
+            const gchar *group)
+{
+    json_t *token = json_object ();
+    json_object_set_new (token, "label", json_string (label));
+    json_object_set_new (token, "issuer", json_string (issuer));
+    if (group != NULL)
+        json_object_set_new (token, "group", json_string (group));
+    return token;
+}
+
+static gboolean
+scan_matches (json_t      *token,
+              const gchar *group_lower,
+              const gchar *text_lower)
+{
+    g_autofree gchar *label = g_utf8_strdown (json_string_value (json_object_get (token, "label")), -1);
+    g_autofree gchar *issuer = g_utf8_strdown (json_string_value (json_object_get (token, "issuer")), -1);
+    const gchar *group_value = json_string_value (json_object_get (token, "group"));
+    g_autofree gchar *group = g_utf8_strdown (group_value ? group_value : "", -1);
+
+    if (group_lower != NULL && strstr (group, group_lower) == NULL)
+        return FALSE;
+    if (text_lower == NULL)
+        return TRUE;
+    g_auto (GStrv) words = g_strsplit (text_lower, " ", -1);
+    for (guint i = 0; words[i] != NULL; i++) {
+        if (strstr (label, words[i]) == NULL && strstr (issuer, words[i]) == NULL)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+static void
+assert_superset (SearchIndex *index,
+                 json_t      *tokens,
+                 const gchar *group_lower,
+                 const gchar *text_lower)
+{
+    GHashTable *candidates = search_index_lookup (index, group_lower, text_lower);
+    g_assert_nonnull (candidates);
+    for (gsize i = 0; i < json_array_size (tokens); i++) {
+        json_t *token = json_array_get (tokens, i);
+        if (scan_matches (token, group_lower, text_lower))
+            g_assert_true (g_hash_table_contains (candidates, token));
+    }
+    g_hash_table_unref (candidates);
+}
+
+static json_t *
+make_sample (void)
+{
+    json_t *tokens = json_array ();
+    json_array_append_new (tokens, make_token ("alice@example.com", "GitHub", "Work"));
+    json_array_append_new (tokens, make_token ("bob@example.com", "GitLab", "Work"));
+    json_array_append_new (tokens, make_token ("alice", "Proton Mail", "Personal"));
+    json_array_append_new (tokens, make_token ("admin", "Cloudflare", NULL));
+    json_array_append_new (tokens, make_token ("Ünïcode", "Ärger", NULL));
+    return tokens;
+}
+
+static void
+test_lookup (void)
+{
+    json_t *tokens = make_sample ();
+    g_autoptr (SearchIndex) index = search_index_new ();
+    for (gsize i = 0; i < json_array_size (tokens); i++)
+        search_index_add (index, json_array_get (tokens, i));
+    g_assert_cmpuint (search_index_get_n_tokens (index), ==, 5);
+
+    // Needles shorter than a trigram cannot use the index.
+    g_assert_null (search_index_lookup (index, NULL, NULL));
+    g_assert_null (search_index_lookup (index, NULL, "gi"));
+    g_assert_null (search_index_lookup (index, "wo", "a b"));
+
+    const gchar *texts[] = { "git", "github", "alice", "example", "mail alice",
+                             "alice mail", "lab bob", "ünï", "ärg", "zzz" };
+    for (guint i = 0; i < G_N_ELEMENTS (texts); i++) {
+        assert_superset (index, tokens, NULL, texts[i]);
+        assert_superset (index, tokens, "work", texts[i]);
+    }
+    assert_superset (index, tokens, "work", NULL);
+    assert_superset (index, tokens, "pers", "al");
+
+    // Pruning: unrelated tokens are not candidates.
+    GHashTable *candidates = search_index_lookup (index, NULL, "github");
+    g_assert_cmpuint (g_hash_table_size (candidates), ==, 1);
+    g_assert_true (g_hash_table_contains (candidates, json_array_get (tokens, 0)));
+    g_hash_table_unref (candidates);
+
+    // The group is its own field: "work" in a label is not a group match.
+    candidates = search_index_lookup (index, "work", NULL);
+    g_assert_cmpuint (g_hash_table_size (candidates), ==, 2);
+    g_hash_table_unref (candidates);
+    candidates = search_index_lookup (index, NULL, "work");
+    g_assert_cmpuint (g_hash_table_size (candidates), ==, 0);
+    g_hash_table_unref (candidates);
+
+    json_decref (tokens);
+}
+
+static void
+test_add_remove (void)
+{
+    json_t *tokens = make_sample ();
+    g_autoptr (SearchIndex) index = search_index_new ();
+    json_t *github = json_array_get (tokens, 0);
+
+    guint stamp = search_index_get_stamp (index);
+    search_index_add (index, github);
+    search_index_add (index, github);
+    g_assert_cmpuint (search_index_get_stamp (index), !=, stamp);
+    g_assert_cmpuint (search_index_get_n_tokens (index), ==, 1);
+
+    // Two models holding the same token: it stays until both let go.
+    search_index_remove (index, github);
+    GHashTable *candidates = search_index_lookup (index, NULL, "github");
+    g_assert_true (g_hash_table_contains (candidates, github));
+    g_hash_table_unref (candidates);
+    search_index_remove (index, github);
+    candidates = search_index_lookup (index, NULL, "github");
+    g_assert_cmpuint (g_hash_table_size (candidates), ==, 0);
+    g_hash_table_unref (candidates);
+    g_assert_cmpuint (search_index_get_n_tokens (index), ==, 0);
+
+    // Enough churn to compact; the survivors must still be found.
+    for (guint round = 0; round < 100; round++) {
+        json_t *edited = make_token ("alice@example.com", "GitHub", "Work");
+        search_index_add (index, edited);
+        search_index_remove (index, edited);
+        json_decref (edited);
+    }
+    for (gsize i = 0; i < json_array_size (tokens); i++)
+        search_index_add (index, json_array_get (tokens, i));
+    for (guint round = 0; round < 100; round++) {
+        json_t *edited = make_token ("carol@example.com", "GitHub", "Work");
+        search_index_add (index, edited);
+        search_index_remove (index, edited);
+        json_decref (edited);
+    }
+    assert_superset (index, tokens, NULL, "github");
+    assert_superset (index, tokens, "work", "example");
+    candidates = search_index_lookup (index, NULL, "carol");
+    g_assert_cmpuint (g_hash_table_size (candidates), ==, 0);
+    g_hash_table_unref (candidates);
+
+    search_index_clear (index);
+    g_assert_cmpuint (search_index_get_n_tokens (index), ==, 0);
+    candidates = search_index_lookup (index, NULL, "github");
+    g_assert_cmpuint (g_hash_table_size (candidates), ==, 0);
+    g_hash_table_unref (candidates);
+
+    json_decref (tokens);
+}
+
+static void
+test_lookup_time (void)
+{
+    if (!g_test_perf ()) {
+        g_test_skip ("Lookup timing only runs with -m perf");
+        return;
+    }
+
+    const guint sizes[] = { 1000, 10000, 50000 };
+    const gchar *issuers[] = { "GitHub", "GitLab", "Google", "Proton Mail", "Cloudflare", "Amazon" };
+    const gchar *needles[] = { "user01234", "proton", "git user", "zzz" };
+    for (guint s = 0; s < G_N_ELEMENTS (sizes); s++) {
+        json_t *tokens = json_array ();
+        for (guint i = 0; i < sizes[s]; i++) {
+            g_autofree gchar *label = g_strdup_printf ("user%05u@example.com", i);
+            json_array_append_new (tokens, make_token (label, issuers[i % G_N_ELEMENTS (issuers)], NULL));
+        }
+        g_autoptr (SearchIndex) index = search_index_new ();
+        g_test_timer_start ();
+        for (guint i = 0; i < sizes[s]; i++)
+            search_index_add (index, json_array_get (tokens, i));
+        gdouble build = g_test_timer_elapsed ();
+
+        for (guint q = 0; q < G_N_ELEMENTS (needles); q++) {
+            g_test_timer_start ();
+            GHashTable *candidates = search_index_lookup (index, NULL, needles[q]);
+            gdouble indexed = g_test_timer_elapsed ();
+
+            g_test_timer_start ();
+            guint matches = 0;
+            for (guint i = 0; i < sizes[s]; i++)
+                matches += scan_matches (json_array_get (tokens, i), NULL, needles[q]);
+            gdouble scanned = g_test_timer_elapsed ();
+
+            g_assert_cmpuint (g_hash_table_size (candidates), >=, matches);
+            g_test_message ("%6u tokens, \"%s\": %u candidates for %u matches, lookup %7.3f ms, scan %7.3f ms",
+                            sizes[s], needles[q], g_hash_table_size (candidates), matches,
+                            indexed * 1000.0, scanned * 1000.0);
+            g_hash_table_unref (candidates);
+        }
+        g_test_message ("%6u tokens indexed in %.1f ms", sizes[s], build * 1000.0);
+        json_decref (tokens);
+    }
+}
+
+int
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+    // Plain malloc: the secure allocator is not needed for test tokens.
+    json_set_alloc_funcs (malloc, free);
+
+    g_test_add_func ("/search-index/lookup",      test_lookup);
+    g_test_add_func ("/search-index/add-remove",  test_add_remove);
+    g_test_add_func ("/search-index/lookup-time", test_lookup_time);
+
+    return g_test_run ();
+}
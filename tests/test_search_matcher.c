@@ -0,0 +1,244 @@
+#include <glib.h>
+#include "search-matcher.h"
+
+/* The search provider answers every keystroke of the shell's search box, so
+ * a query must not cost a casefold per term per entry. The compiled terms
+ * and the trigram index must not change what matches, though: the index may
+ * only narrow the entries that get checked, never drop one that matches. */
+
+typedef struct {
+    GPtrArray *label_folds;
+    GPtrArray *issuer_folds;
+    EntryIndex *index;
+} Entries;
+
+static const gchar *issuers[] = {
+    "GitHub", "GitLab", "Google", "Microsoft", "Proton", "Dropbox", "Bitwarden",
+    "Amazon Web Services", "Cloudflare", "DigitalOcean", "Mastodon", "Straße AG",
+};
+
+static Entries *
+entries_new (guint n_entries)
+{
+    Entries *entries = g_new0 (Entries, 1);
+    entries->label_folds = g_ptr_array_new_with_free_func (g_free);
+    entries->issuer_folds = g_ptr_array_new_with_free_func (g_free);
+    entries->index = entry_index_new ();
+
+    GRand *rand = g_rand_new_with_seed (464);
+    for (guint i = 0; i < n_entries; i++) {
+        g_autofree gchar *label = g_strdup_printf ("User%u@example%u.com", i,
+                                                   g_rand_int_range (rand, 0, 50));
+        const gchar *issuer = issuers[g_rand_int_range (rand, 0, G_N_ELEMENTS (issuers))];
+        gchar *label_fold = g_utf8_casefold (label, -1);
+        gchar *issuer_fold = g_utf8_casefold (issuer, -1);
+        g_ptr_array_add (entries->label_folds, label_fold);
+        g_ptr_array_add (entries->issuer_folds, issuer_fold);
+        g_assert_cmpuint (entry_index_add (entries->index, label_fold, issuer_fold), ==, i);
+    }
+    g_rand_free (rand);
+    g_assert_cmpuint (entry_index_get_n_entries (entries->index), ==, n_entries);
+    return entries;
+}
+
+static void
+entries_free (Entries *entries)
+{
+    g_ptr_array_unref (entries->label_folds);
+    g_ptr_array_unref (entries->issuer_folds);
+    entry_index_free (entries->index);
+    g_free (entries);
+}
+
+// What the provider did before: every term casefolded again for every entry.
+static gboolean
+match_uncompiled (gchar       **terms,
+                  const gchar  *label_fold,
+                  const gchar  *issuer_fold)
+{
+    guint n_terms = g_strv_length (terms);
+    if (n_terms == 0 || label_fold == NULL)
+        return FALSE;
+    for (guint i = 0; i < n_terms; i++) {
+        g_autofree gchar *fold = g_utf8_casefold (terms[i], -1);
+        if (!g_strstr_len (label_fold, -1, fold) && !g_strstr_len (issuer_fold, -1, fold))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+static guint
+count_scan (Entries           *entries,
+            const SearchTerms *terms)
+{
+    guint n = 0;
+    for (guint i = 0; i < entries->label_folds->len; i++)
+        n += search_terms_match (terms, g_ptr_array_index (entries->label_folds, i),
+                                 g_ptr_array_index (entries->issuer_folds, i));
+    return n;
+}
+
+static guint
+count_indexed (Entries           *entries,
+               const SearchTerms *terms)
+{
+    g_autoptr (GArray) candidates = entry_index_lookup (entries->index, terms);
+    if (candidates == NULL)
+        return count_scan (entries, terms);
+    guint n = 0;
+    for (guint i = 0; i < candidates->len; i++) {
+        guint32 id = g_array_index (candidates, guint32, i);
+        if (i > 0)
+            g_assert_cmpuint (id, >, g_array_index (candidates, guint32, i - 1));
+        n += search_terms_match (terms, g_ptr_array_index (entries->label_folds, id),
+                                 g_ptr_array_index (entries->issuer_folds, id));
+    }
+    return n;
+}
+
+static void
+test_compile (void)
+{
+    g_assert_null (search_terms_compile (NULL));
+    gchar *empty[] = { "", "", NULL };
+    g_assert_null (search_terms_compile (empty));
+
+    // "git" is implied by "GitHub" and the repeat adds nothing.
+    gchar *terms[] = { "git", "GitHub", "", "GITHUB", "user", NULL };
+    g_autoptr (SearchTerms) compiled = search_terms_compile (terms);
+    g_assert_nonnull (compiled);
+    g_assert_cmpuint (search_terms_get_n_terms (compiled), ==, 2);
+    g_assert_true (search_terms_match (compiled, "user1@example.com", "github"));
+    g_assert_false (search_terms_match (compiled, "user1@example.com", "gitlab"));
+
+    // Casefolded, not lowercased.
+    gchar *strasse[] = { "STRASSE", NULL };
+    g_autoptr (SearchTerms) folded = search_terms_compile (strasse);
+    g_autofree gchar *issuer_fold = g_utf8_casefold ("Straße AG", -1);
+    g_assert_true (search_terms_match (folded, "alice", issuer_fold));
+}
+
+static void
+test_match (void)
+{
+    gchar *terms[] = { "alice", "proton", NULL };
+    g_autoptr (SearchTerms) compiled = search_terms_compile (terms);
+
+    // Each term may sit in either field.
+    g_assert_true (search_terms_match (compiled, "alice@proton.me", ""));
+    g_assert_true (search_terms_match (compiled, "alice", "proton"));
+    g_assert_false (search_terms_match (compiled, "alice", "google"));
+    // A token without a label never shows up.
+    g_assert_false (search_terms_match (compiled, NULL, "alice proton"));
+    g_assert_false (search_terms_match (NULL, "alice", "proton"));
+
+    // A term must not be stitched together across the two fields.
+    gchar *across[] = { "iceprot", NULL };
+    g_autoptr (SearchTerms) stitched = search_terms_compile (across);
+    g_assert_false (search_terms_match (stitched, "alice", "proton"));
+}
+
+static void
+test_index (void)
+{
+    Entries *entries = entries_new (2000);
+    const gchar *queries[][3] = {
+        { "github", NULL },
+        { "GitHub", "user1", NULL },
+        { "example7.com", "cloud", NULL },
+        { "USER19", "STRASSE", NULL },
+        { "web services", NULL },
+        { "iceprot", NULL },
+        { "nothing-like-this", NULL },
+    };
+    for (guint q = 0; q < G_N_ELEMENTS (queries); q++) {
+        g_autoptr (SearchTerms) compiled = search_terms_compile ((gchar **) queries[q]);
+        g_autoptr (GArray) candidates = entry_index_lookup (entries->index, compiled);
+        g_assert_nonnull (candidates);
+        guint expected = 0;
+        for (guint i = 0; i < entries->label_folds->len; i++)
+            expected += match_uncompiled ((gchar **) queries[q],
+                                          g_ptr_array_index (entries->label_folds, i),
+                                          g_ptr_array_index (entries->issuer_folds, i));
+        g_assert_cmpuint (count_scan (entries, compiled), ==, expected);
+        g_assert_cmpuint (count_indexed (entries, compiled), ==, expected);
+        g_assert_cmpuint (candidates->len, >=, expected);
+    }
+
+    // A trigram no entry has.
+    gchar *absent[] = { "qqq", NULL };
+    g_autoptr (SearchTerms) none = search_terms_compile (absent);
+    g_autoptr (GArray) no_candidates = entry_index_lookup (entries->index, none);
+    g_assert_cmpuint (no_candidates->len, ==, 0);
+
+    // Too short to use the index: everything is a candidate.
+    gchar *shorter[] = { "gi", "b", NULL };
+    g_autoptr (SearchTerms) short_terms = search_terms_compile (shorter);
+    g_assert_null (entry_index_lookup (entries->index, short_terms));
+    g_assert_cmpuint (count_indexed (entries, short_terms), ==, count_scan (entries, short_terms));
+
+    entries_free (entries);
+}
+
+static void
+test_match_latency (void)
+{
+    if (!g_test_perf ()) {
+        g_test_skip ("Match latency only runs with -m perf");
+        return;
+    }
+
+    const gchar *queries[][3] = {
+        { "github", NULL },
+        { "user42", "proton", NULL },
+        { "example3", NULL },
+        { "cloudflare", "user1", NULL },
+    };
+    const guint sizes[] = { 1000, 10000, 50000 };
+    const guint rounds = 20;
+    for (guint s = 0; s < G_N_ELEMENTS (sizes); s++) {
+        Entries *entries = entries_new (sizes[s]);
+        gdouble uncompiled = 0, scan = 0, indexed = 0;
+        for (guint r = 0; r < rounds; r++) {
+            for (guint q = 0; q < G_N_ELEMENTS (queries); q++) {
+                gchar **terms = (gchar **) queries[q];
+                guint expected = 0;
+                g_test_timer_start ();
+                for (guint i = 0; i < entries->label_folds->len; i++)
+                    expected += match_uncompiled (terms, g_ptr_array_index (entries->label_folds, i),
+                                                  g_ptr_array_index (entries->issuer_folds, i));
+                uncompiled += g_test_timer_elapsed ();
+
+                g_test_timer_start ();
+                g_autoptr (SearchTerms) compiled = search_terms_compile (terms);
+                guint n_scan = count_scan (entries, compiled);
+                scan += g_test_timer_elapsed ();
+
+                g_test_timer_start ();
+                g_autoptr (SearchTerms) again = search_terms_compile (terms);
+                guint n_indexed = count_indexed (entries, again);
+                indexed += g_test_timer_elapsed ();
+
+                g_assert_cmpuint (n_scan, ==, expected);
+                g_assert_cmpuint (n_indexed, ==, expected);
+            }
+        }
+        gdouble per_query = 1000.0 / (rounds * G_N_ELEMENTS (queries));
+        g_test_message ("%u entries: casefold per entry %.3f ms, compiled scan %.3f ms, compiled + index %.3f ms per query",
+                        sizes[s], uncompiled * per_query, scan * per_query, indexed * per_query);
+        entries_free (entries);
+    }
+}
+
+int
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_func ("/search-matcher/compile", test_compile);
+    g_test_add_func ("/search-matcher/match", test_match);
+    g_test_add_func ("/search-matcher/index", test_index);
+    g_test_add_func ("/search-matcher/match-latency", test_match_latency);
+
+    return g_test_run ();
+}
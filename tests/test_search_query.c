@@ -0,0 +1,219 @@
+#include <glib.h>
+#include <gtk/gtk.h>
+#include <string.h>
+#include "common.h"
+#include "otp-entry.h"
+#include "search-query.h"
+
+/* The search box is split into a group prefix and free text, and each
+ * keystroke is reported to the filter as narrowing, widening or replacing
+ * the query. A wrong MORE_STRICT or LESS_STRICT would leave rows shown or
+ * hidden that no longer match, so every direction is checked here. */
+
+typedef struct {
+    gchar *group_lower;
+    gchar *text_lower;
+} Query;
+
+static void
+query_set (Query       *query,
+           const gchar *text)
+{
+    g_free (query->group_lower);
+    g_free (query->text_lower);
+    search_query_parse (text, &query->group_lower, &query->text_lower);
+}
+
+static void
+query_clear (Query *query)
+{
+    g_clear_pointer (&query->group_lower, g_free);
+    g_clear_pointer (&query->text_lower, g_free);
+}
+
+static void
+test_parse (void)
+{
+    Query q = { 0 };
+
+    query_set (&q, "");
+    g_assert_null (q.group_lower);
+    g_assert_null (q.text_lower);
+
+    query_set (&q, "GitHub");
+    g_assert_null (q.group_lower);
+    g_assert_cmpstr (q.text_lower, ==, "github");
+
+    query_set (&q, "group:Work Mail");
+    g_assert_cmpstr (q.group_lower, ==, "work");
+    g_assert_cmpstr (q.text_lower, ==, "mail");
+
+    query_set (&q, "#Work");
+    g_assert_cmpstr (q.group_lower, ==, "work");
+    g_assert_null (q.text_lower);
+
+    query_set (&q, "#Work ");
+    g_assert_cmpstr (q.group_lower, ==, "work");
+    g_assert_null (q.text_lower);
+
+    // A lone '#' is text, an empty "group:" matches every group.
+    query_set (&q, "#");
+    g_assert_null (q.group_lower);
+    g_assert_cmpstr (q.text_lower, ==, "#");
+    query_set (&q, "group:");
+    g_assert_cmpstr (q.group_lower, ==, "");
+
+    g_autofree gchar *group = search_query_get_group ("group:Work Mail");
+    g_assert_cmpstr (group, ==, "Work");
+    g_assert_null (search_query_get_group ("Work"));
+
+    query_clear (&q);
+}
+
+static gint
+diff (const gchar *before,
+      const gchar *after)
+{
+    Query a = { 0 }, b = { 0 };
+    query_set (&a, before);
+    query_set (&b, after);
+    GtkFilterChange change = GTK_FILTER_CHANGE_DIFFERENT;
+    gboolean changed = search_query_diff (a.group_lower, a.text_lower,
+                                          b.group_lower, b.text_lower, &change);
+    query_clear (&a);
+    query_clear (&b);
+    return changed ? (gint) change : -1;
+}
+
+static void
+test_diff (void)
+{
+    g_assert_cmpint (diff ("git", "git"), ==, -1);
+    g_assert_cmpint (diff ("Git", "git"), ==, -1);
+
+    // Typing narrows, backspace widens, wherever the caret is.
+    g_assert_cmpint (diff ("", "g"), ==, GTK_FILTER_CHANGE_MORE_STRICT);
+    g_assert_cmpint (diff ("gi", "git"), ==, GTK_FILTER_CHANGE_MORE_STRICT);
+    g_assert_cmpint (diff ("it", "git"), ==, GTK_FILTER_CHANGE_MORE_STRICT);
+    g_assert_cmpint (diff ("git", "gi"), ==, GTK_FILTER_CHANGE_LESS_STRICT);
+    g_assert_cmpint (diff ("g", ""), ==, GTK_FILTER_CHANGE_LESS_STRICT);
+
+    // Replacing a character is neither.
+    g_assert_cmpint (diff ("git", "gif"), ==, GTK_FILTER_CHANGE_DIFFERENT);
+
+    // The group prefix and the text must move the same way.
+    g_assert_cmpint (diff ("#wo", "#work"), ==, GTK_FILTER_CHANGE_MORE_STRICT);
+    g_assert_cmpint (diff ("#work", "#work m"), ==, GTK_FILTER_CHANGE_MORE_STRICT);
+    g_assert_cmpint (diff ("#work m", "#work"), ==, GTK_FILTER_CHANGE_LESS_STRICT);
+    g_assert_cmpint (diff ("#wo mail", "#work ma"), ==, GTK_FILTER_CHANGE_DIFFERENT);
+    g_assert_cmpint (diff ("work", "#work"), ==, GTK_FILTER_CHANGE_DIFFERENT);
+}
+
+static void
+test_rank (void)
+{
+    g_assert_cmpint (search_query_rank ("alice@example.com", "github", NULL), ==, SEARCH_RANK_PREFIX);
+    g_assert_cmpint (search_query_rank ("alice@example.com", "github", "git"), ==, SEARCH_RANK_PREFIX);
+    g_assert_cmpint (search_query_rank ("alice@example.com", "proton mail", "mail"), ==, SEARCH_RANK_WORD_START);
+    g_assert_cmpint (search_query_rank ("alice@example.com", "github", "example"), ==, SEARCH_RANK_WORD_START);
+    g_assert_cmpint (search_query_rank ("alice@example.com", "github", "hub"), ==, SEARCH_RANK_SUBSTRING);
+
+    // Words in any order, spread over account and issuer.
+    g_assert_cmpint (search_query_rank ("alice@example.com", "github", "hub alice"), ==, SEARCH_RANK_WORDS);
+    g_assert_cmpint (search_query_rank ("alice@example.com", "github", "hub bob"), ==, SEARCH_RANK_NONE);
+    g_assert_cmpint (search_query_rank ("alice@example.com", "github", "gitlab"), ==, SEARCH_RANK_NONE);
+
+    // The best field wins.
+    g_assert_cmpint (search_query_rank ("github-bot", "acme github", "github"), ==, SEARCH_RANK_PREFIX);
+}
+
+static gboolean
+filter_entry (gpointer item,
+              gpointer user_data)
+{
+    Query *q = user_data;
+    OTPEntry *entry = OTP_ENTRY (item);
+
+    if (q->group_lower != NULL &&
+        g_strstr_len (otp_entry_get_group_lower (entry), -1, q->group_lower) == NULL)
+        return FALSE;
+    if (q->text_lower == NULL)
+        return TRUE;
+    return (g_strstr_len (otp_entry_get_account_lower (entry), -1, q->text_lower) != NULL ||
+            g_strstr_len (otp_entry_get_issuer_lower (entry), -1, q->text_lower) != NULL);
+}
+
+static void
+test_typing_latency (void)
+{
+    if (!g_test_perf ()) {
+        g_test_skip ("Keystroke timing only runs with -m perf");
+        return;
+    }
+
+    const guint n = 20000;
+    GListStore *store = g_list_store_new (OTP_TYPE_ENTRY);
+    for (guint i = 0; i < n; i++) {
+        g_autofree gchar *account = g_strdup_printf ("user%05u@example.com", i);
+        OTPEntry *entry = otp_entry_new (account, (i % 3) ? "GitHub" : "GitLab", NULL, "TOTP",
+                                         30, 0, "SHA1", 6, "JBSWY3DPEHPK3PXP");
+        g_list_store_append (store, entry);
+        g_object_unref (entry);
+    }
+
+    const gchar *typed = "user01234@";
+    const gboolean use_strictness[] = { FALSE, TRUE };
+    for (guint mode = 0; mode < G_N_ELEMENTS (use_strictness); mode++) {
+        Query q = { 0 };
+        GtkCustomFilter *filter = gtk_custom_filter_new (filter_entry, &q, NULL);
+        GtkFilterListModel *model = gtk_filter_list_model_new (g_object_ref (G_LIST_MODEL (store)),
+                                                               g_object_ref (GTK_FILTER (filter)));
+        gdouble total = 0, worst = 0;
+        gsize len = strlen (typed);
+        // Type the query, then erase it.
+        for (gsize step = 1; step <= 2 * len; step++) {
+            gsize keep = (step <= len) ? step : 2 * len - step;
+            g_autofree gchar *text = g_strndup (typed, keep);
+            Query next = { 0 };
+            query_set (&next, text);
+            GtkFilterChange change = GTK_FILTER_CHANGE_DIFFERENT;
+            gboolean changed = search_query_diff (q.group_lower, q.text_lower,
+                                                  next.group_lower, next.text_lower, &change);
+            query_clear (&q);
+            q = next;
+
+            g_test_timer_start ();
+            if (changed)
+                gtk_filter_changed (GTK_FILTER (filter),
+                                    use_strictness[mode] ? change : GTK_FILTER_CHANGE_DIFFERENT);
+            g_list_model_get_n_items (G_LIST_MODEL (model));
+            gdouble elapsed = g_test_timer_elapsed ();
+            total += elapsed;
+            worst = MAX (worst, elapsed);
+        }
+        g_assert_cmpuint (g_list_model_get_n_items (G_LIST_MODEL (model)), ==, n);
+
+        g_test_message ("%u entries, %s: %6.3f ms per keystroke on average, %6.3f ms worst (frame: 16.7 ms)",
+                        n, use_strictness[mode] ? "narrow/widen" : "always different",
+                        total * 1000.0 / (gdouble) (2 * len), worst * 1000.0);
+        g_object_unref (model);
+        g_object_unref (filter);
+        query_clear (&q);
+    }
+    g_object_unref (store);
+}
+
+int
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+    gchar *init_err = init_libs (DEFAULT_MEMLOCK_VALUE);
+    g_assert_null (init_err);
+
+    g_test_add_func ("/search-query/parse",          test_parse);
+    g_test_add_func ("/search-query/diff",           test_diff);
+    g_test_add_func ("/search-query/rank",           test_rank);
+    g_test_add_func ("/search-query/typing-latency", test_typing_latency);
+
+    return g_test_run ();
+}
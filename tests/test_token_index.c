@@ -0,0 +1,385 @@
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gcrypt.h>
+#include <jansson.h>
+#include <string.h>
+#include "common.h"
+#include "db-common.h"
+#include "db-commit.h"
+#include "db-token-index.h"
+#include "gquarks.h"
+
+/* Imports look duplicates up in a digest index instead of comparing every
+ * imported token against every stored one. Digests must agree with
+ * json_equal, the index must count repeated tokens and follow edits without
+ * a rebuild, and an import must skip exactly the tokens already stored or
+ * repeated in the batch. */
+
+static json_t *
+valid_totp (const gchar *label,
+            const gchar *group)
+{
+    return build_json_obj ("TOTP", label, "Example", "JBSWY3DPEHPK3PXP",
+                           6, "SHA1", 30, 0, group);
+}
+
+static otp_t *
+import_totp (const gchar *label)
+{
+    otp_t *otp = g_new0 (otp_t, 1);
+    otp->type = g_strdup ("TOTP");
+    otp->algo = g_strdup ("SHA1");
+    otp->digits = 6;
+    otp->period = 30;
+    otp->account_name = g_strdup (label);
+    otp->issuer = g_strdup ("Example");
+    otp->secret = secure_strdup ("JBSWY3DPEHPK3PXP");
+    return otp;
+}
+
+static DatabaseData *
+make_saved_db (const gchar *path,
+               guint        n_tokens)
+{
+    DatabaseData *db_data = database_data_new (path, DEFAULT_MEMLOCK_VALUE);
+    db_data->key = secure_strdup ("index-password");
+    db_data->argon2id_iter = ARGON2ID_MIN_ITER;
+    db_data->argon2id_memcost = ARGON2ID_MIN_MC;
+    db_data->argon2id_parallelism = ARGON2ID_MIN_PARAL;
+    db_data->current_db_version = DB_VERSION;
+    db_data->in_memory_json_data = json_array ();
+    for (guint i = 0; i < n_tokens; i++) {
+        g_autofree gchar *label = g_strdup_printf ("stored-%05u", i);
+        json_array_append_new (db_data->in_memory_json_data, valid_totp (label, NULL));
+    }
+    GError *err = NULL;
+    update_db (db_data, &err);
+    g_assert_no_error (err);
+    return db_data;
+}
+
+static void
+cleanup (DatabaseData *db_data,
+         gchar        *dir,
+         gchar        *path)
+{
+    database_data_free (db_data);
+    const gchar *suffixes[] = { "", ".lock", ".bak", ".journal" };
+    for (guint i = 0; i < G_N_ELEMENTS (suffixes); i++) {
+        g_autofree gchar *p = g_strconcat (path, suffixes[i], NULL);
+        g_unlink (p);
+    }
+    g_rmdir (dir);
+    g_free (path);
+    g_free (dir);
+}
+
+static gchar *
+make_tmp_dir (gchar **path_out)
+{
+    GError *err = NULL;
+    gchar *dir = g_dir_make_tmp ("otpclient-token-index-XXXXXX", &err);
+    g_assert_no_error (err);
+    *path_out = g_build_filename (dir, "test.enc", NULL);
+    return dir;
+}
+
+static gboolean
+index_has (DbTokenIndex *index,
+           json_t       *token)
+{
+    DbTokenDigest digest;
+    g_assert_true (db_token_digest (token, &digest));
+    return db_token_index_contains (index, &digest);
+}
+
+static void
+test_digest_matches_json_equal (void)
+{
+    json_t *a = valid_totp ("alice", NULL);
+    json_t *reordered = json_object ();
+    const gchar *key;
+    json_t *value;
+    json_t *keys = json_array ();
+    json_object_foreach (a, key, value)
+        json_array_insert_new (keys, 0, json_string (key));
+    gsize i;
+    json_t *k;
+    json_array_foreach (keys, i, k)
+        json_object_set (reordered, json_string_value (k), json_object_get (a, json_string_value (k)));
+    json_decref (keys);
+    g_assert_true (json_equal (a, reordered));
+
+    DbTokenDigest da, dr, dg;
+    g_assert_true (db_token_digest (a, &da));
+    g_assert_true (db_token_digest (reordered, &dr));
+    g_assert_cmpmem (da.bytes, sizeof (da.bytes), dr.bytes, sizeof (dr.bytes));
+
+    // json_equal tells these apart, so the digest must too.
+    json_t *grouped = valid_totp ("alice", "work");
+    g_assert_true (db_token_digest (grouped, &dg));
+    g_assert_true (memcmp (da.bytes, dg.bytes, sizeof (da.bytes)) != 0);
+
+    json_decref (grouped);
+    json_decref (reordered);
+    json_decref (a);
+}
+
+static void
+test_index_follows_edits (void)
+{
+    json_t *before = json_array ();
+    json_array_append_new (before, valid_totp ("alice", NULL));
+    json_array_append_new (before, valid_totp ("bob", NULL));
+    json_array_append_new (before, valid_totp ("bob", NULL));
+    json_array_append_new (before, valid_totp ("carol", NULL));
+
+    DbTokenIndex *index = db_token_index_new ();
+    db_token_index_update (index, NULL, before);
+    g_assert_cmpuint (db_token_index_size (index), ==, 3);
+
+    // Drop one of the two bobs, rename carol, append dave.
+    json_t *after = json_deep_copy (before);
+    json_array_remove (after, 1);
+    json_array_set_new (after, 2, valid_totp ("carol-renamed", NULL));
+    json_array_append_new (after, valid_totp ("dave", NULL));
+    db_token_index_update (index, before, after);
+
+    json_t *probe = valid_totp ("bob", NULL);
+    g_assert_true (index_has (index, probe));
+    json_decref (probe);
+    probe = valid_totp ("carol", NULL);
+    g_assert_false (index_has (index, probe));
+    json_decref (probe);
+    g_assert_true (index_has (index, json_array_get (after, 2)));
+    g_assert_true (index_has (index, json_array_get (after, 3)));
+    g_assert_cmpuint (db_token_index_size (index), ==, 4);
+
+    db_token_index_update (index, after, NULL);
+    g_assert_cmpuint (db_token_index_size (index), ==, 0);
+
+    db_token_index_free (index);
+    json_decref (after);
+    json_decref (before);
+}
+
+static void
+test_import_skips_duplicates (void)
+{
+    gchar *path = NULL;
+    gchar *dir = make_tmp_dir (&path);
+    DatabaseData *db_data = make_saved_db (path, 3);
+
+    GSList *otps = NULL;
+    otps = g_slist_append (otps, import_totp ("stored-00001"));
+    otps = g_slist_append (otps, import_totp ("new-a"));
+    otps = g_slist_append (otps, import_totp ("new-a"));
+    otps = g_slist_append (otps, import_totp ("new-b"));
+    OtpImportReport report;
+    GError *err = NULL;
+    g_assert_true (db_import_otps (db_data, otps, &report, &err));
+    g_assert_no_error (err);
+    g_assert_cmpuint (report.added, ==, 2);
+    g_assert_cmpuint (report.skipped_duplicates, ==, 2);
+    g_assert_cmpuint (json_array_size (db_data->in_memory_json_data), ==, 5);
+    g_assert_cmpuint (db_token_index_size (db_data->token_index), ==, 5);
+
+    // A token deleted since is no longer a duplicate.
+    json_array_remove (db_data->in_memory_json_data, 1);
+    update_db (db_data, &err);
+    g_assert_no_error (err);
+    g_assert_true (db_import_otps (db_data, otps, &report, &err));
+    g_assert_no_error (err);
+    g_assert_cmpuint (report.added, ==, 1);
+    g_assert_cmpuint (report.skipped_duplicates, ==, 3);
+
+    free_otps_gslist (otps, g_slist_length (otps));
+    cleanup (db_data, dir, path);
+}
+
+static gpointer
+prepare_batch (gpointer data)
+{
+    DbImportBatch *batch = db_import_batch_new ();
+    for (GSList *l = data; l != NULL; l = l->next)
+        db_import_batch_add (batch, l->data);
+    return batch;
+}
+
+static void
+test_import_batch_off_thread (void)
+{
+    gchar *path = NULL;
+    gchar *dir = make_tmp_dir (&path);
+    DatabaseData *db_data = make_saved_db (path, 3);
+
+    GSList *otps = NULL;
+    otps = g_slist_append (otps, import_totp ("stored-00002"));
+    otps = g_slist_append (otps, import_totp ("new-a"));
+    otp_t *broken = import_totp ("broken");
+    broken->digits = 99;
+    otps = g_slist_append (otps, broken);
+    otps = g_slist_append (otps, import_totp ("new-a"));
+
+    // What the import dialog does: prepare on a worker, apply on this thread.
+    GThread *worker = g_thread_new ("import", prepare_batch, otps);
+    DbImportBatch *batch = g_thread_join (worker);
+    g_assert_cmpuint (db_import_batch_get_n_tokens (batch), ==, 3);
+    g_assert_cmpuint (db_import_batch_get_n_invalid (batch), ==, 1);
+
+    OtpImportReport report;
+    DbImportContext ctx = { db_data, batch, &report };
+    GError *err = NULL;
+    g_assert_true (db_commit_async (db_data, db_import_batch_mutation, &ctx, NULL, NULL, &err));
+    g_assert_no_error (err);
+    g_assert_cmpuint (report.added, ==, 1);
+    g_assert_cmpuint (report.skipped_duplicates, ==, 2);
+    g_assert_cmpuint (report.skipped_invalid, ==, 1);
+    g_assert_cmpuint (json_array_size (db_data->in_memory_json_data), ==, 4);
+    db_import_batch_free (batch);
+
+    g_assert_true (db_commit_flush (db_data, &err));
+    g_assert_no_error (err);
+    g_assert_cmpuint (db_token_index_size (db_data->token_index), ==, 4);
+
+    DatabaseData *reloaded = database_data_new (path, DEFAULT_MEMLOCK_VALUE);
+    reloaded->key = secure_strdup ("index-password");
+    load_db (reloaded, &err);
+    g_assert_no_error (err);
+    g_assert_cmpuint (json_array_size (reloaded->in_memory_json_data), ==, 4);
+    database_data_free (reloaded);
+
+    free_otps_gslist (otps, g_slist_length (otps));
+    cleanup (db_data, dir, path);
+}
+
+static gboolean
+append_token (json_t   *live,
+              gpointer  user_data,
+              GError  **err)
+{
+    (void) err;
+    json_array_append (live, user_data);
+    return TRUE;
+}
+
+static gboolean
+remove_first_token (json_t   *live,
+                    gpointer  user_data,
+                    GError  **err)
+{
+    (void) user_data;
+    (void) err;
+    return json_array_remove (live, 0) == 0;
+}
+
+static void
+test_import_after_uncommitted_edits (void)
+{
+    gchar *path = NULL;
+    gchar *dir = make_tmp_dir (&path);
+    DatabaseData *db_data = make_saved_db (path, 3);
+
+    // Still queued: the committed snapshot (and its index) know nothing yet.
+    json_t *queued = valid_totp ("queued-add", NULL);
+    GError *err = NULL;
+    g_assert_true (db_commit_async (db_data, append_token, queued, NULL, NULL, &err));
+    g_assert_no_error (err);
+    g_assert_true (db_commit_async (db_data, remove_first_token, NULL, NULL, NULL, &err));
+    g_assert_no_error (err);
+
+    GSList *otps = NULL;
+    otps = g_slist_append (otps, import_totp ("queued-add"));
+    otps = g_slist_append (otps, import_totp ("stored-00000"));
+    otps = g_slist_append (otps, import_totp ("stored-00001"));
+
+    guint added = 0, skipped = 0;
+    add_otps_to_db_ex (otps, db_data, &added, &skipped);
+    g_assert_cmpuint (added, ==, 1);
+    g_assert_cmpuint (skipped, ==, 2);
+
+    DbImportBatch *batch = prepare_batch (otps);
+    OtpImportReport report;
+    DbImportContext ctx = { db_data, batch, &report };
+    g_assert_true (db_commit_async (db_data, db_import_batch_mutation, &ctx, NULL, NULL, &err));
+    g_assert_no_error (err);
+    g_assert_cmpuint (report.added, ==, 1);
+    g_assert_cmpuint (report.skipped_duplicates, ==, 2);
+    g_assert_cmpuint (json_array_size (db_data->in_memory_json_data), ==, 4);
+    db_import_batch_free (batch);
+    // Borrowing the index for the live tokens must hand it back untouched.
+    g_assert_cmpuint (db_token_index_size (db_data->token_index), ==, 3);
+    g_assert_true (index_has (db_data->token_index, json_array_get (db_data->committed_json_data, 0)));
+
+    g_assert_true (db_commit_flush (db_data, &err));
+    g_assert_no_error (err);
+    g_assert_cmpuint (db_token_index_size (db_data->token_index), ==, 4);
+    g_assert_true (index_has (db_data->token_index, queued));
+
+    DatabaseData *reloaded = database_data_new (path, DEFAULT_MEMLOCK_VALUE);
+    reloaded->key = secure_strdup ("index-password");
+    load_db (reloaded, &err);
+    g_assert_no_error (err);
+    g_assert_cmpuint (json_array_size (reloaded->in_memory_json_data), ==, 4);
+    database_data_free (reloaded);
+
+    json_decref (queued);
+    free_otps_gslist (otps, g_slist_length (otps));
+    cleanup (db_data, dir, path);
+}
+
+static void
+test_import_scales_linearly (void)
+{
+    if (!g_test_perf ()) {
+        g_test_skip ("Import timing only runs with -m perf");
+        return;
+    }
+
+    const guint sizes[] = { 1000, 2000, 5000 };
+    for (guint s = 0; s < G_N_ELEMENTS (sizes); s++) {
+        gchar *path = NULL;
+        gchar *dir = make_tmp_dir (&path);
+        DatabaseData *db_data = make_saved_db (path, sizes[s]);
+
+        // Half of the batch is already stored, half is new.
+        GSList *otps = NULL;
+        for (guint i = 0; i < sizes[s]; i++) {
+            g_autofree gchar *label = (i % 2 == 0)
+                ? g_strdup_printf ("stored-%05u", i)
+                : g_strdup_printf ("imported-%05u", i);
+            otps = g_slist_prepend (otps, import_totp (label));
+        }
+
+        OtpImportReport report;
+        GError *err = NULL;
+        g_test_timer_start ();
+        g_assert_true (db_import_otps (db_data, otps, &report, &err));
+        gdouble elapsed = g_test_timer_elapsed ();
+        g_assert_no_error (err);
+        g_assert_cmpuint (report.added, ==, sizes[s] / 2);
+        g_assert_cmpuint (report.skipped_duplicates, ==, sizes[s] / 2);
+
+        g_test_message ("%5u into %5u tokens: %8.2f ms (%.2f us per imported token)",
+                        sizes[s], sizes[s], elapsed * 1000.0, elapsed * 1e6 / sizes[s]);
+        free_otps_gslist (otps, g_slist_length (otps));
+        cleanup (db_data, dir, path);
+    }
+}
+
+int
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+    gchar *init_err = init_libs (DEFAULT_MEMLOCK_VALUE);
+    g_assert_null (init_err);
+
+    g_test_add_func ("/token-index/digest-matches-json-equal", test_digest_matches_json_equal);
+    g_test_add_func ("/token-index/follows-edits",             test_index_follows_edits);
+    g_test_add_func ("/token-index/import-skips-duplicates",   test_import_skips_duplicates);
+    g_test_add_func ("/token-index/import-batch-off-thread",   test_import_batch_off_thread);
+    g_test_add_func ("/token-index/import-after-uncommitted-edits", test_import_after_uncommitted_edits);
+    g_test_add_func ("/token-index/import-scales-linearly",    test_import_scales_linearly);
+
+    return g_test_run ();
+}